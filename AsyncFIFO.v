@@ -0,0 +1,74 @@
+module AsyncFIFO #(
+parameter DEPTH = 8,																			//Number of words, a power of 2
+parameter WIDTH = 32,																			//Bits per word
+parameter ADDR_WIDTH = $clog2(DEPTH)															//Pointer width
+)(
+output reg[WIDTH-1:0] DataOut,																	//Data output, read clock
+output Full,																					//Status, write clock
+output Empty,																					//Status, read clock
+input [WIDTH-1:0] DataIn,																		//Data input, write clock
+input Write, WClock, WReset,																	//Write side controls
+input Read, RClock, RReset																		//Read side controls
+);
+// Dual-clock version of FIFO.v: the pointers are kept in Gray code so only
+// one bit changes per word and each side sees the other pointer through a
+// two flip-flop synchronizer; Full and Empty are pessimistic while a pointer
+// is crossing, so nothing is lost or read twice and a write to a full FIFO
+// is dropped
+// Read has FIFO.v timing, DataOut holds the popped word from the next clock
+reg[WIDTH-1:0] Stack [DEPTH-1:0];
+reg[ADDR_WIDTH:0] WBin, WGray, RBin, RGray;														//Pointers, one wrap bit
+reg[ADDR_WIDTH:0] WGraySync1, WGraySync2;														//Write pointer in read clock
+reg[ADDR_WIDTH:0] RGraySync1, RGraySync2;														//Read pointer in write clock
+wire[ADDR_WIDTH:0] WBinNext = WBin + 1'b1;
+wire[ADDR_WIDTH:0] RBinNext = RBin + 1'b1;
+assign Full = (WGray == {~RGraySync2[ADDR_WIDTH:ADDR_WIDTH-1], RGraySync2[ADDR_WIDTH-2:0]});	//Full?
+assign Empty = (RGray == WGraySync2);															//Empty?
+initial DataOut <= {WIDTH{1'b0}};																//Clear data out buffer
+
+// Write clock
+always @ (posedge WClock) begin
+	if (Write && !Full)
+		Stack [WBin[ADDR_WIDTH-1:0]] <= DataIn;													//Store data in stack
+end
+
+always @ (posedge WClock, posedge WReset) begin
+	if (WReset) begin
+		WBin <= 1'b0;
+		WGray <= 1'b0;
+		RGraySync1 <= 1'b0;
+		RGraySync2 <= 1'b0;
+	end
+	else begin
+		RGraySync1 <= RGray;
+		RGraySync2 <= RGraySync1;
+		if (Write && !Full) begin
+			WBin <= WBinNext;																	//Update write pointer
+			WGray <= WBinNext ^ (WBinNext >> 1);
+		end
+	end
+end
+
+// Read clock
+always @ (posedge RClock) begin
+	if (Read && !Empty)
+		DataOut <= Stack [RBin[ADDR_WIDTH-1:0]];												//Transfer data to output
+end
+
+always @ (posedge RClock, posedge RReset) begin
+	if (RReset) begin
+		RBin <= 1'b0;
+		RGray <= 1'b0;
+		WGraySync1 <= 1'b0;
+		WGraySync2 <= 1'b0;
+	end
+	else begin
+		WGraySync1 <= WGray;
+		WGraySync2 <= WGraySync1;
+		if (Read && !Empty) begin
+			RBin <= RBinNext;																	//Update read pointer
+			RGray <= RBinNext ^ (RBinNext >> 1);
+		end
+	end
+end
+endmodule
@@ -2,3 +2,6 @@
 
 #define SPI_BASE_OFFSET       0x00008000
 
+// Second core of a top.v built with SPI2_CORE1
+#define SPI1_BASE_OFFSET      0x00009000
+
@@ -15,22 +15,61 @@
 //   Mapped to offset of 0 in light-weight MM interface aperature
 //-----------------------------------------------------------------------------
 
-module spi2 (clk, reset, address, byteenable, chipselect, writedata, readdata, write, read, cs0, cs1, cs2, cs3, rx, tx, clock, LED);
+module spi2 (clk, reset, irq, address, byteenable, chipselect, writedata, readdata, write, read,
+             dma_address, dma_read, dma_write, dma_writedata, dma_readdata, dma_waitrequest,
+             cs0, cs1, cs2, cs3, rx, tx, clock, io_out, io_oe, io_in, spi_clk, spi_clk_locked, LED);
+
+    // TX and RX FIFO depth, a power of 2 from 16 to 4096 (block RAM above 64)
+    parameter FIFO_DEPTH = 16;
+    localparam FIFO_ADDR_WIDTH = $clog2(FIFO_DEPTH);
+    localparam [3:0] DEPTH_LOG2 = FIFO_ADDR_WIDTH;
+
+    // 1 builds the DMA master, 0 ties the master interface off
+    parameter DMA_ENABLE = 0;
+
+    // 1 runs the baud divider and serializer from spi_clk, which must not be
+    // slower than clk, with dual-clock FIFOs between the two domains; 0 runs
+    // them from clk and leaves spi_clk unused
+    parameter SPI_CLOCK_ASYNC = 0;
+
+    // Words held between the Avalon and SPI domains with SPI_CLOCK_ASYNC
+    localparam CDC_DEPTH = 8;
+
+    // Sequencer instructions, a power of 2 from 16 to 256
+    parameter SEQ_DEPTH = 64;
+    localparam SEQ_ADDR_WIDTH = $clog2(SEQ_DEPTH);
+    localparam [3:0] SEQ_DEPTH_LOG2 = SEQ_ADDR_WIDTH;
 
     // Clock, reset, and interrupt
     input   clk, reset;
+    output  irq;
 
-    // Avalon MM interface (8 word aperature)
+    // SPI clock, used when SPI_CLOCK_ASYNC is set; the SPI domain is held
+    // in reset while spi_clk_locked is low (tie high for a clock that is
+    // always stable)
+    input   spi_clk, spi_clk_locked;
+
+    // Avalon MM interface (64 word aperature)
     input             read, write, chipselect;
-    input [2:0]       address;
+    input [5:0]       address;
     input [3:0]       byteenable;
     input [31:0]      writedata;
     output reg [31:0] readdata;
 	 output reg [9:0] LED;
+
+    // Avalon MM master interface (DMA), byte addresses, one word per access
+    output [31:0]     dma_address;
+    output            dma_read, dma_write;
+    output [31:0]     dma_writedata;
+    input  [31:0]     dma_readdata;
+    input             dma_waitrequest;
     
     // spi interface
     input  rx;
 	 output cs0, cs1, cs2, cs3, tx, clock;
+    // dual and quad data lines, io0 carries tx outside dual and quad frames
+    output [3:0] io_out, io_oe;
+    input  [3:0] io_in;
 	 wire rxfo, rxff, rxfe, txfo, txff, txfe;
 	 reg[31:0] int_clr_ov;
 	 reg clr_ov_tx;
@@ -42,19 +81,269 @@ module spi2 (clk, reset, address, byteenable, chipselect, writedata, readdata, w
     reg [31:0] status;
     reg [31:0] control;
     reg [31:0] BRD;
+    reg [31:0] int_enable;
+    reg [6:0]  int_status;
+    reg [6:0]  int_clear_request;
+    wire [FIFO_ADDR_WIDTH:0] tx_level, rx_level;
+    reg        rx_valid;
+    wire [6:0] rx_remaining;
+    reg [31:0] dma_src, dma_dst, dma_len, dma_ctrl;
+    reg [31:0] cs_cfg0, cs_cfg1, cs_cfg2, cs_cfg3;
+    wire       dma_start, dma_abort, dma_push, dma_pop;
+    reg        dma_busy, dma_done;
+    reg [2:0]  dma_state;
+    reg [31:0] dma_src_ptr, dma_dst_ptr, dma_tx_count, dma_rx_count, dma_word;
+    reg [31:0] poll_cmd, poll_period, poll_mask, poll_value, poll_timer;
+    reg [2:0]  poll_ctrl;
+    reg        poll_pending, poll_changed, poll_event;
+    reg [31:0] frames_in_flight;
+    wire       poll_push, poll_capture;
+    reg [31:0] xfer_len, xfer_fill;
+    wire       fill_push;
+    reg [31:0] perf_cycles, perf_frames, perf_bits, perf_tx_wait, perf_rx_full;
+    reg [31:0] perf_txov, perf_rxov, perf_cs;
+    reg [31:0] snap_cycles, snap_frames, snap_bits, snap_tx_wait, snap_rx_full;
+    reg [31:0] snap_txov, snap_rxov, snap_cs;
+    reg        last_cs_idle;
+    wire       perf_snapshot, perf_clear, tx_wait;
+    wire [2:0] bit_strobe;
+    reg [2:0]  io_mode;
+    reg [31:0] sample_delay;
+    reg [31:0] bist_len, bist_sent, bist_checked, bist_errors, bist_cycles;
+    reg [30:0] bist_gen, bist_chk;
+    reg        bist_busy;
+    wire       bist_push, bist_capture, bist_start, bist_abort;
+    wire [31:0] bist_word;
+    wire       spi_cs0, spi_cs1, spi_cs2, spi_cs3;
+    reg [31:0] pack_word, rx_pack;
+    reg [3:0]  pack_valid;
+    reg [2:0]  pack_io;
+    reg [1:0]  pack_tag, rx_lane;
+    reg        pack_half;
+    wire       pack_write, pack_push, host_push, tx_push, rx_host, rx_last, rx_write;
+    reg [31:0] seq_ram [0:SEQ_DEPTH-1];
+    reg [31:0] seq_acc, seq_word, seq_timer;
+    reg [31:0] seq_result0, seq_result1, seq_result2, seq_result3;
+    reg [7:0]  seq_pc, seq_addr;
+    reg [2:0]  seq_state;
+    reg [1:0]  seq_tag;
+    reg [3:0]  seq_hold;
+    reg        seq_recv, seq_irq, seq_event;
+    reg [31:0] seq_in_flight;
+    wire       seq_busy, seq_push, seq_capture, seq_start, seq_abort;
     
     // register map
     // ofs  fn
     //   0  data (r/w)
-    //   4  status (RXFO, RXFF, RXFE, TXFO, TXFF, TXFE)
-    //   8  control 
+    //   4  status (ASYNC[14], BUSY[13], DMA[12], DEPTH_LOG2[11:8], TXFE, TXFF, TXFO, RXFE, RXFF, RXFO)
+    //      BUSY is set while frames pushed to the TX FIFO have not completed,
+    //      ASYNC when the core was built with SPI_CLOCK_ASYNC (BRD then
+    //      counts spi_clk cycles)
+    //   8  control (BANKED[31], PACKED[28], LOOPBACK[27], RX_ONLY[26], TX_ONLY[25], STREAM[24], modes[23:16],
+    //      enable[15], cs_select[14:13],
+    //      cs_enable[12:9], cs_auto[8:5], word size - 1[4:0])
     //  12  BRD (IBRD/FBRD)
+    //  16  int_enable (enables and watermarks, see below) (r/w)
+    //  20  int_status_clear (POLL, DMA, OV, DONE, RXWM, TXWM) (r/w1c)
+    //  24  level (RX level[31:16], TX level[15:0]) (r)
+    //  28  rx_data_valid (VALID[31], RX level[30:24], data[23:0]) (r)
+    //      pops the RX FIFO like data, VALID is clear if it was empty and
+    //      the level left behind saturates at 127; for word sizes <= 24
+    //  32  dma_src (byte address of the TX words) (r/w)
+    //  36  dma_dst (byte address for the RX words) (r/w)
+    //  40  dma_len (words) (r/w)
+    //  44  dma_ctrl (MODE[7:6], CS[5:4], CFG, RX, TX, GO/BUSY) (r/w)
+    //      writing GO starts the descriptor, writing 0 aborts it; TX reads
+    //      the words from dma_src (else zeros are sent), RX writes the
+    //      received words to dma_dst (else they are dropped), CFG first
+    //      selects CS and sets its mode in control; DMA in status is set
+    //      when the core was built with the master
+    //  48  cs_cfg0 (BRD[31:8], cs_auto[7], mode[6:5], word size - 1[4:0]) (r/w)
+    //  52  cs_cfg1
+    //  56  cs_cfg2
+    //  60  cs_cfg3
+    //  64  data_cs0 (w), pushes a TX word for cs0
+    //  68  data_cs1
+    //  72  data_cs2
+    //  76  data_cs3
+    //  80  poll_cmd (TX word of the poll frame) (r/w)
+    //  84  poll_period (system clocks from a poll response to the next poll) (r/w)
+    //  88  poll_mask (response bits that are compared) (r/w)
+    //  92  poll_value (masked response of the last change, or the reference written) (r/w)
+    //  96  poll_ctrl (CHANGED[8] (r/w1c), CS[2:1], EN[0]) (r/w)
+    // 100  xfer_len (frames left to generate in RX_ONLY) (r/w)
+    // 104  xfer_fill (TX word of generated frames) (r/w)
+    //
+    // 108  perf_ctrl (CLEAR[1], SNAPSHOT[0]) (w)
+    // 112  perf_cycles (clocks counted) (r)
+    // 116  perf_frames (frames completed) (r)
+    // 120  perf_bits (bits shifted) (r)
+    // 124  perf_tx_wait (clocks a TX word waited while no bits were shifted) (r)
+    // 128  perf_rx_full (clocks the RX FIFO was full) (r)
+    // 132  perf_txov (TX words dropped on a full TX FIFO) (r)
+    // 136  perf_rxov (RX words dropped on a full RX FIFO) (r)
+    // 140  perf_cs (chip select assertions) (r)
+    // 144  io_mode (READ[2], lines[1:0]: 0 single, 1 dual, 2 quad) (r/w)
+    //      applies to the TX words pushed after it is written by the host,
+    //      the DMA engine and the fill generator; poll frames are single
+    // 148  sample_delay (cs3[27:24], cs2[19:16], cs1[11:8], cs0[3:0]) (r/w)
+    //      clocks from the SCLK sampling edge to the RX sample of the device,
+    //      less than its SCLK period; spi_clk cycles with SPI_CLOCK_ASYNC
+    // 152  bist_ctrl (GO/BUSY[0]) (r/w)
+    //      writing GO starts the self-test, writing 0 aborts it
+    // 156  bist_len (frames of the self-test) (r/w)
+    // 160  bist_errors (self-test frames received wrong) (r)
+    // 164  bist_cycles (clocks from GO to the last frame checked) (r)
+    // 168  seq_ctrl (DEPTH_LOG2[19:16] (r), PC[15:8], GO/BUSY[0]) (r/w)
+    //      writing GO starts the sequencer at PC, writing 0 aborts it
+    // 172  seq_addr (instruction of seq_data) (r/w)
+    // 176  seq_data (instruction at seq_addr) (r/w), a write advances seq_addr
+    // 180  seq_r0 (arguments and results of the sequencer) (r/w)
+    // 184  seq_r1
+    // 188  seq_r2
+    // 192  seq_r3
+    //
+    // The performance counters run freely and wrap; SNAPSHOT copies them
+    // all in the same clock to the registers that are read, so one set of
+    // reads is consistent, and CLEAR restarts them (both together snapshot
+    // the values before the clear)
+    // With SPI_CLOCK_ASYNC the bits of a frame are counted when it reaches
+    // the Avalon side, tx_wait and chip select assertions are sampled on clk
+    //
+    // TX_ONLY drops the received words instead of writing them to the RX
+    // FIFO, so write-only traffic needs no draining and cannot overflow it;
+    // the frames of a DMA descriptor still reach the DMA engine
+    // RX_ONLY has the core push xfer_len frames of xfer_fill for cs_select
+    // into the TX FIFO, never more than the RX FIFO can take, so the host
+    // only reads; data writes are not allowed while frames are left
+    //
+    // Every TX word is tagged with a chip select, cs_select for data and
+    // DMA words and n for data_csn; with BANKED set each frame goes to the
+    // chip select of its word with the word size, mode, auto chip select
+    // and BRD of its cs_cfg bank, so interleaved traffic to several devices
+    // needs no control or BRD writes; without it the tag is ignored
+    //
+    // PACKED carries 8-bit and narrower frames four to a word, byte n in
+    // [8n+7:8n], and up to 16-bit frames two to a word in [15:0] and
+    // [31:16]; a data or data_csn write pushes one frame per lane enabled
+    // by byteenable (the low byte of a halfword lane), lowest lane first,
+    // over the next four clocks, so bus accesses must be at least four
+    // clocks apart; the lane width comes from the word size of cs_select (of the
+    // data_csn bank with BANKED)
+    // The RX FIFO then takes a word once its lanes are full or the last
+    // frame in flight completes, so RX words line up with the TX writes
+    // when only the last write of a burst is partial; use data rather than
+    // rx_data_valid, the RX FIFO level counts words and the DMA engine
+    // stays one frame per word
+    //
+    // LOOPBACK feeds tx (io_out on dual and quad frames) back to the RX
+    // sampler with no sample delay and holds cs0-cs3 deasserted, so the core
+    // can run at full rate with nothing wired to it
+    //
+    // The self-test pushes bist_len frames of a PRBS-31 sequence, 32 new
+    // bits per frame, for cs_select with the word size and IO_MODE in
+    // force, and compares the words received with the same sequence in the
+    // bits of the word size; they are kept out of the RX FIFO, and the
+    // host, DMA and poll engine must be idle while it runs
+    //
+    // STREAM keeps CS asserted and starts the next frame on the next bit
+    // clock while the TX FIFO holds words for the same device, so
+    // back-to-back frames have no idle SCLK periods between them
+    //
+    // With EN set the poll engine pushes poll_cmd tagged with CS every
+    // poll_period clocks, once no host or DMA frames are in flight; its
+    // response is kept out of the RX FIFO and, when the masked response
+    // differs from poll_value, it is latched into poll_value and CHANGED
+    // and the POLL interrupt are set, so an expander input can be watched
+    // without the CPU issuing a read per poll; the frame uses the bank of
+    // CS with BANKED set, otherwise the control settings and cs_select
+    //
+    // The sequencer runs a program from its instruction RAM, so a
+    // transaction of several dependent frames costs the CPU a GO write and
+    // the interrupt instead of a round trip per frame; instructions are
+    // op[31:28] with a 24-bit operand, the immediate [23:0] or seq_rn
+    // (n in [1:0]) when REG[27] is set:
+    //   0  END    wait for its frames, release the chip selects held and
+    //             stop; IRQ[0] sets SEQ
+    //   1  SEND   push the operand, OR ACC[26] ORs in ACC, tagged CS[25:24];
+    //             the response is dropped
+    //   2  RECV   as SEND, then wait for the response and load it in ACC
+    //   3  CS     hold CS[25:24] asserted (ASSERT[0]) or release it once
+    //             the frames pushed have completed
+    //   4  WAIT   wait operand clocks
+    //   5  LOAD   ACC = operand
+    //   6  AND    ACC &= operand
+    //   7  OR     ACC |= operand
+    //   8  JUMP   to [7:0] always (COND[27:26] 0), if ACC[15:0] & [23:8]
+    //             is zero (1) or if it is not (2)
+    //   9  STORE  seq_rn = ACC, n in [1:0]
+    //  10  IRQ    set SEQ and go on
+    // other opcodes end the program like END
+    // Sequencer frames are single, the tag selects the device like the
+    // data_csn registers do and a held chip select stays asserted between
+    // frames; the responses are kept out of the RX FIFO, the poll engine
+    // waits while the sequencer runs, and the host, DMA engine and self-test
+    // must leave the data registers idle; the program must not be written
+    // while it runs
+    //
+    // int_enable
+    //   [0]     TXWM  TX level at or below the TX watermark
+    //   [1]     RXWM  RX level at or above the RX watermark
+    //   [2]     DONE  a frame was written to the RX FIFO
+    //   [3]     OV    TX or RX FIFO overflow
+    //   [15:4]  TX watermark
+    //   [27:16] RX watermark
+    //   [28]    DMA   the DMA descriptor completed (int_status bit 4)
+    //   [29]    POLL  the poll response changed (int_status bit 5)
+    //   [30]    SEQ   the sequencer ended or raised IRQ (int_status bit 6)
     
     // register numbers
-    parameter DATA_REG     = 2'b00;
-    parameter STATUS_REG   = 2'b01;
-    parameter CONTROL_REG  = 2'b10;
-    parameter BRD_REG      = 2'b11;
+    parameter DATA_REG             = 6'b000000;
+    parameter STATUS_REG           = 6'b000001;
+    parameter CONTROL_REG          = 6'b000010;
+    parameter BRD_REG              = 6'b000011;
+    parameter INT_ENABLE_REG       = 6'b000100;
+    parameter INT_STATUS_CLEAR_REG = 6'b000101;
+    parameter LEVEL_REG            = 6'b000110;
+    parameter RX_DATA_VALID_REG    = 6'b000111;
+    parameter DMA_SRC_REG          = 6'b001000;
+    parameter DMA_DST_REG          = 6'b001001;
+    parameter DMA_LEN_REG          = 6'b001010;
+    parameter DMA_CTRL_REG         = 6'b001011;
+    parameter CS_CFG0_REG          = 6'b001100;
+    parameter CS_CFG1_REG          = 6'b001101;
+    parameter CS_CFG2_REG          = 6'b001110;
+    parameter CS_CFG3_REG          = 6'b001111;
+    parameter DATA_CS0_REG         = 6'b010000;
+    parameter POLL_CMD_REG         = 6'b010100;
+    parameter POLL_PERIOD_REG      = 6'b010101;
+    parameter POLL_MASK_REG        = 6'b010110;
+    parameter POLL_VALUE_REG       = 6'b010111;
+    parameter POLL_CTRL_REG        = 6'b011000;
+    parameter XFER_LEN_REG         = 6'b011001;
+    parameter XFER_FILL_REG        = 6'b011010;
+    parameter PERF_CTRL_REG        = 6'b011011;
+    parameter PERF_CYCLES_REG      = 6'b011100;
+    parameter PERF_FRAMES_REG      = 6'b011101;
+    parameter PERF_BITS_REG        = 6'b011110;
+    parameter PERF_TX_WAIT_REG     = 6'b011111;
+    parameter PERF_RX_FULL_REG     = 6'b100000;
+    parameter PERF_TXOV_REG        = 6'b100001;
+    parameter PERF_RXOV_REG        = 6'b100010;
+    parameter PERF_CS_REG          = 6'b100011;
+    parameter IO_MODE_REG          = 6'b100100;
+    parameter SAMPLE_DELAY_REG     = 6'b100101;
+    parameter BIST_CTRL_REG        = 6'b100110;
+    parameter BIST_LEN_REG         = 6'b100111;
+    parameter BIST_ERRORS_REG      = 6'b101000;
+    parameter BIST_CYCLES_REG      = 6'b101001;
+    parameter SEQ_CTRL_REG         = 6'b101010;
+    parameter SEQ_ADDR_REG         = 6'b101011;
+    parameter SEQ_DATA_REG         = 6'b101100;
+    parameter SEQ_R0_REG           = 6'b101101;
+    parameter SEQ_R1_REG           = 6'b101110;
+    parameter SEQ_R2_REG           = 6'b101111;
+    parameter SEQ_R3_REG           = 6'b110000;
     
     // read register
     always @ (*)
@@ -64,11 +353,93 @@ module spi2 (clk, reset, address, byteenable, chipselect, writedata, readdata, w
                 DATA_REG: 
                    readdata = data;
                 STATUS_REG:
-                    readdata = {25'b0, txfe, txff, txfo, rxfe, rxff, rxfo};
+                    readdata = {17'b0, SPI_CLOCK_ASYNC != 0, frames_in_flight != 32'b0, DMA_ENABLE != 0, DEPTH_LOG2, 2'b0, txfe, txff, txfo, rxfe, rxff, rxfo};
                 CONTROL_REG: 
                     readdata = control;
                 BRD_REG: 
                     readdata = BRD;
+                INT_ENABLE_REG:
+                    readdata = int_enable;
+                INT_STATUS_CLEAR_REG:
+                    readdata = {25'b0, int_status};
+                LEVEL_REG:
+                    readdata = {{(15-FIFO_ADDR_WIDTH){1'b0}}, rx_level, {(15-FIFO_ADDR_WIDTH){1'b0}}, tx_level};
+                RX_DATA_VALID_REG:
+                    readdata = {rx_valid, rx_remaining, data[23:0]};
+                DMA_SRC_REG:
+                    readdata = dma_src;
+                DMA_DST_REG:
+                    readdata = dma_dst;
+                DMA_LEN_REG:
+                    readdata = dma_len;
+                DMA_CTRL_REG:
+                    readdata = {dma_ctrl[31:1], dma_busy};
+                CS_CFG0_REG:
+                    readdata = cs_cfg0;
+                CS_CFG1_REG:
+                    readdata = cs_cfg1;
+                CS_CFG2_REG:
+                    readdata = cs_cfg2;
+                CS_CFG3_REG:
+                    readdata = cs_cfg3;
+                POLL_CMD_REG:
+                    readdata = poll_cmd;
+                POLL_PERIOD_REG:
+                    readdata = poll_period;
+                POLL_MASK_REG:
+                    readdata = poll_mask;
+                POLL_VALUE_REG:
+                    readdata = poll_value;
+                POLL_CTRL_REG:
+                    readdata = {23'b0, poll_changed, 5'b0, poll_ctrl};
+                XFER_LEN_REG:
+                    readdata = xfer_len;
+                XFER_FILL_REG:
+                    readdata = xfer_fill;
+                PERF_CYCLES_REG:
+                    readdata = snap_cycles;
+                PERF_FRAMES_REG:
+                    readdata = snap_frames;
+                PERF_BITS_REG:
+                    readdata = snap_bits;
+                PERF_TX_WAIT_REG:
+                    readdata = snap_tx_wait;
+                PERF_RX_FULL_REG:
+                    readdata = snap_rx_full;
+                PERF_TXOV_REG:
+                    readdata = snap_txov;
+                PERF_RXOV_REG:
+                    readdata = snap_rxov;
+                PERF_CS_REG:
+                    readdata = snap_cs;
+                IO_MODE_REG:
+                    readdata = {29'b0, io_mode};
+                SAMPLE_DELAY_REG:
+                    readdata = sample_delay;
+                BIST_CTRL_REG:
+                    readdata = {31'b0, bist_busy};
+                BIST_LEN_REG:
+                    readdata = bist_len;
+                BIST_ERRORS_REG:
+                    readdata = bist_errors;
+                BIST_CYCLES_REG:
+                    readdata = bist_cycles;
+                SEQ_CTRL_REG:
+                    readdata = {12'b0, SEQ_DEPTH_LOG2, seq_pc, 7'b0, seq_busy};
+                SEQ_ADDR_REG:
+                    readdata = {24'b0, seq_addr};
+                SEQ_DATA_REG:
+                    readdata = seq_ram[seq_addr[SEQ_ADDR_WIDTH-1:0]];
+                SEQ_R0_REG:
+                    readdata = seq_result0;
+                SEQ_R1_REG:
+                    readdata = seq_result1;
+                SEQ_R2_REG:
+                    readdata = seq_result2;
+                SEQ_R3_REG:
+                    readdata = seq_result3;
+                default:
+                    readdata = 32'b0;
             endcase
         else
             readdata = 32'b1;
@@ -83,9 +454,31 @@ module spi2 (clk, reset, address, byteenable, chipselect, writedata, readdata, w
             status <= 32'b0;
             control <= 32'b0;
             BRD <= 32'b0;
+            int_enable <= 32'b0;
+            int_clear_request <= 7'b0;
+            dma_src <= 32'b0;
+            dma_dst <= 32'b0;
+            dma_len <= 32'b0;
+            dma_ctrl <= 32'b0;
+            cs_cfg0 <= 32'b0;
+            cs_cfg1 <= 32'b0;
+            cs_cfg2 <= 32'b0;
+            cs_cfg3 <= 32'b0;
+            poll_cmd <= 32'b0;
+            poll_period <= 32'b0;
+            poll_mask <= 32'b0;
+            poll_ctrl <= 3'b0;
+            xfer_len <= 32'b0;
+            xfer_fill <= 32'b0;
+            io_mode <= 3'b0;
+            sample_delay <= 32'b0;
+            bist_len <= 32'b0;
         end
         else
         begin
+            int_clear_request <= 7'b0;
+            if (fill_push)
+                xfer_len <= xfer_len - 1'b1;
             if (write & chipselect)
             begin
                 case (address)
@@ -97,6 +490,51 @@ module spi2 (clk, reset, address, byteenable, chipselect, writedata, readdata, w
                         control <= writedata;
                     BRD_REG: 
                         BRD <= writedata;
+                    INT_ENABLE_REG: 
+                        int_enable <= writedata;
+                    INT_STATUS_CLEAR_REG: 
+                        int_clear_request <= writedata[6:0];
+                    DMA_SRC_REG:
+                        dma_src <= writedata;
+                    DMA_DST_REG:
+                        dma_dst <= writedata;
+                    DMA_LEN_REG:
+                        dma_len <= writedata;
+                    CS_CFG0_REG:
+                        cs_cfg0 <= writedata;
+                    CS_CFG1_REG:
+                        cs_cfg1 <= writedata;
+                    CS_CFG2_REG:
+                        cs_cfg2 <= writedata;
+                    CS_CFG3_REG:
+                        cs_cfg3 <= writedata;
+                    POLL_CMD_REG:
+                        poll_cmd <= writedata;
+                    POLL_PERIOD_REG:
+                        poll_period <= writedata;
+                    POLL_MASK_REG:
+                        poll_mask <= writedata;
+                    POLL_CTRL_REG:
+                        poll_ctrl <= writedata[2:0];
+                    XFER_LEN_REG:
+                        xfer_len <= writedata;
+                    XFER_FILL_REG:
+                        xfer_fill <= writedata;
+                    IO_MODE_REG:
+                        io_mode <= writedata[2:0];
+                    SAMPLE_DELAY_REG:
+                        sample_delay <= writedata & 32'h0F0F0F0F;
+                    BIST_LEN_REG:
+                        bist_len <= writedata;
+                    DMA_CTRL_REG:
+                    begin
+                        dma_ctrl <= writedata;
+                        if (writedata[0] & writedata[3])
+                        begin
+                            control[14:13] <= writedata[5:4];
+                            control[16 + 2*writedata[5:4] +: 2] <= writedata[7:6];
+                        end
+                    end
                 endcase
             end
 				else
@@ -123,18 +561,52 @@ module spi2 (clk, reset, address, byteenable, chipselect, writedata, readdata, w
 	 
 wire writetxfifo;
 wire readtxfifo;
-wire [31:0] txfifo2txserial;
+wire writerxfifo;
+wire [36:0] txfifo2txserial;
 wire [31:0] serial2rxfifo;
 wire BRDclk;
 wire readTXrequest;
 wire writeRXrequest;
+
+// SPI clock domain
+// The baud divider and serializer run from spi_domain_clk and see the
+// registers as spi_control, spi_brd, spi_cfg0-3 and spi_sample_delay; with
+// SPI_CLOCK_ASYNC
+// these are shadow copies and the words cross through AsyncFIFOs (spi_cdc
+// below), otherwise they are the registers and FIFOs themselves
+wire spi_domain_clk = (SPI_CLOCK_ASYNC != 0) ? spi_clk : clk;
+wire spi_reset;
+wire [31:0] spi_control, spi_brd, spi_cfg0, spi_cfg1, spi_cfg2, spi_cfg3;
+wire [31:0] spi_sample_delay;
+wire spi_loopback = spi_control[27];
+wire [36:0] spi_tx_word;
+wire spi_txfe;
+wire spi_rx_write;
+wire [31:0] spi_rx_word;
+reg [5:0] frame_bits;
+
+// Avalon side of the crossing: TX FIFO pops, the bits of a completed frame
+// and the serializer state used by the performance counters
+wire tx_pop;
+wire [5:0] frame_bits_clk;
+wire tx_wait_clk, cs_idle_clk;
+reg cfg_toggle;
+
+// banked configuration, the serializer reports the chip select of the
+// frame it is on and its bank supplies the baud rate divisor
+wire banked = spi_control[31];
+wire [1:0] active_cs;
+wire [1:0] tx_tag;
+wire [31:0] active_cfg = (active_cs == 2'b00) ? spi_cfg0 :
+                         (active_cs == 2'b01) ? spi_cfg1 :
+                         (active_cs == 2'b10) ? spi_cfg2 : spi_cfg3;
 	 
 BaudDivider baudgen 
 (
-	.clk(clk),
-	.enable(control[15]),
-	.reset(reset),
-	.brd(BRD),
+	.clk(spi_domain_clk),
+	.enable(spi_control[15]),
+	.reset(spi_reset),
+	.brd(banked ? {8'b0, active_cfg[31:8]} : spi_brd),
 	.baud_out(BRDclk)
 );
 
@@ -148,18 +620,18 @@ edgeDetector WriteTXfifo
 
 edgeDetector ReadTXfifo
 (
-	.reset(reset),
+	.reset(spi_reset),
 	.signal(readTXrequest),
-	.clk(clk),
+	.clk(spi_domain_clk),
 	.pulse(readtxfifo)
 );
 
 edgeDetector WriteRXfifo
 (
-	.reset(reset),
+	.reset(spi_reset),
 	.signal(writeRXrequest),
-	.clk(clk),
-	.pulse(writerxfifo)
+	.clk(spi_domain_clk),
+	.pulse(spi_rx_write)
 );
 
 edgeDetector ReadRXfifo
@@ -170,32 +642,133 @@ edgeDetector ReadRXfifo
 	.pulse(readrxfifo)
 );
 
-assign Write = (write & chipselect & (address == DATA_REG) & writetxfifo);
-assign Read = (read & chipselect & (address == DATA_REG) & readrxfifo);
+assign Write = (write & chipselect & ((address == DATA_REG) | (address[5:2] == 4'b0100)) & writetxfifo);
+assign tx_tag = (address[5:2] == 4'b0100) ? address[1:0] : control[14:13];
+assign Read = (read & chipselect & ((address == DATA_REG) | (address == RX_DATA_VALID_REG)) & readrxfifo);
+assign dma_start = (DMA_ENABLE != 0) & write & chipselect & (address == DMA_CTRL_REG) & writetxfifo & writedata[0];
+assign dma_abort = write & chipselect & (address == DMA_CTRL_REG) & writetxfifo & !writedata[0];
+
+// packed frames
+// A PACKED data write is latched with its byteenable lanes and pushed one
+// lane per clock; received frames are gathered into rx_pack until the
+// word is full or no frame is left to come (fill frames still to be
+// generated count as coming)
+function [1:0] pack_lanes;
+	input [4:0] size;
+	begin
+		pack_lanes = (size < 5'd8) ? 2'd3 : (size < 5'd16) ? 2'd1 : 2'd0;
+	end
+endfunction
 
-FIFO txfifo
+wire [4:0] select_size = !control[31] ? control[4:0] :
+                         (control[14:13] == 2'b00) ? cs_cfg0[4:0] :
+                         (control[14:13] == 2'b01) ? cs_cfg1[4:0] :
+                         (control[14:13] == 2'b10) ? cs_cfg2[4:0] : cs_cfg3[4:0];
+wire [4:0] tx_size = !control[31] ? control[4:0] :
+                     (tx_tag == 2'b00) ? cs_cfg0[4:0] :
+                     (tx_tag == 2'b01) ? cs_cfg1[4:0] :
+                     (tx_tag == 2'b10) ? cs_cfg2[4:0] : cs_cfg3[4:0];
+wire [1:0] tx_lanes = pack_lanes(tx_size);
+wire [1:0] rx_lanes = pack_lanes(select_size);
+wire rx_pack_en = control[28] & !dma_busy & (rx_lanes != 2'b0);
+wire [31:0] rx_packed = rx_pack | ((rx_lanes == 2'd1) ? {16'b0, serial2rxfifo[15:0]} << {rx_lane[0], 4'b0}
+                                                    : {24'b0, serial2rxfifo[7:0]} << {rx_lane, 3'b0});
+
+assign pack_write = Write & control[28] & (tx_lanes != 2'b0);
+assign pack_push = pack_valid[0];
+assign host_push = (Write & !pack_write) | pack_push;
+assign tx_push = host_push | dma_push | poll_push | fill_push | bist_push | seq_push;
+assign rx_host = writerxfifo & !poll_capture & !bist_capture & !seq_capture & (!control[25] | dma_busy);
+assign rx_last = (frames_in_flight <= 32'd1) & !tx_push & (pack_valid == 4'b0)
+               & !(control[26] & (xfer_len != 32'b0));
+assign rx_write = rx_host & (!rx_pack_en | (rx_lane == rx_lanes) | rx_last);
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+	begin
+		pack_word <= 32'b0;
+		pack_valid <= 4'b0;
+		pack_io <= 3'b0;
+		pack_tag <= 2'b0;
+		pack_half <= 1'b0;
+	end
+	else if (pack_write)
+	begin
+		pack_word <= writedata;
+		pack_valid <= (tx_lanes == 2'd1) ? {2'b0, byteenable[2], byteenable[0]} : byteenable;
+		pack_io <= io_mode;
+		pack_tag <= tx_tag;
+		pack_half <= (tx_lanes == 2'd1);
+	end
+	else if (pack_valid != 4'b0)
+	begin
+		pack_word <= pack_half ? pack_word >> 16 : pack_word >> 8;
+		pack_valid <= pack_valid >> 1;
+	end
+end
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+	begin
+		rx_pack <= 32'b0;
+		rx_lane <= 2'b0;
+	end
+	else if (!rx_pack_en | rx_write)
+	begin
+		rx_pack <= 32'b0;
+		rx_lane <= 2'b0;
+	end
+	else if (rx_host)
+	begin
+		rx_pack <= rx_packed;
+		rx_lane <= rx_lane + 1'b1;
+	end
+end
+
+// VALID tells whether the last pop found a word, it is sampled with the
+// FIFO output once the read wait state has passed
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+		rx_valid <= 1'b0;
+	else if (Read)
+		rx_valid <= !rxfe;
+end
+assign rx_remaining = (rx_level > 127) ? 7'd127 : rx_level;
+
+// TX words are {io_mode, chip select, data}
+FIFO #(.DEPTH(FIFO_DEPTH), .WIDTH(37)) txfifo
 (
 	.DataOut(txfifo2txserial), 
-	.DataIn(writedata),
+	.DataIn(poll_push ? {3'b0, poll_ctrl[2:1], poll_cmd} : dma_push ? {io_mode, control[14:13], dma_word} :
+	        fill_push ? {io_mode, control[14:13], xfer_fill} :
+	        bist_push ? {io_mode, control[14:13], bist_word} :
+	        seq_push ? {3'b0, seq_tag, seq_word} :
+	        pack_push ? {pack_io, pack_tag, pack_half ? {16'b0, pack_word[15:0]} : {24'b0, pack_word[7:0]}} :
+	        {io_mode, tx_tag, writedata}),
 	.Full(txff),
 	.Empty(txfe),
 	.OV(txfo),
-	.Read(readtxfifo), 
-	.Write(Write),
+	.Level(tx_level),
+	.Read(tx_pop), 
+	.Write(tx_push),
 	.Clock(clk),
 	.Reset(reset), 
 	.ClearOV(clr_ov_tx)
 );
 
-FIFO rxfifo
+FIFO #(.DEPTH(FIFO_DEPTH)) rxfifo
 (
 	.DataOut(data), 
-	.DataIn(serial2rxfifo),
+	.DataIn(rx_pack_en ? rx_packed : serial2rxfifo),
 	.Full(rxff),
 	.Empty(rxfe),
 	.OV(rxfo),
-	.Read(Read), 
-	.Write(writerxfifo),
+	.Level(rx_level),
+	.Read(Read | dma_pop), 
+	.Write(rx_write),
 	.Clock(clk),
 	.Reset(reset), 
 	.ClearOV(clr_ov_rx)
@@ -203,35 +776,767 @@ FIFO rxfifo
 
 transmitter serializer 
 (
-	.clock(clk), 
-	.reset(reset), 
+	.clock(spi_domain_clk), 
+	.reset(spi_reset), 
 	.brdClk(BRDclk), 
-	.TXEmpty(txfe), 
-	.DataIn(txfifo2txserial),
-	.DataOuttoRXFifo(serial2rxfifo),
-	.wordSize(control[4:0]),
-	.mode0(control[17:16]), 
-	.mode1(control[19:18]),
-	.mode2(control[21:20]), 
-	.mode3(control[23:22]),
-	.cs_select(control[14:13]),
-	.cs0_enable(control[9]), 
-	.cs1_enable(control[10]), 
-	.cs2_enable(control[11]), 
-	.cs3_enable(control[12]), 
-	.chip_enable(control[15]),
-	.cs0_auto(control[5]), 
-	.cs1_auto(control[6]), 
-	.cs2_auto(control[7]), 
-	.cs3_auto(control[8]),
-	.sc0(cs0), 
-	.sc1(cs1), 
-	.sc2(cs2), 
-	.sc3(cs3), 
+	.TXEmpty(spi_txfe), 
+	.DataIn(spi_tx_word),
+	.DataOuttoRXFifo(spi_rx_word),
+	.wordSize0(banked ? spi_cfg0[4:0] : spi_control[4:0]),
+	.wordSize1(banked ? spi_cfg1[4:0] : spi_control[4:0]),
+	.wordSize2(banked ? spi_cfg2[4:0] : spi_control[4:0]),
+	.wordSize3(banked ? spi_cfg3[4:0] : spi_control[4:0]),
+	.mode0(banked ? spi_cfg0[6:5] : spi_control[17:16]), 
+	.mode1(banked ? spi_cfg1[6:5] : spi_control[19:18]),
+	.mode2(banked ? spi_cfg2[6:5] : spi_control[21:20]), 
+	.mode3(banked ? spi_cfg3[6:5] : spi_control[23:22]),
+	.sampleDelay0(spi_loopback ? 4'b0 : spi_sample_delay[3:0]),
+	.sampleDelay1(spi_loopback ? 4'b0 : spi_sample_delay[11:8]),
+	.sampleDelay2(spi_loopback ? 4'b0 : spi_sample_delay[19:16]),
+	.sampleDelay3(spi_loopback ? 4'b0 : spi_sample_delay[27:24]),
+	.cs_select(spi_control[14:13]),
+	.banked(banked),
+	.active_cs(active_cs),
+	.cs0_enable(spi_control[9]), 
+	.cs1_enable(spi_control[10]), 
+	.cs2_enable(spi_control[11]), 
+	.cs3_enable(spi_control[12]), 
+	.chip_enable(spi_control[15]),
+	.cs0_auto(banked ? spi_cfg0[7] : spi_control[5]), 
+	.cs1_auto(banked ? spi_cfg1[7] : spi_control[6]), 
+	.cs2_auto(banked ? spi_cfg2[7] : spi_control[7]), 
+	.cs3_auto(banked ? spi_cfg3[7] : spi_control[8]),
+	.stream(spi_control[24]),
+	.sc0(spi_cs0), 
+	.sc1(spi_cs1), 
+	.sc2(spi_cs2), 
+	.sc3(spi_cs3), 
 	.tx(tx), 
-	.rx(rx),
+	.rx(spi_loopback ? tx : rx),
+	.io_in(spi_loopback ? io_out : io_in),
+	.io_out(io_out),
+	.io_oe(io_oe),
 	.sysclk(clock),
 	.requestTXread(readTXrequest),
-	.requestRXwrite(writeRXrequest)
+	.requestRXwrite(writeRXrequest),
+	.bitStrobe(bit_strobe),
+	.txWait(tx_wait)
 );
+
+// LOOPBACK keeps the devices deselected, the sequencer holds them
+// asserted between its frames
+assign cs0 = (spi_cs0 & !seq_hold[0]) | spi_loopback;
+assign cs1 = (spi_cs1 & !seq_hold[1]) | spi_loopback;
+assign cs2 = (spi_cs2 & !seq_hold[2]) | spi_loopback;
+assign cs3 = (spi_cs3 & !seq_hold[3]) | spi_loopback;
+
+// Bits of the frame being shifted, reported with its RX word
+always @ (posedge spi_domain_clk)
+begin
+	if (spi_reset || spi_rx_write)
+		frame_bits <= 6'b0;
+	else
+		frame_bits <= frame_bits + bit_strobe;
+end
+
+// Configuration writes flip cfg_toggle once per access, the SPI domain
+// copies the registers once the flip has crossed, when they are stable;
+// TX words pushed after the write cross later than the flip
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+		cfg_toggle <= 1'b0;
+	else if (write & chipselect & writetxfifo & ((address == CONTROL_REG) | (address == BRD_REG)
+	         | (address == DMA_CTRL_REG) | (address == SAMPLE_DELAY_REG) | (address[5:2] == 4'b0011)))
+		cfg_toggle <= !cfg_toggle;
+end
+
+generate
+if (SPI_CLOCK_ASYNC != 0)
+begin : spi_cdc
+	reg [1:0] reset_sync;
+	reg [2:0] cfg_sync;
+	reg [31:0] control_s, brd_s, cfg0_s, cfg1_s, cfg2_s, cfg3_s, sample_delay_s;
+	reg [1:0] state_meta, state_sync;
+	reg [$clog2(CDC_DEPTH):0] cdc_in_flight;
+	reg tx_move, rx_move;
+	reg [1:0] flush_sync;
+	wire spi_hold, cdc_flush, spi_flush;
+	wire rx_pop;
+	wire rxcdc_empty;
+	wire [37:0] rx_entry;
+
+	// reset is asserted at once and released on spi_clk, once the source
+	// of spi_clk is locked
+	assign spi_hold = reset | !spi_clk_locked;
+	always @ (posedge spi_clk or posedge spi_hold)
+	begin
+		if (spi_hold)
+			reset_sync <= 2'b11;
+		else
+			reset_sync <= {reset_sync[0], 1'b0};
+	end
+	assign spi_reset = reset_sync[1];
+
+	// Clearing CHIP_ENABLE empties both AsyncFIFOs and the count of words
+	// between the domains, so words left in them by a disable are not sent
+	// or counted after the next enable; the TX FIFO keeps its words
+	assign cdc_flush = reset | !control[15];
+	always @ (posedge spi_clk or posedge cdc_flush)
+	begin
+		if (cdc_flush)
+			flush_sync <= 2'b11;
+		else
+			flush_sync <= {flush_sync[0], 1'b0};
+	end
+	assign spi_flush = spi_reset | flush_sync[1];
+
+	always @ (posedge spi_clk or posedge spi_reset)
+	begin
+		if (spi_reset)
+		begin
+			cfg_sync <= 3'b0;
+			control_s <= 32'b0;
+			brd_s <= 32'b0;
+			cfg0_s <= 32'b0;
+			cfg1_s <= 32'b0;
+			cfg2_s <= 32'b0;
+			cfg3_s <= 32'b0;
+			sample_delay_s <= 32'b0;
+		end
+		else
+		begin
+			cfg_sync <= {cfg_sync[1:0], cfg_toggle};
+			if (cfg_sync[2] != cfg_sync[1])
+			begin
+				control_s <= control;
+				brd_s <= BRD;
+				cfg0_s <= cs_cfg0;
+				cfg1_s <= cs_cfg1;
+				cfg2_s <= cs_cfg2;
+				cfg3_s <= cs_cfg3;
+				sample_delay_s <= sample_delay;
+			end
+		end
+	end
+	assign spi_control = control_s;
+	assign spi_brd = brd_s;
+	assign spi_cfg0 = cfg0_s;
+	assign spi_cfg1 = cfg1_s;
+	assign spi_cfg2 = cfg2_s;
+	assign spi_cfg3 = cfg3_s;
+	assign spi_sample_delay = sample_delay_s;
+
+	// TX words move from the TX FIFO while fewer than CDC_DEPTH words are
+	// between the domains, so neither AsyncFIFO can fill; the popped word
+	// is on the FIFO output on the next clock
+	assign tx_pop = !txfe & (cdc_in_flight < CDC_DEPTH) & control[15];
+
+	AsyncFIFO #(.DEPTH(CDC_DEPTH), .WIDTH(37)) txcdc
+	(
+		.DataOut(spi_tx_word),
+		.Full(),
+		.Empty(spi_txfe),
+		.DataIn(txfifo2txserial),
+		.Write(tx_move),
+		.WClock(clk),
+		.WReset(cdc_flush),
+		.Read(readtxfifo),
+		.RClock(spi_clk),
+		.RReset(spi_flush)
+	);
+
+	// Every completed frame crosses back with its bit count, TX_ONLY and
+	// poll responses are sorted out on the Avalon side as before
+	assign rx_pop = !rxcdc_empty;
+
+	AsyncFIFO #(.DEPTH(CDC_DEPTH), .WIDTH(38)) rxcdc
+	(
+		.DataOut(rx_entry),
+		.Full(),
+		.Empty(rxcdc_empty),
+		.DataIn({frame_bits + bit_strobe, spi_rx_word}),
+		.Write(spi_rx_write),
+		.WClock(spi_clk),
+		.WReset(spi_flush),
+		.Read(rx_pop),
+		.RClock(clk),
+		.RReset(cdc_flush)
+	);
+
+	always @ (posedge clk or posedge reset)
+	begin
+		if (reset)
+		begin
+			tx_move <= 1'b0;
+			rx_move <= 1'b0;
+			cdc_in_flight <= 1'b0;
+			state_meta <= 2'b0;
+			state_sync <= 2'b0;
+		end
+		else
+		begin
+			tx_move <= tx_pop;
+			rx_move <= rx_pop;
+			if (!control[15])
+				cdc_in_flight <= 1'b0;
+			else
+				cdc_in_flight <= cdc_in_flight + tx_pop - rx_pop;
+			state_meta <= {tx_wait, spi_cs0 & spi_cs1 & spi_cs2 & spi_cs3};
+			state_sync <= state_meta;
+		end
+	end
+	assign writerxfifo = rx_move;
+	assign serial2rxfifo = rx_entry[31:0];
+	assign frame_bits_clk = rx_entry[37:32];
+
+	// Levels sampled for the performance counters only
+	assign tx_wait_clk = state_sync[1];
+	assign cs_idle_clk = state_sync[0];
+end
+else
+begin : spi_sync
+	assign spi_reset = reset;
+	assign spi_control = control;
+	assign spi_brd = BRD;
+	assign spi_cfg0 = cs_cfg0;
+	assign spi_cfg1 = cs_cfg1;
+	assign spi_cfg2 = cs_cfg2;
+	assign spi_cfg3 = cs_cfg3;
+	assign spi_sample_delay = sample_delay;
+	assign spi_tx_word = txfifo2txserial;
+	assign spi_txfe = txfe;
+	assign tx_pop = readtxfifo;
+	assign writerxfifo = spi_rx_write;
+	assign serial2rxfifo = spi_rx_word;
+	assign frame_bits_clk = 6'b0;
+	assign tx_wait_clk = tx_wait;
+	assign cs_idle_clk = spi_cs0 & spi_cs1 & spi_cs2 & spi_cs3;
+end
+endgenerate
+
+// DMA engine
+// Words are fetched from dma_src (or zeros) into the TX FIFO and popped
+// from the RX FIFO to dma_dst (or dropped); RX is served first and at most
+// FIFO_DEPTH words are in flight, so neither FIFO can overflow
+// The host must not use the data registers while the engine is busy
+parameter DMA_IDLE  = 3'b000;
+parameter DMA_READ  = 3'b001;
+parameter DMA_PUSH  = 3'b010;
+parameter DMA_POP   = 3'b011;
+parameter DMA_WRITE = 3'b100;
+
+wire [31:0] dma_in_flight = dma_tx_count - dma_rx_count;
+
+assign dma_push = (dma_state == DMA_PUSH);
+assign dma_pop = (dma_state == DMA_POP);
+assign dma_read = (dma_state == DMA_READ);
+assign dma_write = (dma_state == DMA_WRITE);
+assign dma_address = dma_read ? dma_src_ptr : dma_dst_ptr;
+assign dma_writedata = data;
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+	begin
+		dma_state <= DMA_IDLE;
+		dma_busy <= 1'b0;
+		dma_done <= 1'b0;
+		dma_src_ptr <= 32'b0;
+		dma_dst_ptr <= 32'b0;
+		dma_tx_count <= 32'b0;
+		dma_rx_count <= 32'b0;
+		dma_word <= 32'b0;
+	end
+	else
+	begin
+		dma_done <= 1'b0;
+		if (dma_start)
+		begin
+			dma_state <= DMA_IDLE;
+			dma_busy <= 1'b1;
+			dma_src_ptr <= dma_src;
+			dma_dst_ptr <= dma_dst;
+			dma_tx_count <= 32'b0;
+			dma_rx_count <= 32'b0;
+		end
+		else if (dma_abort)
+		begin
+			dma_state <= DMA_IDLE;
+			dma_busy <= 1'b0;
+		end
+		else if (dma_busy)
+			case (dma_state)
+				DMA_IDLE:
+					if (rx_level != 0 && dma_rx_count != dma_len)
+						dma_state <= DMA_POP;
+					else if (dma_tx_count != dma_len && dma_in_flight < FIFO_DEPTH && !txff)
+					begin
+						if (dma_ctrl[1])
+							dma_state <= DMA_READ;
+						else
+						begin
+							dma_word <= 32'b0;
+							dma_state <= DMA_PUSH;
+						end
+					end
+					else if (dma_rx_count == dma_len)
+					begin
+						dma_busy <= 1'b0;
+						dma_done <= 1'b1;
+					end
+				DMA_READ:
+					if (!dma_waitrequest)
+					begin
+						dma_word <= dma_readdata;
+						dma_src_ptr <= dma_src_ptr + 3'd4;
+						dma_state <= DMA_PUSH;
+					end
+				DMA_PUSH:
+				begin
+					dma_tx_count <= dma_tx_count + 1'b1;
+					dma_state <= DMA_IDLE;
+				end
+				// the popped word is on the RX FIFO output from the next cycle
+				DMA_POP:
+				begin
+					dma_rx_count <= dma_rx_count + 1'b1;
+					dma_state <= dma_ctrl[2] ? DMA_WRITE : DMA_IDLE;
+				end
+				DMA_WRITE:
+					if (!dma_waitrequest)
+					begin
+						dma_dst_ptr <= dma_dst_ptr + 3'd4;
+						dma_state <= DMA_IDLE;
+					end
+				default:
+					dma_state <= DMA_IDLE;
+			endcase
+	end
+end
+
+// poll engine
+// Frames leave in TX FIFO order, so with nothing in flight when the poll
+// word is pushed the next RX write is its response
+// The poll word moves on to the serializer prefetch within a few clocks,
+// so a host keeping FIFO_DEPTH words in flight never finds it in the FIFO
+assign poll_push = poll_ctrl[0] & control[15] & !poll_pending & (poll_timer == 32'b0)
+                 & (frames_in_flight == 32'b0) & txfe & !dma_busy & !(write & chipselect) & (pack_valid == 4'b0)
+                 & !seq_busy;
+assign poll_capture = writerxfifo & poll_pending;
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+		frames_in_flight <= 32'b0;
+	else if (!control[15] & txfe)
+		frames_in_flight <= 32'b0;
+	else if (tx_push & !writerxfifo)
+		frames_in_flight <= frames_in_flight + 1'b1;
+	else if (!tx_push & writerxfifo & (frames_in_flight != 32'b0))
+		frames_in_flight <= frames_in_flight - 1'b1;
+end
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+	begin
+		poll_value <= 32'b0;
+		poll_timer <= 32'b0;
+		poll_pending <= 1'b0;
+		poll_changed <= 1'b0;
+		poll_event <= 1'b0;
+	end
+	else
+	begin
+		poll_event <= 1'b0;
+		if (write & chipselect & (address == POLL_VALUE_REG))
+			poll_value <= writedata;
+		if (write & chipselect & (address == POLL_CTRL_REG) & writedata[8])
+			poll_changed <= 1'b0;
+		if (!poll_ctrl[0])
+			poll_timer <= poll_period;
+		else if (poll_push)
+			poll_pending <= 1'b1;
+		else if (!poll_pending && poll_timer != 32'b0)
+			poll_timer <= poll_timer - 1'b1;
+		if (poll_capture)
+		begin
+			poll_pending <= 1'b0;
+			poll_timer <= poll_period;
+			if ((serial2rxfifo & poll_mask) != poll_value)
+			begin
+				poll_value <= serial2rxfifo & poll_mask;
+				poll_changed <= 1'b1;
+				poll_event <= 1'b1;
+			end
+		end
+	end
+end
+
+// RX_ONLY fill generator
+// Frames in flight plus words waiting in the RX FIFO stay below FIFO_DEPTH
+assign fill_push = control[26] & control[15] & (xfer_len != 32'b0) & !txff & !poll_push & !dma_busy
+                 & (frames_in_flight + rx_level < FIFO_DEPTH);
+
+// self-test
+// PRBS-31 (x^31 + x^28 + 1) stepped 32 bits per frame, the generator and
+// the checker start from the same seed and frames return in order
+function [62:0] prbs31_word;
+	input [30:0] state;
+	integer i;
+	reg [30:0] s;
+	reg [31:0] w;
+	begin
+		s = state;
+		w = 32'b0;
+		for (i = 0; i < 32; i = i + 1)
+		begin
+			w = {w[30:0], s[30] ^ s[27]};
+			s = {s[29:0], s[30] ^ s[27]};
+		end
+		prbs31_word = {s, w};
+	end
+endfunction
+
+wire [62:0] bist_gen_next = prbs31_word(bist_gen);
+wire [62:0] bist_chk_next = prbs31_word(bist_chk);
+assign bist_word = bist_gen_next[31:0];
+wire [31:0] bist_mask = 32'hFFFFFFFF >> (5'd31 - select_size);
+
+assign bist_start = write & chipselect & (address == BIST_CTRL_REG) & writetxfifo & writedata[0];
+assign bist_abort = write & chipselect & (address == BIST_CTRL_REG) & writetxfifo & !writedata[0];
+assign bist_push = bist_busy & control[15] & (bist_sent != bist_len) & !txff & !poll_push & !dma_busy
+                 & !fill_push & (frames_in_flight < FIFO_DEPTH);
+assign bist_capture = writerxfifo & bist_busy & !poll_pending;
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+	begin
+		bist_busy <= 1'b0;
+		bist_sent <= 32'b0;
+		bist_checked <= 32'b0;
+		bist_errors <= 32'b0;
+		bist_cycles <= 32'b0;
+		bist_gen <= 31'h7FFFFFFF;
+		bist_chk <= 31'h7FFFFFFF;
+	end
+	else if (bist_start)
+	begin
+		bist_busy <= (bist_len != 32'b0);
+		bist_sent <= 32'b0;
+		bist_checked <= 32'b0;
+		bist_errors <= 32'b0;
+		bist_cycles <= 32'b0;
+		bist_gen <= 31'h7FFFFFFF;
+		bist_chk <= 31'h7FFFFFFF;
+	end
+	else if (bist_abort)
+		bist_busy <= 1'b0;
+	else if (bist_busy)
+	begin
+		bist_cycles <= bist_cycles + 1'b1;
+		if (bist_push)
+		begin
+			bist_sent <= bist_sent + 1'b1;
+			bist_gen <= bist_gen_next[62:32];
+		end
+		if (bist_capture)
+		begin
+			bist_checked <= bist_checked + 1'b1;
+			bist_chk <= bist_chk_next[62:32];
+			if (((serial2rxfifo ^ bist_chk_next[31:0]) & bist_mask) != 32'b0)
+				bist_errors <= bist_errors + 1'b1;
+			if (bist_checked + 1'b1 == bist_len)
+				bist_busy <= 1'b0;
+		end
+	end
+end
+
+// sequencer
+// Frames leave in TX FIFO order, so the response RECV waits for is the
+// one that brings the sequencer frames in flight to zero; responses still
+// in flight after an abort are dropped as well
+parameter SEQ_IDLE  = 3'b000;
+parameter SEQ_EXEC  = 3'b001;
+parameter SEQ_PUSH  = 3'b010;
+parameter SEQ_RX    = 3'b011;
+parameter SEQ_DELAY = 3'b100;
+parameter SEQ_DRAIN = 3'b101;
+parameter SEQ_END   = 3'b110;
+
+parameter SEQ_OP_END   = 4'h0;
+parameter SEQ_OP_SEND  = 4'h1;
+parameter SEQ_OP_RECV  = 4'h2;
+parameter SEQ_OP_CS    = 4'h3;
+parameter SEQ_OP_WAIT  = 4'h4;
+parameter SEQ_OP_LOAD  = 4'h5;
+parameter SEQ_OP_AND   = 4'h6;
+parameter SEQ_OP_OR    = 4'h7;
+parameter SEQ_OP_JUMP  = 4'h8;
+parameter SEQ_OP_STORE = 4'h9;
+parameter SEQ_OP_IRQ   = 4'hA;
+
+wire [31:0] seq_instr = seq_ram[seq_pc[SEQ_ADDR_WIDTH-1:0]];
+wire [31:0] seq_reg = (seq_instr[1:0] == 2'b00) ? seq_result0 :
+                      (seq_instr[1:0] == 2'b01) ? seq_result1 :
+                      (seq_instr[1:0] == 2'b10) ? seq_result2 : seq_result3;
+wire [31:0] seq_operand = seq_instr[27] ? seq_reg : {8'b0, seq_instr[23:0]};
+wire [15:0] seq_test = seq_acc[15:0] & seq_instr[23:8];
+wire seq_taken = (seq_instr[27:26] == 2'b00) | ((seq_instr[27:26] == 2'b01) & (seq_test == 16'b0))
+               | ((seq_instr[27:26] == 2'b10) & (seq_test != 16'b0));
+
+assign seq_busy = (seq_state != SEQ_IDLE);
+assign seq_start = write & chipselect & (address == SEQ_CTRL_REG) & writetxfifo & writedata[0];
+assign seq_abort = write & chipselect & (address == SEQ_CTRL_REG) & writetxfifo & !writedata[0];
+assign seq_push = (seq_state == SEQ_PUSH) & control[15] & !txff & !poll_push & !dma_busy & !fill_push
+                & !bist_push & (frames_in_flight < FIFO_DEPTH);
+assign seq_capture = writerxfifo & (seq_in_flight != 32'b0) & !poll_pending;
+
+always @ (posedge clk)
+begin
+	if (write & chipselect & (address == SEQ_DATA_REG) & writetxfifo)
+		seq_ram[seq_addr[SEQ_ADDR_WIDTH-1:0]] <= writedata;
+end
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+		seq_addr <= 8'b0;
+	else if (write & chipselect & (address == SEQ_ADDR_REG))
+		seq_addr <= writedata[7:0];
+	else if (write & chipselect & (address == SEQ_DATA_REG) & writetxfifo)
+		seq_addr <= seq_addr + 1'b1;
+end
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+		seq_in_flight <= 32'b0;
+	else if (seq_push & !seq_capture)
+		seq_in_flight <= seq_in_flight + 1'b1;
+	else if (!seq_push & seq_capture)
+		seq_in_flight <= seq_in_flight - 1'b1;
+end
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+	begin
+		seq_state <= SEQ_IDLE;
+		seq_pc <= 8'b0;
+		seq_acc <= 32'b0;
+		seq_word <= 32'b0;
+		seq_timer <= 32'b0;
+		seq_tag <= 2'b0;
+		seq_hold <= 4'b0;
+		seq_recv <= 1'b0;
+		seq_irq <= 1'b0;
+		seq_event <= 1'b0;
+		seq_result0 <= 32'b0;
+		seq_result1 <= 32'b0;
+		seq_result2 <= 32'b0;
+		seq_result3 <= 32'b0;
+	end
+	else
+	begin
+		seq_event <= 1'b0;
+		if (write & chipselect & (address == SEQ_R0_REG))
+			seq_result0 <= writedata;
+		if (write & chipselect & (address == SEQ_R1_REG))
+			seq_result1 <= writedata;
+		if (write & chipselect & (address == SEQ_R2_REG))
+			seq_result2 <= writedata;
+		if (write & chipselect & (address == SEQ_R3_REG))
+			seq_result3 <= writedata;
+		if (seq_start)
+		begin
+			seq_state <= SEQ_EXEC;
+			seq_pc <= writedata[15:8];
+			seq_hold <= 4'b0;
+		end
+		else if (seq_abort)
+		begin
+			seq_state <= SEQ_IDLE;
+			seq_hold <= 4'b0;
+		end
+		else
+			case (seq_state)
+				SEQ_EXEC:
+				begin
+					seq_pc <= seq_pc + 1'b1;
+					seq_tag <= seq_instr[25:24];
+					case (seq_instr[31:28])
+						SEQ_OP_SEND, SEQ_OP_RECV:
+						begin
+							seq_word <= seq_operand | (seq_instr[26] ? seq_acc : 32'b0);
+							seq_recv <= (seq_instr[31:28] == SEQ_OP_RECV);
+							seq_state <= SEQ_PUSH;
+						end
+						SEQ_OP_CS:
+							if (seq_instr[0])
+								seq_hold[seq_instr[25:24]] <= 1'b1;
+							else
+								seq_state <= SEQ_DRAIN;
+						SEQ_OP_WAIT:
+						begin
+							seq_timer <= seq_operand;
+							seq_state <= SEQ_DELAY;
+						end
+						SEQ_OP_LOAD:
+							seq_acc <= seq_operand;
+						SEQ_OP_AND:
+							seq_acc <= seq_acc & seq_operand;
+						SEQ_OP_OR:
+							seq_acc <= seq_acc | seq_operand;
+						SEQ_OP_JUMP:
+							if (seq_taken)
+								seq_pc <= seq_instr[7:0];
+						SEQ_OP_STORE:
+							case (seq_instr[1:0])
+								2'b00: seq_result0 <= seq_acc;
+								2'b01: seq_result1 <= seq_acc;
+								2'b10: seq_result2 <= seq_acc;
+								2'b11: seq_result3 <= seq_acc;
+							endcase
+						SEQ_OP_IRQ:
+							seq_event <= 1'b1;
+						default:
+						begin
+							seq_irq <= (seq_instr[31:28] == SEQ_OP_END) & seq_instr[0];
+							seq_pc <= seq_pc;
+							seq_state <= SEQ_END;
+						end
+					endcase
+				end
+				SEQ_PUSH:
+					if (seq_push)
+						seq_state <= seq_recv ? SEQ_RX : SEQ_EXEC;
+				SEQ_RX:
+					if (seq_capture & (seq_in_flight == 32'd1))
+					begin
+						seq_acc <= serial2rxfifo;
+						seq_state <= SEQ_EXEC;
+					end
+				SEQ_DELAY:
+					if (seq_timer == 32'b0)
+						seq_state <= SEQ_EXEC;
+					else
+						seq_timer <= seq_timer - 1'b1;
+				SEQ_DRAIN:
+					if (seq_in_flight == 32'b0)
+					begin
+						seq_hold[seq_tag] <= 1'b0;
+						seq_state <= SEQ_EXEC;
+					end
+				SEQ_END:
+					if (seq_in_flight == 32'b0)
+					begin
+						seq_hold <= 4'b0;
+						seq_event <= seq_irq;
+						seq_state <= SEQ_IDLE;
+					end
+				default:
+					seq_state <= SEQ_IDLE;
+			endcase
+	end
+end
+
+// performance counters
+assign perf_snapshot = write & chipselect & (address == PERF_CTRL_REG) & writetxfifo & writedata[0];
+assign perf_clear = write & chipselect & (address == PERF_CTRL_REG) & writetxfifo & writedata[1];
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+	begin
+		perf_cycles <= 32'b0;
+		perf_frames <= 32'b0;
+		perf_bits <= 32'b0;
+		perf_tx_wait <= 32'b0;
+		perf_rx_full <= 32'b0;
+		perf_txov <= 32'b0;
+		perf_rxov <= 32'b0;
+		perf_cs <= 32'b0;
+		last_cs_idle <= 1'b1;
+	end
+	else
+	begin
+		last_cs_idle <= cs_idle_clk;
+		if (perf_clear)
+		begin
+			perf_cycles <= 32'b0;
+			perf_frames <= 32'b0;
+			perf_bits <= 32'b0;
+			perf_tx_wait <= 32'b0;
+			perf_rx_full <= 32'b0;
+			perf_txov <= 32'b0;
+			perf_rxov <= 32'b0;
+			perf_cs <= 32'b0;
+		end
+		else
+		begin
+			perf_cycles <= perf_cycles + 1'b1;
+			perf_frames <= perf_frames + writerxfifo;
+			perf_bits <= perf_bits + ((SPI_CLOCK_ASYNC != 0) ? (writerxfifo ? frame_bits_clk : 6'b0) : bit_strobe);
+			perf_tx_wait <= perf_tx_wait + tx_wait_clk;
+			perf_rx_full <= perf_rx_full + rxff;
+			perf_txov <= perf_txov + (tx_push & txff);
+			perf_rxov <= perf_rxov + (rx_write & rxff);
+			perf_cs <= perf_cs + (last_cs_idle & !cs_idle_clk);
+		end
+	end
+end
+
+always @ (posedge clk or posedge reset)
+begin
+	if (reset)
+	begin
+		snap_cycles <= 32'b0;
+		snap_frames <= 32'b0;
+		snap_bits <= 32'b0;
+		snap_tx_wait <= 32'b0;
+		snap_rx_full <= 32'b0;
+		snap_txov <= 32'b0;
+		snap_rxov <= 32'b0;
+		snap_cs <= 32'b0;
+	end
+	else if (perf_snapshot)
+	begin
+		snap_cycles <= perf_cycles;
+		snap_frames <= perf_frames;
+		snap_bits <= perf_bits;
+		snap_tx_wait <= perf_tx_wait;
+		snap_rx_full <= perf_rx_full;
+		snap_txov <= perf_txov;
+		snap_rxov <= perf_rxov;
+		snap_cs <= perf_cs;
+	end
+end
+
+// interrupt generation
+// TXWM, RXWM and OV follow their conditions while enabled, DONE latches
+// on every frame received (written to the RX FIFO unless TX_ONLY), DMA when a descriptor completes, POLL when a
+// poll response changed and SEQ when the sequencer asks for it; all stay
+// set until written back as 1, an event in the clock of that write is
+// kept so the pulses are never lost
+wire [6:0] int_events;
+assign int_events[0] = (tx_level <= int_enable[15:4]);
+assign int_events[1] = (rx_level >= int_enable[27:16]);
+assign int_events[2] = writerxfifo & !poll_capture & !bist_capture & !seq_capture;
+assign int_events[3] = txfo | rxfo;
+assign int_events[4] = dma_done;
+assign int_events[5] = poll_event;
+assign int_events[6] = seq_event;
+
+always @ (posedge clk, posedge reset)
+begin
+	if (reset)
+		int_status <= 7'b0;
+	else
+		int_status <= (int_status & ~int_clear_request) | (int_events & {int_enable[30:28], int_enable[3:0]});
+end
+assign irq = int_status != 7'b0;
+
 endmodule
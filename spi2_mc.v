@@ -0,0 +1,156 @@
+// SPI IP Example
+// Multi-channel SPI Verilog Implementation (spi2_mc.v)
+// Jason Losh
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: DE1-SoC Board
+
+// Hardware configuration:
+// SPI Ports:
+//   CHANNELS independent spi2 cores, each with its own TX and RX FIFOs,
+//   baud divider, serializer and cs0-cs3/clock/io pins, so frames for
+//   devices on different channels are shifted at the same time
+// HPS interface:
+//   Mapped to offset of 0 in light-weight MM interface aperature
+//-----------------------------------------------------------------------------
+
+module spi2_mc (clk, reset, irq, address, byteenable, chipselect, writedata, readdata, write, read,
+                cs, rx, tx, clock, io_out, io_oe, io_in, spi_clk, spi_clk_locked, LED);
+
+    // Channels built, 1 to 4
+    parameter CHANNELS = 4;
+
+    // spi2 parameters of every channel, the DMA master is not built
+    parameter FIFO_DEPTH = 16;
+    parameter SPI_CLOCK_ASYNC = 0;
+    parameter SEQ_DEPTH = 64;
+
+    // Clock, reset, and interrupt
+    input   clk, reset;
+    output  irq;
+
+    // SPI clock and its lock, used when SPI_CLOCK_ASYNC is set
+    input   spi_clk, spi_clk_locked;
+
+    // Avalon MM interface (512 word aperature)
+    input             read, write, chipselect;
+    input [8:0]       address;
+    input [3:0]       byteenable;
+    input [31:0]      writedata;
+    output reg [31:0] readdata;
+    output [9:0]      LED;
+
+    // spi interfaces, channel n uses cs[4n+3:4n], rx[n], tx[n], clock[n] and
+    // io_out, io_oe, io_in[4n+3:4n]
+    input  [CHANNELS-1:0]   rx;
+    output [4*CHANNELS-1:0] cs;
+    output [CHANNELS-1:0]   tx, clock;
+    output [4*CHANNELS-1:0] io_out, io_oe;
+    input  [4*CHANNELS-1:0] io_in;
+
+    // register map
+    // word ofs  fn
+    //   0- 63   channel 0 (spi2 register map)
+    //  64-127   channel 1
+    // 128-191   channel 2
+    // 192-255   channel 3
+    // 384-447   broadcast (w), writes go to the same register of every
+    //           channel, so all channels are configured or started with
+    //           one access; reads return 0
+    // 448       mc_status (CHANNELS[19:16], IRQ[3:0]) (r)
+    //           IRQ[n] is the irq output of channel n, so one read finds
+    //           the channels to service
+    // 449       mc_int_enable (IRQ[3:0]) (r/w)
+    //           channels whose irq drives the core interrupt, all after reset
+    // The blocks of channels that are not built read 0 and ignore writes
+
+    // register numbers in the shared block
+    parameter BROADCAST_BLOCK      = 3'b110;
+    parameter SHARED_BLOCK         = 3'b111;
+    parameter MC_STATUS_REG        = 6'b000000;
+    parameter MC_INT_ENABLE_REG    = 6'b000001;
+
+    // internal
+    wire [2:0]  block = address[8:6];
+    wire [31:0] channel_readdata [0:CHANNELS-1];
+    wire [9:0]  channel_led [0:CHANNELS-1];
+    wire [CHANNELS-1:0] channel_irq;
+    wire [3:0]  irq_pending = channel_irq;
+    reg  [3:0]  mc_int_enable;
+
+    assign irq = |(irq_pending & mc_int_enable);
+    assign LED = channel_led[0];
+
+    genvar n;
+    generate
+        for (n = 0; n < CHANNELS; n = n + 1)
+        begin : channel
+            // reads and writes of its block, and broadcast writes
+            wire select = chipselect & ((block == n) | (write & (block == BROADCAST_BLOCK)));
+
+            spi2 #(.FIFO_DEPTH(FIFO_DEPTH), .DMA_ENABLE(0), .SPI_CLOCK_ASYNC(SPI_CLOCK_ASYNC),
+                   .SEQ_DEPTH(SEQ_DEPTH)) core (
+                .clk(clk),
+                .reset(reset),
+                .irq(channel_irq[n]),
+                .address(address[5:0]),
+                .byteenable(byteenable),
+                .chipselect(select),
+                .writedata(writedata),
+                .readdata(channel_readdata[n]),
+                .write(write),
+                .read(read & (block == n)),
+                .dma_address(),
+                .dma_read(),
+                .dma_write(),
+                .dma_writedata(),
+                .dma_readdata(32'b0),
+                .dma_waitrequest(1'b0),
+                .cs0(cs[4*n]),
+                .cs1(cs[4*n+1]),
+                .cs2(cs[4*n+2]),
+                .cs3(cs[4*n+3]),
+                .rx(rx[n]),
+                .tx(tx[n]),
+                .clock(clock[n]),
+                .io_out(io_out[4*n+3:4*n]),
+                .io_oe(io_oe[4*n+3:4*n]),
+                .io_in(io_in[4*n+3:4*n]),
+                .spi_clk(spi_clk),
+                .spi_clk_locked(spi_clk_locked),
+                .LED(channel_led[n])
+            );
+        end
+    endgenerate
+
+    // read register
+    always @ (*)
+    begin
+        readdata = 32'b0;
+        if (read & chipselect)
+        begin
+            if (block < CHANNELS)
+                readdata = channel_readdata[block];
+            else if (block == SHARED_BLOCK)
+                case (address[5:0])
+                    MC_STATUS_REG:
+                        readdata = {12'b0, CHANNELS[3:0], 12'b0, irq_pending};
+                    MC_INT_ENABLE_REG:
+                        readdata = {28'b0, mc_int_enable};
+                endcase
+        end
+    end
+
+    // write register
+    always @ (posedge clk)
+    begin
+        if (reset)
+            mc_int_enable <= 4'b1111;
+        else if (write & chipselect & (block == SHARED_BLOCK) & (address[5:0] == MC_INT_ENABLE_REG))
+            mc_int_enable <= writedata[3:0];
+    end
+
+endmodule
@@ -0,0 +1,810 @@
+// SPI IP Example
+// SPI IP Verilator Harness and Benchmark (spi2_sim.cpp)
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Linux host, spi2 RTL verilated (Verilator 4.0 or later)
+
+// Build (the verilator command is one line):
+//   verilator -Wno-fatal -O3 --cc --exe --top-module spi2 -Mdir obj_dir
+//       [-GFIFO_DEPTH=16] [-GDMA_ENABLE=1] [-GSPI_CLOCK_ASYNC=1]
+//       spi2.v FIFO.v AsyncFIFO.v transmitter.v BaudDivider.v edgeDetector.v
+//       spi2_sim.cpp
+//   make -C obj_dir -f Vspi2.mk Vspi2
+//
+// Build for spi2_mc, the passes run on channel 0 and -D is not available:
+//   verilator -Wno-fatal -O3 --cc --exe --top-module spi2_mc -Mdir obj_dir_mc
+//       -CFLAGS -DSPI2_MC [-GCHANNELS=4] [-GFIFO_DEPTH=16] [-GSPI_CLOCK_ASYNC=1]
+//       spi2_mc.v spi2.v FIFO.v AsyncFIFO.v transmitter.v BaudDivider.v
+//       edgeDetector.v spi2_sim.cpp
+//   make -C obj_dir_mc -f Vspi2_mc.mk Vspi2_mc
+//
+// Run:
+//   obj_dir/Vspi2 [-n frames] [-w sizes] [-m modes] [-b brds] [-l lines]
+//                 [-c cs] [-a access_cycles] [-f spi_mhz] [-s] [-D] [-p] [-q] [-i]
+//   -w, -m, -b and -l take comma separated lists, every combination is run
+//   -l sets the data lines (1, 2 or 4, IO_MODE), dual and quad settings
+//   also run a read pass where the slave drives the lines
+//   -s runs every setting without and with streaming (CONTROL STREAM)
+//   -D also moves the frames with the DMA master (needs -GDMA_ENABLE=1)
+//   -p also moves word sizes up to 16 with CONTROL PACKED, four or two
+//   frames per access and a short last access when they do not divide
+//   -q also moves single line frames one sequencer program run each (a
+//   held chip select around RECV of seq_r0 and STORE to seq_r1), one GO
+//   write and busy polls per frame
+//   -i also moves single line frames with the DONE interrupt enabled and
+//   INT_STATUS written back on every second clock while they land, each
+//   frame must still raise irq once; the last one is left pending and is
+//   checked on the irq output (and MC_STATUS for spi2_mc)
+//   -f sets the spi_clk frequency (default 50 MHz, not in phase with clk),
+//   it drives SCLK when the core is built with -GSPI_CLOCK_ASYNC=1
+//
+// Harness:
+//   Avalon-MM bus-functional master on the slave port, every access holds
+//   its strobe for one clock and then idles for the rest of access_cycles
+//   SPI slave model on cs0-cs3 that samples MOSI and shifts MISO on the
+//   edges of its mode, checks what it receives and answers with a known
+//   sequence; with 2 or 4 lines it samples io0-io3 and drives them, the
+//   pins resolve to the core wherever its io_oe is set
+//   Memory slave on the DMA master with no wait states
+//   clk and spi_clk are stepped edge by edge in time order, the SPI slave
+//   follows the clock of the SPI side (STATUS ASYNC)
+//   Frames are moved with the same level based loop as spiTransfer()
+//
+// Results (50 MHz clock):
+//   frames/s     frames per second of simulated time
+//   util         SCLK periods that carried a data bit
+//   gap          SPI side clocks between the last bit of a frame and the
+//                first bit of the next one, beyond one bit period
+//   cs/frame     chip select assertions per frame
+//   cs clk       SPI side clocks per frame with the chip select deasserted
+//
+// Status:
+//   The harness has been compiled against stand-in Verilator headers only,
+//   no pass has been run against verilated RTL yet; its pass results are
+//   not evidence of RTL behavior until it is built and run as above
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>          // getopt
+#include <vector>
+#include "verilated.h"
+#ifdef SPI2_MC
+#include "Vspi2_mc.h"
+typedef Vspi2_mc Vtop;
+#else
+#include "Vspi2.h"
+typedef Vspi2 Vtop;
+#endif
+#include "spi_regs.h"
+
+#define SYSTEM_CLOCK 50000000
+#define CLOCK_PERIOD_PS 20000
+#define DEFAULT_SPI_MHZ 50
+
+// spi_clk edges start this far from the clk edges
+#define SPI_CLOCK_OFFSET_PS 1234
+
+#define DEFAULT_FRAMES 4096
+#define DEFAULT_ACCESS_CYCLES 10
+
+// Bus address of the memory slave on the DMA master
+#define MEMORY_BASE 0x20000000
+
+// A packed write pushes its lanes over the next four clocks
+#define PACK_ACCESS_CYCLES 4
+
+// Frames and timeouts are bounded so a hung core ends the run
+#define MAX_SETTINGS 64
+#define TIMEOUT_CYCLES_PER_FRAME 100000
+
+// INT_STATUS writes after the last frame of a group was shifted, so it has
+// landed in the RX FIFO before the irq edges are counted
+#define IRQ_SETTLE_CLEARS 64
+
+//-----------------------------------------------------------------------------
+// SPI slave model
+//-----------------------------------------------------------------------------
+
+// Data bits are sampled on the rising edge of the internal bit clock, which
+// is the SCLK edge where SCLK = 1 ^ CPOL ^ CPHA; MISO moves to the next bit
+// on that same edge so it is stable when the master samples at the end of
+// the bit period
+// Dual and quad frames move a group of lines bits per bit clock, the
+// highest bit of the group on the highest line
+class SpiSlave
+{
+public:
+    uint8_t mode;
+    uint8_t bits;
+    uint8_t cs;
+    uint8_t lines;
+
+    std::vector<uint32_t> received;
+    uint64_t frames;
+    uint64_t firstBitCycle;
+    uint64_t lastBitCycle;
+    uint64_t gapCycles;
+    uint64_t csAsserts;
+    uint64_t csHighCycles;
+
+    SpiSlave() { reset(0, 0, 32, 1); }
+
+    void reset(uint8_t newCs, uint8_t newMode, uint8_t newBits, uint8_t newLines)
+    {
+        cs = newCs;
+        mode = newMode;
+        bits = newBits;
+        lines = newLines;
+        received.clear();
+        frames = 0;
+        firstBitCycle = lastBitCycle = gapCycles = 0;
+        csAsserts = csHighCycles = 0;
+        count = 0;
+        shift = 0;
+        out = 0;
+        lastSclk = mode >> 1;
+        lastSelected = false;
+    }
+
+    // Word the slave answers frame n with
+    uint32_t response(uint64_t n) const
+    {
+        return mask((uint32_t)(n * 0x85EBCA6Bu) ^ (cs << 28));
+    }
+
+    uint32_t mask(uint32_t value) const
+    {
+        return (bits == 32) ? value : value & ((1u << bits) - 1);
+    }
+
+    bool miso() const
+    {
+        return (out >> (bits - (count ? count : 1))) & 1;
+    }
+
+    // Group driven on io0-io3
+    uint8_t drive() const
+    {
+        return (out >> (bits - (count ? count : lines))) & ((1 << lines) - 1);
+    }
+
+    // Called after every clock with the pins of the selected chip select,
+    // io holds MOSI (io0) or the data lines
+    void observe(uint64_t cycle, bool selected, bool sclk, uint8_t io, uint32_t bitPeriod)
+    {
+        bool bitClock = sclk ^ (mode >> 1) ^ (mode & 1);
+        bool lastBitClock = lastSclk ^ (mode >> 1) ^ (mode & 1);
+
+        if (selected && !lastSelected)
+            csAsserts++;
+        if (!selected)
+        {
+            if (frames)
+                csHighCycles++;
+            count = 0;
+        }
+        else if (bitClock && !lastBitClock && sclk != lastSclk)
+        {
+            if (count == 0 || count == bits)
+            {
+                // First bit of a frame
+                if (frames && lastBitCycle)
+                    gapCycles += cycle - lastBitCycle - bitPeriod;
+                if (!frames)
+                    firstBitCycle = cycle;
+                out = response(frames);
+                shift = 0;
+                count = 0;
+            }
+            shift = (shift << lines) | (io & ((1 << lines) - 1));
+            count += lines;
+            lastBitCycle = cycle;
+            if (count == bits)
+            {
+                received.push_back(shift);
+                frames++;
+            }
+        }
+        lastSclk = sclk;
+        lastSelected = selected;
+    }
+
+private:
+    uint8_t count;
+    uint32_t shift;
+    uint32_t out;
+    bool lastSclk;
+    bool lastSelected;
+};
+
+//-----------------------------------------------------------------------------
+// Harness
+//-----------------------------------------------------------------------------
+
+class Harness
+{
+public:
+    Vtop *top;
+    SpiSlave slave;
+    uint64_t cycle;
+    uint64_t irqEdges;
+    bool lastIrq;
+    uint64_t spiCycle;
+    uint64_t accesses;
+    uint32_t accessCycles;
+    uint32_t bitPeriod;
+    bool asyncSpi;
+    std::vector<uint32_t> memory;
+
+    // Times of the next clk and spi_clk edges in ps
+    uint64_t clkNext;
+    uint64_t spiNext;
+    uint64_t spiPeriod;
+
+    Harness(uint32_t spiMhz = DEFAULT_SPI_MHZ)
+        : top(new Vtop), cycle(0), irqEdges(0), lastIrq(false), spiCycle(0), accesses(0), accessCycles(DEFAULT_ACCESS_CYCLES),
+          bitPeriod(1), asyncSpi(false)
+    {
+        spiPeriod = 1000000 / (spiMhz ? spiMhz : DEFAULT_SPI_MHZ);
+        clkNext = CLOCK_PERIOD_PS / 2;
+        spiNext = spiPeriod / 2 + SPI_CLOCK_OFFSET_PS;
+        top->clk = 1;
+        top->spi_clk = 1;
+        top->spi_clk_locked = 1;
+        top->read = 0;
+        top->write = 0;
+        top->chipselect = 0;
+        top->byteenable = 0xF;
+        top->address = 0;
+        top->writedata = 0;
+#ifndef SPI2_MC
+        top->dma_readdata = 0;
+        top->dma_waitrequest = 0;
+#endif
+        top->rx = 0;
+        top->io_in = 0;
+        top->reset = 1;
+        tick();
+        tick();
+        top->reset = 0;
+        tick();
+    }
+
+    ~Harness()
+    {
+        top->final();
+        delete top;
+    }
+
+    // The memory slave answers in the same cycle, spi2_mc has no DMA master
+    void memorySlave()
+    {
+#ifndef SPI2_MC
+        uint32_t index;
+
+        if (top->dma_read || top->dma_write)
+        {
+            index = (top->dma_address - MEMORY_BASE) / 4;
+            if (top->dma_address >= MEMORY_BASE && index < memory.size())
+            {
+                if (top->dma_read)
+                    top->dma_readdata = memory[index];
+                else
+                    memory[index] = top->dma_writedata;
+            }
+            else
+                top->dma_readdata = 0;
+        }
+#endif
+    }
+
+    // One system clock and the spi_clk edges that fall in it, in time order;
+    // the SPI slave samples on the rising edges of the SPI side clock
+    void tick()
+    {
+        bool clkEdge, spiEdge, rose;
+
+        do
+        {
+            clkEdge = clkNext <= spiNext;
+            spiEdge = spiNext <= clkNext;
+            if (clkEdge)
+            {
+                top->clk = !top->clk;
+                clkNext += CLOCK_PERIOD_PS / 2;
+            }
+            if (spiEdge)
+            {
+                top->spi_clk = !top->spi_clk;
+                spiNext += spiPeriod / 2;
+            }
+            if (clkEdge && !top->clk)
+            {
+                top->eval();
+                memorySlave();
+            }
+            top->rx = slave.miso();
+            top->io_in = pins();
+            top->eval();
+            rose = clkEdge && top->clk;
+            if (rose)
+            {
+                cycle++;
+                if (top->irq && !lastIrq)
+                    irqEdges++;
+                lastIrq = top->irq;
+            }
+            if (asyncSpi ? (spiEdge && top->spi_clk) : rose)
+                slave.observe(++spiCycle, selected(), top->clock & 1, pins(), bitPeriod);
+        } while (!rose);
+    }
+
+    // io0-io3 as seen on the board, the core wins where it drives; on
+    // spi2_mc these are the low bits of the channel 0 pins
+    uint8_t pins() const
+    {
+        return ((top->io_oe & top->io_out) | (~top->io_oe & slave.drive())) & 0xF;
+    }
+
+    bool selected() const
+    {
+#ifdef SPI2_MC
+        return !((top->cs >> slave.cs) & 1);
+#else
+        switch (slave.cs)
+        {
+            case 0: return !top->cs0;
+            case 1: return !top->cs1;
+            case 2: return !top->cs2;
+            default: return !top->cs3;
+        }
+#endif
+    }
+
+    void idle(uint32_t cycles)
+    {
+        while (cycles--)
+            tick();
+    }
+
+    void write(uint32_t ofs, uint32_t value, uint8_t byteEnable = 0xF)
+    {
+        top->address = ofs;
+        top->writedata = value;
+        top->byteenable = byteEnable;
+        top->write = 1;
+        top->chipselect = 1;
+        tick();
+        top->write = 0;
+        top->chipselect = 0;
+        top->byteenable = 0xF;
+        idle(accessCycles - 1);
+        accesses++;
+    }
+
+    // The pop of a DATA read lands on the strobe clock, readdata is taken
+    // once it has passed
+    uint32_t read(uint32_t ofs)
+    {
+        uint32_t value;
+        top->address = ofs;
+        top->read = 1;
+        top->chipselect = 1;
+        tick();
+        value = top->readdata;
+        top->read = 0;
+        top->chipselect = 0;
+        idle(accessCycles - 1);
+        accesses++;
+        return value;
+    }
+};
+
+//-----------------------------------------------------------------------------
+// Benchmark
+//-----------------------------------------------------------------------------
+
+struct Result
+{
+    uint64_t cycles;
+    uint64_t frames;
+    uint64_t errors;
+};
+
+// The core samples the lines it drives on dual and quad writes, so those
+// receive tx back instead of the slave responses
+static bool rxOk(const Harness &h, bool echo, const std::vector<uint32_t> &tx, size_t n,
+                 uint32_t value)
+{
+    return h.slave.mask(value) == (echo ? tx[n] : h.slave.response(n));
+}
+
+// Level based full duplex loop of spiTransfer(), one LEVEL read per pass
+static Result burst(Harness &h, const std::vector<uint32_t> &tx, uint32_t depth, bool echo)
+{
+    Result result = {0, 0, 0};
+    std::vector<uint32_t> rx(tx.size());
+    size_t sent = 0, received = 0, n;
+    uint64_t start = h.cycle, timeout = h.cycle + tx.size() * (uint64_t)TIMEOUT_CYCLES_PER_FRAME;
+
+    while (received < tx.size() && h.cycle < timeout)
+    {
+        n = h.read(OFS_LEVEL) >> RX_LEVEL_BIT_OFS;
+        while (n--)
+            rx[received++] = h.read(OFS_DATA);
+        n = depth - (sent - received);
+        if (n > tx.size() - sent)
+            n = tx.size() - sent;
+        while (n--)
+            h.write(OFS_DATA, tx[sent++]);
+    }
+    result.cycles = h.cycle - start;
+    result.frames = received;
+    for (n = 0; n < received; n++)
+        if (!rxOk(h, echo, tx, n, rx[n]))
+            result.errors++;
+    return result;
+}
+
+// The same loop with PACKED words of lanes frames, only the last write
+// is short and leaves byteenable lanes clear
+static Result burstPacked(Harness &h, const std::vector<uint32_t> &tx, uint32_t depth, bool echo,
+                          uint32_t lanes)
+{
+    Result result = {0, 0, 0};
+    std::vector<uint32_t> rx(tx.size());
+    size_t sent = 0, received = 0, n, count, i;
+    uint32_t width = 32 / lanes, laneMask = (1u << width) - 1, value;
+    uint64_t start = h.cycle, timeout = h.cycle + tx.size() * (uint64_t)TIMEOUT_CYCLES_PER_FRAME;
+
+    while (received < tx.size() && h.cycle < timeout)
+    {
+        n = h.read(OFS_LEVEL) >> RX_LEVEL_BIT_OFS;
+        while (n--)
+        {
+            value = h.read(OFS_DATA);
+            for (i = 0; i < lanes && received < tx.size(); i++)
+                rx[received++] = (value >> (i * width)) & laneMask;
+        }
+        while (sent < tx.size())
+        {
+            count = (tx.size() - sent < lanes) ? tx.size() - sent : lanes;
+            if (count > depth - (sent - received))
+                break;
+            for (value = 0, i = 0; i < count; i++)
+                value |= (tx[sent + i] & laneMask) << (i * width);
+            h.write(OFS_DATA, value, (count == lanes) ? BYTE_ENABLE_ALL : (1 << (count * 4 / lanes)) - 1);
+            sent += count;
+        }
+    }
+    result.cycles = h.cycle - start;
+    result.frames = received;
+    for (n = 0; n < received; n++)
+        if (!rxOk(h, echo, tx, n, rx[n]))
+            result.errors++;
+    return result;
+}
+
+// One sequencer run per frame, the program holds the chip select around
+// its frame and returns the response in seq_r1
+static Result seqFrames(Harness &h, const std::vector<uint32_t> &tx, uint32_t cs)
+{
+    Result result = {0, 0, 0};
+    const uint32_t program[] = {
+        SEQ_CS_ASSERT(cs),
+        SEQ_RECV(cs, 0) | SEQ_REG_MASK,
+        SEQ_STORE(1),
+        SEQ_CS_RELEASE(cs),
+        SEQ_END(true)
+    };
+    size_t n;
+    uint64_t start, timeout;
+
+    h.write(OFS_INT_ENABLE, INT_SEQ_ENABLE_MASK);
+    h.write(OFS_SEQ_ADDR, 0);
+    for (n = 0; n < sizeof(program) / sizeof(program[0]); n++)
+        h.write(OFS_SEQ_DATA, program[n]);
+    start = h.cycle;
+    timeout = h.cycle + tx.size() * (uint64_t)TIMEOUT_CYCLES_PER_FRAME;
+    for (n = 0; n < tx.size() && h.cycle < timeout; n++)
+    {
+        h.write(OFS_SEQ_R0, tx[n]);
+        h.write(OFS_SEQ_CTRL, SEQ_GO_MASK);
+        while (!(h.read(OFS_INT_STATUS) & INT_SEQ_MASK) && h.cycle < timeout);
+        h.write(OFS_INT_STATUS, INT_SEQ_MASK);
+        if (!rxOk(h, false, tx, n, h.read(OFS_SEQ_R0 + 1)))
+            result.errors++;
+        result.frames++;
+    }
+    result.cycles = h.cycle - start;
+    if (h.read(OFS_LEVEL) >> RX_LEVEL_BIT_OFS)
+        result.errors++;
+    return result;
+}
+
+// DONE events while INT_STATUS is written back on every second clock: each
+// group of frames waits in the TX FIFO with the core disabled and is then
+// shifted with a clear pulse on every other clock, so about half of the
+// frames land in the clock of a clear, and every frame must still raise
+// irq once
+// The last frame is a group of its own that is not cleared, irq (and the
+// channel 0 bit of MC_STATUS on spi2_mc) must then stay set until it is
+static Result irqClear(Harness &h, const std::vector<uint32_t> &tx, uint32_t depth)
+{
+    Result result = {0, 0, 0};
+    uint32_t control = h.read(OFS_CONTROL), accessCycles = h.accessCycles;
+    size_t sent = 0, count, level, n;
+    uint64_t start = h.cycle, timeout = h.cycle + tx.size() * (uint64_t)TIMEOUT_CYCLES_PER_FRAME;
+    uint64_t edges, events, target;
+    bool pending;
+
+    h.write(OFS_INT_ENABLE, INT_DONE_MASK);
+    while (sent < tx.size() && h.cycle < timeout)
+    {
+        pending = (sent == tx.size() - 1);
+        count = pending ? 1 : tx.size() - 1 - sent;
+        if (count > depth)
+            count = depth;
+        h.write(OFS_CONTROL, control & ~(1 << CHIP_ENABLE_BIT_OFS));
+        for (n = 0; n < count; n++)
+            h.write(OFS_DATA, tx[sent + n]);
+        h.write(OFS_INT_STATUS, INT_EVENTS_MASK);
+        h.idle(2);
+        edges = h.irqEdges;
+        target = h.slave.frames + count;
+
+        // Two clocks per access, the shortest the edge detectors allow
+        h.accessCycles = 2;
+        h.write(OFS_CONTROL, control);
+        while (h.slave.frames < target && h.cycle < timeout)
+            if (pending)
+                h.idle(2);
+            else
+                h.write(OFS_INT_STATUS, INT_DONE_MASK);
+        for (n = 0; n < IRQ_SETTLE_CLEARS; n++)
+            if (pending)
+                h.idle(2);
+            else
+                h.write(OFS_INT_STATUS, INT_DONE_MASK);
+        h.accessCycles = accessCycles;
+        events = h.irqEdges - edges;
+        if (events != count)
+            result.errors += (events > count) ? events - count : count - events;
+
+        if (pending)
+        {
+            if (!h.top->irq || !(h.read(OFS_INT_STATUS) & INT_DONE_MASK))
+                result.errors++;
+#ifdef SPI2_MC
+            if (!(h.read(OFS_MC_STATUS) & 1))
+                result.errors++;
+#endif
+            h.write(OFS_INT_STATUS, INT_DONE_MASK);
+            h.idle(2);
+            if (h.top->irq)
+                result.errors++;
+#ifdef SPI2_MC
+            if (h.read(OFS_MC_STATUS) & 1)
+                result.errors++;
+#endif
+        }
+
+        level = h.read(OFS_LEVEL) >> RX_LEVEL_BIT_OFS;
+        for (n = 0; n < level; n++)
+        {
+            if (!rxOk(h, false, tx, result.frames, h.read(OFS_DATA)))
+                result.errors++;
+            result.frames++;
+        }
+        sent += count;
+    }
+    result.cycles = h.cycle - start;
+    return result;
+}
+
+// Frames moved by the DMA master between two halves of the memory slave
+static Result dma(Harness &h, const std::vector<uint32_t> &tx, bool echo)
+{
+    Result result = {0, 0, 0};
+    size_t n, count = tx.size();
+    uint64_t start = h.cycle, timeout = h.cycle + count * (uint64_t)TIMEOUT_CYCLES_PER_FRAME;
+
+    h.memory.assign(2 * count, 0);
+    for (n = 0; n < count; n++)
+        h.memory[n] = tx[n];
+    h.write(OFS_DMA_SRC, MEMORY_BASE);
+    h.write(OFS_DMA_DST, MEMORY_BASE + count * 4);
+    h.write(OFS_DMA_LEN, count);
+    h.write(OFS_DMA_CTRL, DMA_GO_MASK | DMA_TX_MASK | DMA_RX_MASK);
+    while ((h.read(OFS_DMA_CTRL) & DMA_GO_MASK) && h.cycle < timeout)
+        h.idle(1000);
+    result.cycles = h.cycle - start;
+    result.frames = count;
+    for (n = 0; n < count; n++)
+        if (!rxOk(h, echo, tx, n, h.memory[count + n]))
+            result.errors++;
+    return result;
+}
+
+static void report(const char *path, uint32_t bits, uint32_t mode, uint32_t brd, bool stream,
+                   const Result &r, const SpiSlave &s)
+{
+    uint64_t frames = s.frames ? s.frames : 1;
+    double seconds = (double)r.cycles / SYSTEM_CLOCK;
+    double busy = (double)(s.lastBitCycle - s.firstBitCycle + brd);
+    printf("%-6s %4u %4u %4u %4u %6s %12.0f %6.1f%% %8.2f %8.3f %8.2f %8llu\n",
+           path, bits, s.lines, mode, brd, stream ? "on" : "off",
+           r.frames / seconds,
+           100.0 * s.frames * (bits / s.lines) * brd / (busy > 0 ? busy : 1),
+           s.frames > 1 ? (double)s.gapCycles / (s.frames - 1) : 0.0,
+           (double)s.csAsserts / frames,
+           (double)s.csHighCycles / frames,
+           (unsigned long long)(r.errors + s.frames - r.frames));
+}
+
+struct Pass
+{
+    const char *name;
+    bool stream;
+    bool dma;
+    bool read;
+    bool packed;
+    bool seq;
+    bool irq;
+};
+
+static int parseList(const char *text, uint32_t *list)
+{
+    char buffer[256], *token;
+    int n = 0;
+    strncpy(buffer, text, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 0;
+    for (token = strtok(buffer, ","); token != NULL && n < MAX_SETTINGS; token = strtok(NULL, ","))
+        list[n++] = strtoul(token, NULL, 0);
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// Main
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    uint32_t sizes[MAX_SETTINGS] = {8, 16, 32}, modes[MAX_SETTINGS] = {0}, brds[MAX_SETTINGS] = {4, 8};
+    uint32_t widths[MAX_SETTINGS] = {1};
+    int sizeCount = 3, modeCount = 1, brdCount = 2, widthCount = 1, option, s, m, b, l;
+    uint32_t frames = DEFAULT_FRAMES, accessCycles = DEFAULT_ACCESS_CYCLES, cs = 0;
+    uint32_t spiMhz = DEFAULT_SPI_MHZ;
+    uint32_t depth, depthLog2, bits, mode, brd, lines, io, status, n;
+    bool echo;
+    size_t p;
+    bool sweepStream = false, useDma = false, usePacked = false, useSeq = false, useIrq = false;
+    uint64_t errors = 0;
+    Result r;
+
+    Verilated::commandArgs(argc, argv);
+    while ((option = getopt(argc, argv, "n:w:m:b:l:c:a:f:sDpqi")) != -1)
+    {
+        switch (option)
+        {
+            case 'n': frames = strtoul(optarg, NULL, 0); break;
+            case 'w': sizeCount = parseList(optarg, sizes); break;
+            case 'm': modeCount = parseList(optarg, modes); break;
+            case 'b': brdCount = parseList(optarg, brds); break;
+            case 'l': widthCount = parseList(optarg, widths); break;
+            case 'c': cs = strtoul(optarg, NULL, 0) & CS_SELECT_MASK; break;
+            case 'a': accessCycles = strtoul(optarg, NULL, 0); break;
+            case 'f': spiMhz = strtoul(optarg, NULL, 0); break;
+            case 's': sweepStream = true; break;
+            case 'D': useDma = true; break;
+            case 'p': usePacked = true; break;
+            case 'q': useSeq = true; break;
+            case 'i': useIrq = true; break;
+            default:
+                printf("  usage: Vspi2 [-n frames] [-w sizes] [-m modes] [-b brds] [-l lines]\n"
+                       "               [-c cs] [-a access_cycles] [-f spi_mhz] [-s] [-D] [-p] [-q] [-i]\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    // A strobe needs one idle clock after it for the edge detectors
+    if (accessCycles < 2)
+        accessCycles = 2;
+
+    // Paths run for every setting
+    std::vector<Pass> passes;
+    passes.push_back(Pass{"burst", false, false, false, false, false, false});
+    if (sweepStream)
+        passes.push_back(Pass{"burst", true, false, false, false, false, false});
+    if (useDma)
+        passes.push_back(Pass{"dma", true, true, false, false, false, false});
+    if (usePacked)
+        passes.push_back(Pass{"packed", true, false, false, true, false, false});
+    if (useSeq)
+        passes.push_back(Pass{"seq", false, false, false, false, true, false});
+    if (useIrq)
+        passes.push_back(Pass{"irq", false, false, false, false, false, true});
+    passes.push_back(Pass{"read", false, false, true, false, false, false});
+
+    printf("path   bits   io mode  brd stream     frames/s   util      gap cs/frame   cs clk   errors\n");
+    for (s = 0; s < sizeCount; s++)
+        for (l = 0; l < widthCount; l++)
+            for (m = 0; m < modeCount; m++)
+                for (b = 0; b < brdCount; b++)
+                    for (p = 0; p < passes.size(); p++)
+                    {
+                        bits = sizes[s];
+                        mode = modes[m] & DEVICE_MODE_MASK;
+                        brd = brds[b];
+                        lines = widths[l];
+                        io = (lines == 4) ? IO_QUAD : (lines == 2) ? IO_DUAL : IO_SINGLE;
+                        if (passes[p].read && lines == 1)
+                            continue;
+                        if (passes[p].packed && bits > PACK_HALF_MAX_WORD_SIZE)
+                            continue;
+                        if ((passes[p].seq || passes[p].irq) && lines > 1)
+                            continue;
+                        if (bits % lines)
+                        {
+                            printf("io     %u bit words do not split into %u lines\n", bits, lines);
+                            break;
+                        }
+                        echo = (lines > 1) && !passes[p].read;
+
+                        // A fresh core per setting, so no state leaks between runs
+                        Harness h(spiMhz);
+                        h.accessCycles = (passes[p].packed && accessCycles < PACK_ACCESS_CYCLES)
+                                       ? PACK_ACCESS_CYCLES : accessCycles;
+                        h.bitPeriod = brd;
+                        h.slave.reset(cs, mode, bits, lines);
+                        status = h.read(OFS_STATUS);
+                        h.asyncSpi = (status & ASYNC_CLOCK_MASK) != 0;
+                        depthLog2 = (status >> DEPTH_LOG2_BIT_OFS) & DEPTH_LOG2_MASK;
+                        depth = depthLog2 ? (1 << depthLog2) : FIFO_DEPTH;
+                        if (passes[p].dma && !(status & DMA_PRESENT_MASK))
+                        {
+                            printf("dma    core built without DMA_ENABLE\n");
+                            break;
+                        }
+
+                        std::vector<uint32_t> tx(frames);
+                        for (n = 0; n < frames; n++)
+                            tx[n] = h.slave.mask(n * 0x9E3779B9u);
+
+                        h.write(OFS_BRD, brd << 6);
+                        h.write(OFS_IO_MODE, io | (passes[p].read ? IO_READ_MASK : 0));
+                        h.write(OFS_CONTROL, ((bits - 1) & WORDSIZE_MASK) | (1 << (CS_AUTO_BIT_OFS + cs))
+                                | (cs << CS_SELECT_BIT_OFS) | (mode << (DEVICE_MODE_BIT_OFS + 2*cs))
+                                | (1 << CHIP_ENABLE_BIT_OFS) | (passes[p].stream << STREAM_BIT_OFS)
+                                | (passes[p].packed << PACKED_BIT_OFS));
+                        if (passes[p].dma)
+                            r = dma(h, tx, echo);
+                        else if (passes[p].packed)
+                            r = burstPacked(h, tx, depth, echo, (bits <= PACK_BYTE_MAX_WORD_SIZE) ? 4 : 2);
+                        else if (passes[p].seq)
+                            r = seqFrames(h, tx, cs);
+                        else if (passes[p].irq)
+                            r = irqClear(h, tx, depth);
+                        else
+                            r = burst(h, tx, depth, echo);
+
+                        // The slave must have seen exactly what was sent, on a
+                        // read it only sees its own responses
+                        for (n = 0; n < h.slave.received.size() && n < frames; n++)
+                            if (h.slave.received[n] != (passes[p].read ? h.slave.response(n) : tx[n]))
+                                r.errors++;
+
+                        report(passes[p].name, bits, mode, brd, passes[p].stream, r, h.slave);
+                        errors += r.errors + (r.frames != frames);
+                    }
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+// SPI IP Example
+// SPI IP Register Backend (spi_backend.h)
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: DE1-SoC Board
+
+// Hardware configuration:
+// SPI IP core connected to light-weight Avalon bus, or the software model
+// of the core (spi_model.c) when no board is present
+
+//-----------------------------------------------------------------------------
+
+#ifndef SPI_BACKEND_H_
+#define SPI_BACKEND_H_
+
+#include <stdint.h>
+
+// Register accessors used by the SPI IP library
+// ofs is a word offset (OFS_DATA, OFS_STATUS, ...); writeBytes writes only
+// the byte lanes set in byteEnable (bit n for bits 8n+7:8n); delay lets
+// cycles system clocks pass without a bus access, NULL when the backend
+// can only poll
+typedef struct spiBackend
+{
+    uint32_t (*read)(void *context, uint32_t ofs);
+    void (*write)(void *context, uint32_t ofs, uint32_t value);
+    void (*writeBytes)(void *context, uint32_t ofs, uint32_t value, uint8_t byteEnable);
+    void *context;
+    void (*delay)(void *context, uint64_t cycles);
+} spiBackend;
+
+#endif
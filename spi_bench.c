@@ -0,0 +1,644 @@
+// SPI IP Example
+// Burst Transfer Benchmark (spi_bench.c)
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: DE1-SoC Board
+
+// Hardware configuration:
+// SPI Port:
+//   cs0 is used in auto chip select mode, tx may be looped back to rx
+// HPS interface:
+//   Mapped to offset of 0 in light-weight MM interface aperature
+// Simulation:
+//   With -m the spi2 software model (spi_model.c) is used with tx looped
+//   back to rx, and rates are given in simulated time
+//   -d sets the model FIFO depth (spi2 FIFO_DEPTH parameter)
+//   The model carries a DMA master on a simulated memory slave, the words
+//   are also moved by the DMA engine and checked against tx
+//   A last pass alternates the words between cs0 and cs1 banks (CONTROL
+//   BANKED) in a single burst
+//   The poll engine is then run on cs0 for POLL_CYCLES clocks, the loopback
+//   echo differs from the reference once so exactly one change is expected
+// Results:
+//   bits/SCLK is the fraction of SCLK periods that carried a data bit, the
+//   burst is run without and with streaming (CONTROL STREAM) to show the
+//   idle and cs_assert periods streaming removes between frames
+//   perf lines are read from the core performance counters after a pass
+//   write and read use the TX-only and RX-only modes, the read pass clocks
+//   out an all ones fill that the loopback returns
+//   bytes repeats the stream pass with 8-bit frames, which the library
+//   packs four to a bus access (CONTROL PACKED); one frame less than the
+//   words is sent so the last access is a short one
+//   With a word size that is a multiple of 4 the words are then written to
+//   and read back from a quad slave (spiModelQuadMemory) on 2 and 4 data
+//   lines, after a one word single line opcode; bits/SCLK above 1 is the
+//   gain of the extra lines
+//   Last, the model loopback is given a data delay of 3/4 of an SCLK period
+//   (MISO_DELAY_QUARTERS), so the default sample point fails; the sample
+//   delay of cs0 is calibrated on the first words and the burst is repeated
+//   The core self-test then runs the words as PRBS frames in internal
+//   loopback (CONTROL LOOPBACK), and the fastest clean BRD is searched with
+//   internal loopback and with the model loopback BIST_MISO_DELAY clocks
+//   late
+//   seq-rmw then repeats a register read-modify-write SEQ_RMW_COUNT times
+//   on the model loopback, from the CPU (a transfer, the modify and a
+//   transfer) and as a sequencer program started by one GO write
+//   ring moves the words as RING_CHUNK_WORDS word entries for cs0-cs3 in
+//   turn through the submission ring (spi_ring.c), submitted in batches of
+//   half the ring while completions are reaped; wakeups are the worker
+//   wakeups the submits needed, which depend on thread scheduling (often 0
+//   on the model, where the worker is still busy with the last batch when
+//   the next one is submitted)
+//   session runs CTX_THREADS threads, each with a shared session
+//   (spiCtxOpen) for its own device moving its share of the words in
+//   RING_CHUNK_WORDS word transactions; owned moves all of them from one
+//   exclusive session, which takes no lock and refuses a second session
+//   mc-n splits the words over n channels of an spi2_mc model group
+//   (spiModelGroup, each channel looped back) moved by spiTransferChannels,
+//   bits/SCLK is then the aggregate over the channels
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>          // EXIT_ codes, strtoul
+#include <stdio.h>           // printf
+#include <time.h>            // clock_gettime
+#include <unistd.h>          // getopt
+#include <pthread.h>         // pthread_create
+#include "spi_ip.h"
+#include "spi_regs.h"
+#include "spi_model.h"
+#include "spi_ring.h"
+
+// Avalon clock feeding the baud divider
+#define SYSTEM_CLOCK 50000000
+
+#define DEFAULT_WORDS 65536
+#define DEFAULT_WORD_SIZE 32
+#define DEFAULT_BRD 8
+
+// Bus address of the simulated memory slave
+#define MODEL_MEMORY_BASE 0x20000000
+
+// Clocks the CPU spends elsewhere between DMA busy polls
+#define DMA_POLL_CYCLES 1000
+
+// Poll engine run length and poll period in clocks
+#define POLL_CYCLES 1000000
+#define POLL_PERIOD 1000
+
+// Loopback data delay of the calibration pass in quarter SCLK periods, and
+// the words of its pattern
+#define MISO_DELAY_QUARTERS 3
+#define CALIBRATE_WORDS 16
+
+// Loopback data delay and frames per BRD of the fastest clean rate search
+#define BIST_MISO_DELAY 3
+#define BIST_SEARCH_FRAMES 1024
+#define BIST_MAX_BRD 64
+
+// Read-modify-writes of the sequencer pass, the bits kept and set, and
+// the read command
+#define SEQ_RMW_COUNT 1000
+#define SEQ_RMW_KEEP 0xF0
+#define SEQ_RMW_SET 0x05
+#define SEQ_RMW_COMMAND 0x410900
+
+// Words of each submission ring entry and session transaction
+#define RING_CHUNK_WORDS 64
+
+// Threads of the shared session pass, one device each
+#define CTX_THREADS 4
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+spiModel model;
+spiModelGroup group;
+spiRing ring;
+
+// Words of one thread of the shared session pass
+typedef struct ctxJob
+{
+    spiCtx *ctx;
+    const uint32_t *tx;
+    uint32_t *rx;
+    size_t n;
+} ctxJob;
+bool useModel = false;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+double hostSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Wall time on the board, simulated time on the model
+double seconds()
+{
+    if (useModel)
+        return (double)model.now / SYSTEM_CLOCK;
+    return hostSeconds();
+}
+
+// Reference loop: one word per status poll, as callers did before spiTransfer
+void transferSingle(const uint32_t *tx, uint32_t *rx, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        WriteData(tx[i]);
+        while (ReadStatus() & RXFE_MASK);
+        rx[i] = ReadData();
+    }
+}
+
+// One SCLK period is brd system clocks, so bits/SCLK = rate / line rate
+void report(const char *name, size_t n, double elapsed, double lineRate)
+{
+    double rate = n / elapsed;
+    printf("%-8s %10zu words  %8.3f s  %12.0f words/s  %5.3f bits/SCLK\n",
+           name, n, elapsed, rate, rate / lineRate);
+}
+
+// Core view of the last pass from the performance counters
+void reportPerf()
+{
+    spiPerf perf;
+    spiReadPerf(&perf, true);
+    if (perf.cycles == 0 || perf.frames == 0)
+        return;
+    printf("perf     %10u frames   %5.3f bits/clock  %5.1f%% tx wait  %5.1f%% rx full  %5.2f cs/frame  %u/%u ov\n",
+           perf.frames, (double)perf.bits / perf.cycles, 100.0 * perf.txWait / perf.cycles,
+           100.0 * perf.rxFull / perf.cycles, (double)perf.csAsserts / perf.frames,
+           perf.txOverflows, perf.rxOverflows);
+}
+
+// Transactions of RING_CHUNK_WORDS words on the session of the job
+void *ctxThread(void *context)
+{
+    ctxJob *job = context;
+    size_t i, count;
+    for (i = 0; i < job->n; i += count)
+    {
+        count = (job->n - i < RING_CHUNK_WORDS) ? job->n - i : RING_CHUNK_WORDS;
+        spiCtxTransfer(job->ctx, job->tx + i, job->rx + i, count);
+    }
+    return NULL;
+}
+
+size_t countErrors(const uint32_t *tx, const uint32_t *rx, size_t n, uint32_t wordSize)
+{
+    uint32_t mask = (wordSize >= 32) ? 0xFFFFFFFF : ((1u << wordSize) - 1);
+    size_t i, errors = 0;
+    for (i = 0; i < n; i++)
+        if ((tx[i] ^ rx[i]) & mask)
+            errors++;
+    return errors;
+}
+
+//-----------------------------------------------------------------------------
+// Main
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    size_t n = DEFAULT_WORDS, i;
+    uint32_t wordSize = DEFAULT_WORD_SIZE;
+    uint32_t brd = DEFAULT_BRD;
+    uint32_t *tx, *rx, *memory = NULL, *quadWords = NULL;
+    uint8_t *devices;
+    spiPerf perf;
+    double start, hostStart, lineRate;
+    uint64_t accesses;
+    uint16_t depth = FIFO_DEPTH;
+    int arg, option;
+
+    while ((option = getopt(argc, argv, "md:")) != -1)
+    {
+        if (option == 'm')
+            useModel = true;
+        else if (option == 'd')
+            depth = strtoul(optarg, NULL, 0);
+        else
+        {
+            printf("  usage: spi_bench [-m] [-d depth] [words [word_size [brd]]]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    arg = optind;
+    if (argc > arg)
+        n = strtoul(argv[arg++], NULL, 0);
+    if (argc > arg)
+        wordSize = strtoul(argv[arg++], NULL, 0);
+    if (argc > arg)
+        brd = strtoul(argv[arg++], NULL, 0);
+
+    if (useModel)
+    {
+        spiModelInit(&model);
+        spiModelSetFifoDepth(&model, depth);
+        spiModelAttachSlave(&model, spiModelLoopback, NULL);
+        memory = calloc(2 * n, sizeof(uint32_t));
+        if (memory == NULL)
+            return EXIT_FAILURE;
+        spiModelAttachMemory(&model, memory, MODEL_MEMORY_BASE, 2 * n * sizeof(uint32_t));
+        spiOpenBackend(&model.backend);
+    }
+    else if (!spiOpen())
+    {
+        printf("  cannot open SPI IP\n");
+        return EXIT_FAILURE;
+    }
+
+    tx = malloc(n * sizeof(uint32_t));
+    rx = malloc(n * sizeof(uint32_t));
+    devices = malloc(n);
+    if (tx == NULL || rx == NULL || devices == NULL)
+        return EXIT_FAILURE;
+    for (i = 0; i < n; i++)
+    {
+        tx[i] = i * 0x9E3779B9;
+        devices[i] = i & 1;
+    }
+
+    // cs0 in auto mode, mode 0, one SCLK period every brd system clocks
+    WriteBRD(brd);
+    WriteControl(((wordSize - 1) & WORDSIZE_MASK) | (1 << CS_AUTO_BIT_OFS)
+                 | (1 << CHIP_ENABLE_BIT_OFS));
+    lineRate = (double)SYSTEM_CLOCK / brd / wordSize;
+
+    printf("word size %u, brd %u, fifo depth %u, line rate %.0f words/s\n",
+           wordSize, brd, spiFifoDepth(), lineRate);
+
+    spiReadPerf(&perf, true);
+    start = seconds();
+    transferSingle(tx, rx, n);
+    report("single", n, seconds() - start, lineRate);
+    reportPerf();
+
+    start = seconds();
+    spiTransfer(tx, rx, n);
+    report("burst", n, seconds() - start, lineRate);
+    reportPerf();
+
+    spiSetStream(true);
+    for (i = 0; i < n; i++)
+        rx[i] = 0;
+    hostStart = hostSeconds();
+    accesses = model.accesses;
+    start = seconds();
+    spiTransfer(tx, rx, n);
+    report("stream", n, seconds() - start, lineRate);
+    reportPerf();
+
+    if (useModel)
+    {
+        printf("model    %10zu rx errors  %5.2f bus accesses/word  %12.0f register ops/s on host\n",
+               countErrors(tx, rx, n, wordSize),
+               (double)(model.accesses - accesses) / n,
+               (model.accesses - accesses) / (hostSeconds() - hostStart));
+    }
+
+    // One-directional passes, still streaming
+    accesses = model.accesses;
+    start = seconds();
+    spiWrite(tx, n);
+    report("write", n, seconds() - start, lineRate);
+    if (useModel)
+        printf("model    %10u rx words   %5.2f bus accesses/word\n",
+               (unsigned)model.rxFifo.level, (double)(model.accesses - accesses) / n);
+
+    accesses = model.accesses;
+    start = seconds();
+    spiRead(rx, n, 0xFFFFFFFF);
+    report("read", n, seconds() - start, lineRate);
+    if (useModel)
+    {
+        for (i = 0; i < n; i++)
+            tx[i] = 0xFFFFFFFF;
+        printf("model    %10zu rx errors  %5.2f bus accesses/word\n",
+               countErrors(tx, rx, n, wordSize), (double)(model.accesses - accesses) / n);
+        for (i = 0; i < n; i++)
+            tx[i] = i * 0x9E3779B9;
+    }
+
+    // Packed 8-bit frames, the last word carries three
+    spiSelectDevice(0, 8);
+    for (i = 0; i < n; i++)
+        rx[i] = 0;
+    accesses = model.accesses;
+    start = seconds();
+    spiTransfer(tx, rx, n - 1);
+    report("bytes", n - 1, seconds() - start, (double)SYSTEM_CLOCK / brd / 8);
+    if (useModel)
+        printf("model    %10zu rx errors  %5.2f bus accesses/word\n",
+               countErrors(tx, rx, n - 1, 8), (double)(model.accesses - accesses) / (n - 1));
+    spiSelectDevice(0, wordSize);
+
+    // The model memory holds tx followed by room for rx
+    if (useModel && spiDmaPresent())
+    {
+        for (i = 0; i < n; i++)
+            memory[i] = tx[i];
+        accesses = model.accesses;
+        start = seconds();
+        spiDmaStart(MODEL_MEMORY_BASE, MODEL_MEMORY_BASE + n * sizeof(uint32_t), n,
+                    DMA_TX_MASK | DMA_RX_MASK);
+        while (spiDmaBusy())
+            spiModelAdvance(&model, DMA_POLL_CYCLES);
+        report("dma", n, seconds() - start, lineRate);
+        printf("model    %10zu rx errors  %5.2f bus accesses/word  %10llu memory faults\n",
+               countErrors(tx, memory + n, n, wordSize),
+               (double)(model.accesses - accesses) / n,
+               (unsigned long long)model.memoryFaults);
+    }
+
+    // Same word size and rate on both devices, so only the device changes
+    spiConfigureDevice(0, wordSize, 0, true, brd);
+    spiConfigureDevice(1, wordSize, 0, true, brd);
+    spiSetBanked(true);
+    for (i = 0; i < n; i++)
+        rx[i] = 0;
+    start = seconds();
+    spiTransferDevices(devices, tx, rx, n);
+    report("banked", n, seconds() - start, lineRate);
+    if (useModel)
+        printf("model    %10zu rx errors\n", countErrors(tx, rx, n, wordSize));
+    spiSetBanked(false);
+
+    if (useModel)
+    {
+        uint32_t value, changes = 0;
+        uint64_t polls = model.polls;
+        accesses = model.accesses;
+        spiPollStart(0, 0xA5, 0xFF, 0, POLL_PERIOD);
+        for (i = 0; i < POLL_CYCLES / DMA_POLL_CYCLES; i++)
+        {
+            spiModelAdvance(&model, DMA_POLL_CYCLES);
+            if (spiPollChanged(&value))
+                changes++;
+        }
+        spiPollStop();
+        printf("poll     %10llu polls  %10u changes  %5.2f bus accesses/poll  %zu rx words\n",
+               (unsigned long long)(model.polls - polls), changes,
+               (double)(model.accesses - accesses) / (model.polls - polls),
+               (size_t)model.rxFifo.level);
+    }
+
+    // The opcode is the top byte of a full size single line word
+    quadWords = calloc(n, sizeof(uint32_t));
+    if (useModel && quadWords != NULL && wordSize % 4 == 0 && wordSize >= 8)
+    {
+        spiModelQuadSlave quad = {quadWords, n, 0, 0, 0};
+        uint32_t command;
+        uint8_t lines;
+        spiModelAttachSlave(&model, spiModelQuadMemory, &quad);
+        for (lines = 2; lines <= 4; lines += 2)
+        {
+            command = QUAD_SLAVE_WRITE << (wordSize - 8);
+            start = seconds();
+            spiTransferIo(&command, 1, tx, n, lines, false);
+            report(lines == 2 ? "dual-w" : "quad-w", n, seconds() - start, lineRate);
+            for (i = 0; i < n; i++)
+                rx[i] = 0;
+            command = QUAD_SLAVE_READ << (wordSize - 8);
+            start = seconds();
+            spiTransferIo(&command, 1, rx, n, lines, true);
+            report(lines == 2 ? "dual-r" : "quad-r", n, seconds() - start, lineRate);
+            printf("model    %10zu rx errors  %10llu slave errors\n",
+                   countErrors(tx, rx, n, wordSize), (unsigned long long)quad.errors);
+        }
+        spiModelAttachSlave(&model, spiModelLoopback, NULL);
+    }
+
+    if (useModel && n >= CALIBRATE_WORDS)
+    {
+        uint32_t mask = (wordSize == 32) ? 0xFFFFFFFF : ((1u << wordSize) - 1);
+        uint16_t pass;
+        int delay;
+        spiModelSetMisoDelay(&model, brd * MISO_DELAY_QUARTERS / 4);
+        spiSetStream(false);
+        spiTransfer(tx, rx, n);
+        printf("late     %10zu rx errors  data %u clocks after the launch edge\n",
+               countErrors(tx, rx, n, wordSize), brd * MISO_DELAY_QUARTERS / 4);
+        delay = spiCalibrateSampleDelay(0, tx, tx, mask, CALIBRATE_WORDS, &pass);
+        for (i = 0; i < n; i++)
+            rx[i] = 0;
+        start = seconds();
+        spiTransfer(tx, rx, n);
+        report("tuned", n, seconds() - start, lineRate);
+        printf("model    %10zu rx errors  sample delay %d  passing delays 0x%04X\n",
+               countErrors(tx, rx, n, wordSize), delay, pass);
+        spiModelSetMisoDelay(&model, 0);
+        spiSetSampleDelay(0, 0);
+    }
+
+    if (useModel)
+    {
+        spiSelfTestResult result;
+        uint32_t internalBrd, externalBrd;
+        spiSetStream(true);
+        spiSetLoopback(true);
+        start = seconds();
+        spiSelfTest(n, &result);
+        report("bist", n, seconds() - start, lineRate);
+        printf("model    %10u errors     %5.3f bits/SCLK over %u clocks\n",
+               result.errors, (double)result.frames * wordSize * brd / result.cycles, result.cycles);
+        internalBrd = spiSelfTestMaxRate(BIST_SEARCH_FRAMES, 2, BIST_MAX_BRD);
+        spiSetLoopback(false);
+        spiModelSetMisoDelay(&model, BIST_MISO_DELAY);
+        externalBrd = spiSelfTestMaxRate(BIST_SEARCH_FRAMES, 2, BIST_MAX_BRD);
+        spiModelSetMisoDelay(&model, 0);
+        printf("max rate   internal brd %u (%.1f MHz)  loopback %u clocks late brd %u (%.1f MHz)\n",
+               internalBrd, internalBrd ? SYSTEM_CLOCK / 1e6 / internalBrd : 0.0,
+               BIST_MISO_DELAY, externalBrd, externalBrd ? SYSTEM_CLOCK / 1e6 / externalBrd : 0.0);
+    }
+
+    if (useModel && wordSize >= 8)
+    {
+        uint32_t program[] = {
+            SEQ_RECV(0, 0) | SEQ_REG_MASK,
+            SEQ_AND(SEQ_RMW_KEEP),
+            SEQ_OR(SEQ_RMW_SET),
+            SEQ_STORE(1),
+            SEQ_SEND(0, 0) | SEQ_ACC_MASK,
+            SEQ_END(false)
+        };
+        uint32_t mask = (wordSize == 32) ? 0xFFFFFFFF : ((1u << wordSize) - 1);
+        uint32_t command = SEQ_RMW_COMMAND & mask, expect = (command & SEQ_RMW_KEEP) | SEQ_RMW_SET;
+        uint32_t word, value;
+        size_t errors = 0;
+        double cpuSeconds;
+        spiSetStream(false);
+        accesses = model.accesses;
+        start = seconds();
+        for (i = 0; i < SEQ_RMW_COUNT; i++)
+        {
+            spiTransfer(&command, &value, 1);
+            word = (value & SEQ_RMW_KEEP) | SEQ_RMW_SET;
+            spiTransfer(&word, &value, 1);
+            if (word != expect)
+                errors++;
+        }
+        cpuSeconds = seconds() - start;
+        printf("cpu-rmw  %10u rmw    %8.1f us/rmw  %5.2f bus accesses/rmw  %zu errors\n",
+               SEQ_RMW_COUNT, cpuSeconds * 1e6 / SEQ_RMW_COUNT,
+               (double)(model.accesses - accesses) / SEQ_RMW_COUNT, errors);
+        errors = 0;
+        spiSeqLoad(0, program, sizeof(program) / sizeof(program[0]));
+        spiSeqSetReg(0, command);
+        accesses = model.accesses;
+        start = seconds();
+        for (i = 0; i < SEQ_RMW_COUNT; i++)
+        {
+            if (!spiSeqRun(0, 2) || spiSeqReg(1) != expect)
+                errors++;
+        }
+        printf("seq-rmw  %10u rmw    %8.1f us/rmw  %5.2f bus accesses/rmw  %zu errors  %zu rx words\n",
+               SEQ_RMW_COUNT, (seconds() - start) * 1e6 / SEQ_RMW_COUNT,
+               (double)(model.accesses - accesses) / SEQ_RMW_COUNT, errors, (size_t)model.rxFifo.level);
+    }
+
+    if (useModel && spiRingStart(&ring, 0))
+    {
+        spiRingCompletion completions[SPI_RING_ENTRIES];
+        spiRingEntry *entry;
+        size_t submitted = 0, reaped = 0, errors = 0;
+        uint32_t count, c;
+        for (i = 0; i < n; i++)
+            rx[i] = 0;
+        hostStart = hostSeconds();
+        start = seconds();
+        while (reaped < (n + RING_CHUNK_WORDS - 1) / RING_CHUNK_WORDS)
+        {
+            // Fill half the ring before each submit
+            for (c = 0; c < SPI_RING_ENTRIES / 2 && submitted * RING_CHUNK_WORDS < n; c++)
+            {
+                entry = spiRingGetEntry(&ring);
+                if (entry == NULL)
+                    break;
+                entry->tx = tx + submitted * RING_CHUNK_WORDS;
+                entry->rx = rx + submitted * RING_CHUNK_WORDS;
+                entry->len = (n - submitted * RING_CHUNK_WORDS < RING_CHUNK_WORDS)
+                           ? n - submitted * RING_CHUNK_WORDS : RING_CHUNK_WORDS;
+                entry->device = submitted & CS_SELECT_MASK;
+                entry->userData = submitted++;
+            }
+            spiRingSubmit(&ring);
+            count = spiRingWait(&ring, completions, 1, SPI_RING_ENTRIES);
+            for (c = 0; c < count; c++)
+                if (completions[c].result != 0)
+                    errors++;
+            reaped += count;
+        }
+        spiRingStop(&ring);
+        report("ring", n, seconds() - start, lineRate);
+        printf("model    %10zu rx errors  %zu entries  %llu wakeups  %5.2f us/entry on host  %zu failed\n",
+               countErrors(tx, rx, n, wordSize), submitted, (unsigned long long)ring.wakeups,
+               (hostSeconds() - hostStart) * 1e6 / submitted, errors);
+        spiSelectCore(0);
+    }
+
+    if (useModel)
+    {
+        pthread_t threads[CTX_THREADS];
+        ctxJob jobs[CTX_THREADS];
+        spiCtx *ctx;
+        uint8_t t;
+        for (i = 0; i < n; i++)
+            rx[i] = 0;
+        hostStart = hostSeconds();
+        start = seconds();
+        for (t = 0; t < CTX_THREADS; t++)
+        {
+            jobs[t].ctx = spiCtxOpen(0, t & CS_SELECT_MASK, wordSize, 0, brd, false);
+            jobs[t].tx = tx + t * n / CTX_THREADS;
+            jobs[t].rx = rx + t * n / CTX_THREADS;
+            jobs[t].n = (t + 1) * n / CTX_THREADS - t * n / CTX_THREADS;
+            pthread_create(&threads[t], NULL, ctxThread, &jobs[t]);
+        }
+        for (t = 0; t < CTX_THREADS; t++)
+        {
+            pthread_join(threads[t], NULL);
+            spiCtxClose(jobs[t].ctx);
+        }
+        report("session", n, seconds() - start, lineRate);
+        printf("model    %10zu rx errors  %5.2f us/transaction on host\n",
+               countErrors(tx, rx, n, wordSize),
+               (hostSeconds() - hostStart) * 1e6 / ((n + RING_CHUNK_WORDS - 1) / RING_CHUNK_WORDS));
+
+        for (i = 0; i < n; i++)
+            rx[i] = 0;
+        ctx = spiCtxOpen(0, 0, wordSize, 0, brd, true);
+        jobs[0] = (ctxJob){ctx, tx, rx, n};
+        hostStart = hostSeconds();
+        start = seconds();
+        ctxThread(&jobs[0]);
+        report("owned", n, seconds() - start, lineRate);
+        printf("model    %10zu rx errors  %5.2f us/transaction on host  second session %s\n",
+               countErrors(tx, rx, n, wordSize),
+               (hostSeconds() - hostStart) * 1e6 / ((n + RING_CHUNK_WORDS - 1) / RING_CHUNK_WORDS),
+               spiCtxOpen(0, 1, wordSize, 0, brd, false) == NULL ? "refused" : "opened");
+        spiCtxClose(ctx);
+        spiSelectCore(0);
+    }
+
+    if (useModel)
+    {
+        const uint32_t *channelTx[MC_MAX_CHANNELS];
+        uint32_t *channelRx[MC_MAX_CHANNELS];
+        size_t channelWords[MC_MAX_CHANNELS];
+        uint8_t channels, c;
+        char name[8];
+        for (channels = 1; channels <= MC_MAX_CHANNELS; channels *= 2)
+        {
+            spiModelGroupInit(&group, channels);
+            for (c = 0; c < channels; c++)
+            {
+                spiModelSetFifoDepth(&group.models[c], depth);
+                spiModelAttachSlave(&group.models[c], spiModelLoopback, NULL);
+                spiSelectCore(c);
+                spiOpenBackend(&group.channels[c].backend);
+                WriteBRD(brd);
+                WriteControl(((wordSize - 1) & WORDSIZE_MASK) | (1 << CS_AUTO_BIT_OFS)
+                             | (1 << CHIP_ENABLE_BIT_OFS) | (1 << STREAM_BIT_OFS));
+
+                // Channel c takes the words from c * n / channels
+                channelTx[c] = tx + c * n / channels;
+                channelRx[c] = rx + c * n / channels;
+                channelWords[c] = (c + 1) * n / channels - c * n / channels;
+            }
+            for (i = 0; i < n; i++)
+                rx[i] = 0;
+            spiModelGroupSync(&group);
+            start = (double)group.now / SYSTEM_CLOCK;
+            spiTransferChannels(0, channels, channelTx, channelRx, channelWords);
+            snprintf(name, sizeof(name), "mc-%u", channels);
+            report(name, n, (double)group.now / SYSTEM_CLOCK - start, lineRate);
+            printf("model    %10zu rx errors\n", countErrors(tx, rx, n, wordSize));
+        }
+        spiSelectCore(0);
+        spiOpenBackend(&model.backend);
+    }
+
+    control_disable();
+    free(devices);
+    free(quadWords);
+    free(memory);
+    free(tx);
+    free(rx);
+    return EXIT_SUCCESS;
+}
@@ -13,6 +13,18 @@
 //   SPI_1[31-0] is used as a general purpose SPI port
 // HPS interface:
 //   Mapped to offset of 0 in light-weight MM interface aperature
+//   Optional DMA master reaches SDRAM through the FPGA-to-SDRAM bridge
+// Linux interface:
+//   Platform driver for "de1soc,spi2" nodes, devices at the light-weight
+//   bridge offsets of the offset parameter (address_map.h SPI_BASE_OFFSET
+//   by default) are added when the device tree has none
+//   Each core N gets /dev/spiN, the sysfs attributes under /sys/kernel/spiN
+//   (/sys/kernel/spi for core 0) and an SPI controller with four chip
+//   selects
+//   A "de1soc,spi2-mc" node (or multichannel=1) is an spi2_mc block, each
+//   of its channels is served as a core of its own on the shared IRQ, so
+//   the SPI core and users of /dev/spiN run transfers on the channels at
+//   the same time; the SPI devices of its node are on channel 0
 
 //-----------------------------------------------------------------------------
 
@@ -20,15 +32,146 @@
 #include <linux/module.h>
 #include <linux/kobject.h>
 #include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/kfifo.h>
+#include <linux/uaccess.h>    // copy_to_user, copy_from_user
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/delay.h>          // usleep_range
+#include <linux/dma-mapping.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/spi/spi.h>
 #include <asm/io.h>           // iowrite, ioread (platform specific)
 #include "address_map.h"
 #include "spi_regs.h"
+#include "spi_ioctl.h"
 
 //-----------------------------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------------------------
 
-static unsigned int *base = NULL;
+// Cores served by the module, each with its own registers, IRQ, buffers,
+// sysfs directory, /dev/spiN and SPI bus
+#define SPI2_MAX_CORES 4
+
+// Bulk transfers of at least this many narrow frames turn PACKED on
+#define PACK_MIN_FRAMES 8
+
+// Words are bounced through kernel buffers of chunk_words words, the DMA
+// buffers themselves when the DMA master is used
+#define CHUNK_WORDS 256
+#define RX_BUFFER_WORDS 4096
+
+// Interrupt driven transfer in progress
+struct spi_xfer_state
+{
+	const u32 *tx;
+	u32 *rx;
+	size_t count;
+	size_t sent;
+	size_t received;
+	uint8_t lanes;
+	int result;
+	struct completion done;
+};
+
+// Result of the last self-test run
+struct spi_bist_result
+{
+	uint frames;
+	uint errors;
+	uint cycles;
+};
+
+// Everything the driver keeps about one core, the helpers below work on the
+// core they are given
+struct spi2_core
+{
+	int index;
+	char name[8];
+	unsigned int *base;
+
+	// Shadow copies of CONTROL and BRD, the core never changes these
+	// registers on its own so every get_* is served from memory and every
+	// set_* costs a single bus write
+	uint control_shadow;
+	uint brd_shadow;
+	uint cs_cfg_shadow[4];
+
+	// Device the TX words are tagged with when CONTROL BANKED is set, -1
+	// pushes them to DATA for the CONTROL cs_select
+	int tx_cs;
+
+	// TX/RX FIFO depth reported by the core in STATUS
+	uint fifo_depth;
+
+	// Clock the baud divider counts in Hz, spi_clk for a core that reports
+	// STATUS ASYNC and the system clock otherwise
+	u32 serial_clock;
+
+	// SAMPLE_DELAY shadow, written whole on each device change
+	uint sample_delay_shadow;
+
+	// Serializes the transfers of the character device, of the SPI
+	// controller and of calibration, and the sysfs writes of the
+	// configuration registers, so a message restoring CONTROL and BRD on
+	// its way out never undoes one
+	struct mutex lock;
+
+	// IRQ line wired to the spi2 irq output, 0 keeps the polled path; POLL
+	// stays enabled across transfers while the poll engine runs
+	int irq;
+	struct spi_xfer_state xfer;
+	spinlock_t xfer_lock;
+	uint int_enable_shadow;
+	uint int_enable_poll;
+	struct completion dma_done;
+	struct completion seq_done;
+
+	// Coherent buffers the DMA master reads TX words from and writes RX
+	// words to, allocated for dma_dev
+	struct device *dma_dev;
+	u32 *dma_tx_buffer;
+	u32 *dma_rx_buffer;
+	dma_addr_t dma_tx_handle;
+	dma_addr_t dma_rx_handle;
+
+	// Instructions of the sequencer RAM, 0 when the core has none
+	uint seq_depth;
+
+	// sysfs directory and the state behind its attributes
+	struct kobject *kobj;
+	int calibrate_result[4];
+	uint calibrate_pass[4];
+	uint poll_command;
+	uint poll_period;
+	uint poll_mask;
+	uint poll_device;
+	uint poll_value;
+	struct spi_bist_result bist_result;
+	uint max_rate_period;
+
+	// Character device
+	struct miscdevice misc;
+	DECLARE_KFIFO(rx_words, u32, RX_BUFFER_WORDS);
+	u32 pio_tx_chunk[CHUNK_WORDS];
+	u32 pio_rx_chunk[CHUNK_WORDS];
+	u32 *tx_chunk;
+	u32 *rx_chunk;
+	size_t chunk_words;
+
+	// Bus registered with the SPI core
+	struct spi_controller *controller;
+
+	// Next channel of the same spi2_mc block, probed together
+	struct spi2_core *next;
+};
+
+// Probed cores by index, the sysfs attributes find theirs by kobject
+static struct spi2_core *cores[SPI2_MAX_CORES];
 
 //-----------------------------------------------------------------------------
 // Kernel module information
@@ -42,547 +185,1936 @@ MODULE_DESCRIPTION("SPI IP DRIVER");
 // Subroutines
 //-----------------------------------------------------------------------------
 
-void set_baud_rate(uint brd)
+// One CONTROL field change, bits outside mask are left untouched
+struct spi_field
 {
-	iowrite32(brd, base + OFS_BRD);
-}
+	uint mask;
+	uint value;
+};
 
-uint get_baud_rate(void)
+void write_control(struct spi2_core *core, uint value)
 {
-	return ioread32(base + OFS_BRD);
+	core->control_shadow = value;
+	iowrite32(value, core->base + OFS_CONTROL);
 }
 
-void set_word_size(uint8_t word_size)
+void update_control(struct spi2_core *core, uint mask, uint value)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	value &=  ~WORDSIZE_MASK;
-	iowrite32((value | ((word_size-1)& WORDSIZE_MASK)), base + OFS_CONTROL);
+	write_control(core, (core->control_shadow & ~mask) | (value & mask));
 }
 
-uint get_word_size(void)
+// Applies count field changes with a single register write
+void apply_control(struct spi2_core *core, const struct spi_field *fields, size_t count)
 {
-	return (ioread32(base + OFS_CONTROL) & WORDSIZE_MASK);
+	uint value = core->control_shadow;
+	size_t i;
+	for (i = 0; i < count; i++)
+		value = (value & ~fields[i].mask) | (fields[i].value & fields[i].mask);
+	write_control(core, value);
 }
 
-void set_cs_select(uint8_t device)
+void set_baud_rate(struct spi2_core *core, uint brd)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	value &=  ~(CS_SELECT_MASK << CS_SELECT_BIT_OFS);
-	iowrite32((value | ((device & CS_SELECT_MASK) << CS_SELECT_BIT_OFS)), base + OFS_CONTROL);
+	core->brd_shadow = brd;
+	iowrite32(brd, core->base + OFS_BRD);
 }
 
-uint get_cs_select(void)
+uint get_baud_rate(struct spi2_core *core)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	return (value >> CS_SELECT_BIT_OFS) & CS_SELECT_MASK;
+	return core->brd_shadow;
 }
 
-void set_device_mode(uint8_t device, uint8_t mode)
+void set_word_size(struct spi2_core *core, uint8_t word_size)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	value &= ~(DEVICE_MODE_MASK << (DEVICE_MODE_BIT_OFS+ 2*device));
-	iowrite32((value | ((mode & DEVICE_MODE_MASK) << (DEVICE_MODE_BIT_OFS + 2*device))), base + OFS_CONTROL);
+	update_control(core, WORDSIZE_MASK, word_size-1);
 }
 
-uint get_device_mode(uint8_t device)
+uint get_word_size(struct spi2_core *core)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	return (value >> (DEVICE_MODE_BIT_OFS+2*device)) & DEVICE_MODE_MASK;
+	return (core->control_shadow & WORDSIZE_MASK);
 }
 
-void enable_cs_auto(uint8_t device)
+void set_cs_select(struct spi2_core *core, uint8_t device)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	value &= ~(1 << (device+CS_AUTO_BIT_OFS));
-	iowrite32((value | (1 << (device+CS_AUTO_BIT_OFS))), base + OFS_CONTROL);
+	update_control(core, CS_SELECT_MASK << CS_SELECT_BIT_OFS, device << CS_SELECT_BIT_OFS);
 }
 
-void disable_cs_auto(uint8_t device)
+uint get_cs_select(struct spi2_core *core)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	iowrite32((value & ~(1 << (device+CS_AUTO_BIT_OFS))), base + OFS_CONTROL);
+	return (core->control_shadow >> CS_SELECT_BIT_OFS) & CS_SELECT_MASK;
 }
 
-bool is_cs_auto_Enabled(uint8_t device)
+// Switches the next frames to another device with a single register write
+void select_device(struct spi2_core *core, uint8_t device, uint8_t word_size)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	return (value >> (device+CS_AUTO_BIT_OFS)) & 1;
+	struct spi_field fields[] =
+	{
+		{CS_SELECT_MASK << CS_SELECT_BIT_OFS, device << CS_SELECT_BIT_OFS},
+		{WORDSIZE_MASK, word_size-1}
+	};
+	apply_control(core, fields, ARRAY_SIZE(fields));
 }
 
-void enable_cs_enable(uint8_t device)
+void set_device_mode(struct spi2_core *core, uint8_t device, uint8_t mode)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	value &= ~(1 << (device+CS_ENABLE_BIT_OFS));
-	iowrite32((value | (1 << (device+CS_ENABLE_BIT_OFS))), base + OFS_CONTROL);
+	update_control(core, DEVICE_MODE_MASK << (DEVICE_MODE_BIT_OFS + 2*device), mode << (DEVICE_MODE_BIT_OFS + 2*device));
 }
 
-void disable_cs_enable(uint8_t device)
+uint get_device_mode(struct spi2_core *core, uint8_t device)
 {
-	uint value = ioread32(base + OFS_CONTROL);
-	iowrite32((value & ~(1 << (device+CS_ENABLE_BIT_OFS))), base + OFS_CONTROL);
+	return (core->control_shadow >> (DEVICE_MODE_BIT_OFS+2*device)) & DEVICE_MODE_MASK;
 }
 
-bool is_cs_enable(uint8_t device)
+void enable_cs_auto(struct spi2_core *core, uint8_t device)
 {
-    return (ioread32(base + OFS_CONTROL) >> (device+CS_ENABLE_BIT_OFS)) & 1;
+	update_control(core, 1 << (device+CS_AUTO_BIT_OFS), ~0);
 }
 
-void set_tx_data(uint fifo_value)
+void disable_cs_auto(struct spi2_core *core, uint8_t device)
 {
-	iowrite32(fifo_value, base + OFS_DATA);
+	update_control(core, 1 << (device+CS_AUTO_BIT_OFS), 0);
 }
 
-uint get_rx_data(void)
+bool is_cs_auto_Enabled(struct spi2_core *core, uint8_t device)
 {
-	uint value = ioread32(base + OFS_DATA);
-	if (value)
-		return value;
-	else
-		return -1;
+	return (core->control_shadow >> (device+CS_AUTO_BIT_OFS)) & 1;
 }
 
-//-----------------------------------------------------------------------------
-// Kernel Objects
-//-----------------------------------------------------------------------------
-
-// BAUD_RATE
-static uint baud_rate = 25000000;
-module_param(baud_rate, uint, S_IRUGO);
-MODULE_PARM_DESC(baud_rate, " baud_rate of SPI");
-
-static ssize_t baud_rateStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+void enable_cs_enable(struct spi2_core *core, uint8_t device)
 {
-    int result = kstrtouint(buffer, 0, &baud_rate);
-    if (result == 0)
-    	set_baud_rate(baud_rate);
-    return count;
+	update_control(core, 1 << (device+CS_ENABLE_BIT_OFS), ~0);
 }
 
-static ssize_t baud_rateShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+void disable_cs_enable(struct spi2_core *core, uint8_t device)
 {
-	baud_rate = get_baud_rate();
-    return sprintf(buffer, "%d\n", baud_rate);
+	update_control(core, 1 << (device+CS_ENABLE_BIT_OFS), 0);
 }
 
-static struct kobj_attribute baud_rateAttr = __ATTR(baud_rate, 0664, baud_rateShow, baud_rateStore);
-
-// WORD_SIZE
-static uint word_size = 32;
-module_param(word_size, uint, S_IRUGO);
-MODULE_PARM_DESC(word_size, " word_size in the data bytes");
-
-static ssize_t word_sizeStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+bool is_cs_enable(struct spi2_core *core, uint8_t device)
 {
-    int result = kstrtouint(buffer, 0, &word_size);
-    if (result == 0)
-        set_word_size(word_size);
-    return count;
+    return (core->control_shadow >> (device+CS_ENABLE_BIT_OFS)) & 1;
 }
 
-static ssize_t word_sizeShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+void enable_stream(struct spi2_core *core)
 {
-    word_size = get_word_size();
-    return sprintf(buffer, "%d\n", word_size);
+	update_control(core, 1 << STREAM_BIT_OFS, ~0);
 }
 
-static struct kobj_attribute word_sizeAttr = __ATTR(word_size, 0664, word_sizeShow, word_sizeStore);
-
-// CS_SELECT
-static int cs_select = 0;
-module_param(cs_select, int, S_IRUGO);
-MODULE_PARM_DESC(cs_select, " Select device 0-3");
-
-static ssize_t cs_selectStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+void disable_stream(struct spi2_core *core)
 {
-    int result = kstrtouint(buffer, 0, &cs_select);
-    if (result == 0)
-    	set_cs_select(cs_select);
-    return count;
+	update_control(core, 1 << STREAM_BIT_OFS, 0);
 }
 
-static ssize_t cs_selectShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+bool is_stream_enabled(struct spi2_core *core)
 {
-	cs_select = get_cs_select();
-    return sprintf(buffer, "%d\n", cs_select);
+	return (core->control_shadow >> STREAM_BIT_OFS) & 1;
 }
 
-static struct kobj_attribute cs_selectAttr = __ATTR(cs_select, 0664, cs_selectShow, cs_selectStore);
-
-// DEVICE MODE 0
-static int mode0 = 0;
-module_param(mode0, int, S_IRUGO);
-MODULE_PARM_DESC(mode0, " Select mode for device 0");
-
-static ssize_t mode0Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+bool is_banked(struct spi2_core *core)
 {
-    int result = kstrtouint(buffer, 0, &mode0);
-    if (result == 0)
-    	set_device_mode(0, mode0);
-    return count;
+	return (core->control_shadow >> BANKED_BIT_OFS) & 1;
 }
 
-static ssize_t mode0Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+// Writes the configuration bank of one device, skipped when unchanged
+void set_cs_cfg(struct spi2_core *core, uint8_t device, uint value)
 {
-	mode0 = get_device_mode(0);
-    return sprintf(buffer, "%d\n", mode0);
+	if (core->cs_cfg_shadow[device] == value)
+		return;
+	core->cs_cfg_shadow[device] = value;
+	iowrite32(value, core->base + OFS_CS_CFG0 + device);
 }
 
-static struct kobj_attribute mode0Attr = __ATTR(mode0, 0664, mode0Show, mode0Store);
-
-// DEVICE MODE 1
-static int mode1 = 0;
-module_param(mode1, int, S_IRUGO);
-MODULE_PARM_DESC(mode1, " Select mode for device 1");
-
-static ssize_t mode1Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+// Takes the RX sample of device clocks (0-15) after the SCLK sampling
+// edge, shorter than its SCLK period
+void set_sample_delay(struct spi2_core *core, uint8_t device, uint clocks)
 {
-    int result = kstrtouint(buffer, 0, &mode1);
-    if (result == 0)
-    	set_device_mode(1, mode1);
-    return count;
+	uint shift = SAMPLE_DELAY_BIT_STRIDE * device;
+	core->sample_delay_shadow = (core->sample_delay_shadow & ~(SAMPLE_DELAY_MASK << shift))
+	                          | ((clocks & SAMPLE_DELAY_MASK) << shift);
+	iowrite32(core->sample_delay_shadow, core->base + OFS_SAMPLE_DELAY);
 }
 
-static ssize_t mode1Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+uint get_sample_delay(struct spi2_core *core, uint8_t device)
 {
-	mode1 = get_device_mode(1);
-    return sprintf(buffer, "%d\n", mode1);
+	return (core->sample_delay_shadow >> (SAMPLE_DELAY_BIT_STRIDE * device)) & SAMPLE_DELAY_MASK;
 }
 
-static struct kobj_attribute mode1Attr = __ATTR(mode1, 0664, mode1Show, mode1Store);
-
-// DEVICE MODE 2
-static int mode2 = 0;
-module_param(mode2, int, S_IRUGO);
-MODULE_PARM_DESC(mode2, " Select mode for device 2");
-
-static ssize_t mode2Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+void set_tx_data(struct spi2_core *core, uint fifo_value)
 {
-    int result = kstrtouint(buffer, 0, &mode2);
-    if (result == 0)
-    	set_device_mode(2, mode2);
-    return count;
+	iowrite32(fifo_value, core->base + OFS_DATA);
 }
 
-static ssize_t mode2Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+uint get_rx_level(struct spi2_core *core)
 {
-	mode2 = get_device_mode(2);
-    return sprintf(buffer, "%d\n", mode2);
+	return ioread32(core->base + OFS_LEVEL) >> RX_LEVEL_BIT_OFS;
 }
 
-static struct kobj_attribute mode2Attr = __ATTR(mode2, 0664, mode2Show, mode2Store);
-
-// DEVICE MODE 3
-static int mode3 = 0;
-module_param(mode3, int, S_IRUGO);
-MODULE_PARM_DESC(mode3, " Select mode for device 3");
-
-static ssize_t mode3Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+// True when every word that can be received fits beside the valid flag,
+// with banked configuration that is every bank
+bool rx_data_valid_usable(struct spi2_core *core)
 {
-    int result = kstrtouint(buffer, 0, &mode3);
-    if (result == 0)
-    	set_device_mode(3, mode3);
-    return count;
+	uint8_t i;
+	if (!is_banked(core))
+		return (core->control_shadow & WORDSIZE_MASK) < RXDATA_MAX_WORD_SIZE;
+	for (i = 0; i < 4; i++)
+		if ((core->cs_cfg_shadow[i] & WORDSIZE_MASK) >= RXDATA_MAX_WORD_SIZE)
+			return false;
+	return true;
 }
 
-static ssize_t mode3Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+static inline void push_tx(struct spi2_core *core, u32 value)
 {
-	mode3 = get_device_mode(3);
-    return sprintf(buffer, "%d\n", mode3);
+	iowrite32(value, core->base + (core->tx_cs < 0 ? OFS_DATA : OFS_DATA_CS0 + core->tx_cs));
 }
 
-static struct kobj_attribute mode3Attr = __ATTR(mode3, 0664, mode3Show, mode3Store);
-
-// CS_AUTO0
-static bool cs_auto0 = 0;
-module_param(cs_auto0, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_auto0, " Select cs_auto for device 0");
+// Pops one received word, returns false if the RX FIFO was empty
+bool get_rx_data(struct spi2_core *core, uint *value)
+{
+	uint data;
+	if (rx_data_valid_usable(core))
+	{
+		data = ioread32(core->base + OFS_RX_DATA_VALID);
+		*value = data & RXDATA_DATA_MASK;
+		return (data & RXDATA_VALID_MASK) != 0;
+	}
+	if (get_rx_level(core) == 0)
+		return false;
+	*value = ioread32(core->base + OFS_DATA);
+	return true;
+}
 
-static ssize_t cs_auto0Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+// Reads up to max waiting words into rx (NULL discards them) and returns
+// how many were read
+// Word sizes that fit beside the valid flag cost one read per word,
+// wider words one LEVEL read plus one DATA read per word
+size_t read_rx_words(struct spi2_core *core, u32 *rx, size_t max)
 {
-	if (strncmp(buffer, "auto", count-1) == 0)
+	size_t count = 0, level;
+	uint value;
+
+	if (rx_data_valid_usable(core))
 	{
-		enable_cs_auto(0);
-		cs_auto0 = true;
+		while (count < max)
+		{
+			value = ioread32(core->base + OFS_RX_DATA_VALID);
+			if (!(value & RXDATA_VALID_MASK))
+				break;
+			if (rx != NULL)
+				rx[count] = value & RXDATA_DATA_MASK;
+			count++;
+			if (!((value >> RXDATA_LEVEL_BIT_OFS) & RXDATA_LEVEL_MASK))
+				break;
+		}
 	}
 	else
-		if (strncmp(buffer, "manual", count-1) == 0)
+	{
+		level = min_t(size_t, get_rx_level(core), max);
+		for (; count < level; count++)
 		{
-			disable_cs_auto(0);
-			cs_auto0 = false;
+			value = ioread32(core->base + OFS_DATA);
+			if (rx != NULL)
+				rx[count] = value;
 		}
+	}
 	return count;
 }
 
-static ssize_t cs_auto0Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+// Discards stale words so the in-flight count matches the RX FIFO
+void flush_rx(struct spi2_core *core)
 {
-	cs_auto0 = is_cs_auto_Enabled(0);
-    if (cs_auto0)
-        strcpy(buffer, "true\n");
-    else
-        strcpy(buffer, "false\n");
-    return strlen(buffer);
+	read_rx_words(core, NULL, core->fifo_depth);
 }
 
-static struct kobj_attribute cs_auto0Attr = __ATTR(cs_auto0, 0664, cs_auto0Show, cs_auto0Store);
+// PACKED carries up to four 8-bit or two 16-bit frames per DATA access in
+// both directions, frame n of a word in the nth byte or halfword lane
+bool is_packed(struct spi2_core *core)
+{
+	return (core->control_shadow >> PACKED_BIT_OFS) & 1;
+}
 
-// CS_AUTO1
-static bool cs_auto1 = 0;
-module_param(cs_auto1, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_auto1, " Select cs_auto for device 1");
+// Frames a packed word carries for the selected device; 1 when the TX
+// words go to another bank than the one the RX side unpacks with
+uint8_t pack_lanes(struct spi2_core *core)
+{
+	uint cs = get_cs_select(core), size;
+
+	if (is_banked(core) && core->tx_cs >= 0 && core->tx_cs != cs)
+		return 1;
+	size = ((is_banked(core) ? core->cs_cfg_shadow[cs] : core->control_shadow) & WORDSIZE_MASK) + 1;
+	if (size <= PACK_BYTE_MAX_WORD_SIZE)
+		return 4;
+	return (size <= PACK_HALF_MAX_WORD_SIZE) ? 2 : 1;
+}
 
-static ssize_t cs_auto1Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+// Lanes used for a count frame bulk transfer, 1 when it is not packed;
+// restore is set when PACKED was turned on for it
+static uint8_t start_packed(struct spi2_core *core, size_t count, bool *restore)
 {
-	if (strncmp(buffer, "auto", count-1) == 0)
+	uint8_t lanes = pack_lanes(core);
+
+	*restore = false;
+	if (lanes > 1 && !is_packed(core))
 	{
-		enable_cs_auto(1);
-		cs_auto1 = true;
+		if (count < PACK_MIN_FRAMES)
+			return 1;
+		update_control(core, 1 << PACKED_BIT_OFS, ~0);
+		*restore = true;
 	}
-	else
-		if (strncmp(buffer, "manual", count-1) == 0)
-		{
-			disable_cs_auto(1);
-			cs_auto1 = false;
-		}
-	return count;
+	return lanes;
 }
 
-static ssize_t cs_auto1Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+static void end_packed(struct spi2_core *core, bool restore)
 {
-	cs_auto1 = is_cs_auto_Enabled(1);
-    if (cs_auto1)
-        strcpy(buffer, "true\n");
-    else
-        strcpy(buffer, "false\n");
-    return strlen(buffer);
+	if (restore)
+		update_control(core, 1 << PACKED_BIT_OFS, 0);
 }
 
-static struct kobj_attribute cs_auto1Attr = __ATTR(cs_auto1, 0664, cs_auto1Show, cs_auto1Store);
-
-// CS_AUTO2
-static bool cs_auto2 = 0;
-module_param(cs_auto2, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_auto2, " Select cs_auto for device 2");
+// Allows 1 ms per word on top of a second, enough for 32 kHz SCLK
+static unsigned long dma_timeout(size_t count)
+{
+	return HZ + msecs_to_jiffies(count);
+}
 
-static ssize_t cs_auto2Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+// Waits until no frame is in flight, for at most the time a full FIFO
+// takes; a disabled core never completes its frames
+static int wait_idle(struct spi2_core *core)
 {
-	if (strncmp(buffer, "auto", count-1) == 0)
+	unsigned long deadline = jiffies + dma_timeout(core->fifo_depth);
+
+	while (ioread32(core->base + OFS_STATUS) & BUSY_MASK)
 	{
-		enable_cs_auto(2);
-		cs_auto2 = true;
+		if (!(core->control_shadow & (1 << CHIP_ENABLE_BIT_OFS)) || !time_before(jiffies, deadline))
+			return -ETIMEDOUT;
+		cpu_relax();
 	}
-	else
-		if (strncmp(buffer, "manual", count-1) == 0)
-		{
-			disable_cs_auto(2);
-			cs_auto2 = false;
-		}
-	return count;
+	return 0;
 }
 
-static ssize_t cs_auto2Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+// The PIO loops give up once no word has moved for the time a full FIFO
+// takes, or at once on a disabled core; the task may be rescheduled
+// between polls, the loops run with core->lock held
+static int fifo_stalled(struct spi2_core *core, size_t moved, unsigned long *deadline)
 {
-	cs_auto2 = is_cs_auto_Enabled(2);
-    if (cs_auto2)
-        strcpy(buffer, "true\n");
-    else
-        strcpy(buffer, "false\n");
-    return strlen(buffer);
+	if (moved)
+		*deadline = jiffies + dma_timeout(core->fifo_depth);
+	else if (!(core->control_shadow & (1 << CHIP_ENABLE_BIT_OFS)) || !time_before(jiffies, *deadline))
+		return -ETIMEDOUT;
+	cond_resched();
+	return 0;
 }
 
-static struct kobj_attribute cs_auto2Attr = __ATTR(cs_auto2, 0664, cs_auto2Show, cs_auto2Store);
+// Transfers that read need the received words, a TX_ONLY left set by the
+// tx_only parameter or attribute is cleared once the frames before have
+// completed; returns whether it was set
+static bool start_receive(struct spi2_core *core)
+{
+	if (!((core->control_shadow >> TX_ONLY_BIT_OFS) & 1))
+		return false;
+	wait_idle(core);
+	update_control(core, 1 << TX_ONLY_BIT_OFS, 0);
+	return true;
+}
 
-// CS_AUTO3
-static bool cs_auto3 = 0;
-module_param(cs_auto3, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_auto3, " Select cs_auto for device 3");
+static void end_receive(struct spi2_core *core, bool restore)
+{
+	if (restore)
+		update_control(core, 1 << TX_ONLY_BIT_OFS, ~0);
+}
 
-static ssize_t cs_auto3Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+// Pushes count frames (up to lanes) of tx as one word, a short word is
+// written a byte or halfword lane at a time so only those lanes are
+// enabled; NULL tx sends zeros
+static void push_packed(struct spi2_core *core, const u32 *tx, size_t count, uint8_t lanes)
 {
-	if (strncmp(buffer, "auto", count-1) == 0)
+	u8 __iomem *data = (u8 __iomem *)(core->base + (core->tx_cs < 0 ? OFS_DATA : OFS_DATA_CS0 + core->tx_cs));
+	uint width = 32 / lanes, i;
+	u32 value = 0;
+
+	if (tx != NULL)
+		for (i = 0; i < count; i++)
+			value |= (tx[i] & ((1u << width) - 1)) << (i * width);
+	if (count == lanes)
 	{
-		enable_cs_auto(3);
-		cs_auto3 = true;
+		push_tx(core, value);
+		return;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (lanes == 2)
+			iowrite16(value >> (16 * i), data + 2 * i);
+		else
+			iowrite8(value >> (8 * i), data + i);
 	}
-	else
-		if (strncmp(buffer, "manual", count-1) == 0)
-		{
-			disable_cs_auto(3);
-			cs_auto3 = false;
-		}
-	return count;
 }
 
-static ssize_t cs_auto3Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+// Reads the packed words waiting until max frames into rx (NULL discards
+// them) and returns how many frames were read
+static size_t read_packed_words(struct spi2_core *core, u32 *rx, size_t max, uint8_t lanes)
 {
-	cs_auto3 = is_cs_auto_Enabled(3);
-    if (cs_auto3)
-        strcpy(buffer, "true\n");
-    else
-        strcpy(buffer, "false\n");
-    return strlen(buffer);
-}
-
-static struct kobj_attribute cs_auto3Attr = __ATTR(cs_auto3, 0664, cs_auto3Show, cs_auto3Store);
+	uint width = 32 / lanes, i;
+	size_t count = 0, level;
+	u32 value;
 
-// CS_ENABLE0
-static bool cs_enable0 = 0;
-module_param(cs_enable0, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_enable0, " Select cs_enable for device 0");
+	level = get_rx_level(core);
+	while (level-- && count < max)
+	{
+		value = ioread32(core->base + OFS_DATA);
+		for (i = 0; i < lanes && count < max; i++, count++)
+			if (rx != NULL)
+				rx[count] = (value >> (i * width)) & ((1u << width) - 1);
+	}
+	return count;
+}
 
-static ssize_t cs_enable0Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+// Sends count words with TX_ONLY set, the received words are dropped by
+// the core so nothing is drained; the mode is cleared once no frame is in
+// flight unless it was already set
+// The TX level counts frames, so a packed word waits until all of its
+// frames fit
+// Returns -ETIMEDOUT when the TX FIFO stopped draining
+int write_words(struct spi2_core *core, const u32 *tx, size_t count)
 {
-	if (strncmp(buffer, "auto", count-1) == 0)
+	bool was_tx_only = (core->control_shadow >> TX_ONLY_BIT_OFS) & 1, restore;
+	uint8_t lanes = start_packed(core, count, &restore);
+	unsigned long deadline = jiffies + dma_timeout(core->fifo_depth);
+	size_t sent = 0, n, free, last;
+	int result = 0;
+
+	if (!was_tx_only)
+		update_control(core, 1 << TX_ONLY_BIT_OFS, ~0);
+	while (sent < count && !result)
 	{
-		enable_cs_enable(0);
-		cs_enable0 = true;
-	}
-	else
-		if (strncmp(buffer, "manual", count-1) == 0)
+		free = core->fifo_depth - (ioread32(core->base + OFS_LEVEL) & LEVEL_MASK);
+		last = sent;
+		while (sent < count)
 		{
-			disable_cs_enable(0);
-			cs_enable0 = false;
+			n = min_t(size_t, lanes, count - sent);
+			if (n > free)
+				break;
+			if (lanes > 1)
+				push_packed(core, tx + sent, n, lanes);
+			else
+				push_tx(core, tx[sent]);
+			sent += n;
+			free -= n;
 		}
-	return count;
+		if (sent < count)
+			result = fifo_stalled(core, sent - last, &deadline);
+	}
+	if (!was_tx_only)
+	{
+		if (wait_idle(core) && !result)
+			result = -ETIMEDOUT;
+		update_control(core, 1 << TX_ONLY_BIT_OFS, 0);
+	}
+	end_packed(core, restore);
+	return result;
 }
 
-static ssize_t cs_enable0Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+// Receives count words with RX_ONLY set, the core clocks out zeros and
+// never lets the RX FIFO overflow
+// Returns -ETIMEDOUT when the words stopped arriving
+int read_words(struct spi2_core *core, u32 *rx, size_t count)
 {
-	cs_enable0 = is_cs_enable(0);
-    if (cs_enable0)
-        strcpy(buffer, "true\n");
-    else
-        strcpy(buffer, "false\n");
-    return strlen(buffer);
+	unsigned long deadline = jiffies + dma_timeout(core->fifo_depth);
+	size_t received = 0, n;
+	uint8_t lanes;
+	bool restore, tx_only = start_receive(core);
+	int result = 0;
+
+	flush_rx(core);
+	lanes = start_packed(core, count, &restore);
+	update_control(core, 1 << RX_ONLY_BIT_OFS, ~0);
+	iowrite32(0, core->base + OFS_XFER_FILL);
+	iowrite32(count, core->base + OFS_XFER_LEN);
+	while (received < count && !result)
+	{
+		if (lanes > 1)
+			n = read_packed_words(core, (rx != NULL) ? rx + received : NULL, count - received, lanes);
+		else
+			n = read_rx_words(core, (rx != NULL) ? rx + received : NULL, count - received);
+		received += n;
+		if (received < count)
+			result = fifo_stalled(core, n, &deadline);
+	}
+	if (result)
+		iowrite32(0, core->base + OFS_XFER_LEN);
+	update_control(core, 1 << RX_ONLY_BIT_OFS, 0);
+	end_packed(core, restore);
+	end_receive(core, tx_only);
+	return result;
 }
 
-static struct kobj_attribute cs_enable0Attr = __ATTR(cs_enable0, 0664, cs_enable0Show, cs_enable0Store);
-
-// CS_ENABLE1
-static bool cs_enable1 = 0;
-module_param(cs_enable1, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_enable1, " Select cs_enable for device 0");
-
-static ssize_t cs_enable1Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+// Moves count words full duplex through the TX and RX FIFOs
+// At most fifo_depth words are kept in flight, so a single level read
+// tells how many words can be read and pushed and neither FIFO can overflow
+// A NULL tx or rx uses the one-directional modes
+// Returns -ETIMEDOUT when the words stopped arriving
+int stream_words(struct spi2_core *core, const u32 *tx, u32 *rx, size_t count)
 {
-	if (strncmp(buffer, "auto", count-1) == 0)
+	unsigned long deadline = jiffies + dma_timeout(core->fifo_depth);
+	size_t sent = 0, received = 0, n, got, last;
+	uint8_t lanes;
+	bool restore, tx_only;
+	int result = 0;
+
+	if (tx == NULL)
+		return read_words(core, rx, count);
+	if (rx == NULL)
+		return write_words(core, tx, count);
+
+	tx_only = start_receive(core);
+	flush_rx(core);
+	lanes = start_packed(core, count, &restore);
+	while (received < count && !result)
 	{
-		enable_cs_enable(1);
-		cs_enable1 = true;
+		last = sent;
+		if (lanes > 1)
+		{
+			got = read_packed_words(core, rx + received, sent - received, lanes);
+			received += got;
+			while ((n = min_t(size_t, lanes, count - sent)) != 0 && n <= core->fifo_depth - (sent - received))
+			{
+				push_packed(core, tx + sent, n, lanes);
+				sent += n;
+			}
+		}
+		else
+		{
+			got = read_rx_words(core, rx + received, sent - received);
+			received += got;
+
+			n = min_t(size_t, core->fifo_depth - (sent - received), count - sent);
+			while (n--)
+			{
+				push_tx(core, tx[sent]);
+				sent++;
+			}
+		}
+		if (received < count)
+			result = fifo_stalled(core, got + sent - last, &deadline);
 	}
+	end_packed(core, restore);
+	end_receive(core, tx_only);
+	return result;
+}
+
+// Times the calibration word is sent at each sample delay
+#define CALIBRATE_ROUNDS 8
+
+// Finds the sample delay of device: every delay shorter than its SCLK
+// period is tried with CALIBRATE_ROUNDS frames of command, and passes when
+// each response matches expect in the bits of mask; the middle of the
+// longest run of passing delays is kept and returned, or -1 with the old
+// delay kept when none passed; pass gets bit d set for each passing delay
+// The frames go to device through its bank with BANKED set, otherwise
+// cs_select is pointed at it for the sweep
+int calibrate_sample_delay(struct spi2_core *core, uint8_t device, u32 command, u32 expect, u32 mask, uint *pass)
+{
+	int old_tx_cs = core->tx_cs;
+	uint old_cs = get_cs_select(core);
+	uint old_delay = get_sample_delay(core, device);
+	uint brd = is_banked(core) ? (core->cs_cfg_shadow[device] >> CS_CFG_BRD_BIT_OFS) & CS_CFG_BRD_MASK : core->brd_shadow;
+	uint period = brd >> 6, limit, delay, round, run = 0, best_run = 0, best_start = 0;
+	u32 rx;
+	bool ok;
+
+	if (is_banked(core))
+		core->tx_cs = device;
 	else
-		if (strncmp(buffer, "manual", count-1) == 0)
+		set_cs_select(core, device);
+	limit = min_t(uint, SAMPLE_DELAY_MAX, period ? period - 1 : 0);
+	*pass = 0;
+	for (delay = 0; delay <= limit; delay++)
+	{
+		set_sample_delay(core, device, delay);
+		ok = true;
+		for (round = 0; round < CALIBRATE_ROUNDS && ok; round++)
 		{
-			disable_cs_enable(1);
-			cs_enable1 = false;
+			ok = stream_words(core, &command, &rx, 1) == 0 && ((rx ^ expect) & mask) == 0;
 		}
-	return count;
+		if (ok)
+		{
+			*pass |= 1 << delay;
+			if (++run > best_run)
+			{
+				best_run = run;
+				best_start = delay + 1 - run;
+			}
+		}
+		else
+			run = 0;
+	}
+	core->tx_cs = old_tx_cs;
+	if (!is_banked(core))
+		set_cs_select(core, old_cs);
+	if (best_run == 0)
+	{
+		set_sample_delay(core, device, old_delay);
+		return -1;
+	}
+	set_sample_delay(core, device, best_start + (best_run - 1) / 2);
+	return best_start + (best_run - 1) / 2;
 }
 
-static ssize_t cs_enable1Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+//-----------------------------------------------------------------------------
+// Interrupt driven transfers
+//-----------------------------------------------------------------------------
+
+// IRQ line wired to the spi2 irq output of each core, 0 takes the device
+// tree interrupt or keeps the polled path
+static int irq[SPI2_MAX_CORES];
+module_param_array(irq, int, NULL, S_IRUGO);
+MODULE_PARM_DESC(irq, " Linux IRQ numbers of the SPI IP cores (0 = polling)");
+
+// Interrupt once half of the frames in flight have been received, the RX
+// level counts packed words
+#define RX_WATERMARK max_t(uint, core->fifo_depth / 2 / core->xfer.lanes, 1)
+
+static void xfer_enable(struct spi2_core *core, uint events)
 {
-	cs_enable1 = is_cs_enable(1);
-    if (cs_enable1)
-        strcpy(buffer, "true\n");
-    else
-        strcpy(buffer, "false\n");
-    return strlen(buffer);
+	core->int_enable_shadow = (events ? events | (RX_WATERMARK << RX_WATERMARK_BIT_OFS) : 0) | core->int_enable_poll;
+	iowrite32(core->int_enable_shadow, core->base + OFS_INT_ENABLE);
 }
 
-static struct kobj_attribute cs_enable1Attr = __ATTR(cs_enable1, 0664, cs_enable1Show, cs_enable1Store);
+static void xfer_drain(struct spi2_core *core)
+{
+	u32 *rx = (core->xfer.rx != NULL) ? core->xfer.rx + core->xfer.received : NULL;
 
-// CS_ENABLE2
-static bool cs_enable2 = 0;
-module_param(cs_enable2, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_enable2, " Select cs_enable for device 0");
+	if (core->xfer.lanes > 1)
+		core->xfer.received += read_packed_words(core, rx, core->xfer.sent - core->xfer.received, core->xfer.lanes);
+	else
+		core->xfer.received += read_rx_words(core, rx, core->xfer.sent - core->xfer.received);
+}
 
-static ssize_t cs_enable2Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+// Drains the RX FIFO and refills TX
+// Once the last word is queued, frame-done events drain the tail
+static void xfer_service(struct spi2_core *core)
 {
-	if (strncmp(buffer, "auto", count-1) == 0)
+	size_t n;
+
+	xfer_drain(core);
+	if (core->xfer.lanes > 1)
 	{
-		enable_cs_enable(2);
-		cs_enable2 = true;
+		while ((n = min_t(size_t, core->xfer.lanes, core->xfer.count - core->xfer.sent)) != 0
+		       && n <= core->fifo_depth - (core->xfer.sent - core->xfer.received))
+		{
+			push_packed(core, (core->xfer.tx != NULL) ? core->xfer.tx + core->xfer.sent : NULL, n, core->xfer.lanes);
+			core->xfer.sent += n;
+		}
 	}
 	else
-		if (strncmp(buffer, "manual", count-1) == 0)
+	{
+		n = min_t(size_t, core->fifo_depth - (core->xfer.sent - core->xfer.received), core->xfer.count - core->xfer.sent);
+		while (n--)
+		{
+			push_tx(core, (core->xfer.tx != NULL) ? core->xfer.tx[core->xfer.sent] : 0);
+			core->xfer.sent++;
+		}
+	}
+
+	if (core->xfer.sent == core->xfer.count)
+	{
+		// Enable DONE before the final drain so no frame is missed
+		if (!(core->int_enable_shadow & INT_DONE_MASK))
+		{
+			xfer_enable(core, INT_RXWM_MASK | INT_DONE_MASK | INT_OV_MASK);
+			xfer_drain(core);
+		}
+	}
+}
+
+static void poll_isr(struct spi2_core *core);
+
+static irqreturn_t spi_isr(int irq, void *dev_id)
+{
+	struct spi2_core *core = dev_id;
+	uint events = ioread32(core->base + OFS_INT_STATUS);
+	if (!events)
+		return IRQ_NONE;
+	iowrite32(events, core->base + OFS_INT_STATUS);
+
+	if (events & INT_POLL_MASK)
+		poll_isr(core);
+	if (events & INT_DMA_MASK)
+		complete(&core->dma_done);
+	if (events & INT_SEQ_MASK)
+		complete(&core->seq_done);
+	if (!(events & ~(INT_DMA_MASK | INT_POLL_MASK | INT_SEQ_MASK)))
+		return IRQ_HANDLED;
+
+	spin_lock(&core->xfer_lock);
+	if (events & INT_OV_MASK)
+	{
+		iowrite32(TXFO_MASK | RXFO_MASK, core->base + OFS_STATUS);
+		core->xfer.result = -EIO;
+	}
+	else
+		xfer_service(core);
+
+	if (core->xfer.result || core->xfer.received == core->xfer.count)
+	{
+		xfer_enable(core, 0);
+		complete(&core->xfer.done);
+	}
+	spin_unlock(&core->xfer_lock);
+	return IRQ_HANDLED;
+}
+
+// Primes the FIFOs and lets the interrupt handler move the rest
+int irq_stream_words(struct spi2_core *core, const u32 *tx, u32 *rx, size_t count)
+{
+	unsigned long flags;
+	bool finished, restore, tx_only;
+	int result = 0;
+
+	if (count == 0)
+		return 0;
+
+	tx_only = start_receive(core);
+	flush_rx(core);
+	core->xfer.lanes = start_packed(core, count, &restore);
+	core->xfer.tx = tx;
+	core->xfer.rx = rx;
+	core->xfer.count = count;
+	core->xfer.sent = 0;
+	core->xfer.received = 0;
+	core->xfer.result = 0;
+	reinit_completion(&core->xfer.done);
+
+	iowrite32(INT_EVENTS_MASK, core->base + OFS_INT_STATUS);
+	spin_lock_irqsave(&core->xfer_lock, flags);
+	xfer_service(core);
+	finished = (core->xfer.received == count);
+	if (finished)
+		xfer_enable(core, 0);
+	else if (!(core->int_enable_shadow & INT_DONE_MASK))
+		xfer_enable(core, INT_RXWM_MASK | INT_OV_MASK);
+	spin_unlock_irqrestore(&core->xfer_lock, flags);
+
+	if (!finished && !wait_for_completion_timeout(&core->xfer.done, HZ))
+	{
+		spin_lock_irqsave(&core->xfer_lock, flags);
+		xfer_enable(core, 0);
+		spin_unlock_irqrestore(&core->xfer_lock, flags);
+		result = -ETIMEDOUT;
+	}
+	else if (!finished)
+		result = core->xfer.result;
+	end_packed(core, restore);
+	end_receive(core, tx_only);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// DMA transfers
+//-----------------------------------------------------------------------------
+
+// Use the DMA master when the core was built with one
+static bool dma = true;
+module_param(dma, bool, S_IRUGO);
+MODULE_PARM_DESC(dma, " Move bulk transfers with the DMA master when present");
+
+// Words of each DMA buffer
+#define DMA_CHUNK_WORDS 16384
+
+// Runs one descriptor, tx and rx must be NULL or the DMA buffers
+// The CPU sleeps until the completion interrupt, or polls every 100 us
+// without an IRQ
+int dma_stream_words(struct spi2_core *core, const u32 *tx, u32 *rx, size_t count)
+{
+	uint flags = (tx != NULL ? DMA_TX_MASK : 0) | (rx != NULL ? DMA_RX_MASK : 0);
+	unsigned long deadline = jiffies + dma_timeout(count);
+	bool timed_out, tx_only;
+
+	if (count == 0)
+		return 0;
+	tx_only = (rx != NULL) && start_receive(core);
+
+	// DMA words are tagged with CONTROL cs_select, CFG retargets it to the
+	// banked device without a separate CONTROL write
+	if (core->tx_cs >= 0 && core->tx_cs != get_cs_select(core))
+	{
+		flags |= DMA_CFG_MASK | (core->tx_cs << DMA_CS_BIT_OFS) | (get_device_mode(core, core->tx_cs) << DMA_MODE_BIT_OFS);
+		core->control_shadow = (core->control_shadow & ~(CS_SELECT_MASK << CS_SELECT_BIT_OFS)) | (core->tx_cs << CS_SELECT_BIT_OFS);
+	}
+
+	flush_rx(core);
+	iowrite32(core->dma_tx_handle, core->base + OFS_DMA_SRC);
+	iowrite32(core->dma_rx_handle, core->base + OFS_DMA_DST);
+	iowrite32(count, core->base + OFS_DMA_LEN);
+	if (core->irq > 0)
+	{
+		reinit_completion(&core->dma_done);
+		iowrite32(INT_DMA_MASK, core->base + OFS_INT_STATUS);
+		core->int_enable_shadow = INT_DMA_ENABLE_MASK | core->int_enable_poll;
+		iowrite32(core->int_enable_shadow, core->base + OFS_INT_ENABLE);
+		iowrite32(flags | DMA_GO_MASK, core->base + OFS_DMA_CTRL);
+		timed_out = !wait_for_completion_timeout(&core->dma_done, dma_timeout(count));
+		xfer_enable(core, 0);
+	}
+	else
+	{
+		iowrite32(flags | DMA_GO_MASK, core->base + OFS_DMA_CTRL);
+		while ((ioread32(core->base + OFS_DMA_CTRL) & DMA_GO_MASK) && time_before(jiffies, deadline))
+			usleep_range(100, 200);
+		timed_out = (ioread32(core->base + OFS_DMA_CTRL) & DMA_GO_MASK) != 0;
+	}
+
+	// Stop a descriptor that did not complete in time
+	if (timed_out)
+		iowrite32(0, core->base + OFS_DMA_CTRL);
+	end_receive(core, tx_only);
+	return timed_out ? -ETIMEDOUT : 0;
+}
+
+int transfer_words(struct spi2_core *core, const u32 *tx, u32 *rx, size_t count)
+{
+	if (core->dma_tx_buffer != NULL)
+		return dma_stream_words(core, tx, rx, count);
+	if (core->irq > 0 && tx != NULL && rx != NULL)
+		return irq_stream_words(core, tx, rx, count);
+	return stream_words(core, tx, rx, count);
+}
+
+//-----------------------------------------------------------------------------
+// Self-test
+//-----------------------------------------------------------------------------
+
+// Loopback feeds tx back to the RX sampler inside the core and holds every
+// chip select deasserted
+void set_loopback(struct spi2_core *core, bool enable)
+{
+	update_control(core, 1 << LOOPBACK_BIT_OFS, enable ? ~0 : 0);
+}
+
+bool is_loopback(struct spi2_core *core)
+{
+	return (core->control_shadow >> LOOPBACK_BIT_OFS) & 1;
+}
+
+// Runs frames PRBS-31 frames through the core self-test on the selected
+// device with the current settings and polls every 100 us until they are
+// checked; the core must be enabled and nothing else in flight
+int run_bist(struct spi2_core *core, uint frames, struct spi_bist_result *result)
+{
+	unsigned long deadline = jiffies + dma_timeout(frames);
+
+	iowrite32(frames, core->base + OFS_BIST_LEN);
+	iowrite32(BIST_GO_MASK, core->base + OFS_BIST_CTRL);
+	while ((ioread32(core->base + OFS_BIST_CTRL) & BIST_GO_MASK) && time_before(jiffies, deadline))
+		usleep_range(100, 200);
+	if (ioread32(core->base + OFS_BIST_CTRL) & BIST_GO_MASK)
+	{
+		iowrite32(0, core->base + OFS_BIST_CTRL);
+		return -ETIMEDOUT;
+	}
+	result->frames = frames;
+	result->errors = ioread32(core->base + OFS_BIST_ERRORS);
+	result->cycles = ioread32(core->base + OFS_BIST_CYCLES);
+	return 0;
+}
+
+// Returns the smallest SCLK period in clocks from min to max where frames
+// self-test frames all come back right, 0 if none does; BRD is restored
+uint find_max_rate(struct spi2_core *core, uint frames, uint min, uint max)
+{
+	struct spi_bist_result result;
+	uint old_brd = get_baud_rate(core), period;
+
+	for (period = min; period <= max; period++)
+	{
+		set_baud_rate(core, period << 6);
+		if (run_bist(core, frames, &result) == 0 && result.errors == 0)
+			break;
+	}
+	set_baud_rate(core, old_brd);
+	return (period <= max) ? period : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Sequencer
+//-----------------------------------------------------------------------------
+
+// A program that ends without IRQ is seen by a busy check this often
+#define SEQ_POLL_MS 10
+
+// Copies count instructions to the sequencer RAM from addr
+void load_sequence(struct spi2_core *core, uint addr, const u32 *program, size_t count)
+{
+	iowrite32(addr, core->base + OFS_SEQ_ADDR);
+	while (count--)
+		iowrite32(*program++, core->base + OFS_SEQ_DATA);
+}
+
+// Runs the program at start until it ends, sleeping on the SEQ interrupt
+// with an IRQ or polling every 100 us without; a program still running
+// after a second is aborted
+int run_sequence(struct spi2_core *core, uint start)
+{
+	unsigned long deadline = jiffies + HZ;
+
+	if (core->irq > 0)
+	{
+		reinit_completion(&core->seq_done);
+		iowrite32(INT_SEQ_MASK, core->base + OFS_INT_STATUS);
+		core->int_enable_shadow = INT_SEQ_ENABLE_MASK | core->int_enable_poll;
+		iowrite32(core->int_enable_shadow, core->base + OFS_INT_ENABLE);
+	}
+	iowrite32(SEQ_GO_MASK | (start << SEQ_PC_BIT_OFS), core->base + OFS_SEQ_CTRL);
+	while ((ioread32(core->base + OFS_SEQ_CTRL) & SEQ_GO_MASK) && time_before(jiffies, deadline))
+	{
+		// An IRQ instruction wakes the caller before the end
+		if (core->irq > 0)
 		{
-			disable_cs_enable(2);
-			cs_enable2 = false;
+			wait_for_completion_timeout(&core->seq_done, msecs_to_jiffies(SEQ_POLL_MS));
+			reinit_completion(&core->seq_done);
 		}
+		else
+			usleep_range(100, 200);
+	}
+	if (core->irq > 0)
+		xfer_enable(core, 0);
+	if (ioread32(core->base + OFS_SEQ_CTRL) & SEQ_GO_MASK)
+	{
+		iowrite32(0, core->base + OFS_SEQ_CTRL);
+		return -ETIMEDOUT;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Kernel Objects
+//-----------------------------------------------------------------------------
+
+// The attributes act on the shadows and settings in struct spi2_core under
+// core->lock; values are parsed into locals first, the module parameters of
+// the same names are load-time settings that no attribute writes
+
+// Core whose sysfs directory holds kobj
+static struct spi2_core *kobj_core(struct kobject *kobj)
+{
+	int i;
+	for (i = 0; i < SPI2_MAX_CORES; i++)
+		if (cores[i] != NULL && cores[i]->kobj == kobj)
+			return cores[i];
+	return NULL;
+}
+
+// BAUD_RATE
+static uint baud_rate = 25000000;
+module_param(baud_rate, uint, S_IRUGO);
+MODULE_PARM_DESC(baud_rate, " baud_rate of SPI");
+
+static ssize_t baud_rateStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    	set_baud_rate(core, value);
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t baud_rateShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint value;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	value = get_baud_rate(core);
+	mutex_unlock(&core->lock);
+    return sprintf(buffer, "%u\n", value);
+}
+
+static struct kobj_attribute baud_rateAttr = __ATTR(baud_rate, 0664, baud_rateShow, baud_rateStore);
+
+// WORD_SIZE
+static uint word_size = 32;
+module_param(word_size, uint, S_IRUGO);
+MODULE_PARM_DESC(word_size, " word_size in the data bytes");
+
+static ssize_t word_sizeStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+        set_word_size(core, value);
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t word_sizeShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+    struct spi2_core *core = kobj_core(kobj);
+	uint value;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	value = get_word_size(core);
+	mutex_unlock(&core->lock);
+    return sprintf(buffer, "%u\n", value);
+}
+
+static struct kobj_attribute word_sizeAttr = __ATTR(word_size, 0664, word_sizeShow, word_sizeStore);
+
+// STREAM
+static bool stream = 0;
+module_param(stream, bool, S_IRUGO);
+MODULE_PARM_DESC(stream, " Stream back-to-back frames with CS held");
+
+static ssize_t streamStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "on", count-1) == 0)
+		enable_stream(core);
+	else
+		if (strncmp(buffer, "off", count-1) == 0)
+			disable_stream(core);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t streamShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = is_stream_enabled(core);
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute streamAttr = __ATTR(stream, 0664, streamShow, streamStore);
+
+// CS_SELECT
+static int cs_select = 0;
+module_param(cs_select, int, S_IRUGO);
+MODULE_PARM_DESC(cs_select, " Select device 0-3");
+
+static ssize_t cs_selectStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    	set_cs_select(core, value);
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t cs_selectShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint value;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	value = get_cs_select(core);
+	mutex_unlock(&core->lock);
+    return sprintf(buffer, "%u\n", value);
+}
+
+static struct kobj_attribute cs_selectAttr = __ATTR(cs_select, 0664, cs_selectShow, cs_selectStore);
+
+// DEVICE MODE 0
+static int mode0 = 0;
+module_param(mode0, int, S_IRUGO);
+MODULE_PARM_DESC(mode0, " Select mode for device 0");
+
+static ssize_t mode0Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    	set_device_mode(core, 0, value);
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t mode0Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint value;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	value = get_device_mode(core, 0);
+	mutex_unlock(&core->lock);
+    return sprintf(buffer, "%u\n", value);
+}
+
+static struct kobj_attribute mode0Attr = __ATTR(mode0, 0664, mode0Show, mode0Store);
+
+// DEVICE MODE 1
+static int mode1 = 0;
+module_param(mode1, int, S_IRUGO);
+MODULE_PARM_DESC(mode1, " Select mode for device 1");
+
+static ssize_t mode1Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    	set_device_mode(core, 1, value);
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t mode1Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint value;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	value = get_device_mode(core, 1);
+	mutex_unlock(&core->lock);
+    return sprintf(buffer, "%u\n", value);
+}
+
+static struct kobj_attribute mode1Attr = __ATTR(mode1, 0664, mode1Show, mode1Store);
+
+// DEVICE MODE 2
+static int mode2 = 0;
+module_param(mode2, int, S_IRUGO);
+MODULE_PARM_DESC(mode2, " Select mode for device 2");
+
+static ssize_t mode2Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    	set_device_mode(core, 2, value);
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t mode2Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint value;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	value = get_device_mode(core, 2);
+	mutex_unlock(&core->lock);
+    return sprintf(buffer, "%u\n", value);
+}
+
+static struct kobj_attribute mode2Attr = __ATTR(mode2, 0664, mode2Show, mode2Store);
+
+// DEVICE MODE 3
+static int mode3 = 0;
+module_param(mode3, int, S_IRUGO);
+MODULE_PARM_DESC(mode3, " Select mode for device 3");
+
+static ssize_t mode3Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    	set_device_mode(core, 3, value);
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t mode3Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint value;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	value = get_device_mode(core, 3);
+	mutex_unlock(&core->lock);
+    return sprintf(buffer, "%u\n", value);
+}
+
+static struct kobj_attribute mode3Attr = __ATTR(mode3, 0664, mode3Show, mode3Store);
+
+// CS_AUTO0
+static bool cs_auto0 = 0;
+module_param(cs_auto0, bool, S_IRUGO);
+MODULE_PARM_DESC(cs_auto0, " Select cs_auto for device 0");
+
+static ssize_t cs_auto0Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "auto", count-1) == 0)
+		enable_cs_auto(core, 0);
+	else
+		if (strncmp(buffer, "manual", count-1) == 0)
+			disable_cs_auto(core, 0);
+	mutex_unlock(&core->lock);
 	return count;
 }
 
-static ssize_t cs_enable2Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+static ssize_t cs_auto0Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = is_cs_auto_Enabled(core, 0);
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute cs_auto0Attr = __ATTR(cs_auto0, 0664, cs_auto0Show, cs_auto0Store);
+
+// CS_AUTO1
+static bool cs_auto1 = 0;
+module_param(cs_auto1, bool, S_IRUGO);
+MODULE_PARM_DESC(cs_auto1, " Select cs_auto for device 1");
+
+static ssize_t cs_auto1Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "auto", count-1) == 0)
+		enable_cs_auto(core, 1);
+	else
+		if (strncmp(buffer, "manual", count-1) == 0)
+			disable_cs_auto(core, 1);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t cs_auto1Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = is_cs_auto_Enabled(core, 1);
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute cs_auto1Attr = __ATTR(cs_auto1, 0664, cs_auto1Show, cs_auto1Store);
+
+// CS_AUTO2
+static bool cs_auto2 = 0;
+module_param(cs_auto2, bool, S_IRUGO);
+MODULE_PARM_DESC(cs_auto2, " Select cs_auto for device 2");
+
+static ssize_t cs_auto2Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "auto", count-1) == 0)
+		enable_cs_auto(core, 2);
+	else
+		if (strncmp(buffer, "manual", count-1) == 0)
+			disable_cs_auto(core, 2);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t cs_auto2Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = is_cs_auto_Enabled(core, 2);
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute cs_auto2Attr = __ATTR(cs_auto2, 0664, cs_auto2Show, cs_auto2Store);
+
+// CS_AUTO3
+static bool cs_auto3 = 0;
+module_param(cs_auto3, bool, S_IRUGO);
+MODULE_PARM_DESC(cs_auto3, " Select cs_auto for device 3");
+
+static ssize_t cs_auto3Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "auto", count-1) == 0)
+		enable_cs_auto(core, 3);
+	else
+		if (strncmp(buffer, "manual", count-1) == 0)
+			disable_cs_auto(core, 3);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t cs_auto3Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = is_cs_auto_Enabled(core, 3);
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute cs_auto3Attr = __ATTR(cs_auto3, 0664, cs_auto3Show, cs_auto3Store);
+
+// CS_ENABLE0
+static bool cs_enable0 = 0;
+module_param(cs_enable0, bool, S_IRUGO);
+MODULE_PARM_DESC(cs_enable0, " Select cs_enable for device 0");
+
+static ssize_t cs_enable0Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "auto", count-1) == 0)
+		enable_cs_enable(core, 0);
+	else
+		if (strncmp(buffer, "manual", count-1) == 0)
+			disable_cs_enable(core, 0);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t cs_enable0Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = is_cs_enable(core, 0);
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute cs_enable0Attr = __ATTR(cs_enable0, 0664, cs_enable0Show, cs_enable0Store);
+
+// CS_ENABLE1
+static bool cs_enable1 = 0;
+module_param(cs_enable1, bool, S_IRUGO);
+MODULE_PARM_DESC(cs_enable1, " Select cs_enable for device 0");
+
+static ssize_t cs_enable1Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "auto", count-1) == 0)
+		enable_cs_enable(core, 1);
+	else
+		if (strncmp(buffer, "manual", count-1) == 0)
+			disable_cs_enable(core, 1);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t cs_enable1Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = is_cs_enable(core, 1);
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute cs_enable1Attr = __ATTR(cs_enable1, 0664, cs_enable1Show, cs_enable1Store);
+
+// CS_ENABLE2
+static bool cs_enable2 = 0;
+module_param(cs_enable2, bool, S_IRUGO);
+MODULE_PARM_DESC(cs_enable2, " Select cs_enable for device 0");
+
+static ssize_t cs_enable2Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "auto", count-1) == 0)
+		enable_cs_enable(core, 2);
+	else
+		if (strncmp(buffer, "manual", count-1) == 0)
+			disable_cs_enable(core, 2);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t cs_enable2Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = is_cs_enable(core, 2);
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute cs_enable2Attr = __ATTR(cs_enable2, 0664, cs_enable2Show, cs_enable2Store);
+
+// CS_ENABLE3
+static bool cs_enable3 = 0;
+module_param(cs_enable3, bool, S_IRUGO);
+MODULE_PARM_DESC(cs_enable3, " Select cs_auto for device 3");
+
+static ssize_t cs_enable3Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "auto", count-1) == 0)
+		enable_cs_enable(core, 3);
+	else
+		if (strncmp(buffer, "manual", count-1) == 0)
+			disable_cs_enable(core, 3);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t cs_enable3Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = is_cs_enable(core, 3);
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute cs_enable3Attr = __ATTR(cs_enable3, 0664, cs_enable3Show, cs_enable3Store);
+
+// WRITE TX FIFO
+static uint tx_fifo = 0;
+module_param(tx_fifo, uint, S_IRUGO);
+MODULE_PARM_DESC(tx_fifo, " Write data to Fifo");
+
+static ssize_t tx_fifoStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    	set_tx_data(core, value);
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static struct kobj_attribute tx_fifoAttr = __ATTR(tx_fifo, 0664, NULL, tx_fifoStore);
+
+// TX ONLY, words written to tx_fifo produce nothing in rx_fifo
+static bool tx_only = 0;
+module_param(tx_only, bool, S_IRUGO);
+MODULE_PARM_DESC(tx_only, " Drop the words received for tx_fifo writes");
+
+static ssize_t tx_onlyStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "on", count-1) == 0)
+		update_control(core, 1 << TX_ONLY_BIT_OFS, ~0);
+	else
+		if (strncmp(buffer, "off", count-1) == 0)
+			update_control(core, 1 << TX_ONLY_BIT_OFS, 0);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t tx_onlyShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	bool enabled;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	enabled = (core->control_shadow >> TX_ONLY_BIT_OFS) & 1;
+	mutex_unlock(&core->lock);
+    if (enabled)
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute tx_onlyAttr = __ATTR(tx_only, 0664, tx_onlyShow, tx_onlyStore);
+
+// READ RX FIFO
+static uint rx_fifo = 0;
+module_param(rx_fifo, uint, S_IRUGO);
+MODULE_PARM_DESC(rx_fifo, " Read data from Fifo");
+
+static ssize_t rx_fifoShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint value;
+	bool valid;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	valid = get_rx_data(core, &value);
+	mutex_unlock(&core->lock);
+	// An empty FIFO reads back as an empty file, zero is a valid word
+	if (!valid)
+		return 0;
+    return sprintf(buffer, "%u\n", value);
+}
+
+static struct kobj_attribute rx_fifoAttr = __ATTR(rx_fifo, 0444, rx_fifoShow, NULL);
+
+// SAMPLE_DELAY0-3 and CALIBRATE0-3
+// sample_delayN is the RX sample delay of device N in clocks; writing
+// "command expect [mask]" to calibrateN sweeps it with that frame, e.g. a
+// register read of the MCP23S08 or any word with a loopback plug, and
+// calibrateN then reads back the delay chosen (-1 if none passed) and the
+// passing delays
+
+// Device of a per-device attribute, the last character of its name
+static uint8_t attr_device(struct kobj_attribute *attr)
+{
+	const char *name = attr->attr.name;
+	return (name[strlen(name) - 1] - '0') & CS_SELECT_MASK;
+}
+
+static ssize_t sample_delayStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint clocks;
+	int result = kstrtouint(buffer, 0, &clocks);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (result == 0 && clocks <= SAMPLE_DELAY_MAX)
+		set_sample_delay(core, attr_device(attr), clocks);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t sample_delayShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	return sprintf(buffer, "%u\n", get_sample_delay(core, attr_device(attr)));
+}
+
+static ssize_t calibrateStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint8_t device = attr_device(attr);
+	u32 command, expect, mask = 0xFFFFFFFF;
+	if (sscanf(buffer, "%i %i %i", &command, &expect, &mask) < 2)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	core->calibrate_result[device] = calibrate_sample_delay(core, device, command, expect, mask, &core->calibrate_pass[device]);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t calibrateShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	uint8_t device = attr_device(attr);
+	return sprintf(buffer, "%d 0x%04x\n", core->calibrate_result[device], core->calibrate_pass[device]);
+}
+
+static struct kobj_attribute sample_delay0Attr = __ATTR(sample_delay0, 0664, sample_delayShow, sample_delayStore);
+static struct kobj_attribute sample_delay1Attr = __ATTR(sample_delay1, 0664, sample_delayShow, sample_delayStore);
+static struct kobj_attribute sample_delay2Attr = __ATTR(sample_delay2, 0664, sample_delayShow, sample_delayStore);
+static struct kobj_attribute sample_delay3Attr = __ATTR(sample_delay3, 0664, sample_delayShow, sample_delayStore);
+static struct kobj_attribute calibrate0Attr = __ATTR(calibrate0, 0664, calibrateShow, calibrateStore);
+static struct kobj_attribute calibrate1Attr = __ATTR(calibrate1, 0664, calibrateShow, calibrateStore);
+static struct kobj_attribute calibrate2Attr = __ATTR(calibrate2, 0664, calibrateShow, calibrateStore);
+static struct kobj_attribute calibrate3Attr = __ATTR(calibrate3, 0664, calibrateShow, calibrateStore);
+
+// POLL ENGINE
+// The core sends poll_command to poll_device every poll_period clocks and
+// compares the response bits in poll_mask with poll_value; poll_value
+// reads back the last changed value and can be waited on with poll() when
+// an IRQ is given; the module parameters are the settings each core starts
+// out with
+
+static uint poll_command = 0;
+module_param(poll_command, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_command, " Word sent by the poll engine");
+
+static uint poll_period = 50000;
+module_param(poll_period, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_period, " Clocks from a poll response to the next poll");
+
+static uint poll_mask = 0;
+module_param(poll_mask, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_mask, " Response bits compared by the poll engine");
+
+static uint poll_device = 0;
+module_param(poll_device, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_device, " Chip select the poll word is sent to");
+
+static void poll_isr(struct spi2_core *core)
+{
+	iowrite32(POLL_CHANGED_MASK | (ioread32(core->base + OFS_POLL_CTRL) & ~POLL_CHANGED_MASK), core->base + OFS_POLL_CTRL);
+	core->poll_value = ioread32(core->base + OFS_POLL_VALUE);
+	sysfs_notify(core->kobj, "poll", "poll_value");
+}
+
+void enable_poll(struct spi2_core *core)
+{
+	unsigned long flags;
+	iowrite32(POLL_CHANGED_MASK, core->base + OFS_POLL_CTRL);
+	iowrite32(core->poll_command, core->base + OFS_POLL_CMD);
+	iowrite32(core->poll_period, core->base + OFS_POLL_PERIOD);
+	iowrite32(core->poll_mask, core->base + OFS_POLL_MASK);
+	iowrite32(core->poll_value & core->poll_mask, core->base + OFS_POLL_VALUE);
+	iowrite32(POLL_ENABLE_MASK | ((core->poll_device & CS_SELECT_MASK) << POLL_CS_BIT_OFS), core->base + OFS_POLL_CTRL);
+	if (core->irq > 0)
+	{
+		spin_lock_irqsave(&core->xfer_lock, flags);
+		core->int_enable_poll = INT_POLL_ENABLE_MASK;
+		core->int_enable_shadow |= core->int_enable_poll;
+		iowrite32(core->int_enable_shadow, core->base + OFS_INT_ENABLE);
+		spin_unlock_irqrestore(&core->xfer_lock, flags);
+	}
+}
+
+void disable_poll(struct spi2_core *core)
+{
+	unsigned long flags;
+	iowrite32(POLL_CHANGED_MASK, core->base + OFS_POLL_CTRL);
+	if (core->irq > 0)
+	{
+		spin_lock_irqsave(&core->xfer_lock, flags);
+		core->int_enable_poll = 0;
+		core->int_enable_shadow &= ~INT_POLL_ENABLE_MASK;
+		iowrite32(core->int_enable_shadow, core->base + OFS_INT_ENABLE);
+		spin_unlock_irqrestore(&core->xfer_lock, flags);
+	}
+}
+
+bool is_poll_enabled(struct spi2_core *core)
+{
+	return (ioread32(core->base + OFS_POLL_CTRL) & POLL_ENABLE_MASK) != 0;
+}
+
+static ssize_t poll_enableStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "on", count-1) == 0)
+		enable_poll(core);
+	else
+		if (strncmp(buffer, "off", count-1) == 0)
+			disable_poll(core);
+	mutex_unlock(&core->lock);
+	return count;
+}
+
+static ssize_t poll_enableShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    if (is_poll_enabled(core))
+        strcpy(buffer, "true\n");
+    else
+        strcpy(buffer, "false\n");
+    return strlen(buffer);
+}
+
+static struct kobj_attribute poll_enableAttr = __ATTR(poll_enable, 0664, poll_enableShow, poll_enableStore);
+
+static ssize_t poll_commandStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    {
+        core->poll_command = value;
+        iowrite32(value, core->base + OFS_POLL_CMD);
+    }
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t poll_commandShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    return sprintf(buffer, "0x%x\n", core->poll_command);
+}
+
+static struct kobj_attribute poll_commandAttr = __ATTR(poll_command, 0664, poll_commandShow, poll_commandStore);
+
+static ssize_t poll_periodStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    {
+        core->poll_period = value;
+        iowrite32(value, core->base + OFS_POLL_PERIOD);
+    }
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t poll_periodShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    return sprintf(buffer, "%u\n", core->poll_period);
+}
+
+static struct kobj_attribute poll_periodAttr = __ATTR(poll_period, 0664, poll_periodShow, poll_periodStore);
+
+static ssize_t poll_maskStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    {
+        core->poll_mask = value;
+        iowrite32(value, core->base + OFS_POLL_MASK);
+    }
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t poll_maskShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    return sprintf(buffer, "0x%x\n", core->poll_mask);
+}
+
+static struct kobj_attribute poll_maskAttr = __ATTR(poll_mask, 0664, poll_maskShow, poll_maskStore);
+
+static ssize_t poll_deviceStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0 && value <= CS_SELECT_MASK)
+    {
+        core->poll_device = value;
+        if (is_poll_enabled(core))
+            enable_poll(core);
+    }
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+static ssize_t poll_deviceShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    return sprintf(buffer, "%u\n", core->poll_device);
+}
+
+static struct kobj_attribute poll_deviceAttr = __ATTR(poll_device, 0664, poll_deviceShow, poll_deviceStore);
+
+// Writing sets the reference a response is compared with
+static ssize_t poll_valueStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint value;
+    int result = kstrtouint(buffer, 0, &value);
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (result == 0)
+    {
+        core->poll_value = value;
+        iowrite32(value & core->poll_mask, core->base + OFS_POLL_VALUE);
+    }
+    mutex_unlock(&core->lock);
+    return count;
+}
+
+// Without an IRQ the change flag is checked here
+static ssize_t poll_valueShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
 {
-	cs_enable2 = is_cs_enable(2);
-    if (cs_enable2)
-        strcpy(buffer, "true\n");
-    else
-        strcpy(buffer, "false\n");
-    return strlen(buffer);
+    struct spi2_core *core = kobj_core(kobj);
+    uint ctrl, value;
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    if (core->irq <= 0)
+    {
+        ctrl = ioread32(core->base + OFS_POLL_CTRL);
+        if (ctrl & POLL_CHANGED_MASK)
+            iowrite32(ctrl, core->base + OFS_POLL_CTRL);
+        core->poll_value = ioread32(core->base + OFS_POLL_VALUE);
+    }
+    value = core->poll_value;
+    mutex_unlock(&core->lock);
+    return sprintf(buffer, "0x%x\n", value);
 }
 
-static struct kobj_attribute cs_enable2Attr = __ATTR(cs_enable2, 0664, cs_enable2Show, cs_enable2Store);
+static struct kobj_attribute poll_valueAttr = __ATTR(poll_value, 0664, poll_valueShow, poll_valueStore);
 
-// CS_ENABLE3
-static bool cs_enable3 = 0;
-module_param(cs_enable3, bool, S_IRUGO);
-MODULE_PARM_DESC(cs_enable3, " Select cs_auto for device 3");
+// SELF-TEST
+// loopback turns the internal loopback on and off; writing a frame count
+// to bist runs the self-test, which reads back "frames errors cycles";
+// writing "frames min max" to max_rate searches the smallest clean SCLK
+// period in clocks, which it reads back (0 if none was clean)
 
-static ssize_t cs_enable3Store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+static ssize_t loopbackStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
 {
-	if (strncmp(buffer, "auto", count-1) == 0)
-	{
-		enable_cs_enable(3);
-		cs_enable3 = true;
-	}
+	struct spi2_core *core = kobj_core(kobj);
+	if (mutex_lock_interruptible(&core->lock))
+		return -ERESTARTSYS;
+	if (strncmp(buffer, "on", count-1) == 0)
+		set_loopback(core, true);
 	else
-		if (strncmp(buffer, "manual", count-1) == 0)
-		{
-			disable_cs_enable(3);
-			cs_enable3 = false;
-		}
+		if (strncmp(buffer, "off", count-1) == 0)
+			set_loopback(core, false);
+	mutex_unlock(&core->lock);
 	return count;
 }
 
-static ssize_t cs_enable3Show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+static ssize_t loopbackShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
 {
-	cs_enable3 = is_cs_enable(3);
-    if (cs_enable3)
+    struct spi2_core *core = kobj_core(kobj);
+    if (is_loopback(core))
         strcpy(buffer, "true\n");
     else
         strcpy(buffer, "false\n");
     return strlen(buffer);
 }
 
-static struct kobj_attribute cs_enable3Attr = __ATTR(cs_enable3, 0664, cs_enable3Show, cs_enable3Store);
+static struct kobj_attribute loopbackAttr = __ATTR(loopback, 0664, loopbackShow, loopbackStore);
 
-// WRITE TX FIFO
-static uint tx_fifo = 0;
-module_param(tx_fifo, uint, S_IRUGO);
-MODULE_PARM_DESC(tx_fifo, " Write data to Fifo");
+static ssize_t bistStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint frames;
+    int result = kstrtouint(buffer, 0, &frames);
+    if (result != 0)
+        return result;
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    result = run_bist(core, frames, &core->bist_result);
+    mutex_unlock(&core->lock);
+    return (result == 0) ? count : result;
+}
 
-static ssize_t tx_fifoStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+static ssize_t bistShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
 {
-    int result = kstrtouint(buffer, 0, &tx_fifo);
-    if (result == 0)
-    	set_tx_data(tx_fifo);
+    struct spi2_core *core = kobj_core(kobj);
+    return sprintf(buffer, "%u %u %u\n", core->bist_result.frames, core->bist_result.errors, core->bist_result.cycles);
+}
+
+static struct kobj_attribute bistAttr = __ATTR(bist, 0664, bistShow, bistStore);
+
+static ssize_t max_rateStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    uint frames, min, max;
+    if (sscanf(buffer, "%u %u %u", &frames, &min, &max) != 3 || min < 2 || max < min)
+        return -EINVAL;
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    core->max_rate_period = find_max_rate(core, frames, min, max);
+    mutex_unlock(&core->lock);
     return count;
 }
 
-static struct kobj_attribute tx_fifoAttr = __ATTR(tx_fifo, 0664, NULL, tx_fifoStore);
+static ssize_t max_rateShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    return sprintf(buffer, "%u\n", core->max_rate_period);
+}
 
-// READ RX FIFO
-static uint rx_fifo = 0;
-module_param(rx_fifo, uint, S_IRUGO);
-MODULE_PARM_DESC(rx_fifo, " Read data from Fifo");
+static struct kobj_attribute max_rateAttr = __ATTR(max_rate, 0664, max_rateShow, max_rateStore);
 
-static ssize_t rx_fifoShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+// PERFORMANCE COUNTERS
+// One read snapshots every counter in the same clock and lists them,
+// writing "clear" restarts them
+static const char *perf_names[PERF_COUNTERS] =
+{
+    "cycles", "frames", "bits", "tx_wait", "rx_full", "tx_overflows", "rx_overflows", "cs_asserts"
+};
+
+static ssize_t countersStore(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
 {
-	rx_fifo = get_rx_data();
-    return sprintf(buffer, "%d\n", rx_fifo);
+    struct spi2_core *core = kobj_core(kobj);
+    if (strncmp(buffer, "clear", count-1) == 0)
+        iowrite32(PERF_CLEAR_MASK, core->base + OFS_PERF_CTRL);
+    return count;
 }
 
-static struct kobj_attribute rx_fifoAttr = __ATTR(rx_fifo, 0444, rx_fifoShow, NULL);
+static ssize_t countersShow(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+    struct spi2_core *core = kobj_core(kobj);
+    ssize_t length = 0;
+    int i;
+    iowrite32(PERF_SNAPSHOT_MASK, core->base + OFS_PERF_CTRL);
+    for (i = 0; i < PERF_COUNTERS; i++)
+        length += sprintf(buffer + length, "%s %u\n", perf_names[i], ioread32(core->base + OFS_PERF_CYCLES + i));
+    return length;
+}
+
+static struct kobj_attribute countersAttr = __ATTR(counters, 0664, countersShow, countersStore);
 
 //-----------------------------------------------------------------------------
 // Attributes
@@ -591,12 +2123,21 @@ static struct kobj_attribute rx_fifoAttr = __ATTR(rx_fifo, 0444, rx_fifoShow, NU
 static struct attribute *attrs0[] = {&baud_rateAttr.attr, NULL};
 static struct attribute *attrs1[] = {&word_sizeAttr.attr, NULL};
 static struct attribute *attrs2[] = {&cs_selectAttr.attr, NULL};
-static struct attribute *attrs3[] = {&mode0Attr.attr, &cs_auto0Attr.attr, &cs_enable0Attr.attr, NULL};
-static struct attribute *attrs4[] = {&mode1Attr.attr, &cs_auto1Attr.attr, &cs_enable1Attr.attr, NULL};
-static struct attribute *attrs5[] = {&mode2Attr.attr, &cs_auto2Attr.attr, &cs_enable2Attr.attr, NULL};
-static struct attribute *attrs6[] = {&mode3Attr.attr, &cs_auto3Attr.attr, &cs_enable3Attr.attr, NULL};
-static struct attribute *attrs7[] = {&tx_fifoAttr.attr, NULL};
+static struct attribute *attrs3[] = {&mode0Attr.attr, &cs_auto0Attr.attr, &cs_enable0Attr.attr,
+                                     &sample_delay0Attr.attr, &calibrate0Attr.attr, NULL};
+static struct attribute *attrs4[] = {&mode1Attr.attr, &cs_auto1Attr.attr, &cs_enable1Attr.attr,
+                                     &sample_delay1Attr.attr, &calibrate1Attr.attr, NULL};
+static struct attribute *attrs5[] = {&mode2Attr.attr, &cs_auto2Attr.attr, &cs_enable2Attr.attr,
+                                     &sample_delay2Attr.attr, &calibrate2Attr.attr, NULL};
+static struct attribute *attrs6[] = {&mode3Attr.attr, &cs_auto3Attr.attr, &cs_enable3Attr.attr,
+                                     &sample_delay3Attr.attr, &calibrate3Attr.attr, NULL};
+static struct attribute *attrs7[] = {&tx_fifoAttr.attr, &tx_onlyAttr.attr, NULL};
 static struct attribute *attrs8[] = {&rx_fifoAttr.attr, NULL};
+static struct attribute *attrs9[] = {&streamAttr.attr, NULL};
+static struct attribute *attrs10[] = {&poll_enableAttr.attr, &poll_commandAttr.attr, &poll_periodAttr.attr,
+                                      &poll_maskAttr.attr, &poll_deviceAttr.attr, &poll_valueAttr.attr, NULL};
+static struct attribute *attrs11[] = {&countersAttr.attr, NULL};
+static struct attribute *attrs12[] = {&loopbackAttr.attr, &bistAttr.attr, &max_rateAttr.attr, NULL};
 
 static struct attribute_group group0 =
 {
@@ -652,69 +2193,864 @@ static struct attribute_group group8 =
     .attrs = attrs8
 };
 
-static struct kobject *kobj;
+static struct attribute_group group9 =
+{
+    .name = "stream",
+    .attrs = attrs9
+};
+
+static struct attribute_group group10 =
+{
+    .name = "poll",
+    .attrs = attrs10
+};
+
+static struct attribute_group group11 =
+{
+    .name = "perf",
+    .attrs = attrs11
+};
+
+static struct attribute_group group12 =
+{
+    .name = "selftest",
+    .attrs = attrs12
+};
 
 //-----------------------------------------------------------------------------
-// Initialization and Exit
+// Character device
 //-----------------------------------------------------------------------------
 
-static int __init initialize_module(void)
+// Shifts the words and keeps what was received for read()
+// Received words that do not fit in the buffer are dropped
+// A failed chunk ends the write, its error is returned only when no chunk
+// before it was transferred
+static ssize_t spi_chr_write(struct file *file, const char __user *buffer, size_t count, loff_t *ppos)
+{
+    struct spi2_core *core = container_of(file->private_data, struct spi2_core, misc);
+    size_t words = count / sizeof(u32), done = 0, n;
+    int result = 0;
+    if (words == 0)
+        return 0;
+    if (count % sizeof(u32))
+        return -EINVAL;
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    while (done < words && !result)
+    {
+        n = min_t(size_t, words - done, core->chunk_words);
+        if (copy_from_user(core->tx_chunk, buffer + done * sizeof(u32), n * sizeof(u32)))
+            result = -EFAULT;
+        else
+            result = transfer_words(core, core->tx_chunk, core->rx_chunk, n);
+        if (result)
+            break;
+        kfifo_in(&core->rx_words, core->rx_chunk, n);
+        done += n;
+    }
+    mutex_unlock(&core->lock);
+    return done ? done * sizeof(u32) : result;
+}
+
+static ssize_t spi_chr_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos)
 {
+    struct spi2_core *core = container_of(file->private_data, struct spi2_core, misc);
+    unsigned int copied;
     int result;
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    result = kfifo_to_user(&core->rx_words, buffer, count - count % sizeof(u32), &copied);
+    mutex_unlock(&core->lock);
+    return result ? result : copied;
+}
 
-    printk(KERN_INFO "SPI driver: starting\n");
+// Gives each device its own word size, mode, auto CS and baud rate bank,
+// so switching devices costs no CONTROL or BRD write
+static bool banked = 0;
+module_param(banked, bool, S_IRUGO);
+MODULE_PARM_DESC(banked, " Use the per-device configuration banks");
+
+// Updates the bank of desc->cs, a single write when anything changed
+static void xfer_bank(struct spi2_core *core, struct spi_xfer_desc *desc)
+{
+    uint cfg = core->cs_cfg_shadow[desc->cs];
+    if (desc->word_size)
+        cfg = (cfg & ~WORDSIZE_MASK) | (desc->word_size - 1);
+    if (desc->baud_rate)
+        cfg = (cfg & ~(CS_CFG_BRD_MASK << CS_CFG_BRD_BIT_OFS))
+            | ((desc->baud_rate & CS_CFG_BRD_MASK) << CS_CFG_BRD_BIT_OFS);
+    cfg = (cfg & ~((DEVICE_MODE_MASK << CS_CFG_MODE_BIT_OFS) | (1 << CS_CFG_AUTO_BIT_OFS)))
+        | ((desc->mode & DEVICE_MODE_MASK) << CS_CFG_MODE_BIT_OFS)
+        | (desc->cs_auto ? 1 << CS_CFG_AUTO_BIT_OFS : 0);
+    set_cs_cfg(core, desc->cs, cfg);
+    core->tx_cs = desc->cs;
+}
+
+// Dual and quad transfers, by PIO: IO_MODE is written between the pushes of
+// the two phases, the core keeps the mode of every word it was pushed with
+// A read gives up with -ETIMEDOUT when the words stop arriving
+static long xfer_io(struct spi2_core *core, struct spi_xfer_desc *desc, u32 __user *tx, u32 __user *rx)
+{
+    u32 io = ((desc->io_lines == 4) ? IO_QUAD : IO_DUAL) | (rx ? IO_READ_MASK : 0);
+    bool was_tx_only = (core->control_shadow >> TX_ONLY_BIT_OFS) & 1;
+    size_t done = 0, received = 0, count = desc->len - desc->cmd_len, n, got;
+    unsigned long deadline = jiffies + dma_timeout(core->fifo_depth);
+    long result = 0;
+    int stalled = 0;
+
+    if (copy_from_user(core->tx_chunk, tx, desc->cmd_len * sizeof(u32)))
+        return -EFAULT;
+
+    if (!rx)
+    {
+        // The words received on one line and on a write are dropped
+        if (!was_tx_only)
+            update_control(core, 1 << TX_ONLY_BIT_OFS, ~0);
+        result = write_words(core, core->tx_chunk, desc->cmd_len);
+        iowrite32(io, core->base + OFS_IO_MODE);
+        while (done < count && !result)
+        {
+            n = min_t(size_t, count - done, core->chunk_words);
+            if (copy_from_user(core->tx_chunk, tx + desc->cmd_len + done, n * sizeof(u32)))
+                result = -EFAULT;
+            else
+                result = write_words(core, core->tx_chunk, n);
+            done += n;
+        }
+        iowrite32(IO_SINGLE, core->base + OFS_IO_MODE);
+        if (wait_idle(core) && !result)
+            result = -ETIMEDOUT;
+        if (!was_tx_only)
+            update_control(core, 1 << TX_ONLY_BIT_OFS, 0);
+        return result;
+    }
+
+    // The command words are pushed ahead of the fill generator, their
+    // received words are discarded
+    if (was_tx_only)
+    {
+        wait_idle(core);
+        update_control(core, 1 << TX_ONLY_BIT_OFS, 0);
+    }
+    flush_rx(core);
+    update_control(core, 1 << RX_ONLY_BIT_OFS, ~0);
+    iowrite32(0, core->base + OFS_XFER_FILL);
+    for (n = 0; n < desc->cmd_len; n++)
+        push_tx(core, core->tx_chunk[n]);
+    iowrite32(io, core->base + OFS_IO_MODE);
+    iowrite32(count, core->base + OFS_XFER_LEN);
+    while (received < desc->cmd_len && !stalled)
+    {
+        got = read_rx_words(core, NULL, desc->cmd_len - received);
+        received += got;
+        stalled = fifo_stalled(core, got, &deadline);
+    }
+
+    // A failed copy still drains the rest, so no words are left behind;
+    // a stalled core leaves them to the flush of the next transfer
+    while (done < count && !stalled)
+    {
+        n = min_t(size_t, count - done, core->chunk_words);
+        for (received = 0; received < n && !stalled; received += got)
+        {
+            got = read_rx_words(core, core->rx_chunk + received, n - received);
+            if (received + got < n)
+                stalled = fifo_stalled(core, got, &deadline);
+        }
+        if (!stalled && !result && copy_to_user(rx + desc->cmd_len + done, core->rx_chunk, n * sizeof(u32)))
+            result = -EFAULT;
+        done += n;
+    }
+    if (stalled)
+    {
+        iowrite32(0, core->base + OFS_XFER_LEN);
+        result = stalled;
+    }
+    iowrite32(IO_SINGLE, core->base + OFS_IO_MODE);
+    update_control(core, 1 << RX_ONLY_BIT_OFS, 0);
+    if (was_tx_only)
+        update_control(core, 1 << TX_ONLY_BIT_OFS, ~0);
+    return result;
+}
+
+static long spi_xfer(struct spi2_core *core, struct spi_xfer_desc *desc)
+{
+    u32 __user *tx = (u32 __user *)(uintptr_t)desc->tx_buf;
+    u32 __user *rx = (u32 __user *)(uintptr_t)desc->rx_buf;
+    size_t done = 0, n;
+    int result;
+    struct spi_field fields[] =
+    {
+        {CS_SELECT_MASK << CS_SELECT_BIT_OFS, desc->cs << CS_SELECT_BIT_OFS},
+        {DEVICE_MODE_MASK << (DEVICE_MODE_BIT_OFS + 2*desc->cs), desc->mode << (DEVICE_MODE_BIT_OFS + 2*desc->cs)},
+        {1 << (desc->cs + CS_AUTO_BIT_OFS), desc->cs_auto ? ~0 : 0},
+        {WORDSIZE_MASK, desc->word_size - 1}
+    };
+
+    if (desc->cs > CS_SELECT_MASK || desc->word_size > 32)
+        return -EINVAL;
+    if (desc->io_lines > 1 && ((desc->io_lines != 2 && desc->io_lines != 4) || !tx
+        || desc->cmd_len > desc->len || (rx && desc->cmd_len > core->fifo_depth) || desc->cmd_len > core->chunk_words))
+        return -EINVAL;
+
+    // Device settings cost one CONTROL write (and one BRD write if changed),
+    // or one bank write only if changed in banked mode
+    if (is_banked(core))
+        xfer_bank(core, desc);
+    else
+    {
+        apply_control(core, fields, desc->word_size ? ARRAY_SIZE(fields) : ARRAY_SIZE(fields) - 1);
+        if (desc->baud_rate && desc->baud_rate != core->brd_shadow)
+            set_baud_rate(core, desc->baud_rate);
+    }
+
+    if (desc->io_lines > 1)
+        return xfer_io(core, desc, tx, rx);
+
+    while (done < desc->len)
+    {
+        n = min_t(size_t, desc->len - done, core->chunk_words);
+        if (tx && copy_from_user(core->tx_chunk, tx + done, n * sizeof(u32)))
+            return -EFAULT;
+        result = transfer_words(core, tx ? core->tx_chunk : NULL, rx ? core->rx_chunk : NULL, n);
+        if (result)
+            return result;
+        if (rx && copy_to_user(rx + done, core->rx_chunk, n * sizeof(u32)))
+            return -EFAULT;
+        done += n;
+    }
+    return 0;
+}
+
+// The program is bounced through tx_chunk, which holds more than the
+// largest sequencer RAM
+static long spi_seq(struct spi2_core *core, struct spi_seq_desc *desc)
+{
+    u32 __user *program = (u32 __user *)(uintptr_t)desc->program;
+    int result, i;
+
+    if (core->seq_depth == 0)
+        return -ENODEV;
+    if (desc->addr + desc->len > core->seq_depth || desc->start >= core->seq_depth)
+        return -EINVAL;
+    if (desc->len)
+    {
+        if (copy_from_user(core->tx_chunk, program, desc->len * sizeof(u32)))
+            return -EFAULT;
+        load_sequence(core, desc->addr, core->tx_chunk, desc->len);
+    }
+    for (i = 0; i < SEQ_REGS; i++)
+        iowrite32(desc->regs[i], core->base + OFS_SEQ_R0 + i);
+    result = run_sequence(core, desc->start);
+    for (i = 0; i < SEQ_REGS; i++)
+        desc->regs[i] = ioread32(core->base + OFS_SEQ_R0 + i);
+    return result;
+}
+
+static long spi_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct spi2_core *core = container_of(file->private_data, struct spi2_core, misc);
+    struct spi_xfer_desc desc;
+    struct spi_seq_desc seq;
+    long result;
+    if (cmd == SPI_IOC_SEQ)
+    {
+        if (copy_from_user(&seq, (void __user *)arg, sizeof(seq)))
+            return -EFAULT;
+        if (mutex_lock_interruptible(&core->lock))
+            return -ERESTARTSYS;
+        result = spi_seq(core, &seq);
+        mutex_unlock(&core->lock);
+        if (copy_to_user((void __user *)arg, &seq, sizeof(seq)))
+            return -EFAULT;
+        return result;
+    }
+    if (cmd != SPI_IOC_XFER)
+        return -ENOTTY;
+    if (copy_from_user(&desc, (void __user *)arg, sizeof(desc)))
+        return -EFAULT;
+    if (mutex_lock_interruptible(&core->lock))
+        return -ERESTARTSYS;
+    result = spi_xfer(core, &desc);
+    mutex_unlock(&core->lock);
+    return result;
+}
+
+static const struct file_operations spi_fops =
+{
+    .owner = THIS_MODULE,
+    .read = spi_chr_read,
+    .write = spi_chr_write,
+    .unlocked_ioctl = spi_ioctl,
+    .llseek = no_llseek,
+};
+
+//-----------------------------------------------------------------------------
+// SPI controller
+//-----------------------------------------------------------------------------
+
+// BRD is the SCLK period in 1/64 clocks of the serial clock, the system
+// clock or, for cores built with SPI_CLOCK_ASYNC, spi_clk at the rate in the
+// clock-frequency property of the device node, spi_clock without one
+#define SYSTEM_CLOCK 50000000
+#define BRD_FRACTION_BITS 6
+
+static uint spi_clock = 125000000;
+module_param(spi_clock, uint, S_IRUGO);
+MODULE_PARM_DESC(spi_clock, " spi_clk rate in Hz of cores built with SPI_CLOCK_ASYNC");
+
+// A cs_change between transfers holds the chip select off this long
+#define CS_CHANGE_USECS 1
+
+static uint speed_brd(struct spi2_core *core, u32 speed_hz)
+{
+	return DIV_ROUND_UP_ULL((u64)core->serial_clock << BRD_FRACTION_BITS, speed_hz);
+}
+
+// The SPI core keeps words of up to 8, 16 and 32 bits in 1, 2 and 4 bytes
+static size_t word_bytes(uint8_t bits)
+{
+	return (bits <= 8) ? 1 : (bits <= 16) ? 2 : 4;
+}
+
+static void unpack_words(u32 *words, const void *buffer, size_t count, size_t bytes)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+		words[i] = (bytes == 1) ? ((const u8 *)buffer)[i]
+		         : (bytes == 2) ? ((const u16 *)buffer)[i] : ((const u32 *)buffer)[i];
+}
+
+static void pack_words(void *buffer, const u32 *words, size_t count, size_t bytes)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		if (bytes == 1)
+			((u8 *)buffer)[i] = words[i];
+		else if (bytes == 2)
+			((u16 *)buffer)[i] = words[i];
+		else
+			((u32 *)buffer)[i] = words[i];
+	}
+}
+
+// Streams one spi_transfer through the FIFOs (or the DMA master) in chunks
+// of chunk_words; dual and quad transfers are half duplex and set IO_MODE
+// for all of their words
+static int controller_transfer(struct spi2_core *core, struct spi_transfer *t)
+{
+	uint8_t bits = t->bits_per_word;
+	uint8_t lines = max(t->tx_nbits, t->rx_nbits);
+	size_t bytes = word_bytes(bits), count = t->len / bytes, done = 0, n;
+	u32 io = IO_SINGLE;
+	int result = 0;
+
+	if (lines > 1)
+	{
+		if ((t->tx_buf && t->rx_buf) || bits % lines)
+			return -EINVAL;
+		io = ((lines == 4) ? IO_QUAD : IO_DUAL) | (t->rx_buf ? IO_READ_MASK : 0);
+	}
+	update_control(core, WORDSIZE_MASK, bits - 1);
+	if (t->speed_hz && speed_brd(core, t->speed_hz) != core->brd_shadow)
+		set_baud_rate(core, speed_brd(core, t->speed_hz));
+	if (io != IO_SINGLE)
+		iowrite32(io, core->base + OFS_IO_MODE);
+
+	while (done < count)
+	{
+		n = min_t(size_t, count - done, core->chunk_words);
+		if (t->tx_buf)
+			unpack_words(core->tx_chunk, (const u8 *)t->tx_buf + done * bytes, n, bytes);
+		result = transfer_words(core, t->tx_buf ? core->tx_chunk : NULL, t->rx_buf ? core->rx_chunk : NULL, n);
+		if (result)
+			break;
+		if (t->rx_buf)
+			pack_words((u8 *)t->rx_buf + done * bytes, core->rx_chunk, n, bytes);
+		done += n;
+	}
+
+	if (io != IO_SINGLE)
+		iowrite32(IO_SINGLE, core->base + OFS_IO_MODE);
+	return result;
+}
+
+// The chip select is held by hand for the whole message, so the frames of
+// consecutive transfers run back to back; CONTROL, BRD and the banked TX
+// device are put back for the sysfs and /dev/spiN users afterwards
+static int controller_transfer_one_message(struct spi_controller *ctlr, struct spi_message *msg)
+{
+	struct spi2_core *core = spi_controller_get_devdata(ctlr);
+	struct spi_device *spi = msg->spi;
+	struct spi_transfer *t;
+	uint8_t cs = spi->chip_select;
+	uint saved_control, saved_brd;
+	int saved_tx_cs, result = 0;
+	struct spi_field fields[] =
+	{
+		{1 << CHIP_ENABLE_BIT_OFS, ~0},
+		{1u << BANKED_BIT_OFS, 0},
+		{CS_SELECT_MASK << CS_SELECT_BIT_OFS, cs << CS_SELECT_BIT_OFS},
+		{DEVICE_MODE_MASK << (DEVICE_MODE_BIT_OFS + 2*cs), (spi->mode & DEVICE_MODE_MASK) << (DEVICE_MODE_BIT_OFS + 2*cs)},
+		{1 << (cs + CS_AUTO_BIT_OFS), 0}
+	};
+
+	mutex_lock(&core->lock);
+	saved_control = core->control_shadow;
+	saved_brd = core->brd_shadow;
+	saved_tx_cs = core->tx_cs;
+	core->tx_cs = -1;
+
+	// The mode is set before the chip select asserts, SCLK idles at CPOL
+	apply_control(core, fields, ARRAY_SIZE(fields));
+	enable_cs_enable(core, cs);
+
+	list_for_each_entry(t, &msg->transfers, transfer_list)
+	{
+		result = controller_transfer(core, t);
+		if (result)
+			break;
+		msg->actual_length += t->len;
+		if (t->delay_usecs)
+			udelay(t->delay_usecs);
+		// The chip select is released after the last transfer anyway
+		if (t->cs_change && !list_is_last(&t->transfer_list, &msg->transfers))
+		{
+			disable_cs_enable(core, cs);
+			udelay(CS_CHANGE_USECS);
+			enable_cs_enable(core, cs);
+		}
+	}
+
+	write_control(core, saved_control);
+	if (core->brd_shadow != saved_brd)
+		set_baud_rate(core, saved_brd);
+	core->tx_cs = saved_tx_cs;
+	mutex_unlock(&core->lock);
+
+	msg->status = result;
+	spi_finalize_current_message(ctlr);
+	return result;
+}
 
-    // Create qe directory under /sys/kernel
-    kobj = kobject_create_and_add("spi", kernel_kobj);
-    if (!kobj)
+// node holds the SPI devices of the bus, NULL for none
+static int register_controller(struct spi2_core *core, struct device *dev, struct device_node *node)
+{
+	int result;
+
+	core->controller = spi_alloc_master(dev, 0);
+	if (core->controller == NULL)
+		return -ENOMEM;
+	core->controller->dev.of_node = node;
+	core->controller->bus_num = -1;
+	core->controller->num_chipselect = 4;
+	core->controller->mode_bits = SPI_CPOL | SPI_CPHA | SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL | SPI_RX_QUAD;
+	core->controller->bits_per_word_mask = SPI_BPW_RANGE_MASK(1, 32);
+	core->controller->max_speed_hz = core->serial_clock / 2;
+	core->controller->min_speed_hz = DIV_ROUND_UP_ULL((u64)core->serial_clock << BRD_FRACTION_BITS, 0xFFFFFFFF);
+	core->controller->transfer_one_message = controller_transfer_one_message;
+	spi_controller_set_devdata(core->controller, core);
+
+	result = spi_register_controller(core->controller);
+	if (result != 0)
+	{
+		spi_controller_put(core->controller);
+		core->controller = NULL;
+	}
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// Initialization and Exit
+//-----------------------------------------------------------------------------
+
+static void free_dma_buffers(struct spi2_core *core)
+{
+    if (core->dma_tx_buffer != NULL)
+        dma_free_coherent(core->dma_dev, DMA_CHUNK_WORDS * sizeof(u32), core->dma_tx_buffer, core->dma_tx_handle);
+    if (core->dma_rx_buffer != NULL)
+        dma_free_coherent(core->dma_dev, DMA_CHUNK_WORDS * sizeof(u32), core->dma_rx_buffer, core->dma_rx_handle);
+    core->dma_tx_buffer = NULL;
+    core->dma_rx_buffer = NULL;
+}
+
+// Sets up the core whose registers are at start, shared when its IRQ line
+// is shared with the other channels of an spi2_mc block; the SPI devices
+// under node are added to its bus
+static struct spi2_core *probe_core(struct platform_device *pdev, resource_size_t start, bool shared,
+                                    struct device_node *node)
+{
+    struct spi2_core *core;
+    int index, result;
+
+    // Cores are numbered in probe order, the first one keeps the names
+    // /sys/kernel/spi and /dev/spi0
+    for (index = 0; index < SPI2_MAX_CORES && cores[index] != NULL; index++)
+        ;
+    if (index == SPI2_MAX_CORES)
+        return ERR_PTR(-EBUSY);
+    core = devm_kzalloc(&pdev->dev, sizeof(*core), GFP_KERNEL);
+    if (core == NULL)
+        return ERR_PTR(-ENOMEM);
+    core->index = index;
+    snprintf(core->name, sizeof(core->name), "spi%d", index);
+    core->tx_cs = -1;
+    core->fifo_depth = FIFO_DEPTH;
+    for (result = 0; result < 4; result++)
+        core->calibrate_result[result] = -1;
+    core->poll_command = poll_command;
+    core->poll_period = poll_period;
+    core->poll_mask = poll_mask;
+    core->poll_device = poll_device;
+    core->xfer.lanes = 1;
+    core->tx_chunk = core->pio_tx_chunk;
+    core->rx_chunk = core->pio_rx_chunk;
+    core->chunk_words = CHUNK_WORDS;
+    mutex_init(&core->lock);
+    spin_lock_init(&core->xfer_lock);
+    INIT_KFIFO(core->rx_words);
+    core->misc.minor = MISC_DYNAMIC_MINOR;
+    core->misc.name = core->name;
+    core->misc.fops = &spi_fops;
+    core->misc.parent = &pdev->dev;
+    cores[index] = core;
+
+    // Create spi directory under /sys/kernel, spiN for the later cores
+    core->kobj = kobject_create_and_add(index ? core->name : "spi", kernel_kobj);
+    if (!core->kobj)
     {
         printk(KERN_ALERT "SPI driver: failed to create and add kobj\n");
-        return -ENOENT;
+        result = -ENOENT;
+        goto free_index;
     }
 
-    // Create baudrate, word_size, cs_select, spi0, spi1, spi2 and spi3 groups
-    result = sysfs_create_group(kobj, &group0);
+    // Create baudrate, word_size, cs_select, spi0-spi3, tx_data, rx_data, stream, poll and perf groups
+    result = sysfs_create_group(core->kobj, &group0);
     if (result !=0)
-        return result;
-    result = sysfs_create_group(kobj, &group1);
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group1);
     if (result !=0)
-        return result;
-    result = sysfs_create_group(kobj, &group2);
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group2);
     if (result !=0)
-        return result;
-    result = sysfs_create_group(kobj, &group3);
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group3);
     if (result !=0)
-        return result;
-    result = sysfs_create_group(kobj, &group4);
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group4);
     if (result !=0)
-        return result;
-    result = sysfs_create_group(kobj, &group5);
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group5);
     if (result !=0)
-        return result;
-    result = sysfs_create_group(kobj, &group6);
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group6);
     if (result !=0)
-        return result;
-    result = sysfs_create_group(kobj, &group7);
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group7);
     if (result !=0)
-        return result;
-    result = sysfs_create_group(kobj, &group8);
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group8);
     if (result !=0)
-        return result;
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group9);
+    if (result !=0)
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group10);
+    if (result !=0)
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group11);
+    if (result !=0)
+        goto put_kobj;
+    result = sysfs_create_group(core->kobj, &group12);
+    if (result !=0)
+        goto put_kobj;
 
     // Physical to virtual memory map to access gpio registers
-    base = (unsigned int*)ioremap_nocache(LW_BRIDGE_BASE + SPI_BASE_OFFSET, SPAN_IN_BYTES);
-    if (base == NULL)
+    core->base = (unsigned int*)ioremap_nocache(start, SPAN_IN_BYTES);
+    if (core->base == NULL)
+    {
+        result = -ENODEV;
+        goto put_kobj;
+    }
+
+    // Seed the shadow registers, later reads never touch the bus
+    core->control_shadow = ioread32(core->base + OFS_CONTROL);
+    core->brd_shadow = ioread32(core->base + OFS_BRD);
+    for (result = 0; result < 4; result++)
+        core->cs_cfg_shadow[result] = ioread32(core->base + OFS_CS_CFG0 + result);
+    core->sample_delay_shadow = ioread32(core->base + OFS_SAMPLE_DELAY);
+    result = (ioread32(core->base + OFS_STATUS) >> DEPTH_LOG2_BIT_OFS) & DEPTH_LOG2_MASK;
+    if (result)
+        core->fifo_depth = 1 << result;
+    core->serial_clock = SYSTEM_CLOCK;
+    if ((ioread32(core->base + OFS_STATUS) & ASYNC_CLOCK_MASK)
+        && of_property_read_u32(pdev->dev.of_node, "clock-frequency", &core->serial_clock) != 0)
+        core->serial_clock = spi_clock;
+    result = (ioread32(core->base + OFS_SEQ_CTRL) >> SEQ_DEPTH_LOG2_BIT_OFS) & DEPTH_LOG2_MASK;
+    if (result)
+        core->seq_depth = 1 << result;
+
+    // Seed every bank from CONTROL and BRD so banked mode starts out with
+    // the legacy settings
+    if (tx_only)
+        update_control(core, 1 << TX_ONLY_BIT_OFS, ~0);
+    if (banked)
+    {
+        for (result = 0; result < 4; result++)
+            set_cs_cfg(core, result, (core->control_shadow & WORDSIZE_MASK)
+                       | (get_device_mode(core, result) << CS_CFG_MODE_BIT_OFS)
+                       | (is_cs_auto_Enabled(core, result) << CS_CFG_AUTO_BIT_OFS)
+                       | ((core->brd_shadow & CS_CFG_BRD_MASK) << CS_CFG_BRD_BIT_OFS));
+        update_control(core, 1u << BANKED_BIT_OFS, ~0);
+    }
+
+    // Service the FIFOs from the interrupt handler when an IRQ is given
+    init_completion(&core->xfer.done);
+    init_completion(&core->dma_done);
+    init_completion(&core->seq_done);
+    core->irq = irq[index];
+    if (core->irq == 0 && platform_get_resource(pdev, IORESOURCE_IRQ, 0) != NULL)
+        core->irq = max(platform_get_irq(pdev, 0), 0);
+    if (core->irq > 0)
+    {
+        xfer_enable(core, 0);
+        result = request_irq(core->irq, spi_isr, shared ? IRQF_SHARED : 0, core->name, core);
+        if (result != 0)
+        {
+            printk(KERN_ALERT "SPI driver: failed to request irq %d\n", core->irq);
+            goto unmap;
+        }
+    }
+
+    // Create /dev/spiN for bulk transfers
+    result = misc_register(&core->misc);
+    if (result != 0)
+    {
+        printk(KERN_ALERT "SPI driver: failed to register /dev/%s\n", core->name);
+        goto release_irq;
+    }
+
+    // Bulk transfers go through the DMA master when the core has one, the
+    // chunks then live in coherent memory the master can reach
+    if (dma && (ioread32(core->base + OFS_STATUS) & DMA_PRESENT_MASK))
+    {
+        core->dma_dev = &pdev->dev;
+        dma_set_coherent_mask(core->dma_dev, DMA_BIT_MASK(32));
+        core->dma_tx_buffer = dma_alloc_coherent(core->dma_dev, DMA_CHUNK_WORDS * sizeof(u32),
+                                                 &core->dma_tx_handle, GFP_KERNEL);
+        core->dma_rx_buffer = dma_alloc_coherent(core->dma_dev, DMA_CHUNK_WORDS * sizeof(u32),
+                                                 &core->dma_rx_handle, GFP_KERNEL);
+        if (core->dma_tx_buffer != NULL && core->dma_rx_buffer != NULL)
+        {
+            core->tx_chunk = core->dma_tx_buffer;
+            core->rx_chunk = core->dma_rx_buffer;
+            core->chunk_words = DMA_CHUNK_WORDS;
+        }
+        else
+        {
+            printk(KERN_ALERT "SPI driver: no DMA buffers, using programmed I/O\n");
+            free_dma_buffers(core);
+        }
+    }
+
+    // SPI core devices share the FIFOs and chunks set up above
+    result = register_controller(core, &pdev->dev, node);
+    if (result != 0)
+    {
+        printk(KERN_ALERT "SPI driver: failed to register the SPI controller\n");
+        goto deregister_misc;
+    }
+
+    printk(KERN_INFO "SPI driver: %s initialized\n", core->name);
+
+    return core;
+
+    // Undo the steps that succeeded, the devm allocation goes with pdev
+deregister_misc:
+    misc_deregister(&core->misc);
+    free_dma_buffers(core);
+release_irq:
+    if (core->irq > 0)
+        free_irq(core->irq, core);
+unmap:
+    iounmap(core->base);
+put_kobj:
+    kobject_put(core->kobj);
+free_index:
+    cores[index] = NULL;
+    return ERR_PTR(result);
+}
+
+// The SPI controller and /dev/spiN go first, so no transfer is left
+// running on the buffers and IRQ released after them
+static void remove_core(struct spi2_core *core)
+{
+    spi_unregister_controller(core->controller);
+    core->controller = NULL;
+    misc_deregister(&core->misc);
+    disable_poll(core);
+    if (core->irq > 0)
+    {
+        xfer_enable(core, 0);
+        free_irq(core->irq, core);
+    }
+    free_dma_buffers(core);
+    kobject_put(core->kobj);
+    cores[core->index] = NULL;
+    iounmap(core->base);
+    printk(KERN_INFO "SPI driver: %s exit\n", core->name);
+}
+
+static void remove_cores(struct spi2_core *core)
+{
+    struct spi2_core *next;
+    for (; core != NULL; core = next)
+    {
+        next = core->next;
+        remove_core(core);
+    }
+}
+
+static int spi2_probe(struct platform_device *pdev)
+{
+    struct spi2_core *first = NULL, **link = &first;
+    struct resource *res;
+    unsigned int *shared;
+    uint channels = 1, n;
+
+    printk(KERN_INFO "SPI driver: starting\n");
+
+    res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+    if (res == NULL)
         return -ENODEV;
 
-    printk(KERN_INFO "SPI driver: initialized\n");
+    // An spi2_mc block reports its channels in the shared block, channel n
+    // has the spi2 registers SPAN_IN_BYTES * n bytes in
+    if (resource_size(res) >= MC_SPAN_IN_BYTES)
+    {
+        shared = (unsigned int*)ioremap_nocache(res->start, MC_SPAN_IN_BYTES);
+        if (shared == NULL)
+            return -ENODEV;
+        channels = (ioread32(shared + OFS_MC_STATUS) >> MC_CHANNELS_BIT_OFS) & MC_CHANNELS_MASK;
+        iowrite32(MC_IRQ_MASK, shared + OFS_MC_INT_ENABLE);
+        iounmap(shared);
+        if (channels == 0 || channels > MC_MAX_CHANNELS)
+            return -ENODEV;
+    }
+
+    for (n = 0; n < channels; n++)
+    {
+        // The device tree node describes a single bus, so only channel 0
+        // creates its SPI devices
+        *link = probe_core(pdev, res->start + n * SPAN_IN_BYTES, channels > 1,
+                           (n == 0) ? pdev->dev.of_node : NULL);
+        if (IS_ERR(*link))
+        {
+            int result = PTR_ERR(*link);
+            *link = NULL;
+            remove_cores(first);
+            return result;
+        }
+        link = &(*link)->next;
+    }
+    platform_set_drvdata(pdev, first);
+    return 0;
+}
+
+static int spi2_remove(struct platform_device *pdev)
+{
+    remove_cores(platform_get_drvdata(pdev));
+    return 0;
+}
+
+#define SPI2_NAME "spi2"
+#define SPI2_COMPATIBLE "de1soc,spi2"
+#define SPI2_MC_COMPATIBLE "de1soc,spi2-mc"
+
+// Cores registered when the device tree has no spi2 node, by light-weight
+// bridge offset
+static uint offset[SPI2_MAX_CORES] = {SPI_BASE_OFFSET};
+static int offset_count = 1;
+module_param_array(offset, uint, &offset_count, S_IRUGO);
+MODULE_PARM_DESC(offset, " Light-weight bridge offsets of the cores without a device tree");
+
+// The cores at offset are spi2_mc blocks
+static bool multichannel = false;
+module_param(multichannel, bool, S_IRUGO);
+MODULE_PARM_DESC(multichannel, " Cores without a device tree are spi2_mc blocks (default: false)");
+
+static const struct of_device_id spi2_of_match[] =
+{
+    {.compatible = SPI2_COMPATIBLE},
+    {.compatible = SPI2_MC_COMPATIBLE},
+    {}
+};
+MODULE_DEVICE_TABLE(of, spi2_of_match);
+
+static struct platform_driver spi2_driver =
+{
+    .probe = spi2_probe,
+    .remove = spi2_remove,
+    .driver =
+    {
+        .name = SPI2_NAME,
+        .of_match_table = spi2_of_match,
+    },
+};
+
+// Stand in for the device tree nodes on images that have none
+static struct platform_device *spi2_fallback[SPI2_MAX_CORES];
+
+static void unregister_fallbacks(void)
+{
+    int i;
+    for (i = 0; i < SPI2_MAX_CORES; i++)
+    {
+        if (spi2_fallback[i] != NULL)
+            platform_device_unregister(spi2_fallback[i]);
+        spi2_fallback[i] = NULL;
+    }
+}
+
+static int __init initialize_module(void)
+{
+    struct device_node *node;
+    int result, i;
+
+    result = platform_driver_register(&spi2_driver);
+    if (result != 0)
+        return result;
 
+    node = of_find_compatible_node(NULL, NULL, SPI2_COMPATIBLE);
+    if (node == NULL)
+        node = of_find_compatible_node(NULL, NULL, SPI2_MC_COMPATIBLE);
+    if (node != NULL)
+    {
+        of_node_put(node);
+        return 0;
+    }
+    for (i = 0; i < offset_count; i++)
+    {
+        struct resource res = DEFINE_RES_MEM(LW_BRIDGE_BASE + offset[i],
+                                              multichannel ? MC_SPAN_IN_BYTES : SPAN_IN_BYTES);
+        spi2_fallback[i] = platform_device_register_simple(SPI2_NAME, i, &res, 1);
+        if (IS_ERR(spi2_fallback[i]))
+        {
+            result = PTR_ERR(spi2_fallback[i]);
+            spi2_fallback[i] = NULL;
+            unregister_fallbacks();
+            platform_driver_unregister(&spi2_driver);
+            return result;
+        }
+    }
     return 0;
 }
 
 static void __exit exit_module(void)
 {
-    kobject_put(kobj);
-    printk(KERN_INFO "SPI driver: exit\n");
+    unregister_fallbacks();
+    platform_driver_unregister(&spi2_driver);
 }
 
 module_init(initialize_module);
@@ -19,100 +19,107 @@
 
 #include <stdint.h>          // C99 integer types -- uint32_t
 #include <stdbool.h>         // bool
-#include <fcntl.h>           // open
-#include <sys/mman.h>        // mmap
-#include <unistd.h>          // close
-#include "../address_map.h"  // address map
 #include "spi_ip.h"         // spi
 #include "spi_regs.h"       // registers
 
 //-----------------------------------------------------------------------------
-// Global variables
+// Subroutines
 //-----------------------------------------------------------------------------
 
-uint32_t *base = NULL;
+// Sequencer programs of the expander, loaded at EXP_SEQ_ADDR when the
+// core's tag is not EXP_SEQ_TAG for the device
+// A read-modify-write keeps the RX bits in R1, ORs in R2 and writes the
+// register back, with the read and write commands in R0 and R3; a read
+// leaves the register in R1
+#define EXP_SEQ_ADDR 8
+#define EXP_SEQ_UPDATE EXP_SEQ_ADDR
+#define EXP_SEQ_READ (EXP_SEQ_ADDR + 5)
+#define EXP_SEQ_TAG 0x45585000
+
+static uint8_t expDevice()
+{
+	return (ReadControl() >> CS_SELECT_BIT_OFS) & CS_SELECT_MASK;
+}
 
-//-----------------------------------------------------------------------------
-// Subroutines
-//-----------------------------------------------------------------------------
+static void expLoad(uint8_t device)
+{
+	uint32_t program[] = {
+		SEQ_RECV(device, 0) | SEQ_REG_MASK,
+		SEQ_AND(1) | SEQ_REG_MASK,
+		SEQ_OR(2) | SEQ_REG_MASK,
+		SEQ_SEND(device, 3) | SEQ_REG_MASK | SEQ_ACC_MASK,
+		SEQ_END(false),
+		SEQ_RECV(device, 0) | SEQ_REG_MASK,
+		SEQ_STORE(1),
+		SEQ_END(false)
+	};
+	if (spiSeqTag() == (EXP_SEQ_TAG | device))
+		return;
+	spiSeqLoad(EXP_SEQ_ADDR, program, sizeof(program) / sizeof(program[0]));
+	spiSeqSetTag(EXP_SEQ_TAG | device);
+}
+
+// Clears the bits of clear and sets those of set in an expander register,
+// one GO write for the whole read-modify-write
+static void updateRegister(uint8_t reg, uint8_t clear, uint8_t set)
+{
+	expLoad(expDevice());
+	spiSeqSetReg(0, ((OPCODE | 1) << 16) | (reg << 8));	// Read
+	spiSeqSetReg(1, ~clear & 0xFF);
+	spiSeqSetReg(2, set);
+	spiSeqSetReg(3, (OPCODE << 16) | (reg << 8));	// Write
+	spiSeqRun(EXP_SEQ_UPDATE, 2);
+}
 
-bool spiOpen()
+static uint8_t readRegister(uint8_t reg)
 {
-    // Open /dev/mem
-    int file = open("/dev/mem", O_RDWR | O_SYNC);
-    bool bOK = (file >= 0);
-    if (bOK)
-    {
-        // Create a map from the physical memory location of
-        // /dev/mem at an offset to LW avalon interface
-        // with an aperature of SPAN_IN_BYTES bytes
-        // to any location in the virtual 32-bit memory space of the process
-        base = mmap(NULL, SPAN_IN_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED,
-                    file, LW_BRIDGE_BASE + SPI_BASE_OFFSET);
-        bOK = (base != MAP_FAILED);
-
-        // Close /dev/mem
-        close(file);
-    }
-    return bOK;
+	expLoad(expDevice());
+	spiSeqSetReg(0, ((OPCODE | 1) << 16) | (reg << 8));
+	spiSeqRun(EXP_SEQ_READ, 1);
+	return spiSeqReg(1) & 0xFF;
 }
 
 void selectPinPullOutput(uint8_t pin)
 {
-	uint32_t mask = (OPCODE << 16);		// Opcode
-	mask &= ~(1 << 16);	// Setting the R/W signal as write
-	mask = (GPPU << 8);
-	mask |= (1 << pin);
-    *(base+OFS_DATA) = mask;
+	updateRegister(GPPU, 0, 1 << pin);
 }
 
 void selectPinPushOutput(uint8_t pin)
 {
-	uint32_t mask = (OPCODE << 16);		// Opcode
-	mask &= ~(1 << 16);	// Setting the R/W signal as write
-	mask = (GPPU << 8);
-	mask &= ~(1 << pin);
-    *(base+OFS_DATA) = mask;
+	updateRegister(GPPU, 1 << pin, 0);
 }
 
 void selectPinDirectionInput(uint8_t pin)
 {
-	uint32_t mask = (OPCODE << 16);		// Opcode
-	mask &= ~(1 << 16);	// Setting the R/W signal as write
-	mask = (IODIR << 8);
-	mask |= (1 << pin);
-    *(base+OFS_DATA) = mask;
+	updateRegister(IODIR, 0, 1 << pin);
 }
 
 void selectPinDirectionOutput(uint8_t pin)
 {
-	uint32_t mask = (OPCODE << 16);		// Opcode
-	mask &= ~(1 << 16);	// Setting the R/W signal as write
-	mask = (IODIR << 8);
-	mask &= ~(1 << pin);
-    *(base+OFS_DATA) = mask;
+	updateRegister(IODIR, 1 << pin, 0);
 }
 
 void setPinValue(uint8_t pin, bool value)
 {
-	uint32_t mask = (OPCODE << 16);		// Opcode
-	mask &= (1 << 16);	// Setting the R/W signal as write
-	mask = (GPIO << 8);
-    if (value)
-    	mask |= (1 << pin);
-    else
-    	mask &= ~(1 << pin);
-    *(base+OFS_DATA) = mask;
+	if (value)
+		updateRegister(GPIO, 0, 1 << pin);
+	else
+		updateRegister(GPIO, 1 << pin, 0);
 }
 
+// The response is kept by the sequencer, so TX_ONLY can stay set
 bool getPinValue(uint8_t pin)
 {
-	uint32_t mask = (OPCODE << 16);		// Opcode
-	mask &= ~(1 << 16);	// Setting the R/W signal as write
-	mask = (GPIO << 8);
-	*(base+OFS_DATA) = mask;
-	while(!(*(base+OFS_STATUS) & 32)); // Make sure TX FIFO is non empty
-    return (*(base+OFS_DATA) >> 2;
+	return (readRegister(GPIO) >> pin) & 1;
+}
+
+// Has the core poll the GPIO register every period system clocks, the
+// poll engine reports when the pin is no longer at value
+void watchPinValue(uint8_t pin, bool value, uint32_t period)
+{
+	uint32_t command = ((OPCODE | 1) << 16) | (GPIO << 8);	// Read GPIO
+	uint8_t device = (ReadControl() >> CS_SELECT_BIT_OFS) & CS_SELECT_MASK;
+	spiPollStart(device, command, 1 << pin, value << pin, period);
 }
 
 //void setPortValue(uint32_t value)
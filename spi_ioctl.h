@@ -0,0 +1,72 @@
+// SPI IP Example
+// SPI IP Character Device Interface (spi_ioctl.h)
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: DE1-SoC Board
+
+// Device interface:
+//   /dev/spi0 write() queues binary 32-bit words for transmission
+//   /dev/spi0 read() returns the words received while they were shifted
+//   SPI_IOC_XFER runs one full duplex transfer with its own device settings,
+//   or a command phase on one line followed by a dual or quad data phase
+//   SPI_IOC_SEQ loads and runs a sequencer program
+
+//-----------------------------------------------------------------------------
+
+#ifndef SPI_IOCTL_H_
+#define SPI_IOCTL_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// Full duplex transfer descriptor
+// Buffers are user pointers to arrays of len 32-bit words, a zero tx_buf
+// clocks out zeros and a zero rx_buf discards the received words
+// Zero word_size or baud_rate keep the current setting
+// io_lines of 2 or 4 sends the first cmd_len words of tx_buf (up to the
+// FIFO depth on a read) on one line and the rest of the len words on that many lines,
+// reading them into rx_buf from word cmd_len when rx_buf is set and writing
+// them from tx_buf otherwise; the word size must be a multiple of io_lines
+// and the chip select must stay asserted across both phases (cs_auto clear
+// with the device enabled, or STREAM for short transfers)
+// io_lines of 0 or 1 is a full duplex transfer and cmd_len is ignored
+struct spi_xfer_desc
+{
+    __u64 tx_buf;
+    __u64 rx_buf;
+    __u32 len;
+    __u32 baud_rate;
+    __u8 cs;
+    __u8 mode;
+    __u8 word_size;
+    __u8 cs_auto;
+    __u32 cmd_len;
+    __u8 io_lines;
+    __u8 pad[3];
+};
+
+// Sequencer run descriptor, instructions are built with the SEQ_ macros of
+// spi_regs.h
+// len instructions at the user pointer program are loaded from addr, a
+// zero len runs what is already loaded; regs go to seq_r0-seq_r3, the
+// program runs from start until it ends and regs return seq_r0-seq_r3
+// With an IRQ the caller sleeps until SEQ, so programs should end with
+// SEQ_END(true)
+struct spi_seq_desc
+{
+    __u64 program;
+    __u32 len;
+    __u32 regs[4];
+    __u8 addr;
+    __u8 start;
+    __u8 pad[2];
+};
+
+#define SPI_IOC_MAGIC 's'
+#define SPI_IOC_XFER _IOWR(SPI_IOC_MAGIC, 0, struct spi_xfer_desc)
+#define SPI_IOC_SEQ _IOWR(SPI_IOC_MAGIC, 1, struct spi_seq_desc)
+
+#endif
@@ -19,18 +19,185 @@
 
 #include <stdint.h>          // C99 integer types -- uint32_t
 #include <stdbool.h>         // bool
+#include <stddef.h>          // size_t
+#include <stdlib.h>          // malloc, free
+#include <stdatomic.h>       // atomic_compare_exchange_weak
+#include <pthread.h>         // pthread_mutex_lock
 #include <fcntl.h>           // open
 #include <sys/mman.h>        // mmap
 #include <unistd.h>          // close
+#include <time.h>            // clock_gettime
 #include "../address_map.h"  // address map
 #include "spi_ip.h"         // gpio
 #include "spi_regs.h"       // registers
+#include "spi_backend.h"    // register backend
 
 //-----------------------------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------------------------
 
-uint32_t *base = NULL;
+// State of one core; the calls below work on the core last opened or
+// selected by the calling thread
+typedef struct spiCore
+{
+    volatile uint32_t *base;
+    const spiBackend *backend;
+    spiBackend mmio;
+
+    // Shadow copies of the software-owned registers, the core never changes
+    // CONTROL or BRD on its own so reads are served from memory
+    uint32_t controlShadow;
+    uint32_t brdShadow;
+    uint32_t csCfgShadow[4];
+    uint32_t fifoDepth;
+    bool dmaPresent;
+    bool asyncClock;
+    uint32_t sampleDelayShadow;
+
+    // Clock BRD divides in Hz, spi_clk for a core built with
+    // SPI_CLOCK_ASYNC, the system clock otherwise
+    uint32_t serialClock;
+
+    // Program the caller tagged as loaded in the sequencer RAM, 0 once
+    // spiSeqLoad changes the RAM
+    uint32_t seqTag;
+
+    // Sessions open on the core, or SESSIONS_EXCLUSIVE for one that owns
+    // it; lock serializes the transactions of shared sessions
+    atomic_int sessions;
+    pthread_mutex_t lock;
+} spiCore;
+
+// Sessions of a core and the settings applied at the start of each of its
+// transactions
+struct spiCtx
+{
+    spiCore *core;
+    uint8_t device;
+    uint8_t wordSize;
+    uint8_t mode;
+    uint32_t brd;
+    bool exclusive;
+};
+
+static spiCore cores[SPI_MAX_CORES];
+static __thread spiCore *core = &cores[0];
+static pthread_once_t locksOnce = PTHREAD_ONCE_INIT;
+
+#define SESSIONS_EXCLUSIVE -1
+
+// Bulk transfers of at least this many narrow frames turn PACKED on
+#define PACK_MIN_FRAMES 8
+
+// Times the calibration pattern is repeated at each sample delay, and the
+// longest pattern
+#define CALIBRATE_ROUNDS 4
+#define CALIBRATE_MAX_WORDS 16
+
+// Bound of the wait for frames in flight: SCLK periods of the longest
+// frame with its chip select timing, and frames beyond the FIFO depth
+// (shifter and the clock domain crossing)
+#define IDLE_FRAME_PERIODS 36
+#define IDLE_MARGIN_FRAMES 16
+
+// System clock of the core, for the waits of the mmio backend
+#define SYSTEM_CLOCK 50000000
+
+// spi_clk of a core built with SPI_CLOCK_ASYNC until spiSetSerialClock
+// gives its rate, the spi_clock default of the driver
+#define SPI_CLOCK 125000000
+
+// A sequencer program still running after this many system clocks (one
+// second) is aborted, as by the driver
+#define SEQ_RUN_CLOCKS SYSTEM_CLOCK
+
+//-----------------------------------------------------------------------------
+// Register access
+//-----------------------------------------------------------------------------
+
+// The context of the mmio backend is the spiCore mapped
+static uint32_t mmioRead(void *context, uint32_t ofs)
+{
+    return *(((spiCore *)context)->base+ofs);
+}
+
+static void mmioWrite(void *context, uint32_t ofs, uint32_t value)
+{
+    *(((spiCore *)context)->base+ofs) = value;
+}
+
+// Byte lanes are written with byte and aligned halfword stores, each one a
+// bus access of its own
+static void mmioWriteBytes(void *context, uint32_t ofs, uint32_t value, uint8_t byteEnable)
+{
+    volatile uint32_t *base = ((spiCore *)context)->base;
+    volatile uint8_t *bytes = (volatile uint8_t *)(base+ofs);
+    uint8_t i;
+
+    if (byteEnable == BYTE_ENABLE_ALL)
+    {
+        *(base+ofs) = value;
+        return;
+    }
+    for (i = 0; i < 4; i++)
+    {
+        if (!(i & 1) && ((byteEnable >> i) & 0x3) == 0x3)
+        {
+            *(volatile uint16_t *)(bytes + i) = value >> (8*i);
+            i++;
+        }
+        else if (byteEnable & (1 << i))
+            bytes[i] = value >> (8*i);
+    }
+}
+
+// Spins on the monotonic clock, waits are a few frames long so sleeping
+// would overshoot them
+static void mmioDelay(void *context, uint64_t cycles)
+{
+    struct timespec now, end;
+    uint64_t ns = cycles * 1000000000 / SYSTEM_CLOCK;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += ns / 1000000000;
+    end.tv_nsec += ns % 1000000000;
+    if (end.tv_nsec >= 1000000000)
+    {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000;
+    }
+    do
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    while (now.tv_sec < end.tv_sec || (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+}
+
+
+static inline uint32_t readReg(uint32_t ofs)
+{
+    return core->backend->read(core->backend->context, ofs);
+}
+
+static inline void writeReg(uint32_t ofs, uint32_t value)
+{
+    core->backend->write(core->backend->context, ofs, value);
+}
+
+static void loadShadows()
+{
+    uint32_t status = readReg(OFS_STATUS);
+    uint32_t depthLog2 = (status >> DEPTH_LOG2_BIT_OFS) & DEPTH_LOG2_MASK;
+    uint8_t i;
+    core->dmaPresent = (status & DMA_PRESENT_MASK) != 0;
+    core->asyncClock = (status & ASYNC_CLOCK_MASK) != 0;
+    core->serialClock = core->asyncClock ? SPI_CLOCK : SYSTEM_CLOCK;
+    core->controlShadow = readReg(OFS_CONTROL);
+    core->brdShadow = readReg(OFS_BRD);
+    for (i = 0; i < 4; i++)
+        core->csCfgShadow[i] = readReg(OFS_CS_CFG0 + i);
+    core->sampleDelayShadow = readReg(OFS_SAMPLE_DELAY);
+    core->seqTag = 0;
+    core->fifoDepth = depthLog2 ? (1 << depthLog2) : FIFO_DEPTH;
+}
 
 //-----------------------------------------------------------------------------
 // Subroutines
@@ -38,18 +205,39 @@ uint32_t *base = NULL;
 
 bool spiOpen()
 {
+    return spiOpenCore(0, SPI_BASE_OFFSET);
+}
+
+// Maps the core at offset in the light-weight bridge (SPI_BASE_OFFSET,
+// SPI1_BASE_OFFSET, ...) as core index and selects it
+bool spiOpenCore(uint8_t index, uint32_t offset)
+{
+    spiCore *newCore;
+    int file;
+    bool bOK = index < SPI_MAX_CORES;
+    if (!bOK)
+        return false;
+    newCore = &cores[index];
+
     // Open /dev/mem
-    int file = open("/dev/mem", O_RDWR | O_SYNC);
-    bool bOK = (file >= 0);
+    file = open("/dev/mem", O_RDWR | O_SYNC);
+    bOK = (file >= 0);
     if (bOK)
     {
         // Create a map from the physical memory location of
         // /dev/mem at an offset to LW avalon interface
         // with an aperature of SPAN_IN_BYTES bytes
         // to any location in the virtual 32-bit memory space of the process
-        base = mmap(NULL, SPAN_IN_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED,
-                    file, LW_BRIDGE_BASE + SPI_BASE_OFFSET);
-        bOK = (base != MAP_FAILED);
+        newCore->base = mmap(NULL, SPAN_IN_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             file, LW_BRIDGE_BASE + offset);
+        bOK = (newCore->base != MAP_FAILED);
+        if (bOK)
+        {
+            newCore->mmio = (spiBackend){mmioRead, mmioWrite, mmioWriteBytes, newCore, mmioDelay};
+            newCore->backend = &newCore->mmio;
+            core = newCore;
+            loadShadows();
+        }
 
         // Close /dev/mem
         close(file);
@@ -57,58 +245,1203 @@ bool spiOpen()
     return bOK;
 }
 
+// Maps an spi2_mc block at offset and opens its channels as cores first,
+// first + 1, ...; returns the number of channels opened (0 on failure) and
+// selects the first
+uint8_t spiOpenChannels(uint8_t first, uint32_t offset)
+{
+    volatile uint32_t *base;
+    uint8_t count = 0, i;
+    int file;
+
+    if (first >= SPI_MAX_CORES)
+        return 0;
+
+    // Open /dev/mem
+    file = open("/dev/mem", O_RDWR | O_SYNC);
+    if (file < 0)
+        return 0;
+
+    // The channel windows and the shared block, MC_SPAN_IN_BYTES bytes
+    base = mmap(NULL, MC_SPAN_IN_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED,
+                file, LW_BRIDGE_BASE + offset);
+    if (base != MAP_FAILED)
+    {
+        count = (*(base+OFS_MC_STATUS) >> MC_CHANNELS_BIT_OFS) & MC_CHANNELS_MASK;
+        if (count > SPI_MAX_CORES - first)
+            count = SPI_MAX_CORES - first;
+        for (i = count; i > 0; i--)
+        {
+            core = &cores[first + i - 1];
+            core->base = base + (i - 1) * MC_CHANNEL_WORDS;
+            core->mmio = (spiBackend){mmioRead, mmioWrite, mmioWriteBytes, core, mmioDelay};
+            core->backend = &core->mmio;
+            loadShadows();
+        }
+        if (count == 0)
+            munmap((void *)base, MC_SPAN_IN_BYTES);
+    }
+
+    // Close /dev/mem
+    close(file);
+    return count;
+}
+
+// Makes the calls of this thread work on core index, opened before
+void spiSelectCore(uint8_t index)
+{
+    if (index < SPI_MAX_CORES)
+        core = &cores[index];
+}
+
+// Routes all register accesses of the selected core through another
+// backend, e.g. the spi2 model
+void spiOpenBackend(const spiBackend *newBackend)
+{
+    core->backend = newBackend;
+    loadShadows();
+}
+
 void WriteData(uint32_t pin)
 {
-    *(base+OFS_DATA) =  pin;
+    writeReg(OFS_DATA, pin);
 }
 
 
+// Tags the word with its device, used when CONTROL BANKED is set
+void WriteDataTo(uint8_t device, uint32_t pin)
+{
+    writeReg(OFS_DATA_CS0 + (device & CS_SELECT_MASK), pin);
+}
+
 void WriteStatus(uint32_t pin)
 {
-    *(base+OFS_STATUS) = pin;
+    writeReg(OFS_STATUS, pin);
 }
 
 void WriteControl(uint32_t pin)
 {
-    *(base+OFS_CONTROL) =  pin;
+    core->controlShadow = pin;
+    writeReg(OFS_CONTROL, pin);
 }
 
 void WriteBRD(uint32_t pin)
 {
     uint32_t mask = pin << 6;
-    *(base+OFS_BRD)  = mask;
+    core->brdShadow = mask;
+    writeReg(OFS_BRD, mask);
 }
 
 uint32_t ReadData()
 {
-    uint32_t value = *(base+OFS_DATA);
+    uint32_t value = readReg(OFS_DATA);
     return value;
 }
 
 uint32_t ReadStatus()
 {
-    uint32_t value = *(base+OFS_STATUS);
+    uint32_t value = readReg(OFS_STATUS);
     return value;
 }
 uint32_t ReadControl()
 {
-    uint32_t value = *(base+OFS_CONTROL);
-    return value;
+    return core->controlShadow;
 }
 uint32_t ReadBRD()
 {
-    uint32_t value = *(base+OFS_BRD);
+    return core->brdShadow;
+}
+uint32_t ReadLevel()
+{
+    uint32_t value = readReg(OFS_LEVEL);
     return value;
 }
 
+uint32_t spiFifoDepth()
+{
+    return core->fifoDepth;
+}
+
+// Pops one received word with a single read, returns false if none was
+// waiting; for word sizes up to RXDATA_MAX_WORD_SIZE
+bool ReadDataValid(uint32_t *value)
+{
+    uint32_t data = readReg(OFS_RX_DATA_VALID);
+    *value = data & RXDATA_DATA_MASK;
+    return (data & RXDATA_VALID_MASK) != 0;
+}
+
+// True when every word that can be received fits beside the RX_DATA_VALID
+// flag; with banked configuration that is every bank
+static bool compactRx()
+{
+    uint8_t i;
+    if (!(core->controlShadow & (1u << BANKED_BIT_OFS)))
+        return (core->controlShadow & WORDSIZE_MASK) < RXDATA_MAX_WORD_SIZE;
+    for (i = 0; i < 4; i++)
+        if ((core->csCfgShadow[i] & WORDSIZE_MASK) >= RXDATA_MAX_WORD_SIZE)
+            return false;
+    return true;
+}
+
+// Reads up to max of the words waiting in the RX FIFO into rx (NULL
+// discards them) and returns how many were read
+// Word sizes that fit beside the valid flag cost one read per word,
+// wider words one LEVEL read plus one DATA read per word
+static size_t drainRx(uint32_t *rx, size_t max)
+{
+    size_t count = 0, level;
+    uint32_t value;
+
+    if (compactRx())
+    {
+        while (count < max)
+        {
+            value = readReg(OFS_RX_DATA_VALID);
+            if (!(value & RXDATA_VALID_MASK))
+                break;
+            if (rx != NULL)
+                rx[count] = value & RXDATA_DATA_MASK;
+            count++;
+            if (!((value >> RXDATA_LEVEL_BIT_OFS) & RXDATA_LEVEL_MASK))
+                break;
+        }
+    }
+    else
+    {
+        level = readReg(OFS_LEVEL) >> RX_LEVEL_BIT_OFS;
+        if (level > max)
+            level = max;
+        for (; count < level; count++)
+        {
+            value = readReg(OFS_DATA);
+            if (rx != NULL)
+                rx[count] = value;
+        }
+    }
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+// Packed frames
+//-----------------------------------------------------------------------------
+
+// Frames a PACKED word carries for the word size of the selected device
+static uint8_t packLanes()
+{
+    uint8_t cs = (core->controlShadow >> CS_SELECT_BIT_OFS) & CS_SELECT_MASK;
+    uint32_t cfg = (core->controlShadow & (1u << BANKED_BIT_OFS)) ? core->csCfgShadow[cs] : core->controlShadow;
+    uint32_t size = (cfg & WORDSIZE_MASK) + 1;
+    return (size <= PACK_BYTE_MAX_WORD_SIZE) ? 4 : (size <= PACK_HALF_MAX_WORD_SIZE) ? 2 : 1;
+}
+
+// Lanes used for an n frame bulk transfer, 1 when it is not packed;
+// restore is set when PACKED was turned on for it
+static uint8_t startPacked(size_t n, bool *restore)
+{
+    uint8_t lanes = packLanes();
+
+    *restore = false;
+    if (lanes > 1 && !spiPacked())
+    {
+        if (n < PACK_MIN_FRAMES || core->backend->writeBytes == NULL)
+            return 1;
+        spiSetPacked(true);
+        *restore = true;
+    }
+    return lanes;
+}
+
+// Writes count frames (up to lanes) of tx as one packed word, a short
+// word only enables the byte lanes it fills; NULL tx sends zeros
+static void writePacked(uint32_t ofs, const uint32_t *tx, size_t count, uint8_t lanes)
+{
+    uint8_t width = 32 / lanes;
+    uint32_t value = 0;
+    size_t i;
+
+    if (tx != NULL)
+        for (i = 0; i < count; i++)
+            value |= (tx[i] & ((1u << width) - 1)) << (i * width);
+    if (count == lanes)
+        writeReg(ofs, value);
+    else
+        core->backend->writeBytes(core->backend->context, ofs, value, (1 << (count * 4 / lanes)) - 1);
+}
+
+// Reads the packed words waiting in the RX FIFO into rx (NULL discards
+// them) until max frames, and returns how many frames were read; only
+// the last word of a transfer is short
+static size_t drainPacked(uint32_t *rx, size_t max, uint8_t lanes)
+{
+    uint8_t width = 32 / lanes;
+    size_t count = 0, level, i;
+    uint32_t value;
+
+    level = readReg(OFS_LEVEL) >> RX_LEVEL_BIT_OFS;
+    while (level-- && count < max)
+    {
+        value = readReg(OFS_DATA);
+        for (i = 0; i < lanes && count < max; i++, count++)
+            if (rx != NULL)
+                rx[count] = (value >> (i * width)) & ((1u << width) - 1);
+    }
+    return count;
+}
+
+// PACKED carries up to four 8-bit or two 16-bit frames per data access in
+// both directions; the bulk transfers turn it on for narrow frames
+void spiSetPacked(bool enable)
+{
+    spiField field = {1u << PACKED_BIT_OFS, enable ? ~0 : 0};
+    spiApplyControl(&field, 1);
+}
+
+bool spiPacked()
+{
+    return (core->controlShadow >> PACKED_BIT_OFS) & 1;
+}
+
 void control_enable()
 {
 	uint32_t mask = (1 << 15);
-	*(base+OFS_CONTROL) |= mask;
+	WriteControl(core->controlShadow | mask);
 }
 
 void control_disable()
 {
 	uint32_t mask = ~(1 << 15);
-	*(base+OFS_CONTROL) &= mask;
+	WriteControl(core->controlShadow & mask);
+}
+
+// Applies n CONTROL field changes with a single register write
+void spiApplyControl(const spiField *fields, size_t n)
+{
+    uint32_t value = core->controlShadow;
+    size_t i;
+    for (i = 0; i < n; i++)
+        value = (value & ~fields[i].mask) | (fields[i].value & fields[i].mask);
+    WriteControl(value);
+}
+
+// Retargets the next frames to another device with a single register write
+void spiSelectDevice(uint8_t device, uint8_t wordSize)
+{
+    spiField fields[] =
+    {
+        {CS_SELECT_MASK << CS_SELECT_BIT_OFS, device << CS_SELECT_BIT_OFS},
+        {WORDSIZE_MASK, wordSize - 1}
+    };
+    spiApplyControl(fields, 2);
+}
+
+// Streaming keeps CS asserted across frames while the TX FIFO holds words;
+// CS is released when the FIFO runs dry, so keep it fed for long reads
+void spiSetStream(bool enable)
+{
+    spiField field = {1 << STREAM_BIT_OFS, enable ? ~0 : 0};
+    spiApplyControl(&field, 1);
+}
+
+// Sets the bank of one device, brd is in WriteBRD units
+// The bank is used for words written with WriteDataTo once BANKED is set
+void spiConfigureDevice(uint8_t device, uint8_t wordSize, uint8_t mode, bool csAuto,
+                        uint32_t brd)
+{
+    uint32_t value = ((wordSize - 1) & WORDSIZE_MASK)
+                   | ((mode & DEVICE_MODE_MASK) << CS_CFG_MODE_BIT_OFS)
+                   | (csAuto ? (1 << CS_CFG_AUTO_BIT_OFS) : 0)
+                   | (((brd << 6) & CS_CFG_BRD_MASK) << CS_CFG_BRD_BIT_OFS);
+    device &= CS_SELECT_MASK;
+    core->csCfgShadow[device] = value;
+    writeReg(OFS_CS_CFG0 + device, value);
+}
+
+// Banked mode takes the word size, mode, auto CS and baud rate of each
+// frame from the bank of its device instead of CONTROL and BRD
+void spiSetBanked(bool enable)
+{
+    spiField field = {1u << BANKED_BIT_OFS, enable ? ~0 : 0};
+    spiApplyControl(&field, 1);
+}
+
+// Register reads (at least a clock each) that cover frames of the longest
+// frames at the slowest SCLK in use, with IDLE_MARGIN_FRAMES more
+static uint64_t framePolls(uint64_t frames)
+{
+    uint64_t period = core->brdShadow >> 6;
+    uint8_t i;
+
+    if (core->controlShadow & (1u << BANKED_BIT_OFS))
+        for (i = 0; i < 4; i++)
+            if ((((core->csCfgShadow[i] >> CS_CFG_BRD_BIT_OFS) & CS_CFG_BRD_MASK) >> 6) > period)
+                period = ((core->csCfgShadow[i] >> CS_CFG_BRD_BIT_OFS) & CS_CFG_BRD_MASK) >> 6;
+    return (frames + IDLE_MARGIN_FRAMES) * IDLE_FRAME_PERIODS * (period + 1);
+}
+
+// Polls that cover a full FIFO
+static uint64_t idlePolls()
+{
+    return framePolls(core->fifoDepth);
+}
+
+// Waits until no frame is in flight; false if the core is disabled, which
+// never completes them, or after idlePolls() status reads
+static bool waitIdle()
+{
+    uint64_t polls = idlePolls();
+
+    while (readReg(OFS_STATUS) & BUSY_MASK)
+        if (!(core->controlShadow & (1 << CHIP_ENABLE_BIT_OFS)) || polls-- == 0)
+            return false;
+    return true;
+}
+
+// The transfer loops give up once no word has moved for budget passes (a
+// level read each), or at once on a disabled core; left is reset on
+// progress
+static bool stalled(size_t moved, uint64_t budget, uint64_t *left)
+{
+    if (moved)
+        *left = budget;
+    else if (!(core->controlShadow & (1 << CHIP_ENABLE_BIT_OFS)) || (*left)-- == 0)
+        return true;
+    return false;
+}
+
+// TX-only drops every received word, for write-only devices and traffic
+// such as expander output updates; full duplex and RX-only transfers
+// clear it for their own frames
+void spiSetTxOnly(bool enable)
+{
+    spiField field = {1 << TX_ONLY_BIT_OFS, enable ? ~0 : 0};
+    if (!enable)
+        waitIdle();
+    spiApplyControl(&field, 1);
+}
+
+bool spiTxOnly()
+{
+    return (core->controlShadow >> TX_ONLY_BIT_OFS) & 1;
+}
+
+// Transfers that read need the received words, a TX_ONLY left set is
+// cleared once the frames before have completed; returns whether it was
+static bool startReceive()
+{
+    if (!spiTxOnly())
+        return false;
+    spiSetTxOnly(false);
+    return true;
+}
+
+static void endReceive(bool restore)
+{
+    if (restore)
+        spiSetTxOnly(true);
+}
+
+bool spiDmaPresent()
+{
+    return core->dmaPresent;
+}
+
+// True when SCLK is made from the separate spi_clk (SPI_CLOCK_ASYNC), BRD
+// then divides spi_clk rather than the bus clock
+bool spiAsyncClock()
+{
+    return core->asyncClock;
+}
+
+// Gives the spi_clk rate in Hz of a core built with SPI_CLOCK_ASYNC, used
+// to time the waits of spiSeqRun; the serial clock of other cores is the
+// system clock
+void spiSetSerialClock(uint32_t hz)
+{
+    if (core->asyncClock && hz != 0)
+        core->serialClock = hz;
+}
+
+// Starts the DMA master on n words, src and dst are bus (physical) byte
+// addresses; flags are DMA_TX_MASK, DMA_RX_MASK and DMA_CFG_MASK with the
+// CS and mode fields of DMA_CTRL
+void spiDmaStart(uint32_t src, uint32_t dst, uint32_t n, uint32_t flags)
+{
+    uint8_t cs = (flags >> DMA_CS_BIT_OFS) & CS_SELECT_MASK;
+    uint8_t mode = (flags >> DMA_MODE_BIT_OFS) & DEVICE_MODE_MASK;
+    spiField fields[] =
+    {
+        {CS_SELECT_MASK << CS_SELECT_BIT_OFS, cs << CS_SELECT_BIT_OFS},
+        {DEVICE_MODE_MASK << (DEVICE_MODE_BIT_OFS + 2*cs), mode << (DEVICE_MODE_BIT_OFS + 2*cs)}
+    };
+    size_t i;
+
+    // The core applies CFG to CONTROL itself, keep the shadow in step
+    if (flags & DMA_CFG_MASK)
+        for (i = 0; i < 2; i++)
+            core->controlShadow = (core->controlShadow & ~fields[i].mask) | fields[i].value;
+
+    writeReg(OFS_DMA_SRC, src);
+    writeReg(OFS_DMA_DST, dst);
+    writeReg(OFS_DMA_LEN, n);
+    writeReg(OFS_DMA_CTRL, flags | DMA_GO_MASK);
+}
+
+bool spiDmaBusy()
+{
+    return (readReg(OFS_DMA_CTRL) & DMA_GO_MASK) != 0;
+}
+
+void spiDmaAbort()
+{
+    writeReg(OFS_DMA_CTRL, 0);
+}
+
+// TX-only: the core drops the received words, so only the TX level is
+// watched and nothing is drained
+// Frames still shifting are dropped only while TX_ONLY is set, so a mode
+// set here is cleared once the core reports no frame in flight
+static void transferTxOnly(const uint8_t *devices, const uint32_t *tx, size_t n)
+{
+    spiField field = {1 << TX_ONLY_BIT_OFS, ~0};
+    bool wasTxOnly = spiTxOnly(), restore = false;
+    uint8_t lanes = (devices == NULL) ? startPacked(n, &restore) : 1;
+    uint64_t budget = idlePolls(), left = budget;
+    size_t sent = 0, count, free;
+
+    if (!wasTxOnly)
+        spiApplyControl(&field, 1);
+    while (sent < n)
+    {
+        free = core->fifoDepth - (readReg(OFS_LEVEL) & LEVEL_MASK);
+        if (stalled(free, budget, &left))
+            break;
+        if (lanes > 1)
+        {
+            // The TX level counts frames, a word is written once all of
+            // its frames fit
+            while (sent < n)
+            {
+                count = (n - sent < lanes) ? n - sent : lanes;
+                if (count > free)
+                    break;
+                writePacked(OFS_DATA, tx + sent, count, lanes);
+                sent += count;
+                free -= count;
+            }
+            continue;
+        }
+        if (free > n - sent)
+            free = n - sent;
+        while (free--)
+        {
+            writeReg((devices != NULL) ? OFS_DATA_CS0 + devices[sent] : OFS_DATA, tx[sent]);
+            sent++;
+        }
+    }
+    if (!wasTxOnly)
+    {
+        waitIdle();
+        field.value = 0;
+        spiApplyControl(&field, 1);
+    }
+    if (restore)
+        spiSetPacked(false);
+}
+
+// RX-only: the core generates n frames of fill and keeps the RX FIFO from
+// overflowing, the host only reads
+static void transferRxOnly(uint32_t *rx, size_t n, uint32_t fill)
+{
+    spiField field = {1 << RX_ONLY_BIT_OFS, ~0};
+    uint64_t budget = idlePolls(), left = budget;
+    size_t received = 0, got;
+    bool restore, txOnly = startReceive();
+    uint8_t lanes;
+
+    drainRx(NULL, SIZE_MAX);
+    lanes = startPacked(n, &restore);
+    spiApplyControl(&field, 1);
+    writeReg(OFS_XFER_FILL, fill);
+    writeReg(OFS_XFER_LEN, n);
+    while (received < n)
+    {
+        if (lanes > 1)
+            got = drainPacked((rx != NULL) ? rx + received : NULL, n - received, lanes);
+        else
+            got = drainRx((rx != NULL) ? rx + received : NULL, n - received);
+        received += got;
+        if (stalled(got, budget, &left))
+        {
+            writeReg(OFS_XFER_LEN, 0);
+            break;
+        }
+    }
+    field.value = 0;
+    spiApplyControl(&field, 1);
+    if (restore)
+        spiSetPacked(false);
+    endReceive(txOnly);
+}
+
+// At most one FIFO depth of words is kept in flight (TX FIFO + shifter +
+// RX FIFO), so one level read is enough to know how many words can be
+// read and pushed and neither FIFO can overflow
+// Packed words are only written whole, so the RX FIFO gathers whole words
+// until the last one
+static void transferPacked(const uint32_t *tx, uint32_t *rx, size_t n, uint8_t lanes)
+{
+    uint64_t budget = idlePolls(), left = budget;
+    size_t sent = 0, received = 0, count, moved;
+
+    while (received < n)
+    {
+        moved = drainPacked((rx != NULL) ? rx + received : NULL, n - received, lanes);
+        received += moved;
+        while (sent < n)
+        {
+            count = (n - sent < lanes) ? n - sent : lanes;
+            if (count > core->fifoDepth - (sent - received))
+                break;
+            writePacked(OFS_DATA, (tx != NULL) ? tx + sent : NULL, count, lanes);
+            sent += count;
+            moved += count;
+        }
+        if (stalled(moved, budget, &left))
+            break;
+    }
+}
+
+static void transfer(const uint8_t *devices, const uint32_t *tx, uint32_t *rx, size_t n)
+{
+    uint64_t budget, left;
+    size_t sent = 0, received = 0, count, moved;
+    bool restore, txOnly = startReceive();
+    uint8_t lanes;
+
+    // Discard stale words so the in-flight count matches the RX FIFO
+    drainRx(NULL, SIZE_MAX);
+
+    lanes = (devices == NULL) ? startPacked(n, &restore) : 1;
+    if (lanes > 1)
+    {
+        transferPacked(tx, rx, n, lanes);
+        if (restore)
+            spiSetPacked(false);
+        endReceive(txOnly);
+        return;
+    }
+    budget = left = idlePolls();
+    while (received < n)
+    {
+        moved = drainRx((rx != NULL) ? rx + received : NULL, n - received);
+        received += moved;
+
+        // Top up the TX FIFO with as many words as are free
+        count = core->fifoDepth - (sent - received);
+        if (count > n - sent)
+            count = n - sent;
+        moved += count;
+        while (count--)
+        {
+            writeReg((devices != NULL) ? OFS_DATA_CS0 + devices[sent] : OFS_DATA,
+                     (tx != NULL) ? tx[sent] : 0);
+            sent++;
+        }
+        if (stalled(moved, budget, &left))
+            break;
+    }
+    endReceive(txOnly);
+}
+
+// Starts the poll engine: command is sent to device every period system
+// clocks while the host has no frames in flight, and a response whose
+// mask bits differ from value sets CHANGED and the POLL interrupt
+void spiPollStart(uint8_t device, uint32_t command, uint32_t mask, uint32_t value,
+                  uint32_t period)
+{
+    writeReg(OFS_POLL_CTRL, POLL_CHANGED_MASK);
+    writeReg(OFS_POLL_CMD, command);
+    writeReg(OFS_POLL_PERIOD, period);
+    writeReg(OFS_POLL_MASK, mask);
+    writeReg(OFS_POLL_VALUE, value & mask);
+    writeReg(OFS_POLL_CTRL, POLL_ENABLE_MASK | ((device & CS_SELECT_MASK) << POLL_CS_BIT_OFS));
+}
+
+// A poll already on the bus still completes
+void spiPollStop()
+{
+    writeReg(OFS_POLL_CTRL, POLL_CHANGED_MASK);
+}
+
+// Returns true once per change of the masked response, value receives it
+bool spiPollChanged(uint32_t *value)
+{
+    uint32_t ctrl = readReg(OFS_POLL_CTRL);
+    if (!(ctrl & POLL_CHANGED_MASK))
+        return false;
+    writeReg(OFS_POLL_CTRL, ctrl);
+    *value = readReg(OFS_POLL_VALUE);
+    return true;
+}
+
+// Snapshots the performance counters and reads them, clear restarts them
+// from the snapshot
+void spiReadPerf(spiPerf *perf, bool clear)
+{
+    uint32_t *counter = (uint32_t *)perf;
+    uint8_t i;
+    writeReg(OFS_PERF_CTRL, PERF_SNAPSHOT_MASK | (clear ? PERF_CLEAR_MASK : 0));
+    for (i = 0; i < PERF_COUNTERS; i++)
+        counter[i] = readReg(OFS_PERF_CYCLES + i);
+}
+
+// Loopback feeds tx back to the RX sampler inside the core and keeps every
+// chip select deasserted, for testing with nothing wired to the port
+void spiSetLoopback(bool enable)
+{
+    spiField field = {1 << LOOPBACK_BIT_OFS, enable ? ~0 : 0};
+    spiApplyControl(&field, 1);
+}
+
+// Runs the core self-test: frames PRBS-31 words go to the selected device
+// with the current settings and come back checked against the sequence,
+// nothing passes through the FIFOs seen by the host; the core must be
+// enabled and the host, DMA and poll engine idle
+// Returns true when every frame came back right, false as well when the
+// test was aborted after framePolls(frames) reads without finishing
+bool spiSelfTest(uint32_t frames, spiSelfTestResult *result)
+{
+    uint64_t polls = framePolls(frames);
+    bool running;
+
+    writeReg(OFS_BIST_LEN, frames);
+    writeReg(OFS_BIST_CTRL, BIST_GO_MASK);
+    while ((running = (readReg(OFS_BIST_CTRL) & BIST_GO_MASK) != 0) && polls-- != 0);
+    if (running)
+        writeReg(OFS_BIST_CTRL, 0);
+    result->frames = frames;
+    result->errors = readReg(OFS_BIST_ERRORS);
+    result->cycles = readReg(OFS_BIST_CYCLES);
+    return !running && result->errors == 0;
+}
+
+// Finds the fastest clean baud rate: the self-test is run with frames
+// frames at each BRD from minBrd to maxBrd (WriteBRD units) and the first
+// one without errors is returned, 0 if none; BRD is restored afterwards
+// With loopback the core itself is measured, without it a loopback plug
+// or a slave that echoes its input
+uint32_t spiSelfTestMaxRate(uint32_t frames, uint32_t minBrd, uint32_t maxBrd)
+{
+    spiSelfTestResult result;
+    uint32_t oldBrd = core->brdShadow, brd;
+
+    for (brd = minBrd; brd <= maxBrd; brd++)
+    {
+        WriteBRD(brd);
+        if (spiSelfTest(frames, &result))
+            break;
+    }
+    core->brdShadow = oldBrd;
+    writeReg(OFS_BRD, oldBrd);
+    return (brd <= maxBrd) ? brd : 0;
+}
+
+// Copies n instructions to the sequencer RAM from addr, the sequencer must
+// be idle
+void spiSeqLoad(uint8_t addr, const uint32_t *program, size_t n)
+{
+    core->seqTag = 0;
+    writeReg(OFS_SEQ_ADDR, addr);
+    while (n--)
+        writeReg(OFS_SEQ_DATA, *program++);
+}
+
+// Tags the programs of the selected core's sequencer RAM, so a caller can
+// tell whether its program is still loaded
+void spiSeqSetTag(uint32_t tag)
+{
+    core->seqTag = tag;
+}
+
+uint32_t spiSeqTag()
+{
+    return core->seqTag;
+}
+
+// Instructions the sequencer RAM holds
+uint16_t spiSeqDepth()
+{
+    return 1 << ((readReg(OFS_SEQ_CTRL) >> SEQ_DEPTH_LOG2_BIT_OFS) & DEPTH_LOG2_MASK);
+}
+
+void spiSeqSetReg(uint8_t n, uint32_t value)
+{
+    writeReg(OFS_SEQ_R0 + (n & (SEQ_REGS - 1)), value);
+}
+
+uint32_t spiSeqReg(uint8_t n)
+{
+    return readReg(OFS_SEQ_R0 + (n & (SEQ_REGS - 1)));
+}
+
+// Starts the program at pc; the core must be enabled and the host, DMA,
+// and self-test must leave the data registers alone until it ends
+void spiSeqStart(uint8_t pc)
+{
+    writeReg(OFS_SEQ_CTRL, SEQ_GO_MASK | (pc << SEQ_PC_BIT_OFS));
+}
+
+bool spiSeqBusy()
+{
+    return readReg(OFS_SEQ_CTRL) & SEQ_GO_MASK;
+}
+
+// Chip selects held by the program are released, frames already pushed
+// still complete
+void spiSeqAbort()
+{
+    writeReg(OFS_SEQ_CTRL, 0);
+}
+
+// Runs the program at pc to its END; frames is the number of frames it
+// shifts, 0 when not known
+// SEQ_CTRL is first read once the frames can have been shifted, each with
+// the largest word size of the core at its fastest SCLK rate, then once a
+// frame, so the wait costs a few bus accesses rather than one per access
+// time; SCLK periods are taken in the serial clock (spiSetSerialClock)
+// Returns false when the program was aborted after SEQ_RUN_CLOCKS
+bool spiSeqRun(uint8_t pc, uint32_t frames)
+{
+    uint64_t period = core->brdShadow >> 6, bits = (core->controlShadow & WORDSIZE_MASK) + 1;
+    uint64_t frameCycles, waited, limit = SEQ_RUN_CLOCKS;
+    uint8_t i;
+
+    if (core->controlShadow & (1u << BANKED_BIT_OFS))
+        for (i = 0, bits = 1; i < 4; i++)
+        {
+            if ((((core->csCfgShadow[i] >> CS_CFG_BRD_BIT_OFS) & CS_CFG_BRD_MASK) >> 6) < period)
+                period = ((core->csCfgShadow[i] >> CS_CFG_BRD_BIT_OFS) & CS_CFG_BRD_MASK) >> 6;
+            if ((core->csCfgShadow[i] & WORDSIZE_MASK) + 1 > bits)
+                bits = (core->csCfgShadow[i] & WORDSIZE_MASK) + 1;
+        }
+    frameCycles = bits * (period + 1) * SYSTEM_CLOCK / core->serialClock;
+    if (frameCycles == 0)
+        frameCycles = 1;
+
+    spiSeqStart(pc);
+    if (core->backend->delay == NULL)
+    {
+        // Every SEQ_CTRL read takes at least a clock
+        while (spiSeqBusy())
+            if (limit-- == 0)
+            {
+                spiSeqAbort();
+                return false;
+            }
+        return true;
+    }
+    waited = frames * frameCycles;
+    core->backend->delay(core->backend->context, waited);
+    while (spiSeqBusy())
+    {
+        if (waited >= limit)
+        {
+            spiSeqAbort();
+            return false;
+        }
+        core->backend->delay(core->backend->context, frameCycles);
+        waited += frameCycles;
+    }
+    return true;
+}
+
+// Moves n words full duplex through the TX and RX FIFOs
+// tx may be NULL to clock out zeros, rx may be NULL to discard received words,
+// either uses the one-directional modes
+void spiTransfer(const uint32_t *tx, uint32_t *rx, size_t n)
+{
+    if (tx == NULL)
+        transferRxOnly(rx, n, 0);
+    else if (rx == NULL)
+        transferTxOnly(NULL, tx, n);
+    else
+        transfer(NULL, tx, rx, n);
+}
+
+// Sends n words, nothing is written to the RX FIFO
+void spiWrite(const uint32_t *tx, size_t n)
+{
+    transferTxOnly(NULL, tx, n);
+}
+
+// Receives n words while the core clocks out fill
+void spiRead(uint32_t *rx, size_t n, uint32_t fill)
+{
+    transferRxOnly(rx, n, fill);
+}
+
+// As spiTransfer with word i sent to devices[i] (0-3), so frames for
+// several devices can share one burst when BANKED is set; PACKED must be
+// clear
+void spiTransferDevices(const uint8_t *devices, const uint32_t *tx, uint32_t *rx, size_t n)
+{
+    if (rx == NULL && tx != NULL)
+        transferTxOnly(devices, tx, n);
+    else
+        transfer(devices, tx, rx, n);
+}
+
+// Runs the transfers of count cores from first at the same time, core
+// first + i moving n[i] words from tx[i] (NULL clocks out zeros) to rx[i]
+// (NULL discards them), so channels of an spi2_mc block shift in parallel
+// while the CPU tops up and drains each in turn; the selected core is
+// kept and PACKED must be clear on every core
+// Returns false without a transfer when a core was never opened, and false
+// once the others are done when a core stopped moving words (see stalled())
+bool spiTransferChannels(uint8_t first, uint8_t count, const uint32_t *const *tx,
+                         uint32_t *const *rx, const size_t *n)
+{
+    spiCore *selected = core;
+    size_t sent[SPI_MAX_CORES] = {0}, received[SPI_MAX_CORES] = {0}, free, got;
+    uint64_t budget[SPI_MAX_CORES], left[SPI_MAX_CORES];
+    bool busy = true, ok = true, stopped[SPI_MAX_CORES] = {false}, txOnly[SPI_MAX_CORES];
+    uint8_t i;
+
+    if (first >= SPI_MAX_CORES)
+        return false;
+    if (count > SPI_MAX_CORES - first)
+        count = SPI_MAX_CORES - first;
+    for (i = 0; i < count; i++)
+        if (cores[first + i].backend == NULL)
+            return false;
+
+    // Discard stale words so the in-flight counts match the RX FIFOs
+    for (i = 0; i < count; i++)
+    {
+        core = &cores[first + i];
+        txOnly[i] = startReceive();
+        drainRx(NULL, SIZE_MAX);
+        budget[i] = left[i] = idlePolls();
+    }
+    while (busy)
+    {
+        busy = false;
+        for (i = 0; i < count; i++)
+        {
+            if (received[i] == n[i] || stopped[i])
+                continue;
+            busy = true;
+            core = &cores[first + i];
+            got = drainRx((rx[i] != NULL) ? rx[i] + received[i] : NULL, n[i] - received[i]);
+            received[i] += got;
+            free = core->fifoDepth - (sent[i] - received[i]);
+            if (free > n[i] - sent[i])
+                free = n[i] - sent[i];
+            got += free;
+            while (free--)
+            {
+                writeReg(OFS_DATA, (tx[i] != NULL) ? tx[i][sent[i]] : 0);
+                sent[i]++;
+            }
+            stopped[i] = stalled(got, budget[i], &left[i]);
+            ok = ok && !stopped[i];
+        }
+    }
+    for (i = 0; i < count; i++)
+    {
+        core = &cores[first + i];
+        endReceive(txOnly[i]);
+    }
+    core = selected;
+    return ok;
+}
+
+// Sets the data lines (1, 2 or 4) of the words pushed from now on, read
+// releases the lines on dual and quad frames so the slave drives them
+// Words already in the TX FIFO keep the mode they were pushed with
+void spiSetIoMode(uint8_t lines, bool read)
+{
+    uint32_t value = (lines == 4) ? IO_QUAD : (lines == 2) ? IO_DUAL : IO_SINGLE;
+    if (read && value != IO_SINGLE)
+        value |= IO_READ_MASK;
+    writeReg(OFS_IO_MODE, value);
+}
+
+// Sends cmdLen command words on one line and then n data words on lines
+// (1, 2 or 4) data lines, read fills data from the slave, otherwise data is
+// sent; command and data words are one burst, so CS stays asserted with
+// manual chip select, or with STREAM while the command is still shifting
+// when the data words are queued
+// A read pushes its command without a level check, so its command is limited
+// to the FIFO depth, as for dual and quad SPI_IOC_XFER descriptors of the
+// driver; false is returned and nothing is sent for a longer one, and false
+// as well when the read words stop arriving (see stalled())
+bool spiTransferIo(const uint32_t *cmd, size_t cmdLen, uint32_t *data, size_t n,
+                   uint8_t lines, bool read)
+{
+    spiField field = {1 << RX_ONLY_BIT_OFS, ~0};
+    bool wasTxOnly = spiTxOnly(), ok = true;
+    uint64_t budget, left;
+    size_t received = 0, got;
+
+    if (!read)
+    {
+        spiSetTxOnly(true);
+        transferTxOnly(NULL, cmd, cmdLen);
+        spiSetIoMode(lines, false);
+        transferTxOnly(NULL, data, n);
+        spiSetTxOnly(wasTxOnly);
+        spiSetIoMode(1, false);
+        return true;
+    }
+
+    // The command is pushed ahead of the fill generator without a level
+    // check, the FIFO is empty and holds all of it; the generator tags its
+    // frames with the mode set when it pushes them, the command echoes are
+    // discarded
+    if (cmdLen > core->fifoDepth)
+        return false;
+    spiSetTxOnly(false);
+    drainRx(NULL, SIZE_MAX);
+    spiApplyControl(&field, 1);
+    writeReg(OFS_XFER_FILL, 0);
+    for (; received < cmdLen; received++)
+        writeReg(OFS_DATA, cmd[received]);
+    spiSetIoMode(lines, true);
+    writeReg(OFS_XFER_LEN, n);
+    budget = left = idlePolls();
+    received = 0;
+    while (received < cmdLen && ok)
+    {
+        got = drainRx(NULL, cmdLen - received);
+        received += got;
+        ok = !stalled(got, budget, &left);
+    }
+    received = 0;
+    while (received < n && ok)
+    {
+        got = drainRx(data + received, n - received);
+        received += got;
+        ok = !stalled(got, budget, &left);
+    }
+    if (!ok)
+        writeReg(OFS_XFER_LEN, 0);
+    spiSetIoMode(1, false);
+    field.value = 0;
+    spiApplyControl(&field, 1);
+    spiSetTxOnly(wasTxOnly);
+    return ok;
+}
+
+// Takes the RX sample of device clocks (0-15) after the SCLK sampling edge,
+// for slaves and cables whose data arrives late at high baud rates; it must
+// stay shorter than the SCLK period of the device
+void spiSetSampleDelay(uint8_t device, uint8_t clocks)
+{
+    uint8_t shift = SAMPLE_DELAY_BIT_STRIDE * (device & CS_SELECT_MASK);
+    core->sampleDelayShadow = (core->sampleDelayShadow & ~(SAMPLE_DELAY_MASK << shift))
+                      | ((clocks & SAMPLE_DELAY_MASK) << shift);
+    writeReg(OFS_SAMPLE_DELAY, core->sampleDelayShadow);
+}
+
+uint8_t spiSampleDelay(uint8_t device)
+{
+    return (core->sampleDelayShadow >> (SAMPLE_DELAY_BIT_STRIDE * (device & CS_SELECT_MASK))) & SAMPLE_DELAY_MASK;
+}
+
+// SCLK period of device in clocks, from its bank when BANKED is set
+static uint32_t sclkPeriod(uint8_t device)
+{
+    uint32_t brd = core->brdShadow;
+    if (core->controlShadow & (1u << BANKED_BIT_OFS))
+        brd = (core->csCfgShadow[device & CS_SELECT_MASK] >> CS_CFG_BRD_BIT_OFS) & CS_CFG_BRD_MASK;
+    return brd >> 6;
+}
+
+// Finds the sample delay of device for the current baud rate: every delay
+// shorter than the SCLK period is tried by sending the n words of tx (up to
+// CALIBRATE_MAX_WORDS) CALIBRATE_ROUNDS times, and passes when every word
+// received matches expect in the bits of mask
+// The delay is left in the middle of the longest run of passing delays and
+// returned, or the old delay is kept and -1 returned if none passed; pass
+// (if not NULL) gets bit d set for each passing delay d
+// The pattern needs a known answer, such as a loopback plug (expect = tx)
+// or a register read of the MCP23S08; the words are sent to device through
+// DATA_CSn, so without BANKED it must be the selected device
+int spiCalibrateSampleDelay(uint8_t device, const uint32_t *tx, const uint32_t *expect,
+                            uint32_t mask, size_t n, uint16_t *pass)
+{
+    uint32_t rx[CALIBRATE_MAX_WORDS];
+    uint8_t devices[CALIBRATE_MAX_WORDS];
+    uint8_t old = spiSampleDelay(device);
+    uint32_t period = sclkPeriod(device), limit, delay, run = 0, bestRun = 0, bestStart = 0;
+    uint16_t passes = 0;
+    size_t i, round;
+    bool ok;
+
+    if (n > CALIBRATE_MAX_WORDS)
+        n = CALIBRATE_MAX_WORDS;
+    for (i = 0; i < n; i++)
+        devices[i] = device;
+    limit = (period > SAMPLE_DELAY_MAX) ? SAMPLE_DELAY_MAX : (period ? period - 1 : 0);
+    for (delay = 0; delay <= limit; delay++)
+    {
+        spiSetSampleDelay(device, delay);
+        ok = true;
+        for (round = 0; round < CALIBRATE_ROUNDS && ok; round++)
+        {
+            spiTransferDevices(devices, tx, rx, n);
+            for (i = 0; i < n && ok; i++)
+                ok = ((rx[i] ^ expect[i]) & mask) == 0;
+        }
+        if (ok)
+        {
+            passes |= 1 << delay;
+            if (++run > bestRun)
+            {
+                bestRun = run;
+                bestStart = delay + 1 - run;
+            }
+        }
+        else
+            run = 0;
+    }
+    if (pass != NULL)
+        *pass = passes;
+    if (bestRun == 0)
+    {
+        spiSetSampleDelay(device, old);
+        return -1;
+    }
+    spiSetSampleDelay(device, bestStart + (bestRun - 1) / 2);
+    return bestStart + (bestRun - 1) / 2;
+}
+
+//-----------------------------------------------------------------------------
+// Sessions
+//-----------------------------------------------------------------------------
+
+static void initLocks()
+{
+    uint8_t i;
+    for (i = 0; i < SPI_MAX_CORES; i++)
+        pthread_mutex_init(&cores[i].lock, NULL);
+}
+
+// Opens a session for device (0-3) of core index, opened before, with
+// wordSize bits per frame, mode and an SCLK period of brd clocks (0 keeps
+// the BRD in force); NULL if the core is owned by an exclusive session or,
+// for an exclusive session, has any other session open
+// The transactions of shared sessions take the core lock, those of an
+// exclusive session take no lock at all
+spiCtx *spiCtxOpen(uint8_t index, uint8_t device, uint8_t wordSize, uint8_t mode,
+                   uint32_t brd, bool exclusive)
+{
+    spiCore *target;
+    spiCtx *ctx;
+    int sessions;
+
+    if (index >= SPI_MAX_CORES || device > CS_SELECT_MASK || wordSize == 0 || wordSize > 32)
+        return NULL;
+    pthread_once(&locksOnce, initLocks);
+    target = &cores[index];
+    if (target->backend == NULL)
+        return NULL;
+
+    // Claim the core without a lock, an exclusive session only from zero
+    sessions = atomic_load(&target->sessions);
+    do
+    {
+        if (sessions == SESSIONS_EXCLUSIVE || (exclusive && sessions != 0))
+            return NULL;
+    }
+    while (!atomic_compare_exchange_weak(&target->sessions, &sessions,
+                                         exclusive ? SESSIONS_EXCLUSIVE : sessions + 1));
+
+    ctx = malloc(sizeof(*ctx));
+    if (ctx == NULL)
+    {
+        if (exclusive)
+            atomic_store(&target->sessions, 0);
+        else
+            atomic_fetch_sub(&target->sessions, 1);
+        return NULL;
+    }
+    ctx->core = target;
+    ctx->device = device;
+    ctx->wordSize = wordSize;
+    ctx->mode = mode & DEVICE_MODE_MASK;
+    ctx->brd = brd;
+    ctx->exclusive = exclusive;
+    return ctx;
+}
+
+// Closes a session outside its transactions
+void spiCtxClose(spiCtx *ctx)
+{
+    if (ctx == NULL)
+        return;
+    if (ctx->exclusive)
+        atomic_store(&ctx->core->sessions, 0);
+    else
+        atomic_fetch_sub(&ctx->core->sessions, 1);
+    free(ctx);
+}
+
+// Starts a transaction: the calls of this thread then work on the core of
+// the session with its device selected, and no other session's frames
+// reach the core until spiCtxEnd, so a multi-frame sequence (or expander
+// access) runs as one; settings are compared with the shadows, so only a
+// change of session costs register writes
+void spiCtxBegin(spiCtx *ctx)
+{
+    uint8_t cs = ctx->device;
+    spiField fields[] =
+    {
+        {CS_SELECT_MASK << CS_SELECT_BIT_OFS, cs << CS_SELECT_BIT_OFS},
+        {WORDSIZE_MASK, ctx->wordSize - 1},
+        {DEVICE_MODE_MASK << (DEVICE_MODE_BIT_OFS + 2*cs), ctx->mode << (DEVICE_MODE_BIT_OFS + 2*cs)}
+    };
+    uint32_t value;
+    size_t i;
+
+    if (!ctx->exclusive)
+        pthread_mutex_lock(&ctx->core->lock);
+    core = ctx->core;
+    value = core->controlShadow;
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+        value = (value & ~fields[i].mask) | (fields[i].value & fields[i].mask);
+    if (value != core->controlShadow)
+        WriteControl(value);
+    if (ctx->brd != 0 && core->brdShadow != ctx->brd << 6)
+        WriteBRD(ctx->brd);
+}
+
+void spiCtxEnd(spiCtx *ctx)
+{
+    if (!ctx->exclusive)
+        pthread_mutex_unlock(&ctx->core->lock);
+}
+
+// spiTransfer, spiWrite and spiRead as a transaction of their own
+void spiCtxTransfer(spiCtx *ctx, const uint32_t *tx, uint32_t *rx, size_t n)
+{
+    spiCtxBegin(ctx);
+    spiTransfer(tx, rx, n);
+    spiCtxEnd(ctx);
+}
+
+void spiCtxWrite(spiCtx *ctx, const uint32_t *tx, size_t n)
+{
+    spiCtxBegin(ctx);
+    spiWrite(tx, n);
+    spiCtxEnd(ctx);
+}
+
+void spiCtxRead(spiCtx *ctx, uint32_t *rx, size_t n, uint32_t fill)
+{
+    spiCtxBegin(ctx);
+    spiRead(rx, n, fill);
+    spiCtxEnd(ctx);
 }
@@ -22,22 +22,130 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include "spi_backend.h"
+
+// Cores spiOpenCore and spiOpenChannels can map, each keeps its own
+// shadows
+#define SPI_MAX_CORES 4
+
+// Session of one device, opaque; see spiCtxOpen
+typedef struct spiCtx spiCtx;
+
+// One CONTROL field change, bits outside mask are left untouched
+typedef struct spiField
+{
+    uint32_t mask;
+    uint32_t value;
+} spiField;
+
+// Performance counters, in register order from OFS_PERF_CYCLES
+typedef struct spiPerf
+{
+    uint32_t cycles;
+    uint32_t frames;
+    uint32_t bits;
+    uint32_t txWait;
+    uint32_t rxFull;
+    uint32_t txOverflows;
+    uint32_t rxOverflows;
+    uint32_t csAsserts;
+} spiPerf;
+
+// Outcome of a self-test run, cycles are clocks from start to the last
+// frame checked
+typedef struct spiSelfTestResult
+{
+    uint32_t frames;
+    uint32_t errors;
+    uint32_t cycles;
+} spiSelfTestResult;
 
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 bool spiOpen();
+bool spiOpenCore(uint8_t index, uint32_t offset);
+uint8_t spiOpenChannels(uint8_t first, uint32_t offset);
+void spiSelectCore(uint8_t index);
+void spiOpenBackend(const spiBackend *newBackend);
 void WriteData(uint32_t pin);
+void WriteDataTo(uint8_t device, uint32_t pin);
 void WriteStatus(uint32_t pin);
 void WriteControl(uint32_t pin);
 void WriteBRD(uint32_t pin);
 void control_enable();
 void control_disable();
+void spiApplyControl(const spiField *fields, size_t n);
+void spiSelectDevice(uint8_t device, uint8_t wordSize);
+void spiSetStream(bool enable);
+void spiConfigureDevice(uint8_t device, uint8_t wordSize, uint8_t mode, bool csAuto,
+                        uint32_t brd);
+void spiSetBanked(bool enable);
+void spiSetTxOnly(bool enable);
+bool spiTxOnly();
+void spiSetPacked(bool enable);
+bool spiPacked();
 
 uint32_t ReadData();
 uint32_t ReadStatus();
 uint32_t ReadControl();
 uint32_t ReadBRD();
+uint32_t ReadLevel();
+bool ReadDataValid(uint32_t *value);
+uint32_t spiFifoDepth();
+
+void spiTransfer(const uint32_t *tx, uint32_t *rx, size_t n);
+void spiTransferDevices(const uint8_t *devices, const uint32_t *tx, uint32_t *rx, size_t n);
+bool spiTransferChannels(uint8_t first, uint8_t count, const uint32_t *const *tx,
+                         uint32_t *const *rx, const size_t *n);
+void spiWrite(const uint32_t *tx, size_t n);
+void spiRead(uint32_t *rx, size_t n, uint32_t fill);
+void spiSetIoMode(uint8_t lines, bool read);
+bool spiTransferIo(const uint32_t *cmd, size_t cmdLen, uint32_t *data, size_t n,
+                   uint8_t lines, bool read);
+void spiSetSampleDelay(uint8_t device, uint8_t clocks);
+uint8_t spiSampleDelay(uint8_t device);
+int spiCalibrateSampleDelay(uint8_t device, const uint32_t *tx, const uint32_t *expect,
+                            uint32_t mask, size_t n, uint16_t *pass);
+
+bool spiDmaPresent();
+bool spiAsyncClock();
+void spiSetSerialClock(uint32_t hz);
+void spiDmaStart(uint32_t src, uint32_t dst, uint32_t n, uint32_t flags);
+bool spiDmaBusy();
+void spiDmaAbort();
+
+void spiPollStart(uint8_t device, uint32_t command, uint32_t mask, uint32_t value,
+                  uint32_t period);
+void spiPollStop();
+bool spiPollChanged(uint32_t *value);
+
+void spiReadPerf(spiPerf *perf, bool clear);
+
+void spiSetLoopback(bool enable);
+bool spiSelfTest(uint32_t frames, spiSelfTestResult *result);
+uint32_t spiSelfTestMaxRate(uint32_t frames, uint32_t minBrd, uint32_t maxBrd);
+
+void spiSeqLoad(uint8_t addr, const uint32_t *program, size_t n);
+void spiSeqSetTag(uint32_t tag);
+uint32_t spiSeqTag();
+uint16_t spiSeqDepth();
+void spiSeqSetReg(uint8_t n, uint32_t value);
+uint32_t spiSeqReg(uint8_t n);
+void spiSeqStart(uint8_t pc);
+bool spiSeqBusy();
+void spiSeqAbort();
+bool spiSeqRun(uint8_t pc, uint32_t frames);
+
+spiCtx *spiCtxOpen(uint8_t index, uint8_t device, uint8_t wordSize, uint8_t mode,
+                   uint32_t brd, bool exclusive);
+void spiCtxClose(spiCtx *ctx);
+void spiCtxBegin(spiCtx *ctx);
+void spiCtxEnd(spiCtx *ctx);
+void spiCtxTransfer(spiCtx *ctx, const uint32_t *tx, uint32_t *rx, size_t n);
+void spiCtxWrite(spiCtx *ctx, const uint32_t *tx, size_t n);
+void spiCtxRead(spiCtx *ctx, uint32_t *rx, size_t n, uint32_t fill);
 
 void selectPinPullOutput(uint8_t pin);
 void selectPinPushOutput(uint8_t pin);
@@ -45,5 +153,6 @@ void selectPinDirectionInput(uint8_t pin);
 void selectPinDirectionOutput(uint8_t pin);
 void setPinValue(uint8_t pin, bool value);
 bool getPinValue(uint8_t pin);
+void watchPinValue(uint8_t pin, bool value, uint32_t period);
 
 #endif
@@ -0,0 +1,1240 @@
+// SPI IP Example
+// SPI IP Software Model (spi_model.c)
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Host PC (behavioral model of spi2.v)
+
+// Model configuration:
+//   Register reads and writes land accessCycles system clocks after the
+//   previous access, the serializer is stepped one baud edge at a time and
+//   idle stretches with an empty TX FIFO are skipped in a single step
+
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>          // C99 integer types -- uint32_t
+#include <stdbool.h>         // bool
+#include <string.h>          // memset, memcpy
+#include "spi_model.h"
+#include "spi_regs.h"
+
+// transmitter.v phases
+#define PHASE_IDLE      0
+#define PHASE_CS_ASSERT 1
+#define PHASE_TX_BITS   2
+
+// Sequencer states
+#define SEQ_STATE_IDLE  0
+#define SEQ_STATE_EXEC  1
+#define SEQ_STATE_PUSH  2
+#define SEQ_STATE_RX    3
+#define SEQ_STATE_DELAY 4
+#define SEQ_STATE_DRAIN 5
+#define SEQ_STATE_END   6
+
+// Live performance counter of a PERF register
+#define PERF(model, ofs) ((model)->perf[(ofs) - OFS_PERF_CYCLES])
+
+//-----------------------------------------------------------------------------
+// FIFO.v
+//-----------------------------------------------------------------------------
+
+static void fifoWrite(spiModelFifo *fifo, uint32_t value, uint8_t tag)
+{
+    if (fifo->level < fifo->depth)
+    {
+        fifo->stack[fifo->writePtr] = value;
+        fifo->tag[fifo->writePtr] = tag;
+        fifo->writePtr = (fifo->writePtr + 1) % fifo->depth;
+        fifo->level++;
+    }
+    else
+    {
+        // Full: the write pointer aliases the oldest entry, which is
+        // overwritten until the overflow flag is set
+        if (!fifo->ov)
+        {
+            fifo->stack[fifo->writePtr] = value;
+            fifo->tag[fifo->writePtr] = tag;
+        }
+        fifo->ov = true;
+    }
+}
+
+// Every TX FIFO write is counted as a frame in flight, as spi2.v does
+// The word is tagged with its chip select and IO_MODE value
+static void pushTx(spiModel *model, uint32_t value, uint8_t cs, uint8_t io)
+{
+    if (model->txFifo.level == model->txFifo.depth)
+        PERF(model, OFS_PERF_TXOV)++;
+    fifoWrite(&model->txFifo, value, cs | (io << IO_TAG_BIT_OFS));
+    model->framesInFlight++;
+}
+
+static void fifoRead(spiModelFifo *fifo)
+{
+    if (fifo->level > 0)
+    {
+        fifo->dataOut = fifo->stack[fifo->readPtr];
+        fifo->readPtr = (fifo->readPtr + 1) % fifo->depth;
+        fifo->level--;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Performance counters
+//-----------------------------------------------------------------------------
+
+// The state is constant between baud edges and register accesses, so the
+// clock counters are advanced a span at a time
+static void perfAccount(spiModel *model, uint64_t until)
+{
+    uint32_t span;
+
+    if (until <= model->perfTime)
+        return;
+    span = until - model->perfTime;
+    PERF(model, OFS_PERF_CYCLES) += span;
+    if ((model->control & (1 << CHIP_ENABLE_BIT_OFS)) && model->phase != PHASE_TX_BITS
+        && model->txFifo.level > 0)
+        PERF(model, OFS_PERF_TX_WAIT) += span;
+    if (model->rxFifo.level == model->rxFifo.depth)
+        PERF(model, OFS_PERF_RX_FULL) += span;
+    model->perfTime = until;
+}
+
+static void perfControl(spiModel *model, uint32_t value)
+{
+    if (value & PERF_SNAPSHOT_MASK)
+        memcpy(model->perfSnapshot, model->perf, sizeof(model->perf));
+    if (value & PERF_CLEAR_MASK)
+        memset(model->perf, 0, sizeof(model->perf));
+}
+
+//-----------------------------------------------------------------------------
+// RX_ONLY fill generator
+//-----------------------------------------------------------------------------
+
+// Pushes fill words while frames in flight plus the RX FIFO level stay
+// below the FIFO depth
+static void fillService(spiModel *model)
+{
+    if (!((model->control >> RX_ONLY_BIT_OFS) & 1) || model->dmaBusy)
+        return;
+    while (model->xferLen > 0 && model->txFifo.level < model->txFifo.depth
+           && model->framesInFlight + model->rxFifo.level < model->rxFifo.depth)
+    {
+        pushTx(model, model->xferFill, (model->control >> CS_SELECT_BIT_OFS) & CS_SELECT_MASK,
+               model->ioMode);
+        model->xferLen--;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Self-test
+//-----------------------------------------------------------------------------
+
+// PRBS-31 (x^31 + x^28 + 1) stepped 32 bits per word, as spi2.v does
+static uint32_t prbs31Word(uint32_t *state)
+{
+    uint32_t s = *state, word = 0, bit;
+    uint8_t i;
+
+    for (i = 0; i < 32; i++)
+    {
+        bit = ((s >> 30) ^ (s >> 27)) & 1;
+        word = (word << 1) | bit;
+        s = ((s << 1) | bit) & BIST_SEED;
+    }
+    *state = s;
+    return word;
+}
+
+// Pushes self-test frames while fewer than the FIFO depth are in flight
+static void bistService(spiModel *model)
+{
+    if (!model->bistBusy || model->dmaBusy)
+        return;
+    while (model->bistSent < model->bistLen && model->txFifo.level < model->txFifo.depth
+           && model->framesInFlight < model->txFifo.depth)
+    {
+        pushTx(model, prbs31Word(&model->bistGen), (model->control >> CS_SELECT_BIT_OFS) & CS_SELECT_MASK,
+               model->ioMode);
+        model->bistSent++;
+    }
+}
+
+static void bistControl(spiModel *model, uint32_t value)
+{
+    if (value & BIST_GO_MASK)
+    {
+        model->bistBusy = (model->bistLen != 0);
+        model->bistSent = 0;
+        model->bistChecked = 0;
+        model->bistErrors = 0;
+        model->bistCycles = 0;
+        model->bistGen = BIST_SEED;
+        model->bistChk = BIST_SEED;
+        model->bistStart = model->now;
+    }
+    else if (model->bistBusy)
+    {
+        model->bistBusy = false;
+        model->bistCycles = model->now - model->bistStart;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Sequencer
+//-----------------------------------------------------------------------------
+
+static void seqEvent(spiModel *model)
+{
+    if (model->intEnable & INT_SEQ_ENABLE_MASK)
+        model->intStatus |= INT_SEQ_MASK;
+}
+
+static uint32_t seqOperand(const spiModel *model, uint32_t instr)
+{
+    if (instr & SEQ_REG_MASK)
+        return model->seqResult[instr & (SEQ_REGS - 1)];
+    return instr & SEQ_IMM_MASK;
+}
+
+// Executes the instruction at the PC, one clock
+static void seqExecute(spiModel *model)
+{
+    uint32_t instr = model->seqRam[model->seqPc % MODEL_SEQ_DEPTH];
+    uint32_t operand = seqOperand(model, instr);
+    uint32_t test = model->seqAcc & ((instr >> SEQ_TEST_BIT_OFS) & SEQ_TEST_MASK);
+    uint8_t cond = (instr >> SEQ_COND_BIT_OFS) & SEQ_COND_MASK;
+
+    model->seqPc++;
+    model->seqTag = (instr >> SEQ_CS_BIT_OFS) & CS_SELECT_MASK;
+    model->seqTime++;
+    switch (instr >> SEQ_OP_BIT_OFS)
+    {
+        case SEQ_OP_SEND:
+        case SEQ_OP_RECV:
+            model->seqWord = operand | ((instr & SEQ_ACC_MASK) ? model->seqAcc : 0);
+            model->seqRecv = (instr >> SEQ_OP_BIT_OFS) == SEQ_OP_RECV;
+            model->seqState = SEQ_STATE_PUSH;
+            break;
+        case SEQ_OP_CS:
+            if (!(instr & SEQ_ASSERT_MASK))
+                model->seqState = SEQ_STATE_DRAIN;
+            break;
+        case SEQ_OP_WAIT:
+            model->seqTime += operand;
+            model->seqState = SEQ_STATE_DELAY;
+            break;
+        case SEQ_OP_LOAD:
+            model->seqAcc = operand;
+            break;
+        case SEQ_OP_AND:
+            model->seqAcc &= operand;
+            break;
+        case SEQ_OP_OR:
+            model->seqAcc |= operand;
+            break;
+        case SEQ_OP_JUMP:
+            if (cond == SEQ_COND_ALWAYS || (cond == SEQ_COND_ZERO && test == 0)
+                || (cond == SEQ_COND_NONZERO && test != 0))
+                model->seqPc = instr & SEQ_TARGET_MASK;
+            break;
+        case SEQ_OP_STORE:
+            model->seqResult[instr & (SEQ_REGS - 1)] = model->seqAcc;
+            break;
+        case SEQ_OP_IRQ:
+            seqEvent(model);
+            break;
+        default:
+            model->seqIrq = (instr >> SEQ_OP_BIT_OFS) == SEQ_OP_END && (instr & SEQ_IRQ_MASK);
+            model->seqPc--;
+            model->seqState = SEQ_STATE_END;
+            break;
+    }
+}
+
+// Runs the sequencer up to until; states that wait for frames resume at
+// the time they are checked
+static void seqService(spiModel *model, uint64_t until)
+{
+    while (model->seqState != SEQ_STATE_IDLE && model->seqTime <= until)
+    {
+        switch (model->seqState)
+        {
+            case SEQ_STATE_EXEC:
+                seqExecute(model);
+                break;
+            case SEQ_STATE_PUSH:
+                if (!(model->control & (1 << CHIP_ENABLE_BIT_OFS)) || model->dmaBusy
+                    || model->txFifo.level == model->txFifo.depth
+                    || model->framesInFlight >= model->txFifo.depth)
+                {
+                    model->seqTime = until + 1;
+                    break;
+                }
+                pushTx(model, model->seqWord, model->seqTag, IO_SINGLE);
+                model->seqInFlight++;
+                model->seqState = model->seqRecv ? SEQ_STATE_RX : SEQ_STATE_EXEC;
+                model->seqTime++;
+                break;
+            case SEQ_STATE_DELAY:
+                model->seqState = SEQ_STATE_EXEC;
+                break;
+            case SEQ_STATE_DRAIN:
+            case SEQ_STATE_END:
+                if (model->seqInFlight > 0)
+                {
+                    model->seqTime = until + 1;
+                    break;
+                }
+                if (model->seqState == SEQ_STATE_END)
+                {
+                    if (model->seqIrq)
+                        seqEvent(model);
+                    model->seqState = SEQ_STATE_IDLE;
+                }
+                else
+                    model->seqState = SEQ_STATE_EXEC;
+                model->seqTime++;
+                break;
+            default:
+                // RX resumes at the capture
+                model->seqTime = until + 1;
+                break;
+        }
+    }
+}
+
+// The response RECV waits for brings the frames in flight to zero
+static void seqCapture(spiModel *model, uint32_t word)
+{
+    model->seqInFlight--;
+    if (model->seqState == SEQ_STATE_RX && model->seqInFlight == 0)
+    {
+        model->seqAcc = word;
+        model->seqState = SEQ_STATE_EXEC;
+        model->seqTime = model->edgeTime + 1;
+    }
+}
+
+static void seqControl(spiModel *model, uint32_t value)
+{
+    if (value & SEQ_GO_MASK)
+    {
+        model->seqPc = (value >> SEQ_PC_BIT_OFS) & SEQ_PC_MASK;
+        model->seqState = SEQ_STATE_EXEC;
+        model->seqTime = model->now + 1;
+    }
+    else
+        model->seqState = SEQ_STATE_IDLE;
+}
+
+//-----------------------------------------------------------------------------
+// Poll engine
+//-----------------------------------------------------------------------------
+
+static bool pollEnabled(const spiModel *model)
+{
+    return (model->pollCtrl & POLL_ENABLE_MASK) != 0;
+}
+
+// Pushes the poll word once it is due and nothing else is in flight
+static void pollService(spiModel *model, uint64_t until)
+{
+    if (pollEnabled(model) && !model->pollPending && model->pollTime <= until
+        && model->framesInFlight == 0 && model->txFifo.level == 0 && !model->dmaBusy
+        && model->seqState == SEQ_STATE_IDLE)
+    {
+        pushTx(model, model->pollCmd, (model->pollCtrl >> POLL_CS_BIT_OFS) & CS_SELECT_MASK,
+               IO_SINGLE);
+        model->pollPending = true;
+        model->polls++;
+    }
+}
+
+// The response is kept out of the RX FIFO, only a change is reported
+static void pollCapture(spiModel *model, uint32_t response)
+{
+    model->pollPending = false;
+    model->pollTime = model->edgeTime + model->pollPeriod;
+    if ((response & model->pollMask) != model->pollValue)
+    {
+        model->pollValue = response & model->pollMask;
+        model->pollChanged = true;
+        if (model->intEnable & INT_POLL_ENABLE_MASK)
+            model->intStatus |= INT_POLL_MASK;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// transmitter.v
+//-----------------------------------------------------------------------------
+
+static uint8_t csSelect(const spiModel *model)
+{
+    return (model->control >> CS_SELECT_BIT_OFS) & CS_SELECT_MASK;
+}
+
+static bool banked(const spiModel *model)
+{
+    return (model->control >> BANKED_BIT_OFS) & 1;
+}
+
+// Chip select of the word at the head of the TX FIFO
+static uint8_t nextCs(const spiModel *model)
+{
+    return banked(model) ? model->txFifo.tag[model->txFifo.readPtr] & CS_SELECT_MASK
+                         : csSelect(model);
+}
+
+static bool csAuto(const spiModel *model, uint8_t cs)
+{
+    if (banked(model))
+        return (model->csCfg[cs] >> CS_CFG_AUTO_BIT_OFS) & 1;
+    return (model->control >> (CS_AUTO_BIT_OFS + cs)) & 1;
+}
+
+static uint8_t wordSize(const spiModel *model, uint8_t cs)
+{
+    if (banked(model))
+        return model->csCfg[cs] & WORDSIZE_MASK;
+    return model->control & WORDSIZE_MASK;
+}
+
+static uint8_t deviceMode(const spiModel *model, uint8_t cs)
+{
+    if (banked(model))
+        return (model->csCfg[cs] >> CS_CFG_MODE_BIT_OFS) & DEVICE_MODE_MASK;
+    return (model->control >> (DEVICE_MODE_BIT_OFS + 2*cs)) & DEVICE_MODE_MASK;
+}
+
+// Divisor feeding BaudDivider.v, from the bank of the current frame
+static uint32_t baudDivisor(const spiModel *model)
+{
+    if (banked(model))
+        return (model->csCfg[model->frameCs] >> CS_CFG_BRD_BIT_OFS) & CS_CFG_BRD_MASK;
+    return model->brd;
+}
+
+static bool stream(const spiModel *model)
+{
+    return (model->control >> STREAM_BIT_OFS) & 1;
+}
+
+// Word the core samples when the slave data settles misoDelayCycles after
+// each launch edge and the sample is taken half an SCLK period plus the
+// SAMPLE_DELAY of the device later; a sample before the data settles sees
+// the group before it, one after the next launch plus settling sees the
+// group after it, and the lines hold their level outside the frame
+static uint32_t sampleWindow(spiModel *model, uint32_t word, uint8_t bits)
+{
+    uint64_t half = baudDivisor(model);
+    uint64_t sample = half + 128 * (uint64_t)((model->sampleDelay >> (SAMPLE_DELAY_BIT_STRIDE * model->frameCs))
+                                             & SAMPLE_DELAY_MASK);
+    uint64_t settle = 128 * (uint64_t)model->misoDelayCycles;
+    uint8_t lines = model->frameLines;
+    uint32_t group = (1u << lines) - 1;
+    uint32_t mask = (bits == 32) ? 0xFFFFFFFF : ((1u << bits) - 1);
+    uint32_t last = word & group;
+
+    if (sample < settle)
+        word = ((word & mask) >> lines) | (model->misoLast << (bits - lines));
+    else if (sample >= 2 * half + settle)
+        word = (word << lines) | last;
+    model->misoLast = last;
+    return word & mask;
+}
+
+// Dual and quad write frames sample the lines the core drives, so they
+// return the TX word; single and read frames return the slave word
+static void startFrame(spiModel *model)
+{
+    uint8_t cs = nextCs(model);
+    uint8_t bits = wordSize(model, cs) + 1;
+    uint8_t mode = deviceMode(model, cs);
+    uint8_t io = model->txFifo.tag[model->txFifo.readPtr] >> IO_TAG_BIT_OFS;
+    uint32_t mask = (bits == 32) ? 0xFFFFFFFF : ((1u << bits) - 1);
+
+    model->frameCs = cs;
+    model->frameLines = ((io & IO_WIDTH_MASK) == IO_QUAD) ? 4 : ((io & IO_WIDTH_MASK) == IO_DUAL) ? 2 : 1;
+    model->frameRead = (model->frameLines > 1) && (io & IO_READ_MASK);
+    fifoRead(&model->txFifo);
+    model->dataIn = model->txFifo.dataOut;
+    if ((model->control >> LOOPBACK_BIT_OFS) & 1)
+    {
+        model->miso = model->dataIn;
+        return;
+    }
+    if (model->slave != NULL)
+        model->miso = model->slave(model->slaveContext, cs, mode, model->dataIn & mask, bits,
+                                   model->frameLines, model->frameRead);
+    else
+        model->miso = 0;
+    if (model->frameLines > 1 && !model->frameRead)
+        model->miso = model->dataIn;
+    else if (model->slave != NULL)
+        model->miso = sampleWindow(model, model->miso, bits);
+}
+
+// The self-test frame is compared in the bits of the word size
+static void bistCapture(spiModel *model, uint32_t word)
+{
+    uint8_t bits = wordSize(model, model->frameCs) + 1;
+    uint32_t mask = (bits == 32) ? 0xFFFFFFFF : ((1u << bits) - 1);
+
+    if ((word ^ prbs31Word(&model->bistChk)) & mask)
+        model->bistErrors++;
+    if (++model->bistChecked == model->bistLen)
+    {
+        model->bistBusy = false;
+        model->bistCycles = model->edgeTime - model->bistStart;
+    }
+}
+
+// Frames a PACKED word carries for the word size of cs, 1 without PACKED
+static uint8_t packLanes(const spiModel *model, uint8_t cs)
+{
+    uint8_t size = wordSize(model, cs) + 1;
+
+    if (!((model->control >> PACKED_BIT_OFS) & 1))
+        return 1;
+    return (size <= PACK_BYTE_MAX_WORD_SIZE) ? 4 : (size <= PACK_HALF_MAX_WORD_SIZE) ? 2 : 1;
+}
+
+// A data write pushes one frame per lane enabled by byteEnable, lowest
+// lane first; a halfword lane is enabled by its low byte
+static void pushData(spiModel *model, uint32_t value, uint8_t cs, uint8_t byteEnable)
+{
+    uint8_t lanes = packLanes(model, cs);
+    uint8_t width = 32 / lanes;
+    uint8_t i;
+
+    if (lanes == 1)
+    {
+        pushTx(model, value, cs, model->ioMode);
+        return;
+    }
+    for (i = 0; i < lanes; i++)
+        if (byteEnable & (1 << (i * 4 / lanes)))
+            pushTx(model, (value >> (i * width)) & ((1u << width) - 1), cs, model->ioMode);
+}
+
+// Received frames are gathered into a word until its lanes are full or no
+// frame is left to come, fill frames still to be generated included; the
+// DMA engine keeps one frame per word
+static void rxWrite(spiModel *model, uint32_t word)
+{
+    uint8_t lanes = model->dmaBusy ? 1 : packLanes(model, csSelect(model));
+    uint8_t width = 32 / lanes;
+    bool last;
+
+    if (lanes > 1)
+    {
+        model->rxPack |= (word & ((1u << width) - 1)) << (model->rxLane * width);
+        last = model->framesInFlight == 0
+            && !(((model->control >> RX_ONLY_BIT_OFS) & 1) && model->xferLen > 0);
+        if (++model->rxLane < lanes && !last)
+            return;
+        word = model->rxPack;
+    }
+    model->rxPack = 0;
+    model->rxLane = 0;
+    if (model->rxFifo.level == model->rxFifo.depth)
+        PERF(model, OFS_PERF_RXOV)++;
+    fifoWrite(&model->rxFifo, word, 0);
+}
+
+static void baudEdge(spiModel *model)
+{
+    bool txEmpty = (model->txFifo.level == 0);
+    uint32_t bits;
+
+    model->brdClk = !model->brdClk;
+    if (model->brdClk)
+    {
+        switch (model->phase)
+        {
+            case PHASE_IDLE:
+                model->assertCS = false;
+                if (!txEmpty && csAuto(model, nextCs(model)))
+                {
+                    startFrame(model);
+                    model->phase = PHASE_CS_ASSERT;
+                    model->csAsserts++;
+                    PERF(model, OFS_PERF_CS)++;
+                }
+                break;
+            case PHASE_CS_ASSERT:
+                model->assertCS = true;
+                break;
+        }
+    }
+    else
+    {
+        switch (model->phase)
+        {
+            case PHASE_IDLE:
+                if (!txEmpty && !csAuto(model, nextCs(model)))
+                {
+                    startFrame(model);
+                    model->phase = PHASE_TX_BITS;
+                    model->counter = wordSize(model, model->frameCs);
+                }
+                break;
+            case PHASE_CS_ASSERT:
+                if (model->assertCS)
+                {
+                    model->phase = PHASE_TX_BITS;
+                    model->counter = wordSize(model, model->frameCs);
+                }
+                break;
+            case PHASE_TX_BITS:
+                // Bits above the word size keep their value from earlier
+                // frames, dual and quad frames shift a group of bits
+                bits = ((1u << model->frameLines) - 1)
+                     << ((model->counter + 1 >= model->frameLines) ? model->counter + 1 - model->frameLines : 0);
+                PERF(model, OFS_PERF_BITS) += model->frameLines;
+                model->dataOut = (model->dataOut & ~bits) | (model->miso & bits);
+                if (model->counter >= model->frameLines)
+                    model->counter -= model->frameLines;
+                else
+                {
+                    if (model->framesInFlight > 0)
+                        model->framesInFlight--;
+                    if (model->pollPending)
+                        pollCapture(model, model->dataOut);
+                    else if (model->seqInFlight > 0)
+                        seqCapture(model, model->dataOut);
+                    else if (model->bistBusy)
+                        bistCapture(model, model->dataOut);
+                    else
+                    {
+                        // TX_ONLY drops the word unless the DMA engine
+                        // expects it, DONE still latches
+                        if (!((model->control >> TX_ONLY_BIT_OFS) & 1) || model->dmaBusy)
+                            rxWrite(model, model->dataOut);
+                        model->intStatus |= model->intEnable & INT_DONE_MASK;
+                    }
+                    model->frames++;
+                    PERF(model, OFS_PERF_FRAMES)++;
+                    // Streaming starts the next frame on the next bit clock
+                    // while it is for the same device
+                    if (stream(model) && !txEmpty && nextCs(model) == model->frameCs)
+                    {
+                        startFrame(model);
+                        model->counter = wordSize(model, model->frameCs);
+                    }
+                    else
+                        model->phase = PHASE_IDLE;
+                }
+                break;
+        }
+    }
+}
+
+// Latches the level-triggered interrupt conditions of spi2.v
+// Conditions are only sampled at register accesses, DONE latches per frame
+static void updateInterrupts(spiModel *model)
+{
+    uint32_t txWatermark = (model->intEnable >> TX_WATERMARK_BIT_OFS) & WATERMARK_MASK;
+    uint32_t rxWatermark = (model->intEnable >> RX_WATERMARK_BIT_OFS) & WATERMARK_MASK;
+    uint32_t events = 0;
+
+    if (model->txFifo.level <= txWatermark)
+        events |= INT_TXWM_MASK;
+    if (model->rxFifo.level >= rxWatermark)
+        events |= INT_RXWM_MASK;
+    if (model->txFifo.ov || model->rxFifo.ov)
+        events |= INT_OV_MASK;
+    model->intStatus |= events & model->intEnable & (INT_TXWM_MASK | INT_RXWM_MASK | INT_OV_MASK);
+}
+
+//-----------------------------------------------------------------------------
+// DMA master and memory slave
+//-----------------------------------------------------------------------------
+
+// Accesses outside the attached memory read 0 and drop writes
+static uint32_t *memoryWord(spiModel *model, uint32_t address)
+{
+    uint32_t offset = address - model->memoryBase;
+    model->memoryAccesses++;
+    if (model->memory == NULL || address < model->memoryBase || offset >= model->memoryBytes)
+    {
+        model->memoryFaults++;
+        return NULL;
+    }
+    return &model->memory[offset / 4];
+}
+
+// Runs the DMA state machine up to system clock until, one IDLE decision
+// per step with the clocks its states take
+static void dmaService(spiModel *model, uint64_t until)
+{
+    uint32_t *word, value;
+    uint64_t cycles;
+
+    if (model->dmaTime < model->now)
+        model->dmaTime = model->now;
+    while (model->dmaBusy && model->dmaTime < until)
+    {
+        if (model->rxFifo.level > 0 && model->dmaRxCount != model->dmaLen)
+        {
+            // IDLE, POP (and WRITE)
+            fifoRead(&model->rxFifo);
+            model->dmaRxCount++;
+            cycles = 2;
+            if (model->dmaCtrl & DMA_RX_MASK)
+            {
+                word = memoryWord(model, model->dmaDstPtr);
+                if (word != NULL)
+                    *word = model->rxFifo.dataOut;
+                model->dmaDstPtr += 4;
+                cycles += 1 + model->memoryWaitCycles;
+            }
+        }
+        else if (model->dmaTxCount != model->dmaLen
+                 && model->dmaTxCount - model->dmaRxCount < model->txFifo.depth
+                 && model->txFifo.level < model->txFifo.depth)
+        {
+            // IDLE, (READ and) PUSH
+            value = 0;
+            cycles = 2;
+            if (model->dmaCtrl & DMA_TX_MASK)
+            {
+                word = memoryWord(model, model->dmaSrcPtr);
+                value = (word != NULL) ? *word : 0;
+                model->dmaSrcPtr += 4;
+                cycles += 1 + model->memoryWaitCycles;
+            }
+            pushTx(model, value, csSelect(model), model->ioMode);
+            model->dmaTxCount++;
+        }
+        else if (model->dmaRxCount == model->dmaLen)
+        {
+            model->dmaBusy = false;
+            if (model->intEnable & INT_DMA_ENABLE_MASK)
+                model->intStatus |= INT_DMA_MASK;
+            cycles = 1;
+        }
+        else
+        {
+            // Waiting on the serializer, nothing changes before until
+            model->dmaTime = until;
+            break;
+        }
+        model->dmaTime += cycles;
+    }
+}
+
+static void dmaControl(spiModel *model, uint32_t value)
+{
+    uint8_t cs = (value >> DMA_CS_BIT_OFS) & CS_SELECT_MASK;
+    uint32_t modeMask = DEVICE_MODE_MASK << (DEVICE_MODE_BIT_OFS + 2*cs);
+
+    model->dmaCtrl = value;
+    if (!(value & DMA_GO_MASK))
+    {
+        model->dmaBusy = false;
+        return;
+    }
+    if (value & DMA_CFG_MASK)
+    {
+        model->control = (model->control & ~(CS_SELECT_MASK << CS_SELECT_BIT_OFS)) | (cs << CS_SELECT_BIT_OFS);
+        model->control = (model->control & ~modeMask)
+                       | ((((value >> DMA_MODE_BIT_OFS) & DEVICE_MODE_MASK) << (DEVICE_MODE_BIT_OFS + 2*cs)));
+    }
+    if (model->dmaPresent)
+    {
+        model->dmaBusy = true;
+        model->dmaSrcPtr = model->dmaSrc;
+        model->dmaDstPtr = model->dmaDst;
+        model->dmaTxCount = 0;
+        model->dmaRxCount = 0;
+        model->dmaTime = model->now;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void spiModelInit(spiModel *model)
+{
+    memset(model, 0, sizeof(*model));
+    model->backend.read = spiModelRead;
+    model->backend.write = spiModelWrite;
+    model->backend.writeBytes = spiModelWriteBytes;
+    model->backend.context = model;
+    model->backend.delay = spiModelDelay;
+    model->accessCycles = MODEL_ACCESS_CYCLES;
+    model->memoryWaitCycles = MODEL_MEMORY_WAIT_CYCLES;
+    spiModelSetFifoDepth(model, FIFO_DEPTH);
+}
+
+// Matches the FIFO_DEPTH parameter of spi2.v, a power of 2 up to
+// MAX_FIFO_DEPTH; call before the first access
+void spiModelSetFifoDepth(spiModel *model, uint16_t depth)
+{
+    model->txFifo.depth = depth;
+    model->rxFifo.depth = depth;
+    model->depthLog2 = 0;
+    while ((1u << model->depthLog2) < depth)
+        model->depthLog2++;
+}
+
+// Builds the model with the DMA master and places memory on it
+void spiModelAttachMemory(spiModel *model, uint32_t *memory, uint32_t base, uint32_t bytes)
+{
+    model->memory = memory;
+    model->memoryBase = base;
+    model->memoryBytes = bytes;
+    model->dmaPresent = true;
+}
+
+// Clocks from an SCLK launch edge until the slave data is valid at the
+// core, slave clock-to-out plus the cable both ways
+void spiModelSetMisoDelay(spiModel *model, uint32_t cycles)
+{
+    model->misoDelayCycles = cycles;
+}
+
+void spiModelAttachSlave(spiModel *model, spiModelSlave slave, void *context)
+{
+    model->slave = slave;
+    model->slaveContext = context;
+}
+
+// Runs the core for a number of system clocks
+void spiModelAdvance(spiModel *model, uint64_t cycles)
+{
+    uint64_t target = model->now + cycles;
+    uint64_t brd;
+    uint64_t limit, skip;
+
+    if (model->control & (1 << CHIP_ENABLE_BIT_OFS))
+    {
+        // Edges scheduled at or before target
+        limit = (target - model->enableTime + 1) * 128;
+        while (model->match < limit)
+        {
+            // BaudDivider.v compares count[31:7], so steps below one clock
+            // are lost
+            brd = baudDivisor(model);
+            if (brd < 128)
+                brd = 128;
+
+            if (model->phase == PHASE_IDLE && model->txFifo.level == 0 && !model->dmaBusy
+                && !pollEnabled(model) && model->xferLen == 0 && !model->bistBusy
+                && model->seqState == SEQ_STATE_IDLE)
+            {
+                skip = (limit - 1 - model->match) / brd + 1;
+                if (skip > 1 || !model->brdClk)
+                    model->assertCS = false;
+                model->brdClk ^= (skip & 1);
+                model->match += skip * brd;
+                break;
+            }
+            model->edgeTime = model->enableTime + model->match / 128;
+            perfAccount(model, model->edgeTime);
+            dmaService(model, model->edgeTime);
+            pollService(model, model->edgeTime);
+            fillService(model);
+            bistService(model);
+            seqService(model, model->edgeTime);
+            baudEdge(model);
+            model->match += brd;
+        }
+    }
+    dmaService(model, target);
+    seqService(model, target);
+    perfAccount(model, target);
+    model->now = target;
+}
+
+bool spiModelIrq(spiModel *model)
+{
+    updateInterrupts(model);
+    return model->intStatus != 0;
+}
+
+// Backend wait, the core runs on without a register access
+void spiModelDelay(void *context, uint64_t cycles)
+{
+    spiModelAdvance(context, cycles);
+}
+
+uint32_t spiModelRead(void *context, uint32_t ofs)
+{
+    spiModel *model = context;
+    uint32_t value = 0;
+
+    spiModelAdvance(model, model->accessCycles);
+    model->accesses++;
+    switch (ofs)
+    {
+        case OFS_DATA:
+            fifoRead(&model->rxFifo);
+            value = model->rxFifo.dataOut;
+            break;
+        case OFS_STATUS:
+            value = (model->txFifo.level == 0 ? TXFE_MASK : 0)
+                  | (model->txFifo.level == model->txFifo.depth ? TXFF_MASK : 0)
+                  | (model->txFifo.ov ? TXFO_MASK : 0)
+                  | (model->rxFifo.level == 0 ? RXFE_MASK : 0)
+                  | (model->rxFifo.level == model->rxFifo.depth ? RXFF_MASK : 0)
+                  | (model->rxFifo.ov ? RXFO_MASK : 0)
+                  | (model->depthLog2 << DEPTH_LOG2_BIT_OFS)
+                  | (model->dmaPresent ? DMA_PRESENT_MASK : 0)
+                  | (model->framesInFlight ? BUSY_MASK : 0);
+            break;
+        case OFS_CONTROL:
+            value = model->control;
+            break;
+        case OFS_BRD:
+            value = model->brd;
+            break;
+        case OFS_INT_ENABLE:
+            value = model->intEnable;
+            break;
+        case OFS_INT_STATUS:
+            updateInterrupts(model);
+            value = model->intStatus;
+            break;
+        case OFS_LEVEL:
+            value = model->txFifo.level | (model->rxFifo.level << RX_LEVEL_BIT_OFS);
+            break;
+        case OFS_RX_DATA_VALID:
+            value = (model->rxFifo.level > 0) ? RXDATA_VALID_MASK : 0;
+            fifoRead(&model->rxFifo);
+            value |= (model->rxFifo.dataOut & RXDATA_DATA_MASK)
+                   | ((model->rxFifo.level > RXDATA_LEVEL_MASK ? RXDATA_LEVEL_MASK : model->rxFifo.level)
+                      << RXDATA_LEVEL_BIT_OFS);
+            break;
+        case OFS_DMA_SRC:
+            value = model->dmaSrc;
+            break;
+        case OFS_DMA_DST:
+            value = model->dmaDst;
+            break;
+        case OFS_DMA_LEN:
+            value = model->dmaLen;
+            break;
+        case OFS_DMA_CTRL:
+            value = (model->dmaCtrl & ~DMA_GO_MASK) | (model->dmaBusy ? DMA_GO_MASK : 0);
+            break;
+        case OFS_CS_CFG0:
+        case OFS_CS_CFG0 + 1:
+        case OFS_CS_CFG0 + 2:
+        case OFS_CS_CFG0 + 3:
+            value = model->csCfg[ofs - OFS_CS_CFG0];
+            break;
+        case OFS_POLL_CMD:
+            value = model->pollCmd;
+            break;
+        case OFS_POLL_PERIOD:
+            value = model->pollPeriod;
+            break;
+        case OFS_POLL_MASK:
+            value = model->pollMask;
+            break;
+        case OFS_POLL_VALUE:
+            value = model->pollValue;
+            break;
+        case OFS_POLL_CTRL:
+            value = (model->pollCtrl & 0x7) | (model->pollChanged ? POLL_CHANGED_MASK : 0);
+            break;
+        case OFS_XFER_LEN:
+            value = model->xferLen;
+            break;
+        case OFS_XFER_FILL:
+            value = model->xferFill;
+            break;
+        case OFS_BIST_CTRL:
+            value = model->bistBusy ? BIST_GO_MASK : 0;
+            break;
+        case OFS_BIST_LEN:
+            value = model->bistLen;
+            break;
+        case OFS_BIST_ERRORS:
+            value = model->bistErrors;
+            break;
+        case OFS_BIST_CYCLES:
+            value = model->bistBusy ? (uint32_t)(model->now - model->bistStart) : model->bistCycles;
+            break;
+        case OFS_SEQ_CTRL:
+            value = (model->seqState != SEQ_STATE_IDLE ? SEQ_GO_MASK : 0)
+                  | (model->seqPc << SEQ_PC_BIT_OFS)
+                  | (MODEL_SEQ_LOG2 << SEQ_DEPTH_LOG2_BIT_OFS);
+            break;
+        case OFS_SEQ_ADDR:
+            value = model->seqAddr;
+            break;
+        case OFS_SEQ_DATA:
+            value = model->seqRam[model->seqAddr % MODEL_SEQ_DEPTH];
+            break;
+        case OFS_SEQ_R0:
+        case OFS_SEQ_R0 + 1:
+        case OFS_SEQ_R0 + 2:
+        case OFS_SEQ_R0 + 3:
+            value = model->seqResult[ofs - OFS_SEQ_R0];
+            break;
+        case OFS_PERF_CYCLES:
+        case OFS_PERF_FRAMES:
+        case OFS_PERF_BITS:
+        case OFS_PERF_TX_WAIT:
+        case OFS_PERF_RX_FULL:
+        case OFS_PERF_TXOV:
+        case OFS_PERF_RXOV:
+        case OFS_PERF_CS:
+            value = model->perfSnapshot[ofs - OFS_PERF_CYCLES];
+            break;
+        case OFS_IO_MODE:
+            value = model->ioMode;
+            break;
+        case OFS_SAMPLE_DELAY:
+            value = model->sampleDelay;
+            break;
+    }
+    return value;
+}
+
+void spiModelWrite(void *context, uint32_t ofs, uint32_t value)
+{
+    spiModelWriteBytes(context, ofs, value, BYTE_ENABLE_ALL);
+}
+
+// Only PACKED data writes use byteEnable, as in spi2.v
+void spiModelWriteBytes(void *context, uint32_t ofs, uint32_t value, uint8_t byteEnable)
+{
+    spiModel *model = context;
+    uint32_t enable = 1 << CHIP_ENABLE_BIT_OFS;
+
+    spiModelAdvance(model, model->accessCycles);
+    model->accesses++;
+    switch (ofs)
+    {
+        case OFS_DATA:
+            pushData(model, value, csSelect(model), byteEnable);
+            break;
+        case OFS_DATA_CS0:
+        case OFS_DATA_CS0 + 1:
+        case OFS_DATA_CS0 + 2:
+        case OFS_DATA_CS0 + 3:
+            pushData(model, value, ofs - OFS_DATA_CS0, byteEnable);
+            break;
+        case OFS_CS_CFG0:
+        case OFS_CS_CFG0 + 1:
+        case OFS_CS_CFG0 + 2:
+        case OFS_CS_CFG0 + 3:
+            model->csCfg[ofs - OFS_CS_CFG0] = value;
+            break;
+        case OFS_STATUS:
+            if (value & TXFO_MASK)
+                model->txFifo.ov = false;
+            if (value & RXFO_MASK)
+                model->rxFifo.ov = false;
+            break;
+        case OFS_CONTROL:
+            // The baud divider is held in reset while the core is disabled
+            if ((value & enable) && !(model->control & enable))
+            {
+                model->enableTime = model->now;
+                model->match = model->brd;
+                model->brdClk = false;
+            }
+            else if (!(value & enable))
+            {
+                model->phase = PHASE_IDLE;
+                if (model->txFifo.level == 0)
+                    model->framesInFlight = 0;
+            }
+            if (!((value >> PACKED_BIT_OFS) & 1))
+            {
+                model->rxPack = 0;
+                model->rxLane = 0;
+            }
+            model->control = value;
+            break;
+        case OFS_BRD:
+            model->brd = value;
+            break;
+        case OFS_INT_ENABLE:
+            model->intEnable = value;
+            break;
+        case OFS_INT_STATUS:
+            updateInterrupts(model);
+            model->intStatus &= ~value;
+            break;
+        case OFS_DMA_SRC:
+            model->dmaSrc = value;
+            break;
+        case OFS_DMA_DST:
+            model->dmaDst = value;
+            break;
+        case OFS_DMA_LEN:
+            model->dmaLen = value;
+            break;
+        case OFS_DMA_CTRL:
+            dmaControl(model, value);
+            break;
+        case OFS_POLL_CMD:
+            model->pollCmd = value;
+            break;
+        case OFS_POLL_PERIOD:
+            model->pollPeriod = value;
+            break;
+        case OFS_POLL_MASK:
+            model->pollMask = value;
+            break;
+        case OFS_POLL_VALUE:
+            model->pollValue = value;
+            break;
+        case OFS_POLL_CTRL:
+            // The period restarts while the engine is disabled
+            if (!pollEnabled(model))
+                model->pollTime = model->now + model->pollPeriod;
+            if (value & POLL_CHANGED_MASK)
+                model->pollChanged = false;
+            model->pollCtrl = value & 0x7;
+            break;
+        case OFS_XFER_LEN:
+            model->xferLen = value;
+            break;
+        case OFS_XFER_FILL:
+            model->xferFill = value;
+            break;
+        case OFS_BIST_CTRL:
+            bistControl(model, value);
+            break;
+        case OFS_BIST_LEN:
+            model->bistLen = value;
+            break;
+        case OFS_SEQ_CTRL:
+            seqControl(model, value);
+            break;
+        case OFS_SEQ_ADDR:
+            model->seqAddr = value & SEQ_PC_MASK;
+            break;
+        case OFS_SEQ_DATA:
+            model->seqRam[model->seqAddr++ % MODEL_SEQ_DEPTH] = value;
+            break;
+        case OFS_SEQ_R0:
+        case OFS_SEQ_R0 + 1:
+        case OFS_SEQ_R0 + 2:
+        case OFS_SEQ_R0 + 3:
+            model->seqResult[ofs - OFS_SEQ_R0] = value;
+            break;
+        case OFS_PERF_CTRL:
+            perfControl(model, value);
+            break;
+        case OFS_IO_MODE:
+            model->ioMode = value & (IO_WIDTH_MASK | IO_READ_MASK);
+            break;
+        case OFS_SAMPLE_DELAY:
+            model->sampleDelay = value & 0x0F0F0F0F;
+            break;
+    }
+}
+
+// Slave that echoes tx back on rx (tx wired to rx)
+uint32_t spiModelLoopback(void *context, uint8_t cs, uint8_t mode,
+                          uint32_t mosi, uint8_t bits, uint8_t lines, bool read)
+{
+    return mosi;
+}
+
+// Quad slave, context is a spiModelQuadSlave
+// The opcode is the top 8 bits of a single line frame and restarts the
+// buffer; dual and quad frames are only accepted in the direction of the
+// last opcode
+uint32_t spiModelQuadMemory(void *context, uint8_t cs, uint8_t mode,
+                            uint32_t mosi, uint8_t bits, uint8_t lines, bool read)
+{
+    spiModelQuadSlave *slave = context;
+    uint32_t value = 0;
+
+    if (lines == 1)
+    {
+        slave->opcode = (bits >= 8) ? (mosi >> (bits - 8)) & 0xFF : 0;
+        slave->index = 0;
+    }
+    else if (slave->index >= slave->size
+             || read != (slave->opcode == QUAD_SLAVE_READ)
+             || (!read && slave->opcode != QUAD_SLAVE_WRITE))
+        slave->errors++;
+    else if (read)
+        value = slave->words[slave->index++];
+    else
+        slave->words[slave->index++] = mosi;
+    return value;
+}
+
+//-----------------------------------------------------------------------------
+// Channel groups
+//-----------------------------------------------------------------------------
+
+// Brings every channel to the time of the last access, so a channel that
+// was not accessed shifts the frames in its FIFO meanwhile
+void spiModelGroupSync(spiModelGroup *group)
+{
+    uint8_t i;
+    for (i = 0; i < group->count; i++)
+        if (group->models[i].now < group->now)
+            spiModelAdvance(&group->models[i], group->now - group->models[i].now);
+}
+
+static uint32_t groupRead(void *context, uint32_t ofs)
+{
+    spiModelChannel *channel = context;
+    uint32_t value;
+    spiModelGroupSync(channel->group);
+    value = spiModelRead(channel->model, ofs);
+    channel->group->now = channel->model->now;
+    return value;
+}
+
+static void groupWriteBytes(void *context, uint32_t ofs, uint32_t value, uint8_t byteEnable)
+{
+    spiModelChannel *channel = context;
+    spiModelGroupSync(channel->group);
+    spiModelWriteBytes(channel->model, ofs, value, byteEnable);
+    channel->group->now = channel->model->now;
+}
+
+static void groupWrite(void *context, uint32_t ofs, uint32_t value)
+{
+    groupWriteBytes(context, ofs, value, BYTE_ENABLE_ALL);
+}
+
+static void groupDelay(void *context, uint64_t cycles)
+{
+    spiModelChannel *channel = context;
+    spiModelGroupSync(channel->group);
+    spiModelAdvance(channel->model, cycles);
+    channel->group->now = channel->model->now;
+}
+
+// count channels (up to MC_MAX_CHANNELS) with the spiModelInit defaults,
+// the backend of channel n is group->channels[n].backend
+void spiModelGroupInit(spiModelGroup *group, uint8_t count)
+{
+    uint8_t i;
+    memset(group, 0, sizeof(*group));
+    group->count = (count > MC_MAX_CHANNELS) ? MC_MAX_CHANNELS : count;
+    for (i = 0; i < group->count; i++)
+    {
+        spiModelInit(&group->models[i]);
+        group->channels[i].backend.read = groupRead;
+        group->channels[i].backend.write = groupWrite;
+        group->channels[i].backend.writeBytes = groupWriteBytes;
+        group->channels[i].backend.context = &group->channels[i];
+        group->channels[i].backend.delay = groupDelay;
+        group->channels[i].group = group;
+        group->channels[i].model = &group->models[i];
+    }
+}
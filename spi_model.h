@@ -0,0 +1,258 @@
+// SPI IP Example
+// SPI IP Software Model (spi_model.h)
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Host PC (behavioral model of spi2.v)
+
+// Model configuration:
+//   DATA/STATUS/CONTROL/BRD/INT_ENABLE/INT_STATUS/LEVEL/RX_DATA_VALID,
+//   DMA, CS_CFG, DATA_CS, POLL, XFER, PERF, IO_MODE, SAMPLE_DELAY and BIST
+//   register map of spi2.v
+//   TX and RX FIFOs of FIFO_DEPTH (or spiModelSetFifoDepth) entries with
+//   FIFO.v overflow semantics
+//   transmitter.v framing driven by the BaudDivider.v edge schedule,
+//   including back-to-back streaming frames and banked per-device
+//   configuration of tagged TX words
+//   Time advances by accessCycles system clocks per register access
+//   The DMA master is present once a memory slave is attached, each memory
+//   access costs one clock plus memoryWaitCycles wait states
+//   The poll engine and the RX_ONLY fill generator are checked at baud
+//   edges, the idle SCLK skip is off while either has work
+//   TX words carry their IO_MODE, dual and quad frames shift 2 or 4 bits
+//   per SCLK; spiModelQuadMemory is a slave for them
+//   Slave data settles misoDelayCycles (spiModelSetMisoDelay) clocks after
+//   its launch edge, a SAMPLE_DELAY that misses the window shifts the word
+//   received by one bit group; the later RX write of a delayed sample is
+//   not modelled
+//   LOOPBACK returns the TX word without calling the slave, the self-test
+//   pushes and checks its PRBS-31 frames at baud edges like the fill
+//   generator
+//   PACKED data writes push all their lanes at the access
+//   The sequencer runs one instruction per clock, checked at baud edges
+//   and accesses; held chip selects only order its frames, the pins are
+//   not modelled
+//   A spiModelGroup holds the channels of spi2_mc.v as one model each,
+//   kept at the same time so the bus accesses of one channel let the
+//   others shift; the broadcast and shared blocks are not modelled
+
+//-----------------------------------------------------------------------------
+
+#ifndef SPI_MODEL_H_
+#define SPI_MODEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "spi_backend.h"
+#include "spi_regs.h"
+
+// Default cost of one light-weight bridge access in 50 MHz clocks
+#define MODEL_ACCESS_CYCLES 10
+
+// Default SDRAM wait states seen by the DMA master
+#define MODEL_MEMORY_WAIT_CYCLES 4
+
+// Instructions of the sequencer RAM, the SEQ_DEPTH parameter of spi2.v
+#define MODEL_SEQ_DEPTH 64
+#define MODEL_SEQ_LOG2  6
+
+// Tag bits of the IO_MODE value in TX FIFO entries, below them is the CS
+#define IO_TAG_BIT_OFS 2
+
+// Opcodes of spiModelQuadMemory
+#define QUAD_SLAVE_WRITE 0x32
+#define QUAD_SLAVE_READ  0x6B
+
+// Called when a frame starts shifting, returns the word the slave drives
+// on rx; bit (bits - 1) is shifted first
+// lines is 1, 2 or 4; on dual and quad frames mosi is the word the core
+// drives unless read is set, then the return value is driven by the slave
+typedef uint32_t (*spiModelSlave)(void *context, uint8_t cs, uint8_t mode,
+                                  uint32_t mosi, uint8_t bits, uint8_t lines, bool read);
+
+// Word buffer of spiModelQuadMemory
+typedef struct spiModelQuadSlave
+{
+    uint32_t *words;
+    uint32_t size;
+    uint32_t index;
+    uint8_t opcode;
+    uint64_t errors;
+} spiModelQuadSlave;
+
+typedef struct spiModelFifo
+{
+    uint32_t stack[MAX_FIFO_DEPTH];
+    uint8_t tag[MAX_FIFO_DEPTH];
+    uint32_t dataOut;
+    uint16_t depth;
+    uint16_t readPtr;
+    uint16_t writePtr;
+    uint16_t level;
+    bool ov;
+} spiModelFifo;
+
+typedef struct spiModel
+{
+    spiBackend backend;
+
+    // registers
+    uint32_t control;
+    uint32_t brd;
+    uint32_t intEnable;
+    uint32_t intStatus;
+    uint32_t csCfg[4];
+    spiModelFifo txFifo;
+    spiModelFifo rxFifo;
+    uint8_t depthLog2;
+
+    // baud divider, edge times are in 1/128 clock units from enableTime
+    uint64_t enableTime;
+    uint64_t match;
+    bool brdClk;
+
+    // transmitter
+    uint8_t phase;
+    uint8_t counter;
+    uint8_t frameCs;
+    uint8_t frameLines;
+    bool frameRead;
+    bool assertCS;
+    uint32_t dataIn;
+    uint32_t miso;
+    uint32_t dataOut;
+
+    // slave attached to cs0-cs3
+    spiModelSlave slave;
+    void *slaveContext;
+
+    // DMA engine
+    bool dmaPresent;
+    bool dmaBusy;
+    uint32_t dmaSrc;
+    uint32_t dmaDst;
+    uint32_t dmaLen;
+    uint32_t dmaCtrl;
+    uint32_t dmaSrcPtr;
+    uint32_t dmaDstPtr;
+    uint32_t dmaTxCount;
+    uint32_t dmaRxCount;
+    uint64_t dmaTime;
+
+    // poll engine
+    uint32_t pollCmd;
+    uint32_t pollPeriod;
+    uint32_t pollMask;
+    uint32_t pollValue;
+    uint32_t pollCtrl;
+    bool pollPending;
+    bool pollChanged;
+    uint64_t pollTime;
+    uint64_t edgeTime;
+    uint32_t framesInFlight;
+    uint64_t polls;
+
+    // RX_ONLY fill generator
+    uint32_t xferLen;
+    uint32_t xferFill;
+
+    // IO_MODE of the words pushed
+    uint8_t ioMode;
+
+    // RX sample point and the board delay it compensates
+    uint32_t sampleDelay;
+    uint32_t misoDelayCycles;
+    uint32_t misoLast;
+
+    // received frames gathered for a PACKED word
+    uint32_t rxPack;
+    uint8_t rxLane;
+
+    // self-test
+    bool bistBusy;
+    uint32_t bistLen;
+    uint32_t bistSent;
+    uint32_t bistChecked;
+    uint32_t bistErrors;
+    uint32_t bistCycles;
+    uint32_t bistGen;
+    uint32_t bistChk;
+    uint64_t bistStart;
+
+    // sequencer, instructions run up to seqTime
+    uint32_t seqRam[MODEL_SEQ_DEPTH];
+    uint32_t seqResult[SEQ_REGS];
+    uint32_t seqAcc;
+    uint32_t seqWord;
+    uint32_t seqInFlight;
+    uint8_t seqAddr;
+    uint8_t seqPc;
+    uint8_t seqState;
+    uint8_t seqTag;
+    bool seqRecv;
+    bool seqIrq;
+    uint64_t seqTime;
+
+    // performance counters, live and snapshot in PERF register order;
+    // waits are accounted up to perfTime
+    uint32_t perf[PERF_COUNTERS];
+    uint32_t perfSnapshot[PERF_COUNTERS];
+    uint64_t perfTime;
+
+    // memory slave on the DMA master, memoryBytes bytes at byte address
+    // memoryBase
+    uint32_t *memory;
+    uint32_t memoryBase;
+    uint32_t memoryBytes;
+    uint32_t memoryWaitCycles;
+    uint64_t memoryAccesses;
+    uint64_t memoryFaults;
+
+    // time and statistics
+    uint32_t accessCycles;
+    uint64_t now;
+    uint64_t accesses;
+    uint64_t frames;
+    uint64_t csAsserts;
+} spiModel;
+
+struct spiModelGroup;
+
+// Register window of one channel of a group
+typedef struct spiModelChannel
+{
+    spiBackend backend;
+    struct spiModelGroup *group;
+    spiModel *model;
+} spiModelChannel;
+
+// Channels of spi2_mc.v sharing one bus, now is the time of the last access
+typedef struct spiModelGroup
+{
+    spiModel models[MC_MAX_CHANNELS];
+    spiModelChannel channels[MC_MAX_CHANNELS];
+    uint8_t count;
+    uint64_t now;
+} spiModelGroup;
+
+void spiModelInit(spiModel *model);
+void spiModelAttachSlave(spiModel *model, spiModelSlave slave, void *context);
+void spiModelSetFifoDepth(spiModel *model, uint16_t depth);
+void spiModelAttachMemory(spiModel *model, uint32_t *memory, uint32_t base, uint32_t bytes);
+void spiModelSetMisoDelay(spiModel *model, uint32_t cycles);
+void spiModelAdvance(spiModel *model, uint64_t cycles);
+bool spiModelIrq(spiModel *model);
+uint32_t spiModelRead(void *context, uint32_t ofs);
+void spiModelWrite(void *context, uint32_t ofs, uint32_t value);
+void spiModelWriteBytes(void *context, uint32_t ofs, uint32_t value, uint8_t byteEnable);
+void spiModelDelay(void *context, uint64_t cycles);
+void spiModelGroupInit(spiModelGroup *group, uint8_t count);
+void spiModelGroupSync(spiModelGroup *group);
+uint32_t spiModelLoopback(void *context, uint8_t cs, uint8_t mode,
+                          uint32_t mosi, uint8_t bits, uint8_t lines, bool read);
+uint32_t spiModelQuadMemory(void *context, uint8_t cs, uint8_t mode,
+                            uint32_t mosi, uint8_t bits, uint8_t lines, bool read);
+
+#endif
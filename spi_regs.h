@@ -23,6 +23,42 @@
 #define OFS_STATUS           1
 #define OFS_CONTROL          2
 #define OFS_BRD              3
+#define OFS_INT_ENABLE       4
+#define OFS_INT_STATUS       5
+#define OFS_LEVEL            6
+#define OFS_RX_DATA_VALID    7
+#define OFS_DMA_SRC          8
+#define OFS_DMA_DST          9
+#define OFS_DMA_LEN          10
+#define OFS_DMA_CTRL         11
+#define OFS_CS_CFG0          12
+#define OFS_DATA_CS0         16
+#define OFS_POLL_CMD         20
+#define OFS_POLL_PERIOD      21
+#define OFS_POLL_MASK        22
+#define OFS_POLL_VALUE       23
+#define OFS_POLL_CTRL        24
+#define OFS_XFER_LEN         25
+#define OFS_XFER_FILL        26
+#define OFS_PERF_CTRL        27
+#define OFS_PERF_CYCLES      28
+#define OFS_PERF_FRAMES      29
+#define OFS_PERF_BITS        30
+#define OFS_PERF_TX_WAIT     31
+#define OFS_PERF_RX_FULL     32
+#define OFS_PERF_TXOV        33
+#define OFS_PERF_RXOV        34
+#define OFS_PERF_CS          35
+#define OFS_IO_MODE          36
+#define OFS_SAMPLE_DELAY     37
+#define OFS_BIST_CTRL        38
+#define OFS_BIST_LEN         39
+#define OFS_BIST_ERRORS      40
+#define OFS_BIST_CYCLES      41
+#define OFS_SEQ_CTRL         42
+#define OFS_SEQ_ADDR         43
+#define OFS_SEQ_DATA         44
+#define OFS_SEQ_R0           45
 
 #define WORDSIZE_MASK	0x1F
 #define CS_SELECT_MASK	0x3
@@ -32,13 +68,161 @@
 #define DEVICE_MODE_BIT_OFS	16
 #define CS_AUTO_BIT_OFS	5
 #define CS_ENABLE_BIT_OFS	9
+#define CHIP_ENABLE_BIT_OFS	15
+#define STREAM_BIT_OFS	24
+#define TX_ONLY_BIT_OFS	25
+#define RX_ONLY_BIT_OFS	26
+#define LOOPBACK_BIT_OFS	27
+#define PACKED_BIT_OFS	28
+#define BANKED_BIT_OFS	31
+
+#define RXFO_MASK	0x01
+#define RXFF_MASK	0x02
+#define RXFE_MASK	0x04
+#define TXFO_MASK	0x08
+#define TXFF_MASK	0x10
+#define TXFE_MASK	0x20
+
+// Depth of cores built before STATUS reported DEPTH_LOG2
+#define FIFO_DEPTH 16
+#define MAX_FIFO_DEPTH 4096
+
+#define DMA_PRESENT_MASK	0x1000
+#define BUSY_MASK	0x2000
+#define ASYNC_CLOCK_MASK	0x4000
+#define DEPTH_LOG2_BIT_OFS	8
+#define DEPTH_LOG2_MASK	0xF
+#define LEVEL_MASK	0xFFFF
+#define RX_LEVEL_BIT_OFS	16
+
+#define RXDATA_VALID_MASK	0x80000000
+#define RXDATA_LEVEL_BIT_OFS	24
+#define RXDATA_LEVEL_MASK	0x7F
+#define RXDATA_DATA_MASK	0xFFFFFF
+#define RXDATA_MAX_WORD_SIZE	24
+
+#define INT_TXWM_MASK	0x01
+#define INT_RXWM_MASK	0x02
+#define INT_DONE_MASK	0x04
+#define INT_OV_MASK	0x08
+#define INT_DMA_MASK	0x10
+#define INT_POLL_MASK	0x20
+#define INT_SEQ_MASK	0x40
+#define INT_EVENTS_MASK	0x0F
+#define INT_DMA_ENABLE_MASK	0x10000000
+#define INT_POLL_ENABLE_MASK	0x20000000
+#define INT_SEQ_ENABLE_MASK	0x40000000
+#define WATERMARK_MASK	0xFFF
+
+#define TX_WATERMARK_BIT_OFS	4
+#define RX_WATERMARK_BIT_OFS	16
+
+#define DMA_GO_MASK	0x01
+#define DMA_TX_MASK	0x02
+#define DMA_RX_MASK	0x04
+#define DMA_CFG_MASK	0x08
+#define DMA_CS_BIT_OFS	4
+#define DMA_MODE_BIT_OFS	6
+
+#define CS_CFG_MODE_BIT_OFS	5
+#define CS_CFG_AUTO_BIT_OFS	7
+#define CS_CFG_BRD_BIT_OFS	8
+#define CS_CFG_BRD_MASK	0xFFFFFF
+
+#define POLL_ENABLE_MASK	0x01
+#define POLL_CS_BIT_OFS	1
+#define POLL_CHANGED_MASK	0x100
+
+#define PERF_SNAPSHOT_MASK	0x01
+#define PERF_CLEAR_MASK	0x02
+#define PERF_COUNTERS	8
+
+#define IO_SINGLE	0
+#define IO_DUAL	1
+#define IO_QUAD	2
+#define IO_WIDTH_MASK	0x03
+#define IO_READ_MASK	0x04
+
+#define SAMPLE_DELAY_MASK	0xF
+#define SAMPLE_DELAY_BIT_STRIDE	8
+#define SAMPLE_DELAY_MAX	15
+
+#define BIST_GO_MASK	0x01
+#define BIST_SEED	0x7FFFFFFF
+
+#define PACK_BYTE_MAX_WORD_SIZE	8
+#define PACK_HALF_MAX_WORD_SIZE	16
+#define BYTE_ENABLE_ALL	0xF
+
+#define SEQ_GO_MASK	0x01
+#define SEQ_PC_BIT_OFS	8
+#define SEQ_PC_MASK	0xFF
+#define SEQ_DEPTH_LOG2_BIT_OFS	16
+#define SEQ_REGS	4
+
+// Sequencer instructions, op[31:28] with a 24-bit operand; OR SEQ_REG_MASK
+// in to take the operand from seq_rn (n as the immediate) and SEQ_ACC_MASK
+// to OR ACC into a SEND or RECV word
+#define SEQ_OP_END	0x0
+#define SEQ_OP_SEND	0x1
+#define SEQ_OP_RECV	0x2
+#define SEQ_OP_CS	0x3
+#define SEQ_OP_WAIT	0x4
+#define SEQ_OP_LOAD	0x5
+#define SEQ_OP_AND	0x6
+#define SEQ_OP_OR	0x7
+#define SEQ_OP_JUMP	0x8
+#define SEQ_OP_STORE	0x9
+#define SEQ_OP_IRQ	0xA
+#define SEQ_OP_BIT_OFS	28
+#define SEQ_REG_MASK	0x08000000
+#define SEQ_ACC_MASK	0x04000000
+#define SEQ_CS_BIT_OFS	24
+#define SEQ_IMM_MASK	0xFFFFFF
+#define SEQ_COND_BIT_OFS	26
+#define SEQ_COND_MASK	0x3
+#define SEQ_COND_ALWAYS	0
+#define SEQ_COND_ZERO	1
+#define SEQ_COND_NONZERO	2
+#define SEQ_TEST_BIT_OFS	8
+#define SEQ_TEST_MASK	0xFFFF
+#define SEQ_TARGET_MASK	0xFF
+#define SEQ_ASSERT_MASK	0x01
+#define SEQ_IRQ_MASK	0x01
+
+#define SEQ_INSTR(op, operand)	(((uint32_t)(op) << SEQ_OP_BIT_OFS) | (operand))
+#define SEQ_END(irq)	SEQ_INSTR(SEQ_OP_END, (irq) ? SEQ_IRQ_MASK : 0)
+#define SEQ_SEND(cs, imm)	SEQ_INSTR(SEQ_OP_SEND, ((cs) << SEQ_CS_BIT_OFS) | ((imm) & SEQ_IMM_MASK))
+#define SEQ_RECV(cs, imm)	SEQ_INSTR(SEQ_OP_RECV, ((cs) << SEQ_CS_BIT_OFS) | ((imm) & SEQ_IMM_MASK))
+#define SEQ_CS_ASSERT(cs)	SEQ_INSTR(SEQ_OP_CS, ((cs) << SEQ_CS_BIT_OFS) | SEQ_ASSERT_MASK)
+#define SEQ_CS_RELEASE(cs)	SEQ_INSTR(SEQ_OP_CS, (cs) << SEQ_CS_BIT_OFS)
+#define SEQ_WAIT(clocks)	SEQ_INSTR(SEQ_OP_WAIT, (clocks) & SEQ_IMM_MASK)
+#define SEQ_LOAD(imm)	SEQ_INSTR(SEQ_OP_LOAD, (imm) & SEQ_IMM_MASK)
+#define SEQ_AND(imm)	SEQ_INSTR(SEQ_OP_AND, (imm) & SEQ_IMM_MASK)
+#define SEQ_OR(imm)	SEQ_INSTR(SEQ_OP_OR, (imm) & SEQ_IMM_MASK)
+#define SEQ_JUMP(cond, test, target)	SEQ_INSTR(SEQ_OP_JUMP, ((cond) << SEQ_COND_BIT_OFS) \
+                                          | ((test) << SEQ_TEST_BIT_OFS) | (target))
+#define SEQ_STORE(n)	SEQ_INSTR(SEQ_OP_STORE, n)
+#define SEQ_IRQ	SEQ_INSTR(SEQ_OP_IRQ, 0)
 
 #define IODIR 0x00
 #define GPPU 0x06
 #define GPIO 0x09
 #define OPCODE 0x40
 
-#define SPAN_IN_BYTES 16
+#define SPAN_IN_BYTES 256
+
+// spi2_mc: channel n at word n * MC_CHANNEL_WORDS, then the broadcast and
+// shared blocks
+#define MC_MAX_CHANNELS      4
+#define MC_CHANNEL_WORDS     64
+#define OFS_MC_BROADCAST     384
+#define OFS_MC_STATUS        448
+#define OFS_MC_INT_ENABLE    449
+#define MC_IRQ_MASK	0xF
+#define MC_CHANNELS_BIT_OFS	16
+#define MC_CHANNELS_MASK	0xF
+#define MC_SPAN_IN_BYTES 2048
 
 #endif
 
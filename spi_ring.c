@@ -0,0 +1,220 @@
+// SPI IP Example
+// SPI IP Asynchronous Transfer Rings (spi_ring.c)
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: DE1-SoC Board
+
+// Hardware configuration:
+// SPI IP core connected to light-weight Avalon bus, or the software model
+// of the core (spi_model.c) when no board is present
+// Library interface:
+//   Single producer, single consumer rings; one thread fills and submits
+//   entries and reaps completions, the worker is the only user of the core
+//   until spiRingStop, so no other spi_ip.c call may be made meanwhile
+
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>          // C99 integer types -- uint32_t
+#include <stdbool.h>         // bool
+#include <stddef.h>          // NULL
+#include <string.h>          // memset
+#include <stdatomic.h>       // atomic_load, atomic_store
+#include <pthread.h>         // pthread_create, pthread_cond_wait
+#include "spi_ip.h"         // spi
+#include "spi_regs.h"       // registers
+#include "spi_ring.h"       // rings
+
+#define RING_MASK (SPI_RING_ENTRIES - 1)
+
+//-----------------------------------------------------------------------------
+// Worker
+//-----------------------------------------------------------------------------
+
+static int32_t runEntry(const spiRingEntry *entry)
+{
+    uint8_t wordSize = entry->wordSize;
+    uint32_t control = ReadControl();
+
+    if (entry->device > CS_SELECT_MASK || wordSize > 32)
+        return -1;
+    if (wordSize == 0)
+        wordSize = (control & WORDSIZE_MASK) + 1;
+
+    // CONTROL is only written when the device or word size changes
+    if (((control >> CS_SELECT_BIT_OFS) & CS_SELECT_MASK) != entry->device
+        || (control & WORDSIZE_MASK) != wordSize - 1u)
+        spiSelectDevice(entry->device, wordSize);
+    if (entry->len != 0)
+        spiTransfer(entry->tx, entry->rx, entry->len);
+    return 0;
+}
+
+// Runs entries while the submission ring holds them, then spins
+// SPI_RING_SPINS polls before sleeping until a submit wakes it; leaves
+// once stopped with the ring empty
+static void *worker(void *context)
+{
+    spiRing *ring = context;
+    spiRingCompletion *completion;
+    uint32_t head, cqTail, spins = 0;
+
+    spiSelectCore(ring->core);
+    for (;;)
+    {
+        head = atomic_load_explicit(&ring->sqHead, memory_order_relaxed);
+        if (head == atomic_load_explicit(&ring->sqTail, memory_order_acquire))
+        {
+            if (atomic_load(&ring->stop))
+                break;
+            if (++spins < SPI_RING_SPINS)
+                continue;
+            spins = 0;
+
+            // The submitter checks sleeping after it moves sqTail, so one
+            // of the two sees the other
+            pthread_mutex_lock(&ring->lock);
+            atomic_store(&ring->sleeping, true);
+            while (atomic_load(&ring->sqTail) == head && !atomic_load(&ring->stop))
+                pthread_cond_wait(&ring->wake, &ring->lock);
+            atomic_store(&ring->sleeping, false);
+            pthread_mutex_unlock(&ring->lock);
+            continue;
+        }
+        spins = 0;
+
+        // spiRingGetEntry keeps the entries in flight below the ring size,
+        // so the completion slot is free
+        cqTail = atomic_load_explicit(&ring->cqTail, memory_order_relaxed);
+        completion = &ring->cq[cqTail & RING_MASK];
+        completion->userData = ring->sq[head & RING_MASK].userData;
+        completion->len = ring->sq[head & RING_MASK].len;
+        completion->result = runEntry(&ring->sq[head & RING_MASK]);
+        atomic_store_explicit(&ring->sqHead, head + 1, memory_order_release);
+        atomic_store(&ring->cqTail, cqTail + 1);
+
+        if (atomic_load(&ring->waiting))
+        {
+            pthread_mutex_lock(&ring->lock);
+            pthread_cond_broadcast(&ring->done);
+            pthread_mutex_unlock(&ring->lock);
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Starts the worker on core (opened with spiOpen, spiOpenCore or
+// spiOpenBackend), the caller's selected core is left to the worker
+bool spiRingStart(spiRing *ring, uint8_t core)
+{
+    memset(ring, 0, sizeof(*ring));
+    atomic_init(&ring->sqHead, 0);
+    atomic_init(&ring->sqTail, 0);
+    atomic_init(&ring->cqHead, 0);
+    atomic_init(&ring->cqTail, 0);
+    atomic_init(&ring->sleeping, false);
+    atomic_init(&ring->waiting, false);
+    atomic_init(&ring->stop, false);
+    ring->core = core;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->wake, NULL);
+    pthread_cond_init(&ring->done, NULL);
+    if (pthread_create(&ring->worker, NULL, worker, ring) != 0)
+    {
+        pthread_cond_destroy(&ring->done);
+        pthread_cond_destroy(&ring->wake);
+        pthread_mutex_destroy(&ring->lock);
+        return false;
+    }
+    return true;
+}
+
+// Runs the entries submitted and stops the worker; completions not reaped
+// are dropped
+void spiRingStop(spiRing *ring)
+{
+    atomic_store(&ring->stop, true);
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_signal(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->worker, NULL);
+    pthread_cond_destroy(&ring->done);
+    pthread_cond_destroy(&ring->wake);
+    pthread_mutex_destroy(&ring->lock);
+}
+
+// Next free submission entry, cleared, or NULL while SPI_RING_ENTRIES
+// entries are submitted, filled or waiting to be reaped
+// The buffers of an entry must stay valid until its completion is reaped
+spiRingEntry *spiRingGetEntry(spiRing *ring)
+{
+    spiRingEntry *entry;
+    if (ring->sqPending - atomic_load_explicit(&ring->cqHead, memory_order_relaxed) >= SPI_RING_ENTRIES)
+        return NULL;
+    entry = &ring->sq[ring->sqPending++ & RING_MASK];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+// Hands the entries filled since the last submit to the worker, which is
+// only woken (a system call) when it went to sleep
+void spiRingSubmit(spiRing *ring)
+{
+    atomic_store(&ring->sqTail, ring->sqPending);
+    if (atomic_load(&ring->sleeping))
+    {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_signal(&ring->wake);
+        pthread_mutex_unlock(&ring->lock);
+        ring->wakeups++;
+    }
+}
+
+// Reaps up to max completions in submission order without blocking
+uint32_t spiRingPeek(spiRing *ring, spiRingCompletion *completions, uint32_t max)
+{
+    uint32_t head = atomic_load_explicit(&ring->cqHead, memory_order_relaxed);
+    uint32_t count = atomic_load_explicit(&ring->cqTail, memory_order_acquire) - head;
+    uint32_t i;
+
+    if (count > max)
+        count = max;
+    for (i = 0; i < count; i++)
+        completions[i] = ring->cq[(head + i) & RING_MASK];
+    atomic_store_explicit(&ring->cqHead, head + count, memory_order_release);
+    return count;
+}
+
+// Reaps between min and max completions, sleeping while fewer than min
+// are posted; min must not exceed the entries submitted and not reaped
+uint32_t spiRingWait(spiRing *ring, spiRingCompletion *completions, uint32_t min, uint32_t max)
+{
+    uint32_t count = 0, spins = 0;
+
+    if (min > max)
+        min = max;
+    for (;;)
+    {
+        count += spiRingPeek(ring, completions + count, max - count);
+        if (count >= min)
+            break;
+        if (++spins < SPI_RING_SPINS)
+            continue;
+        spins = 0;
+
+        // The worker checks waiting after it moves cqTail
+        pthread_mutex_lock(&ring->lock);
+        atomic_store(&ring->waiting, true);
+        while (atomic_load(&ring->cqTail) == atomic_load(&ring->cqHead))
+            pthread_cond_wait(&ring->done, &ring->lock);
+        atomic_store(&ring->waiting, false);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return count;
+}
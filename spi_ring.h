@@ -0,0 +1,96 @@
+// SPI IP Example
+// SPI IP Asynchronous Transfer Rings (spi_ring.h)
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: DE1-SoC Board
+
+// Hardware configuration:
+// SPI IP core connected to light-weight Avalon bus, or the software model
+// of the core (spi_model.c) when no board is present
+// Library interface:
+//   A worker thread owns one core opened with spi_ip.c and runs the
+//   transfers of a submission ring, posting a completion for each to a
+//   completion ring; the caller fills entries and submits them in batches
+//   and reaps completions from shared memory, so neither side makes a
+//   system call per transfer
+
+//-----------------------------------------------------------------------------
+
+#ifndef SPI_RING_H_
+#define SPI_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Entries of each ring, a power of 2
+#define SPI_RING_ENTRIES 64
+
+// Polls of an empty submission ring before the worker sleeps
+#define SPI_RING_SPINS 1000
+
+// Transfer of len words from tx to rx (either may be NULL, as for
+// spiTransfer) on device (0-3) with wordSize bits per frame, 0 keeping the
+// current word size; userData comes back in the completion
+typedef struct spiRingEntry
+{
+    const uint32_t *tx;
+    uint32_t *rx;
+    uint32_t len;
+    uint8_t device;
+    uint8_t wordSize;
+    uint64_t userData;
+} spiRingEntry;
+
+// result is 0, or -1 for an entry with a bad device or word size that was
+// not run
+typedef struct spiRingCompletion
+{
+    uint64_t userData;
+    uint32_t len;
+    int32_t result;
+} spiRingCompletion;
+
+// Heads are consumer and tails producer indexes, free running and taken
+// modulo SPI_RING_ENTRIES; entries past sqTail up to sqPending are filled
+// but not yet submitted
+typedef struct spiRing
+{
+    spiRingEntry sq[SPI_RING_ENTRIES];
+    spiRingCompletion cq[SPI_RING_ENTRIES];
+    atomic_uint sqHead;
+    atomic_uint sqTail;
+    atomic_uint cqHead;
+    atomic_uint cqTail;
+    uint32_t sqPending;
+
+    // Worker sleeps on wake once idle, reapers on done
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    atomic_bool sleeping;
+    atomic_bool waiting;
+    atomic_bool stop;
+    uint8_t core;
+
+    // times the worker was woken, the system calls made for submissions;
+    // timing dependent, 0 while every submit finds the worker spinning
+    uint64_t wakeups;
+} spiRing;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+bool spiRingStart(spiRing *ring, uint8_t core);
+void spiRingStop(spiRing *ring);
+spiRingEntry *spiRingGetEntry(spiRing *ring);
+void spiRingSubmit(spiRing *ring);
+uint32_t spiRingPeek(spiRing *ring, spiRingCompletion *completions, uint32_t max);
+uint32_t spiRingWait(spiRing *ring, spiRingCompletion *completions, uint32_t min, uint32_t max);
+
+#endif
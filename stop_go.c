@@ -27,6 +27,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <unistd.h>          // usleep
 #include "spi_ip.h"
 
 // Pins
@@ -34,14 +35,22 @@
 #define GREEN_LED 1
 #define PUSH_BUTTON 2
 
+// Pushbutton sampled by the core every 1 ms (50 MHz clocks)
+#define PB_POLL_CLOCKS 50000
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
 // Blocking function that returns only when SW1 is pressed
+// The core polls the expander, the CPU only checks the change flag
 void waitPbPress()
 {
-	while(getPinValue(PUSH_BUTTON));
+	uint32_t value;
+	watchPinValue(PUSH_BUTTON, 1, PB_POLL_CLOCKS);
+	while (!spiPollChanged(&value))
+		usleep(1000);
+	spiPollStop();
 }
 
 // Initialize Hardware
@@ -59,6 +68,8 @@ void initHw()
 	selectPinPullOutput(GREEN_LED);
 	selectPinPullOutput(RED_LED);
     
+    // Only writes follow, the responses never reach the RX FIFO
+    spiSetTxOnly(true);
 
 }
 
@@ -11,6 +11,16 @@
 // Hardware configuration:
 // GPIO Port:
 //   GPIO_1[31-0] is used as a general purpose GPIO port
+// SPI Port:
+//   GPIO_0[13,15,17,19] are cs0-cs3, GPIO_0[11] is the clock
+//   GPIO_0[7,9,21,23] are io0-io3, io0 is tx and io1 is rx outside dual
+//   and quad frames
+//   spi_clk (125 MHz from CLOCK2_50) clocks the SPI side of a core built
+//   with SPI_CLOCK_ASYNC, so SCLK can reach 62.5 MHz; its SPI side is held
+//   in reset until the PLL locks
+//   Defining SPI2_CORE1 connects a second core (spi2_1 in soc_system, at
+//   SPI1_BASE_OFFSET) to the same pins of GPIO_1, which then no longer
+//   serves as a GPIO port
 // HPS interface:
 //   Mapped to offset of 0 in light-weight MM interface aperature
 //   IRQ80 is used as the interrupt interface to the HPS
@@ -191,6 +201,23 @@ module top
     wire        hps_warm_reset;
     wire        hps_debug_reset;
 
+    // SPI data lines, driven while their output enable is set
+    wire        spi_tx;
+    wire [3:0]  spi_io_out;
+    wire [3:0]  spi_io_oe;
+    wire [3:0]  spi_io_in;
+
+`ifdef SPI2_CORE1
+    wire        spi1_tx;
+    wire [3:0]  spi1_io_out;
+    wire [3:0]  spi1_io_oe;
+    wire [3:0]  spi1_io_in;
+`endif
+
+    // SPI clock domain
+    wire        spi_clk;
+    wire        spi_pll_locked;
+
     // Assignments to module signals 
     assign ADC_DIN = 1'b0;
     assign ADC_SCLK = 1'b0;
@@ -222,6 +249,20 @@ module top
     assign GPIO_0 = 36'bzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz;
     assign GPIO_1[35:32] = 4'bzzzz;
 
+    assign GPIO_0[7]  = spi_io_oe[0] ? spi_io_out[0] : 1'bz;
+    assign GPIO_0[9]  = spi_io_oe[1] ? spi_io_out[1] : 1'bz;
+    assign GPIO_0[21] = spi_io_oe[2] ? spi_io_out[2] : 1'bz;
+    assign GPIO_0[23] = spi_io_oe[3] ? spi_io_out[3] : 1'bz;
+    assign spi_io_in = {GPIO_0[23], GPIO_0[21], GPIO_0[9], GPIO_0[7]};
+
+`ifdef SPI2_CORE1
+    assign GPIO_1[7]  = spi1_io_oe[0] ? spi1_io_out[0] : 1'bz;
+    assign GPIO_1[9]  = spi1_io_oe[1] ? spi1_io_out[1] : 1'bz;
+    assign GPIO_1[21] = spi1_io_oe[2] ? spi1_io_out[2] : 1'bz;
+    assign GPIO_1[23] = spi1_io_oe[3] ? spi1_io_out[3] : 1'bz;
+    assign spi1_io_in = {GPIO_1[23], GPIO_1[21], GPIO_1[9], GPIO_1[7]};
+`endif
+
     assign HEX0 = 7'b1111111;
     assign HEX1 = 7'b1111111;
     assign HEX2 = 7'b1111111;
@@ -249,6 +290,27 @@ module top
     assign VGA_SYNC_N  = 1'b1;
     assign VGA_VS      = 1'b0;
 
+    // SPI clock, from its own oscillator input so it is unrelated to the
+    // Avalon clock
+    altera_pll #(
+        .fractional_vco_multiplier("false"),
+        .reference_clock_frequency("50.0 MHz"),
+        .operation_mode("direct"),
+        .number_of_clocks(1),
+        .output_clock_frequency0("125.000000 MHz"),
+        .phase_shift0("0 ps"),
+        .duty_cycle0(50),
+        .pll_type("General"),
+        .pll_subtype("General")
+    ) spi_pll (
+        .rst      (1'b0),
+        .outclk   (spi_clk),
+        .locked   (spi_pll_locked),
+        .fboutclk (),
+        .fbclk    (1'b0),
+        .refclk   (CLOCK2_50)
+    );
+
     // SoC System
 	 soc_system spi2 (
 		  .spi2_0_port_new_signal                         (GPIO_0[13]), //cs0
@@ -256,9 +318,29 @@ module top
 		  .spi2_0_port_new_signal_2							  (GPIO_0[17]), //cs2
 		  .spi2_0_port_new_signal_3							  (GPIO_0[19]), //cs3
 		  .spi2_0_port_new_signal_4							  (GPIO_0[9]), //rx
-		  .spi2_0_port_new_signal_5							  (GPIO_0[7]), //tx
+		  .spi2_0_port_new_signal_5							  (spi_tx), //tx, driven on io0
 		  .spi2_0_port_new_signal_6 							  (GPIO_0[11]), //clock
 		  .spi2_0_port_new_signal_7 (LEDR[8:0]),
+		  .spi2_0_port_new_signal_8 							  (spi_io_out), //io0-io3 out
+		  .spi2_0_port_new_signal_9 							  (spi_io_oe), //io0-io3 output enable
+		  .spi2_0_port_new_signal_10 							  (spi_io_in), //io0-io3 in
+		  .spi2_0_port_new_signal_11 							  (spi_clk), //SPI clock
+		  .spi2_0_port_new_signal_12 							  (spi_pll_locked), //SPI clock locked
+`ifdef SPI2_CORE1
+		  .spi2_1_port_new_signal                         (GPIO_1[13]), //cs0
+		  .spi2_1_port_new_signal_1                       (GPIO_1[15]), //cs1
+		  .spi2_1_port_new_signal_2                       (GPIO_1[17]), //cs2
+		  .spi2_1_port_new_signal_3                       (GPIO_1[19]), //cs3
+		  .spi2_1_port_new_signal_4                       (GPIO_1[9]), //rx
+		  .spi2_1_port_new_signal_5                       (spi1_tx), //tx, driven on io0
+		  .spi2_1_port_new_signal_6                       (GPIO_1[11]), //clock
+		  .spi2_1_port_new_signal_7                       (), //LEDs stay with the first core
+		  .spi2_1_port_new_signal_8                       (spi1_io_out), //io0-io3 out
+		  .spi2_1_port_new_signal_9                       (spi1_io_oe), //io0-io3 output enable
+		  .spi2_1_port_new_signal_10                      (spi1_io_in), //io0-io3 in
+		  .spi2_1_port_new_signal_11                      (spi_clk), //SPI clock
+		  .spi2_1_port_new_signal_12                      (spi_pll_locked), //SPI clock locked
+`endif
 			
 			
         .memory_mem_a                          (HPS_DDR3_ADDR),
@@ -1,38 +1,118 @@
 module transmitter
 (
 	input clock, reset, brdClk, TXEmpty, 
-	input [31:0] DataIn,
-	input [4:0] wordSize,
+	input [36:0] DataIn,
+	input [4:0] wordSize0, wordSize1, wordSize2, wordSize3,
 	input [1:0] mode0, mode1, mode2, mode3,
+	input [3:0] sampleDelay0, sampleDelay1, sampleDelay2, sampleDelay3,
 	input [1:0] cs_select,
+	input banked,
 	input cs0_enable, cs1_enable, cs2_enable, cs3_enable, chip_enable,
 	input cs0_auto, cs1_auto, cs2_auto, cs3_auto,
+	input stream,
 	output reg sc0, sc1, sc2, sc3, tx, sysclk,
 	input rx,
+	input [3:0] io_in,
+	output reg [3:0] io_out,
+	output reg [3:0] io_oe,
+	output [1:0] active_cs,
 	output reg requestTXread,
 	output reg requestRXwrite,
+	output reg [2:0] bitStrobe,
+	output txWait,
 	output reg [31:0] DataOuttoRXFifo
 );
 
+	// TX words carry the target chip select in DataIn[33:32], it is used
+	// instead of cs_select when banked is set; the next word is prefetched
+	// from the TX FIFO so its device is known before it is started
+	// DataIn[35:34] give the data lines of the frame (0 single, 1 dual,
+	// 2 quad) and DataIn[36] makes a dual or quad frame a read, where the
+	// lines are released for the slave; dual and quad frames shift 2 or 4
+	// bits per SCLK on io[1:0] or io[3:0], MSB first with the highest bit
+	// of each group on the highest line, and need a word size that is a
+	// multiple of the line count
+	// sampleDelayn takes the RX sample of cs n that many clocks after the
+	// SCLK sampling edge, for slaves and cables whose data arrives late;
+	// it must be shorter than the SCLK period, and an auto chip select is
+	// held until the last delayed sample is taken
+
 	parameter Idle = 2'b00;
 	parameter cs_assert = 2'b01;
 	parameter TX_bits = 2'b10;
 	
 	reg[1:0] phase;
 	reg last_brd;
-	reg cs_auto;
+	reg next_auto;
+	reg[4:0] next_size;
+	reg[4:0] frame_size;
 	reg[4:0] counter;
 	reg assertCS;
 	reg debug;
+	reg[31:0] data;
+	reg[1:0] data_cs;
+	reg[1:0] data_width;
+	reg data_read;
+	reg[36:0] next_data;
+	reg next_valid;
+	reg[1:0] fetch;
+	reg[3:0] frame_delay;
+	reg sample_pending;
+	reg[3:0] sample_count;
+	reg[4:0] sample_counter;
+	reg[1:0] sample_width;
+	reg sample_last;
+	wire[1:0] frame_cs = banked ? data_cs : cs_select;
+	wire[1:0] next_cs = banked ? next_data[33:32] : cs_select;
+	wire[4:0] step = (data_width == 2'b10) ? 5'd4 : (data_width == 2'b01) ? 5'd2 : 5'd1;
+	wire[2:0] sample_step = (sample_width == 2'b10) ? 3'd4 : (sample_width == 2'b01) ? 3'd2 : 3'd1;
+	wire cs_idle = (phase == Idle) && !sample_pending;
+
+	assign active_cs = frame_cs;
+
+	// bitStrobe gives the number of bits sampled on each bit clock, txWait is set while a word is
+	// waiting but no bits are being shifted (idle and cs_assert periods)
+	assign txWait = chip_enable && (phase != TX_bits) && (next_valid || !TXEmpty);
+
+// io0 is driven as MOSI outside dual and quad frames, io1-io3 only while a
+// dual or quad write frame shifts
+always @ (*) begin
+
+	io_out = {3'b000, tx};
+	io_oe = 4'b0001;
+	
+	if (phase == TX_bits && data_width == 2'b10) begin
+		io_out = data[counter -: 4];
+		io_oe = data_read ? 4'b0000 : 4'b1111;
+	end
+	else if (phase == TX_bits && data_width == 2'b01) begin
+		io_out[1:0] = data[counter -: 2];
+		io_oe = data_read ? 4'b0000 : 4'b0011;
+	end
+		
+end
 						
 always @ (*) begin
 
-	case (cs_select)
+	case (next_cs)
+	
+		2'b00: begin next_auto = cs0_auto; next_size = wordSize0; end
+		2'b01: begin next_auto = cs1_auto; next_size = wordSize1; end
+		2'b10: begin next_auto = cs2_auto; next_size = wordSize2; end
+		2'b11: begin next_auto = cs3_auto; next_size = wordSize3; end
+		
+	endcase
+	
+end
+
+always @ (*) begin
+
+	case (frame_cs)
 	
-		2'b00: cs_auto = cs0_auto;
-		2'b01: cs_auto = cs1_auto;
-		2'b10: cs_auto = cs2_auto;
-		2'b11: cs_auto = cs3_auto;			
+		2'b00: begin frame_size = wordSize0; frame_delay = sampleDelay0; end
+		2'b01: begin frame_size = wordSize1; frame_delay = sampleDelay1; end
+		2'b10: begin frame_size = wordSize2; frame_delay = sampleDelay2; end
+		2'b11: begin frame_size = wordSize3; frame_delay = sampleDelay3; end
 		
 	endcase
 	
@@ -48,41 +128,41 @@ always @ (*) begin
 	
 	if (chip_enable) begin
 	
-		case (cs_select)
+		case (frame_cs)
 		
 			2'b00: begin
-				if(cs0_auto == 1'b1 && phase == Idle) 
+				if(cs0_auto == 1'b1 && cs_idle) 
 					sc0 = 1'b1;
 				else if(cs0_auto == 1'b0 && cs0_enable == 1'b1)
 					sc0 = 1'b0;
-				else if(cs0_auto == 1'b1 && assertCS == 1'b1 && phase != Idle)
+				else if(cs0_auto == 1'b1 && assertCS == 1'b1 && !cs_idle)
 					sc0 = 1'b0;
 			end
 			
 			2'b01: begin
-				if(cs1_auto == 1'b1 && phase == Idle) 
+				if(cs1_auto == 1'b1 && cs_idle) 
 					sc1 = 1'b1;
 				else if(cs1_auto == 1'b0 && cs1_enable == 1'b1)
 					sc1 = 1'b0;
-				else if(cs1_auto == 1'b1 && assertCS == 1'b1 && phase != Idle)
+				else if(cs1_auto == 1'b1 && assertCS == 1'b1 && !cs_idle)
 					sc1 = 1'b0;
 			end
 			
 			2'b10: begin
-				if(cs2_auto == 1'b1 && phase == Idle) 
+				if(cs2_auto == 1'b1 && cs_idle) 
 					sc2 = 1'b1;
 				else if(cs2_auto == 1'b0 && cs2_enable == 1'b1)
 					sc2 = 1'b0;
-				else if(cs2_auto == 1'b1 && assertCS == 1'b1 && phase != Idle)
+				else if(cs2_auto == 1'b1 && assertCS == 1'b1 && !cs_idle)
 					sc2 = 1'b0;
 			end
 			
 			2'b11: begin
-				if(cs3_auto == 1'b1 && phase == Idle) 
+				if(cs3_auto == 1'b1 && cs_idle) 
 					sc3 = 1'b1;
 				else if(cs3_auto == 1'b0 && cs3_enable == 1'b1)
 					sc3 = 1'b0;
-				else if(cs3_auto == 1'b1 && assertCS == 1'b1 && phase != Idle)
+				else if(cs3_auto == 1'b1 && assertCS == 1'b1 && !cs_idle)
 					sc3 = 1'b0;
 			end
 		endcase
@@ -94,28 +174,28 @@ always @ (*) begin
 	
 	if(phase == 2'b00) begin
 	
-		if(cs_select == 2'b00)
+		if(frame_cs == 2'b00)
 			sysclk = mode0[1];
-		else if (cs_select == 2'b01)
+		else if (frame_cs == 2'b01)
 			sysclk = mode1[1];
-		else if (cs_select == 2'b10)
+		else if (frame_cs == 2'b10)
 			sysclk = mode2[1];
-		else if (cs_select == 2'b11)
+		else if (frame_cs == 2'b11)
 			sysclk = mode3[1];
 
 	end
 	
 	else if(phase == 2'b10) begin
 	
-		tx = DataIn[counter];
+		tx = data[counter];
 	
-		if(cs_select == 2'b00)
+		if(frame_cs == 2'b00)
 			sysclk = brdClk ^ mode0[0] ^ mode0[1];
-		else if (cs_select == 2'b01)
+		else if (frame_cs == 2'b01)
 			sysclk = brdClk ^ mode1[0] ^ mode1[1];
-		else if (cs_select == 2'b10)
+		else if (frame_cs == 2'b10)
 			sysclk = brdClk ^ mode2[0] ^ mode2[1];
-		else if (cs_select == 2'b11)
+		else if (frame_cs == 2'b11)
 			sysclk = brdClk ^ mode3[0] ^ mode3[1];
 			
 	end
@@ -132,15 +212,59 @@ always @ (posedge clock) begin
 
 	requestTXread <= 1'b0;
 	requestRXwrite <= 1'b0;
+	bitStrobe <= 3'b0;
+	fetch <= {fetch[0], 1'b0};
 
 	if (reset) begin
 		phase <= Idle;
 		requestTXread <= 1'b0;
 		requestRXwrite <= 1'b0;
 		counter <= 5'b0;
+		next_valid <= 1'b0;
+		fetch <= 2'b0;
+		sample_pending <= 1'b0;
+		data_cs <= 2'b0;
+		data_width <= 2'b0;
+		data_read <= 1'b0;
+	end
+	
+	else begin
+	
+	// prefetch, the FIFO output is valid two clocks after the request; a
+	// disabled core drops the prefetched word with the rest of its frames,
+	// so nothing is left queued once BUSY reads idle
+	if (!chip_enable) begin
+		next_valid <= 1'b0;
+		fetch <= 2'b0;
+	end
+	else if (fetch[1]) begin
+		next_data <= DataIn;
+		next_valid <= 1'b1;
+	end
+	else if (!next_valid && fetch == 2'b00 && !TXEmpty) begin
+		requestTXread <= 1'b1;
+		fetch[0] <= 1'b1;
 	end
 	
-	else if (last_brd != brdClk) begin
+	// delayed RX sample, taken sample_count clocks after its SCLK edge
+	if (sample_pending) begin
+		if (sample_count == 4'd1) begin
+			sample_pending <= 1'b0;
+			bitStrobe <= sample_step;
+			if (sample_width == 2'b10)
+				DataOuttoRXFifo[sample_counter -: 4] <= io_in;
+			else if (sample_width == 2'b01)
+				DataOuttoRXFifo[sample_counter -: 2] <= io_in[1:0];
+			else
+				DataOuttoRXFifo[sample_counter] <= rx;
+			if (sample_last)
+				requestRXwrite <= 1'b1;
+		end
+		else
+			sample_count <= sample_count - 1'b1;
+	end
+	
+	if (last_brd != brdClk) begin
 	
 	
 	 debug <= 1'b1;
@@ -152,13 +276,17 @@ always @ (posedge clock) begin
 				case (phase)
 					2'b00: begin
 					
-							assertCS <= 1'b0;
-							if (TXEmpty) begin
-								phase <= Idle;
-							end
-							else if (!TXEmpty && cs_auto) begin
-								requestTXread <= 1'b1;
-								phase <= cs_assert;
+							// a delayed sample of the last frame still needs CS
+							if (!sample_pending) begin
+								assertCS <= 1'b0;
+								if (next_valid && next_auto) begin
+									data <= next_data[31:0];
+									data_cs <= next_data[33:32];
+									data_width <= next_data[35:34];
+									data_read <= next_data[36];
+									next_valid <= 1'b0;
+									phase <= cs_assert;
+								end
 							end
 							
 					end
@@ -179,30 +307,61 @@ always @ (posedge clock) begin
 				
 					if(phase == 2'b00) begin
 					
-							if (!TXEmpty && !cs_auto) begin
+							if (next_valid && !next_auto) begin
+								data <= next_data[31:0];
+								data_cs <= next_data[33:32];
+								data_width <= next_data[35:34];
+								data_read <= next_data[36];
+								next_valid <= 1'b0;
 								phase <= TX_bits;
-								requestTXread <= 1'b1;
-								counter <= wordSize;
+								counter <= next_size;
 							end
 					end
 					if(phase == 2'b01) begin
 							
 							if (assertCS) begin
 								phase <= TX_bits;
-								counter <= wordSize;
+								counter <= frame_size;
 							end
 					end
 							
 					if(phase == 2'b10) begin
 					
-							if(counter > 0) begin
-								DataOuttoRXFifo[counter] <= rx;
-								counter <= counter -1'b1;
+							if (frame_delay == 4'b0) begin
+								bitStrobe <= step[2:0];
+								if (data_width == 2'b10)
+									DataOuttoRXFifo[counter -: 4] <= io_in;
+								else if (data_width == 2'b01)
+									DataOuttoRXFifo[counter -: 2] <= io_in[1:0];
+								else
+									DataOuttoRXFifo[counter] <= rx;
+							end
+							else begin
+								sample_pending <= 1'b1;
+								sample_count <= frame_delay;
+								sample_counter <= counter;
+								sample_width <= data_width;
+								sample_last <= (counter < step);
 							end
-							else if (counter == 0) begin
-								phase <= Idle;
-								DataOuttoRXFifo[counter] <= rx;
-								requestRXwrite <= 1'b1;
+							if(counter >= step) begin
+								counter <= counter - step;
+							end
+							else begin
+								if (frame_delay == 4'b0)
+									requestRXwrite <= 1'b1;
+								// streaming: the next word starts on the next bit
+								// clock with CS held, instead of going through Idle
+								// and cs_assert again, while it is for the same device
+								if (stream && next_valid && next_cs == frame_cs) begin
+									data <= next_data[31:0];
+									data_cs <= next_data[33:32];
+									data_width <= next_data[35:34];
+									data_read <= next_data[36];
+									next_valid <= 1'b0;
+									counter <= next_size;
+								end
+								else
+									phase <= Idle;
 							end
 					end
 					
@@ -211,6 +370,7 @@ always @ (posedge clock) begin
 		else
 			phase <= Idle;
 	end
+	end
 end				
 
 endmodule